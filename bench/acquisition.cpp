@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "benchutil.h"
+#include "nidaqmxeventhandler.h"
+#include "syntheticsource.h"
+
+/*
+ * Drives the meter handler with a syntheticSource at increasing sample rates
+ * while a session is open, and reports how many of the samples the clock
+ * produced reached the handler, how long the handler held up the source's
+ * callback thread beyond reading the samples, and how much CPU time the
+ * server path spent on each sample. Each rate runs reading volts and reading
+ * 16-bit codes, each once logging averages and once capturing every sample.
+ * The rates go well past what the DAQmx chassis runs at, to show where the
+ * path stops keeping up. Unless callbacks per second are given, the handler
+ * sizes the blocks and the buffer itself, as the server does. Each rate also
+ * runs once with the callback thread stalling now and then, to show the
+ * handler taking the backlog in larger reads without losing samples.
+ *
+ *   acquisition [seconds per rate] [channels] [callbacks per second or 0]
+ *               [rate ...]
+ */
+
+// With stalls, every STALL_EVERY callbacks the callback thread sleeps for
+// STALL_CALLBACKS callback periods before calling the handler.
+#define STALL_EVERY 10
+#define STALL_CALLBACKS 3
+
+// This is the CPU time the process has used, in nanoseconds.
+static uint64_t cpuNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * A syntheticSource that times each call of the handler's callback, which is
+ * the time a driver thread would be kept from its next buffer. The time spent
+ * generating samples in read() is left out, since a driver has them ready.
+ * It can also stall the callback thread for a few callback periods every so
+ * often, as a descheduled driver thread would be.
+ */
+class timedSource : public syntheticSource {
+ public:
+  std::vector<uint64_t> callbacks;
+  // every how many callbacks to stall, or 0 to never stall
+  uint64_t stallEvery = 0;
+
+  bool configure(const sampleSourceConfig &config,
+                 const samplesReadyCallback &onSamples) {
+    callbacks.reserve(1 << 16);
+    auto stall = std::chrono::duration<double>(
+        STALL_CALLBACKS * config.samplesPerCallback / config.sampleClockRate);
+    return syntheticSource::configure(config, [this, onSamples, stall]() {
+      if (stallEvery > 0 && ++calls % stallEvery == 0) {
+        std::this_thread::sleep_for(stall);
+      }
+      reading = 0;
+      uint64_t start = nanos();
+      onSamples();
+      callbacks.push_back(nanos() - start - reading);
+    });
+  }
+
+  long read(double *data, size_t size) {
+    uint64_t start = nanos();
+    long samples = syntheticSource::read(data, size);
+    reading += nanos() - start;
+    return samples;
+  }
+
+  // This calls read(), so the time it already added is replaced.
+  long readCodes(int16_t *data, size_t size) {
+    uint64_t before = reading;
+    uint64_t start = nanos();
+    long samples = syntheticSource::readCodes(data, size);
+    reading = before + nanos() - start;
+    return samples;
+  }
+
+ private:
+  uint64_t reading = 0;
+  uint64_t calls = 0;
+};
+
+/**
+ * Runs one session at one sample rate
+ */
+static benchResult benchRate(int sampleFormat, bool rawCapture, bool stall,
+                             double rate, int channels,
+                             double callbacksPerSecond, double seconds,
+                             const std::string &logFile) {
+  timedSource meter;
+  meter.stallEvery = stall ? STALL_EVERY : 0;
+  NIDAQmxEventHandler handler(logFile, &meter);
+
+  NIDAQmxConfig config;
+  config.numChannels = channels;
+  if (callbacksPerSecond > 0.0) {
+    config.samplesPerCallback = std::max(1, (int)(rate / callbacksPerSecond));
+  }
+  config.sampleClockRate = rate;
+  config.channelDescription = "synthetic";
+  config.channelVoltages = new double[channels];
+  for (int i = 0; i < channels; i++) {
+    config.channelVoltages[i] = 12.0;
+  }
+  config.historySeconds = 1.0;
+  config.preRollMs = 0;
+  config.rawCapture = rawCapture;
+  config.sampleFormat = sampleFormat;
+  // The synthetic waveform is around 20 mV, so a small range keeps codes
+  // meaningful, as it would on a meter.
+  config.inputRange = 0.2;
+  handler.configure(config);
+
+  handler.startAcquisition();
+  handler.startHandler(0, nanos());
+  uint64_t cpuStart = cpuNanos();
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  uint64_t cpu = cpuNanos() - cpuStart;
+  handler.endHandler(0, nanos());
+  handler.stopAcquisition();
+  std::string rawFile = handler.sessionLogFile(0) + ".raw";
+  struct stat rawStat;
+  double rawBytes = stat(rawFile.c_str(), &rawStat) == 0 ? rawStat.st_size : 0;
+  unlink(handler.sessionLogFile(0).c_str());
+  unlink(rawFile.c_str());
+
+  double expected = rate * seconds;
+  benchResult result;
+  result.name = "synthetic";
+  result.parameter("format",
+                   sampleFormat == SAMPLE_FORMAT_I16 ? "i16" : "f64");
+  result.parameter("capture", rawCapture ? "raw" : "averaged");
+  result.parameter("stalls", stall ? "yes" : "no");
+  result.parameter("rate", std::to_string((long)rate));
+  result.parameter("channels", std::to_string(channels));
+  result.value("samples_per_callback", handler.config.samplesPerCallback);
+  result.value("buffer_samples", handler.config.bufferSamples);
+  result.latencies(meter.callbacks);
+  result.value("total_samples", (double)handler.totalSamplesRead);
+  result.value("delivered_fraction", handler.totalSamplesRead / expected);
+  result.value("cpu_fraction", cpu / (seconds * 1e9));
+  result.value("raw_bytes_per_sample",
+               handler.totalSamplesRead > 0
+                   ? rawBytes / handler.totalSamplesRead
+                   : 0.0);
+  result.value("cpu_ns_per_reading",
+               handler.totalSamplesRead > 0
+                   ? cpu / ((double)handler.totalSamplesRead * channels)
+                   : 0.0);
+  result.value("gaps", handler.health.gaps);
+  result.value("lost_samples", handler.health.lostSamples);
+  result.value("late_reads", handler.health.lateReads);
+  result.value("max_backlog", handler.health.maxBacklog);
+  result.value("largest_read", handler.health.largestRead);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+  int channels = argc > 2 ? atoi(argv[2]) : 18;
+  double callbacksPerSecond = argc > 3 ? atof(argv[3]) : 0.0;
+  std::vector<double> rates;
+  for (int i = 4; i < argc; i++) {
+    rates.push_back(atof(argv[i]));
+  }
+  if (rates.empty()) {
+    rates = {1000.0, 10000.0, 50000.0, 100000.0, 1000000.0};
+  }
+
+  setUpBenchmark();
+  char logDirectory[] = "/tmp/acquisitionXXXXXX";
+  if (!mkdtemp(logDirectory)) {
+    perror("acquisition: cannot create a directory for session logs");
+    return 1;
+  }
+  std::string logFile = std::string(logDirectory) + "/session";
+
+  std::vector<benchResult> results;
+  for (double rate : rates) {
+    for (int sampleFormat : {SAMPLE_FORMAT_F64, SAMPLE_FORMAT_I16}) {
+      for (bool rawCapture : {false, true}) {
+        results.push_back(benchRate(sampleFormat, rawCapture, false, rate,
+                                    channels, callbacksPerSecond, seconds,
+                                    logFile));
+      }
+    }
+    results.push_back(benchRate(SAMPLE_FORMAT_F64, false, true, rate,
+                                channels, callbacksPerSecond, seconds,
+                                logFile));
+  }
+  rmdir(logDirectory);
+
+  writeJSON("acquisition", results);
+  return 0;
+}
@@ -0,0 +1,141 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "socketutils.h"
+
+/*
+ * Shared pieces of the benchmarks: an in-process server that does nothing with
+ * what it receives, latency percentiles, and JSON output. Every benchmark
+ * prints a single JSON object to stdout so runs can be compared by scripts.
+ */
+
+// This handler only counts what it receives, so the server keeps up with the
+// client and does not skew the measurement.
+class countingHandler : public eventHandler {
+ public:
+  uint64_t tags = 0;
+  uint64_t regions = 0;
+
+  void startHandler(uint32_t sessionID, uint64_t timestamp) {
+    tags = 0;
+    regions = 0;
+  }
+  void tagHandler(uint32_t sessionID, uint64_t timestamp, uint32_t tagID,
+                  uint32_t threadID, uint32_t cpu) {
+    tags++;
+  }
+  void regionHandler(uint32_t sessionID, uint64_t timestamp, uint32_t tagID,
+                     uint32_t threadID, uint32_t cpu, bool begin) {
+    regions++;
+  }
+  void endHandler(uint32_t sessionID, uint64_t timestamp) {}
+};
+
+/**
+ * A socketServer with a countingHandler that serves a session on a background
+ * thread.
+ */
+class benchServer {
+ public:
+  countingHandler handler;
+  uint16_t port;
+
+  benchServer(uint16_t port) : port(port), server(port, &handler) {}
+
+  // This serves the next session on a background thread. The server listens
+  // from the moment it is created, so clients can connect right away.
+  void accept() {
+    thread = std::thread([this]() { server.listenForClient(); });
+  }
+
+  // This waits for every client to end its session.
+  void finish() { thread.join(); }
+
+ private:
+  socketServer server;
+  std::thread thread;
+};
+
+/**
+ * One line of benchmark output: a name, the parameters it ran with, and the
+ * measurements it produced.
+ */
+struct benchResult {
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> parameters;
+  std::vector<std::pair<std::string, double>> values;
+
+  void parameter(const std::string &key, const std::string &value) {
+    parameters.emplace_back(key, value);
+  }
+
+  void value(const std::string &key, double number) {
+    values.emplace_back(key, number);
+  }
+
+  // This adds the count, mean and percentiles of a set of latencies in
+  // nanoseconds. The samples are sorted in place.
+  void latencies(std::vector<uint64_t> &samples) {
+    if (samples.empty()) {
+      return;
+    }
+    std::sort(samples.begin(), samples.end());
+    double total = 0.0;
+    for (uint64_t sample : samples) {
+      total += (double)sample;
+    }
+    auto percentile = [&samples](double p) {
+      size_t index = (size_t)(p * (samples.size() - 1) + 0.5);
+      return (double)samples[index];
+    };
+    value("samples", (double)samples.size());
+    value("mean_ns", total / samples.size());
+    value("p50_ns", percentile(0.50));
+    value("p99_ns", percentile(0.99));
+    value("p999_ns", percentile(0.999));
+    value("max_ns", (double)samples.back());
+  }
+};
+
+/**
+ * Prints every result as one JSON object
+ *
+ * @param benchmark the name of the benchmark program
+ * @param results the results to print
+ */
+inline void writeJSON(const std::string &benchmark,
+                      const std::vector<benchResult> &results) {
+  printf("{\"benchmark\": \"%s\", \"clock\": \"%s\", \"results\": [\n",
+         benchmark.c_str(),
+         getClockSource() == CLOCK_SOURCE_TSC ? "tsc" : "chrono");
+  for (size_t i = 0; i < results.size(); i++) {
+    const benchResult &result = results[i];
+    printf("  {\"name\": \"%s\"", result.name.c_str());
+    for (auto &entry : result.parameters) {
+      printf(", \"%s\": \"%s\"", entry.first.c_str(), entry.second.c_str());
+    }
+    for (auto &entry : result.values) {
+      printf(", \"%s\": %.6g", entry.first.c_str(), entry.second);
+    }
+    printf("}%s\n", i + 1 < results.size() ? "," : "");
+  }
+  printf("]}\n");
+}
+
+// This sends what the library writes to std::cout to stderr instead, so
+// stdout only holds the JSON, and uses the TSC for timing when it can, since
+// reading the clock is part of every latency sample.
+inline void setUpBenchmark() {
+  std::cout.rdbuf(std::cerr.rdbuf());
+  setClockSource(CLOCK_SOURCE_TSC);
+}
+
+#endif
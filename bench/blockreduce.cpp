@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "benchutil.h"
+#include "channelstats.h"
+#include "nidaqmxeventhandler.h"
+
+/*
+ * Measures how long it takes to reduce one block of samples to per-channel
+ * power, for the averaging loop the handler used before the kernels and for
+ * every channelStats kernel the CPU can run. The kernels also find each
+ * channel's minimum, maximum and variance. Blocks are grouped by channel the
+ * way DAQmx returns them. Each result says whether it is the kernel the
+ * handler dispatches to on this CPU. The i16 results time the writer's path
+ * for blocks read as ADC codes: scaling them to volts with each scaling
+ * kernel, then reducing them with the dispatched channelStats kernel.
+ *
+ *   blockreduce [samples per channel] [blocks] [channels ...]
+ */
+
+// This is the reduction the handler did before the kernels: a mean per
+// channel, then nidaqDiffVoltToPower.
+static void averageThenConvert(const double *data, size_t numChannels,
+                               size_t samples, double *voltages,
+                               double *averages, double *power) {
+  for (size_t i = 0; i < numChannels; i++) {
+    averages[i] = 0.0;
+    for (size_t j = 0; j < samples; j++) {
+      averages[i] += data[j + i * samples];
+    }
+    averages[i] /= samples;
+  }
+  nidaqDiffVoltToPower(power, averages, voltages, numChannels);
+}
+
+/**
+ * Times one way of reducing blocks of the given shape
+ */
+static benchResult benchReduction(const std::string &name, size_t channels,
+                                  size_t samples, size_t blocks,
+                                  const channelStatsKernel kernel) {
+  std::mt19937 generator(1);
+  std::normal_distribution<double> noise(0.01, 0.0005);
+  std::vector<double> data(channels * samples);
+  for (double &value : data) {
+    value = noise(generator);
+  }
+  std::vector<double> voltages(channels, 12.0);
+  std::vector<double> averages(channels), power(channels);
+  std::vector<channelStats> stats(channels);
+
+  std::vector<uint64_t> elapsed;
+  elapsed.reserve(blocks);
+  double checksum = 0.0;
+  for (size_t block = 0; block < blocks; block++) {
+    uint64_t start = nanos();
+    if (kernel) {
+      kernel(data.data(), channels, samples, voltages.data(),
+             NIDAQ_CHAN_RESISTOR, stats.data(), power.data());
+    } else {
+      averageThenConvert(data.data(), channels, samples, voltages.data(),
+                         averages.data(), power.data());
+    }
+    elapsed.push_back(nanos() - start);
+    checksum += power[block % channels];
+  }
+
+  benchResult result;
+  result.name = name;
+  result.parameter("channels", std::to_string(channels));
+  result.parameter("samples_per_channel", std::to_string(samples));
+  result.parameter("dispatched",
+                   name == bestChannelStats().name ? "yes" : "no");
+  double total = 0.0;
+  for (uint64_t time : elapsed) {
+    total += (double)time;
+  }
+  result.value("gsamples_per_second", channels * samples * blocks / total);
+  result.latencies(elapsed);
+  // This keeps the compiler from dropping the reductions.
+  result.value("checksum", checksum);
+  return result;
+}
+
+/**
+ * Times scaling blocks of codes to volts and reducing them
+ */
+static benchResult benchCodes(const std::string &name, size_t channels,
+                              size_t samples, size_t blocks,
+                              const codeScalingKernel kernel) {
+  std::mt19937 generator(1);
+  std::normal_distribution<double> noise(33.0, 2.0);
+  std::vector<int16_t> codes(channels * samples);
+  for (int16_t &code : codes) {
+    code = (int16_t)noise(generator);
+  }
+  std::vector<double> scaling(channels * SAMPLE_SCALING_COEFFS, 0.0);
+  for (size_t i = 0; i < channels; i++) {
+    scaling[i * SAMPLE_SCALING_COEFFS + 1] = SAMPLE_INPUT_RANGE / 32768.0;
+  }
+  std::vector<double> data(channels * samples);
+  std::vector<double> voltages(channels, 12.0), power(channels);
+  std::vector<channelStats> stats(channels);
+
+  std::vector<uint64_t> elapsed;
+  elapsed.reserve(blocks);
+  double checksum = 0.0;
+  for (size_t block = 0; block < blocks; block++) {
+    uint64_t start = nanos();
+    kernel(codes.data(), channels, samples, scaling.data(), data.data());
+    computeChannelStats(data.data(), channels, samples, voltages.data(),
+                        NIDAQ_CHAN_RESISTOR, stats.data(), power.data());
+    elapsed.push_back(nanos() - start);
+    checksum += power[block % channels];
+  }
+
+  benchResult result;
+  result.name = name;
+  result.parameter("channels", std::to_string(channels));
+  result.parameter("samples_per_channel", std::to_string(samples));
+  double total = 0.0;
+  for (uint64_t time : elapsed) {
+    total += (double)time;
+  }
+  result.value("gsamples_per_second", channels * samples * blocks / total);
+  result.latencies(elapsed);
+  result.value("checksum", checksum);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  size_t samples = argc > 1 ? (size_t)atol(argv[1]) : 1000;
+  size_t blocks = argc > 2 ? (size_t)atol(argv[2]) : 2000;
+  std::vector<size_t> channelCounts;
+  for (int i = 3; i < argc; i++) {
+    channelCounts.push_back((size_t)atol(argv[i]));
+  }
+  if (channelCounts.empty()) {
+    channelCounts = {18, 32, 64, 128, 256};
+  }
+
+  setUpBenchmark();
+  std::vector<benchResult> results;
+  for (size_t channels : channelCounts) {
+    results.push_back(
+        benchReduction("average", channels, samples, blocks, nullptr));
+    for (const channelStatsImplementation &implementation :
+         channelStatsImplementations()) {
+      results.push_back(benchReduction(implementation.name, channels, samples,
+                                       blocks, implementation.kernel));
+    }
+    results.push_back(benchCodes("i16-scalar", channels, samples, blocks,
+                                 scaleSampleCodesScalar));
+#ifdef CHANNEL_STATS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      results.push_back(benchCodes("i16-avx2", channels, samples, blocks,
+                                   scaleSampleCodesAVX2));
+    }
+#endif
+  }
+
+  writeJSON("blockreduce", results);
+  return 0;
+}
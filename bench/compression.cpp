@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "benchutil.h"
+#include "nidaqmxeventhandler.h"
+#include "rawsamples.h"
+#include "samplecodec.h"
+#include "sessionlog.h"
+#include "syntheticsource.h"
+
+/*
+ * Measures the codecs of samplecodec.h on recorded sessions: how much smaller
+ * each kind of column gets, and how many gigabytes of uncompressed column
+ * each codec encodes and decodes per second. Binary session logs give their
+ * timestamps, samples and power readings, and raw sample files their codes,
+ * or volts for files read as f64. Every column is checked to decode back to
+ * exactly what was encoded, and the run fails if one does not. With no
+ * files, a session of the synthetic source is recorded first, reading codes
+ * and capturing every sample.
+ *
+ *   compression [seconds to record] [session log or raw sample file ...]
+ */
+
+// Each codec runs over the columns until this much time has passed, so
+// small files still give a steady rate.
+#define MIN_BENCH_NANOS 200000000ULL
+
+/**
+ * Times a codec over a set of columns
+ *
+ * @param name the kind of column
+ * @param file the file the columns come from
+ * @param columns the columns
+ * @param encode the encoder
+ * @param decode the decoder
+ * @returns the result
+ */
+template <typename T>
+static benchResult benchCodec(
+    const std::string &name, const std::string &file,
+    const std::vector<std::vector<T>> &columns,
+    void (*encode)(const T *, size_t, std::vector<uint8_t> &),
+    bool (*decode)(const uint8_t *, size_t, T *, size_t)) {
+  std::vector<std::vector<uint8_t>> encoded(columns.size());
+  size_t rawBytes = 0, encodedBytes = 0;
+  for (size_t i = 0; i < columns.size(); i++) {
+    encode(columns[i].data(), columns[i].size(), encoded[i]);
+    rawBytes += columns[i].size() * sizeof(T);
+    encodedBytes += encoded[i].size();
+  }
+
+  uint64_t passes = 0, start = nanos(), elapsed;
+  do {
+    for (size_t i = 0; i < columns.size(); i++) {
+      encoded[i].clear();
+      encode(columns[i].data(), columns[i].size(), encoded[i]);
+    }
+    passes++;
+    elapsed = nanos() - start;
+  } while (elapsed < MIN_BENCH_NANOS);
+  double encodeRate = (double)rawBytes * passes / elapsed;
+
+  std::vector<T> values;
+  bool exact = true;
+  passes = 0;
+  start = nanos();
+  do {
+    for (size_t i = 0; i < columns.size(); i++) {
+      values.resize(columns[i].size());
+      exact &= decode(encoded[i].data(), encoded[i].size(), values.data(),
+                      values.size());
+      if (passes == 0) {
+        exact &= memcmp(values.data(), columns[i].data(),
+                        values.size() * sizeof(T)) == 0;
+      }
+    }
+    passes++;
+    elapsed = nanos() - start;
+  } while (elapsed < MIN_BENCH_NANOS);
+
+  benchResult result;
+  result.name = name;
+  result.parameter("file", file);
+  result.value("columns", (double)columns.size());
+  result.value("raw_bytes", (double)rawBytes);
+  result.value("encoded_bytes", (double)encodedBytes);
+  result.value("ratio",
+               encodedBytes > 0 ? (double)rawBytes / encodedBytes : 0.0);
+  result.value("encode_gb_per_second", encodeRate);
+  result.value("decode_gb_per_second", (double)rawBytes * passes / elapsed);
+  result.value("exact", exact ? 1.0 : 0.0);
+  return result;
+}
+
+/**
+ * Times the codecs on the columns of a binary session log, a column per
+ * chunk for each kind
+ */
+static void benchSessionLog(const std::string &path,
+                            std::vector<benchResult> &results) {
+  sessionLogReader log;
+  if (!log.open(path)) {
+    return;
+  }
+  std::vector<std::vector<uint64_t>> timestamps;
+  std::vector<std::vector<uint32_t>> samples;
+  std::vector<std::vector<double>> readings;
+  for (size_t chunk = 0; chunk < log.chunkCount(); chunk++) {
+    sessionLogSpan span = log.chunk(chunk);
+    timestamps.emplace_back(span.timestamps, span.timestamps + span.rows);
+    samples.emplace_back(span.samples, span.samples + span.rows);
+    for (size_t channel = 0; channel < log.header.numChannels; channel++) {
+      const double *power = span.channel(channel);
+      readings.emplace_back(power, power + span.rows);
+    }
+  }
+  results.push_back(benchCodec("timestamps", path, timestamps,
+                               encodeTimestamps, decodeTimestamps));
+  results.push_back(
+      benchCodec("samples", path, samples, encodeCounts, decodeCounts));
+  results.push_back(benchCodec("power", path, readings, encodeReadings,
+                               decodeReadings));
+}
+
+/**
+ * Times the codecs on the blocks of a raw sample file, a column per block of
+ * codes or per channel of each block of volts
+ */
+static void benchRawSamples(const std::string &path,
+                            std::vector<benchResult> &results) {
+  rawSampleReader reader;
+  if (!reader.open(path)) {
+    return;
+  }
+  rawBlockHeader block;
+  if (reader.header.format == SAMPLE_FORMAT_I16) {
+    std::vector<std::vector<int16_t>> codes;
+    std::vector<int16_t> data;
+    while (reader.next(block, data)) {
+      codes.push_back(data);
+    }
+    results.push_back(
+        benchCodec("codes", path, codes, encodeCodes, decodeCodes));
+    return;
+  }
+  std::vector<std::vector<double>> volts;
+  std::vector<double> data;
+  while (reader.next(block, data)) {
+    for (size_t channel = 0; channel < reader.header.numChannels; channel++) {
+      volts.emplace_back(data.begin() + channel * block.samples,
+                         data.begin() + (channel + 1) * block.samples);
+    }
+  }
+  results.push_back(
+      benchCodec("volts", path, volts, encodeReadings, decodeReadings));
+}
+
+/**
+ * Records a session of the synthetic source reading codes, with a binary log
+ * and a raw capture
+ *
+ * @returns the session's log file
+ */
+static std::string recordSession(const std::string &logFile, double seconds) {
+  syntheticSource meter;
+  NIDAQmxEventHandler handler(logFile, &meter);
+  NIDAQmxConfig config;
+  config.numChannels = 18;
+  config.sampleClockRate = 50000.0;
+  config.channelDescription = "synthetic";
+  config.channelVoltages = new double[config.numChannels];
+  for (int i = 0; i < config.numChannels; i++) {
+    config.channelVoltages[i] = 12.0;
+  }
+  config.preRollMs = 0;
+  config.sampleFormat = SAMPLE_FORMAT_I16;
+  // The synthetic waveform is around 20 mV, so a small range keeps codes
+  // meaningful, as it would on a meter.
+  config.inputRange = 0.2;
+  config.rawCapture = true;
+  config.binaryLog = true;
+  handler.configure(config);
+
+  handler.startAcquisition();
+  handler.startHandler(0, nanos());
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  handler.endHandler(0, nanos());
+  handler.stopAcquisition();
+  return handler.sessionLogFile(0);
+}
+
+int main(int argc, char **argv) {
+  double seconds = argc > 1 ? atof(argv[1]) : 4.0;
+  std::vector<std::string> files;
+  for (int i = 2; i < argc; i++) {
+    files.push_back(argv[i]);
+  }
+
+  setUpBenchmark();
+  char logDirectory[] = "/tmp/compressionXXXXXX";
+  std::string recorded;
+  if (files.empty()) {
+    if (!mkdtemp(logDirectory)) {
+      perror("compression: cannot create a directory for session logs");
+      return 1;
+    }
+    recorded = recordSession(std::string(logDirectory) + "/session", seconds);
+    files = {recorded + ".ppl", recorded + ".raw"};
+  }
+
+  std::vector<benchResult> results;
+  for (const std::string &file : files) {
+    if (file.size() > 4 && file.compare(file.size() - 4, 4, ".raw") == 0) {
+      benchRawSamples(file, results);
+    } else {
+      benchSessionLog(file, results);
+    }
+  }
+
+  if (!recorded.empty()) {
+    for (const char *suffix : {"", ".ppl", ".raw", ".folded"}) {
+      unlink((recorded + suffix).c_str());
+    }
+    rmdir(logDirectory);
+  }
+  writeJSON("compression", results);
+
+  int status = 0;
+  for (const benchResult &result : results) {
+    for (const auto &value : result.values) {
+      if (value.first == "exact" && value.second == 0.0) {
+        fprintf(stderr, "compression: %s of %s did not decode exactly\n",
+                result.name.c_str(), result.parameters[0].second.c_str());
+        status = 1;
+      }
+    }
+  }
+  return status;
+}
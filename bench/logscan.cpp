@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include "benchutil.h"
+#include "sessionlog.h"
+
+/*
+ * Compares the text session log with the binary one for a long session: how
+ * long each takes to write and how big it is, how long it takes to go through
+ * every reading, and for the binary log how long it takes to open, to find
+ * the readings of a random minute and to work out the energy of a random
+ * region from its energy table. A few of the regions are also worked out by
+ * going through the readings, to time that and to check both agree. The text
+ * log is parsed the way a script
+ * would read it, a line per reading, and has no timestamps to search. Both
+ * files are read back while they are still in the page cache, so the scans
+ * measure parsing rather than the disk.
+ *
+ *   logscan [hours] [channels] [readings per second]
+ */
+
+// This is how many random minutes the range lookups are timed over.
+#define RANGE_LOOKUPS 1000
+
+// These are how many random regions the energy lookups are timed over, and
+// how many of those are also worked out by going through the readings.
+#define ENERGY_LOOKUPS 10000
+#define ENERGY_SCANS 100
+
+// This is a handler with no sessions, whose string table names the tags.
+class namesOnly : public eventHandler {
+ public:
+  void startHandler(uint32_t sessionID, uint64_t timestamp) {}
+  void tagHandler(uint32_t sessionID, uint64_t timestamp, uint32_t tagID,
+                  uint32_t threadID, uint32_t cpu) {}
+  void endHandler(uint32_t sessionID, uint64_t timestamp) {}
+};
+
+static double seconds(uint64_t start) { return (nanos() - start) / 1e9; }
+
+static size_t fileSize(const std::string &path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  return (size_t)file.tellg();
+}
+
+// This works out the joules used from begin to end by going through the
+// readings from the start of the log, as a script without the energy table
+// would. The first reading covers no time.
+static double scanEnergy(const sessionLogReader &log, uint64_t begin,
+                         uint64_t end) {
+  double joules = 0.0;
+  uint64_t previous = UINT64_MAX;
+  for (const sessionLogSpan &span : log.range(0, UINT64_MAX)) {
+    for (size_t row = 0; row < span.rows; row++) {
+      uint64_t timestamp = span.timestamps[row];
+      uint64_t from = std::max(previous, begin);
+      uint64_t to = std::min(timestamp, end);
+      if (previous != UINT64_MAX && to > from) {
+        for (size_t index = 0; index < log.header.numChannels; index++) {
+          joules += span.channel(index)[row] * (double)(to - from) * 1e-9;
+        }
+      }
+      if (timestamp >= end) {
+        return joules;
+      }
+      previous = timestamp;
+    }
+  }
+  return joules;
+}
+
+int main(int argc, char **argv) {
+  double hours = argc > 1 ? atof(argv[1]) : 2.0;
+  size_t channels = argc > 2 ? (size_t)atol(argv[2]) : 18;
+  double readingsPerSecond = argc > 3 ? atof(argv[3]) : 25.0;
+  size_t rows = (size_t)(hours * 3600 * readingsPerSecond);
+  uint64_t period = (uint64_t)(1e9 / readingsPerSecond);
+
+  setUpBenchmark();
+  char logDirectory[] = "/tmp/logscanXXXXXX";
+  if (!mkdtemp(logDirectory)) {
+    perror("logscan: cannot create a directory for session logs");
+    return 1;
+  }
+  std::string textFile = std::string(logDirectory) + "/session";
+  std::string binaryFile = textFile + ".ppl";
+
+  std::mt19937 generator(1);
+  std::normal_distribution<double> noise(1.0, 0.05);
+  std::vector<double> readings(channels * 1024);
+  for (double &value : readings) {
+    value = noise(generator);
+  }
+  std::vector<double> voltages(channels, 12.0);
+  namesOnly names;
+  std::vector<tagEvent> tags;
+  for (size_t i = 0; i < 1000; i++) {
+    tags.push_back({i * rows / 1000 * period,
+                    names.internTag("tag " + std::to_string(i % 10)),
+                    TAG_EVENT_TAG, 0, TAG_CPU_UNKNOWN});
+  }
+
+  benchResult text, binary;
+  text.name = "text";
+  binary.name = "binary";
+  for (benchResult *result : {&text, &binary}) {
+    result->parameter("hours", std::to_string(hours));
+    result->parameter("channels", std::to_string(channels));
+    result->parameter("rows", std::to_string(rows));
+  }
+
+  // This writes the readings the way the handler's writeReadings does.
+  uint64_t start = nanos();
+  {
+    std::fstream writer(textFile, std::fstream::out);
+    char reading[32];
+    for (size_t row = 0; row < rows; row++) {
+      const double *power = &readings[(row % 1024) * channels];
+      for (size_t index = 0; index < channels; index++) {
+        int length = snprintf(reading, sizeof(reading), "%f ", power[index]);
+        writer.write(reading, length);
+      }
+      writer.put('\n');
+    }
+  }
+  text.value("write_seconds", seconds(start));
+  text.value("bytes", (double)fileSize(textFile));
+
+  start = nanos();
+  {
+    sessionLogWriter writer;
+    sessionLogHeader header = {};
+    header.numChannels = (uint32_t)channels;
+    header.sampleClockRate = 1000.0;
+    header.samplesPerCallback = 40;
+    writer.open(binaryFile, header, voltages.data(), nullptr, "bench");
+    for (size_t row = 0; row < rows; row++) {
+      writer.append(row * period, 40, &readings[(row % 1024) * channels]);
+    }
+    writer.close(tags, names);
+  }
+  binary.value("write_seconds", seconds(start));
+  binary.value("bytes", (double)fileSize(binaryFile));
+
+  start = nanos();
+  double textTotal = 0.0;
+  {
+    std::ifstream reader(textFile);
+    std::string line;
+    while (std::getline(reader, line)) {
+      const char *cursor = line.c_str();
+      char *end;
+      for (double value = strtod(cursor, &end); end != cursor;
+           value = strtod(cursor, &end)) {
+        textTotal += value;
+        cursor = end;
+      }
+    }
+  }
+  text.value("scan_seconds", seconds(start));
+  text.value("checksum", textTotal);
+
+  start = nanos();
+  sessionLogReader log;
+  if (!log.open(binaryFile)) {
+    return 1;
+  }
+  binary.value("open_ns", (double)(nanos() - start));
+  double binaryTotal = 0.0;
+  for (const sessionLogSpan &span : log.range(0, UINT64_MAX)) {
+    for (size_t index = 0; index < channels; index++) {
+      const double *power = span.channel(index);
+      for (size_t row = 0; row < span.rows; row++) {
+        binaryTotal += power[row];
+      }
+    }
+  }
+  binary.value("scan_seconds", seconds(start));
+  binary.value("checksum", binaryTotal);
+
+  uint64_t minute = 60000000000ULL;
+  uint64_t last = rows * period > minute ? rows * period - minute : 0;
+  std::uniform_int_distribution<uint64_t> minutes(0, last);
+  std::vector<uint64_t> lookups;
+  size_t found = 0;
+  for (size_t i = 0; i < RANGE_LOOKUPS; i++) {
+    uint64_t begin = minutes(generator);
+    uint64_t lookupStart = nanos();
+    std::vector<sessionLogSpan> spans = log.range(begin, begin + minute);
+    lookups.push_back(nanos() - lookupStart);
+    for (const sessionLogSpan &span : spans) {
+      found += span.rows;
+    }
+  }
+  benchResult range;
+  range.name = "binary-minute";
+  range.parameter("hours", std::to_string(hours));
+  range.parameter("channels", std::to_string(channels));
+  range.value("rows_per_lookup", (double)found / RANGE_LOOKUPS);
+  range.latencies(lookups);
+
+  // The regions are as long as a minute on average, and the first lookups
+  // take longer while the running sums of each chunk are worked out.
+  std::uniform_int_distribution<uint64_t> times(0, rows * period);
+  std::vector<uint64_t> energyLookups, energyScans;
+  double joules = 0.0, largestError = 0.0;
+  for (size_t i = 0; i < ENERGY_LOOKUPS; i++) {
+    uint64_t begin = times(generator);
+    uint64_t end = begin + times(generator) / (uint64_t)(hours * 60);
+    uint64_t lookupStart = nanos();
+    double energy = log.energyBetween(begin, end);
+    energyLookups.push_back(nanos() - lookupStart);
+    joules += energy;
+    if (i < ENERGY_SCANS) {
+      uint64_t scanStart = nanos();
+      double scanned = scanEnergy(log, begin, end);
+      energyScans.push_back(nanos() - scanStart);
+      if (scanned > 0.0) {
+        largestError =
+            std::max(largestError, std::abs(energy - scanned) / scanned);
+      }
+    }
+  }
+  benchResult energy;
+  energy.name = "binary-energy";
+  energy.parameter("hours", std::to_string(hours));
+  energy.parameter("channels", std::to_string(channels));
+  energy.value("joules_per_lookup", joules / ENERGY_LOOKUPS);
+  energy.value("largest_relative_error", largestError);
+  energy.latencies(energyLookups);
+  benchResult scan;
+  scan.name = "binary-energy-scan";
+  scan.parameter("hours", std::to_string(hours));
+  scan.parameter("channels", std::to_string(channels));
+  scan.latencies(energyScans);
+  log.close();
+
+  unlink(textFile.c_str());
+  unlink(binaryFile.c_str());
+  rmdir(logDirectory);
+  writeJSON("logscan", {text, binary, range, energy, scan});
+  return 0;
+}
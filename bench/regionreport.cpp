@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "benchutil.h"
+#include "sessionlog.h"
+#include "sessionreport.h"
+
+/*
+ * Measures how fast sessionReport goes through a long binary session log
+ * with many regions, with one thread and then more up to a thread per core.
+ * The rate is in megabytes of uncompressed columns per second. Every
+ * interval's joules are checked against the log's energy table.
+ *
+ *   regionreport [hours] [channels] [readings per second] [compress]
+ */
+
+// These are the lengths of the outer regions on each client thread and of
+// the regions inside them.
+#define OUTER_REGION_NANOS 10000000000ULL
+#define INNER_REGION_NANOS 1000000000ULL
+#define CLIENT_THREADS 2
+
+// This is a handler with no sessions, whose string table names the tags.
+class namesOnly : public eventHandler {
+ public:
+  void startHandler(uint32_t sessionID, uint64_t timestamp) {}
+  void tagHandler(uint32_t sessionID, uint64_t timestamp, uint32_t tagID,
+                  uint32_t threadID, uint32_t cpu) {}
+  void endHandler(uint32_t sessionID, uint64_t timestamp) {}
+};
+
+int main(int argc, char **argv) {
+  double hours = argc > 1 ? atof(argv[1]) : 2.0;
+  size_t channels = argc > 2 ? (size_t)atol(argv[2]) : 18;
+  double readingsPerSecond = argc > 3 ? atof(argv[3]) : 25.0;
+  bool compress = argc > 4 ? atoi(argv[4]) != 0 : true;
+  size_t rows = (size_t)(hours * 3600 * readingsPerSecond);
+  uint64_t period = (uint64_t)(1e9 / readingsPerSecond);
+
+  setUpBenchmark();
+  char logDirectory[] = "/tmp/regionreportXXXXXX";
+  if (!mkdtemp(logDirectory)) {
+    perror("regionreport: cannot create a directory for session logs");
+    return 1;
+  }
+  std::string logFile = std::string(logDirectory) + "/session.ppl";
+
+  // Each client thread runs outer regions back to back, with a tag at the
+  // start of each and inner regions filling them, offset from one another.
+  namesOnly names;
+  std::vector<tagEvent> tags;
+  uint64_t duration = rows * period;
+  uint32_t outer = names.internTag("outer"), inner = names.internTag("inner");
+  for (uint32_t thread = 0; thread < CLIENT_THREADS; thread++) {
+    uint64_t offset = thread * INNER_REGION_NANOS / CLIENT_THREADS;
+    for (uint64_t start = offset; start + OUTER_REGION_NANOS <= duration;
+         start += OUTER_REGION_NANOS) {
+      tags.push_back({start, names.internTag("phase"), TAG_EVENT_TAG, thread,
+                      TAG_CPU_UNKNOWN});
+      tags.push_back(
+          {start, outer, TAG_EVENT_REGION_BEGIN, thread, TAG_CPU_UNKNOWN});
+      for (uint64_t time = start; time < start + OUTER_REGION_NANOS;
+           time += INNER_REGION_NANOS) {
+        tags.push_back(
+            {time, inner, TAG_EVENT_REGION_BEGIN, thread, TAG_CPU_UNKNOWN});
+        tags.push_back({time + INNER_REGION_NANOS / 2, inner,
+                        TAG_EVENT_REGION_END, thread, TAG_CPU_UNKNOWN});
+      }
+      tags.push_back({start + OUTER_REGION_NANOS, outer, TAG_EVENT_REGION_END,
+                      thread, TAG_CPU_UNKNOWN});
+    }
+  }
+  std::stable_sort(tags.begin(), tags.end(),
+                   [](const tagEvent &a, const tagEvent &b) {
+                     return a.timestamp < b.timestamp;
+                   });
+
+  std::mt19937 generator(1);
+  std::normal_distribution<double> noise(1.0, 0.05);
+  std::vector<double> readings(channels * 1024);
+  for (double &value : readings) {
+    value = noise(generator);
+  }
+  std::vector<double> voltages(channels, 12.0);
+  {
+    sessionLogWriter writer;
+    sessionLogHeader header = {};
+    header.numChannels = (uint32_t)channels;
+    header.sampleClockRate = 1000.0;
+    header.samplesPerCallback = 40;
+    writer.open(logFile, header, voltages.data(), nullptr, "bench", compress);
+    writer.coverFrom(0);
+    for (size_t row = 0; row < rows; row++) {
+      writer.append((row + 1) * period, 40,
+                    &readings[(row % 1024) * channels]);
+    }
+    writer.close(tags, names);
+  }
+  double columnBytes = (double)rows * (sizeof(uint64_t) + sizeof(uint32_t) +
+                                       channels * sizeof(double));
+
+  std::vector<benchResult> results;
+  unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+  for (unsigned threads = 1;; threads = std::min(threads * 2, cores)) {
+    uint64_t start = nanos();
+    sessionReport report;
+    if (!report.open({logFile})) {
+      return 1;
+    }
+    report.run(threads);
+    double seconds = (nanos() - start) / 1e9;
+
+    sessionLogReader log;
+    log.open(logFile);
+    double largestError = 0.0;
+    for (const reportInterval &interval : report.getIntervals()) {
+      double expected = log.energyBetween(interval.begin, interval.end);
+      if (expected > 0.0) {
+        largestError = std::max(
+            largestError, std::abs(interval.joules - expected) / expected);
+      }
+    }
+
+    benchResult result;
+    result.name = "report";
+    result.parameter("hours", std::to_string(hours));
+    result.parameter("channels", std::to_string(channels));
+    result.parameter("compressed", compress ? "1" : "0");
+    result.parameter("threads", std::to_string(threads));
+    result.value("intervals", (double)report.getIntervals().size());
+    result.value("seconds", seconds);
+    result.value("megabytes_per_second", columnBytes / seconds / 1e6);
+    result.value("largest_relative_error", largestError);
+    results.push_back(result);
+    if (threads == cores) {
+      break;
+    }
+  }
+
+  unlink(logFile.c_str());
+  rmdir(logDirectory);
+  writeJSON("regionreport", results);
+  return 0;
+}
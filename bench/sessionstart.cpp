@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "benchutil.h"
+#include "nidaqmxeventhandler.h"
+
+/*
+ * Measures how long the meter handler takes to start and end a session when
+ * the task is built for every session, when configure() committed it ahead of
+ * time (fast start), and when the acquisition runs continuously. The meter is
+ * a mockSource that sleeps for as long as each DAQmx operation is assumed to
+ * take, so no NI hardware is needed; the results show which operations land
+ * inside a session and what the handler adds on top.
+ *
+ *   sessionstart [sessions] [configure us] [commit us] [start us] [stop us]
+ *                [clear us]
+ */
+
+// These are the ways the handler can run the acquisition.
+static const char *modes[] = {"per_session", "fast_start", "continuous"};
+
+/**
+ * Times the sessions of one mode
+ */
+static std::vector<benchResult> benchMode(const std::string &mode,
+                                          const mockLatency &latency,
+                                          size_t sessions,
+                                          const std::string &logFile) {
+  mockSource meter(0.001);
+  meter.latency = latency;
+  NIDAQmxEventHandler handler(logFile, &meter);
+
+  NIDAQmxConfig config;
+  config.numChannels = 4;
+  config.samplesPerCallback = 40;
+  config.channelDescription = "mock";
+  config.channelVoltages = new double[config.numChannels]{12.0, 12.0, 5.0,
+                                                          3.3};
+  config.historySeconds = 1.0;
+  config.preRollMs = 0;
+  config.fastStart = mode != "per_session";
+  handler.configure(config);
+  if (mode == "continuous") {
+    handler.startAcquisition();
+  }
+
+  uint64_t configures = meter.configures;
+  uint64_t commits = meter.commits;
+  std::vector<uint64_t> starts, ends;
+  for (size_t i = 0; i < sessions; i++) {
+    uint32_t sessionID = (uint32_t)i;
+    uint64_t start = nanos();
+    handler.startHandler(sessionID, nanos());
+    starts.push_back(nanos() - start);
+
+    start = nanos();
+    handler.endHandler(sessionID, nanos());
+    ends.push_back(nanos() - start);
+    unlink(handler.sessionLogFile(sessionID).c_str());
+  }
+
+  std::vector<benchResult> results(2);
+  results[0].name = "session_start";
+  results[0].parameter("mode", mode);
+  results[0].latencies(starts);
+  results[0].value("configures_per_session",
+                   (double)(meter.configures - configures) / sessions);
+  results[0].value("commits_per_session",
+                   (double)(meter.commits - commits) / sessions);
+  results[1].name = "session_end";
+  results[1].parameter("mode", mode);
+  results[1].latencies(ends);
+  return results;
+}
+
+int main(int argc, char **argv) {
+  size_t sessions = argc > 1 ? (size_t)atol(argv[1]) : 20;
+
+  // The defaults are rough figures for a CompactDAQ chassis; the point is
+  // which of them a session start waits on, not their exact size.
+  mockLatency latency;
+  latency.configure = argc > 2 ? strtoull(argv[2], NULL, 10) : 20000;
+  latency.commit = argc > 3 ? strtoull(argv[3], NULL, 10) : 100000;
+  latency.start = argc > 4 ? strtoull(argv[4], NULL, 10) : 2000;
+  latency.stop = argc > 5 ? strtoull(argv[5], NULL, 10) : 2000;
+  latency.clear = argc > 6 ? strtoull(argv[6], NULL, 10) : 10000;
+
+  setUpBenchmark();
+  char logDirectory[] = "/tmp/sessionstartXXXXXX";
+  if (!mkdtemp(logDirectory)) {
+    perror("sessionstart: cannot create a directory for session logs");
+    return 1;
+  }
+  std::string logFile = std::string(logDirectory) + "/session";
+
+  std::vector<benchResult> results;
+  for (const char *mode : modes) {
+    for (benchResult &result : benchMode(mode, latency, sessions, logFile)) {
+      results.push_back(result);
+    }
+  }
+  rmdir(logDirectory);
+
+  writeJSON("sessionstart", results);
+  return 0;
+}
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "benchutil.h"
+#include "region.h"
+
+/*
+ * Measures what instrumentation costs. Every tag encoding is timed on every
+ * transport against an in-process server, each call separately for the
+ * latency percentiles and as one loop for the throughput. Session start and
+ * end round trips are timed over fresh connections, and the server's frame
+ * decoding and tag formatting are timed on their own.
+ *
+ *   tagbench [iterations] [port]
+ */
+
+// These are the ways a client can send a tag.
+static const char *encodings[] = {"string", "id", "tagf", "region"};
+
+// These are the ways tags can reach the server.
+static const char *transports[] = {"sync", "async", "shm"};
+
+static void enableTransport(socketClient &client, const std::string &transport,
+                            size_t iterations) {
+  // The rings hold every tag of a run so the flusher never has to keep up.
+  size_t capacity = std::min<size_t>(2 * iterations + 1024,
+                                     SHARED_RING_MAX_CAPACITY);
+  if (transport == "async") {
+    client.enableAsyncTags(capacity);
+  } else if (transport == "shm") {
+    client.enableSharedMemory(capacity);
+  }
+}
+
+static void sendOne(socketClient &client, const std::string &encoding,
+                    uint32_t tagID, powerpack::regionSite &site, size_t i) {
+  if (encoding == "string") {
+    client.sendTag(std::string("benchmark tag"));
+  } else if (encoding == "id") {
+    client.sendTag(tagID);
+  } else if (encoding == "tagf") {
+    client.sendTagf("benchmark tag %zu", i);
+  } else {
+    powerpack::Region region(client, site);
+  }
+}
+
+/**
+ * Times one encoding over one transport
+ */
+static benchResult benchTags(benchServer &server, const std::string &transport,
+                             const std::string &encoding, size_t iterations) {
+  static powerpack::regionSite site(powerpack::regionHash("benchmark region"),
+                                    "benchmark region");
+  server.accept();
+  socketClient client(server.port, "127.0.0.1");
+  enableTransport(client, transport, iterations);
+  uint32_t tagID = client.registerTag("benchmark tag");
+  client.sendSessionStart();
+
+  // The encoding is chosen outside the timed region for the throughput loop.
+  std::vector<uint64_t> samples(iterations);
+  for (size_t i = 0; i < iterations; i++) {
+    uint64_t start = nanos();
+    sendOne(client, encoding, tagID, site, i);
+    samples[i] = nanos() - start;
+  }
+
+  uint64_t start = nanos();
+  if (encoding == "string") {
+    for (size_t i = 0; i < iterations; i++) {
+      client.sendTag(std::string("benchmark tag"));
+    }
+  } else if (encoding == "id") {
+    for (size_t i = 0; i < iterations; i++) {
+      client.sendTag(tagID);
+    }
+  } else if (encoding == "tagf") {
+    for (size_t i = 0; i < iterations; i++) {
+      client.sendTagf("benchmark tag %zu", i);
+    }
+  } else {
+    for (size_t i = 0; i < iterations; i++) {
+      powerpack::Region region(client, site);
+    }
+  }
+  uint64_t elapsed = nanos() - start;
+
+  uint64_t dropped = client.droppedTags();
+  client.sendSessionEnd();
+  server.finish();
+
+  benchResult result;
+  result.name = "send";
+  result.parameter("transport", transport);
+  result.parameter("encoding", encoding);
+  result.latencies(samples);
+  result.value("calls_per_s", iterations / (elapsed * 1e-9));
+  result.value("dropped", (double)dropped);
+  result.value("received",
+               (double)(server.handler.tags + server.handler.regions / 2));
+  return result;
+}
+
+/**
+ * Times sendSessionStart and sendSessionEnd, each over a new connection
+ */
+static std::vector<benchResult> benchSessions(benchServer &server,
+                                              size_t sessions) {
+  std::vector<uint64_t> starts, ends;
+  for (size_t i = 0; i < sessions; i++) {
+    server.accept();
+    socketClient client(server.port, "127.0.0.1");
+
+    uint64_t start = nanos();
+    client.sendSessionStart();
+    starts.push_back(nanos() - start);
+
+    start = nanos();
+    client.sendSessionEnd();
+    ends.push_back(nanos() - start);
+    server.finish();
+  }
+
+  std::vector<benchResult> results(2);
+  results[0].name = "session_start";
+  results[0].latencies(starts);
+  results[1].name = "session_end";
+  results[1].latencies(ends);
+  return results;
+}
+
+/**
+ * Times decodeTagBatch on a full frame of records like the flusher sends
+ */
+static benchResult benchDecode(size_t frames, bool formatted) {
+  std::vector<char> payload;
+  uint64_t timestamp = nanos();
+  putFixed<uint32_t>(payload, TAG_FLUSH_BATCH_SIZE);
+  putFixed<uint64_t>(payload, timestamp);
+  for (int i = 0; i < TAG_FLUSH_BATCH_SIZE; i++) {
+    uint8_t kind = formatted ? TAG_EVENT_FORMATTED : TAG_EVENT_TAG;
+    putVarint(payload, zigzagEncode(150 + i % 7));
+    putVarint(payload, (uint64_t)(i % 16) << 2 | kind);
+    putVarint(payload, 3);
+    putVarint(payload, 5);
+    if (formatted) {
+      char args[TAG_ARGS_SIZE];
+      uint8_t size = 0;
+      packTagArgs(args, size, i, 0.5 * i);
+      payload.push_back((char)size);
+      payload.insert(payload.end(), args, args + size);
+    }
+  }
+
+  uint64_t checksum = 0;
+  tagCallback onTag = [&checksum](const tagRecord &record) {
+    checksum += record.tagID + record.argsSize;
+  };
+
+  std::vector<uint64_t> samples(frames);
+  for (size_t i = 0; i < frames; i++) {
+    uint64_t start = nanos();
+    if (!decodeTagBatch(payload.data(), payload.size(), onTag)) {
+      fprintf(stderr, "benchmark frame failed to decode\n");
+      exit(EXIT_FAILURE);
+    }
+    samples[i] = nanos() - start;
+  }
+  uint64_t elapsed = 0;
+  for (uint64_t sample : samples) {
+    elapsed += sample;
+  }
+
+  benchResult result;
+  result.name = "decode_batch";
+  result.parameter("encoding", formatted ? "tagf" : "id");
+  result.value("records_per_frame", TAG_FLUSH_BATCH_SIZE);
+  result.value("frame_bytes", (double)payload.size());
+  result.latencies(samples);
+  result.value("records_per_s",
+               (double)frames * TAG_FLUSH_BATCH_SIZE / (elapsed * 1e-9));
+  result.value("checksum", (double)(checksum & 0xffff));
+  return result;
+}
+
+/**
+ * Times the server's formatting of a sendTagf record
+ */
+static benchResult benchFormat(size_t iterations) {
+  std::string format = "Starting for n := %zu, scale %.3f on %s";
+  std::vector<uint64_t> samples(iterations);
+  size_t length = 0;
+
+  for (size_t i = 0; i < iterations; i++) {
+    char args[TAG_ARGS_SIZE];
+    uint8_t size = 0;
+    packTagArgs(args, size, i, 0.25 * i, "node");
+    uint64_t start = nanos();
+    length += formatTag(format, args, size).size();
+    samples[i] = nanos() - start;
+  }
+
+  benchResult result;
+  result.name = "format_tag";
+  result.latencies(samples);
+  result.value("mean_length", (double)length / iterations);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  size_t iterations = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+  uint16_t port = argc > 2 ? (uint16_t)atoi(argv[2]) : 8096;
+
+  setUpBenchmark();
+  benchServer server(port);
+  std::vector<benchResult> results;
+
+  for (const char *transport : transports) {
+    for (const char *encoding : encodings) {
+      results.push_back(benchTags(server, transport, encoding, iterations));
+    }
+  }
+
+  for (benchResult &result : benchSessions(server, 50)) {
+    results.push_back(result);
+  }
+  results.push_back(benchDecode(iterations / 10 + 1, false));
+  results.push_back(benchDecode(iterations / 10 + 1, true));
+  results.push_back(benchFormat(iterations));
+
+  writeJSON("tagbench", results);
+  return 0;
+}
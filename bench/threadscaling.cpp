@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "benchutil.h"
+
+/*
+ * Measures what sendTag costs the calling thread as more threads tag at once.
+ * Every run starts a fresh session against an in-process server, has each
+ * thread send the same number of tags as fast as it can, and reports the mean
+ * time per tag seen by a thread and the total rate across threads.
+ *
+ *   threadscaling [max threads] [tags per thread] [port]
+ */
+
+benchResult runThreads(benchServer &server, const std::string &transport,
+                       int threads, int tagsPerThread) {
+  server.accept();
+  socketClient client(server.port, "127.0.0.1");
+  if (transport == "async") {
+    client.enableAsyncTags(1 << 16);
+  } else if (transport == "shm") {
+    client.enableSharedMemory(SHARED_RING_MAX_CAPACITY);
+  }
+  uint32_t tagID = client.registerTag("bench");
+  client.sendSessionStart();
+
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<uint64_t> elapsed(threads);
+  std::vector<std::thread> workers;
+
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      ready++;
+      while (!go.load()) {
+      }
+      uint64_t start = nanos();
+      for (int i = 0; i < tagsPerThread; i++) {
+        client.sendTag(tagID);
+      }
+      elapsed[t] = nanos() - start;
+    });
+  }
+
+  while (ready.load() < threads) {
+  }
+  uint64_t start = nanos();
+  go.store(true);
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  uint64_t wall = nanos() - start;
+
+  uint64_t dropped = client.droppedTags();
+  client.sendSessionEnd();
+  server.finish();
+
+  double total = 0.0;
+  for (uint64_t time : elapsed) {
+    total += (double)time;
+  }
+
+  benchResult result;
+  result.name = "thread_scaling";
+  result.parameter("transport", transport);
+  result.value("threads", threads);
+  result.value("ns_per_tag", total / ((double)threads * tagsPerThread));
+  result.value("tags_per_s", (double)threads * tagsPerThread / (wall * 1e-9));
+  result.value("dropped", (double)dropped);
+  result.value("received", (double)server.handler.tags);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  int maxThreads = argc > 1 ? atoi(argv[1]) : 128;
+  int tagsPerThread = argc > 2 ? atoi(argv[2]) : 100000;
+  uint16_t port = argc > 3 ? (uint16_t)atoi(argv[3]) : 8095;
+
+  setUpBenchmark();
+  benchServer server(port);
+  std::vector<benchResult> results;
+
+  for (const char *transport : {"async", "shm"}) {
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+      results.push_back(runThreads(server, transport, threads, tagsPerThread));
+    }
+  }
+
+  writeJSON("threadscaling", results);
+  return 0;
+}
@@ -0,0 +1,335 @@
+#include "channelstats.h"
+#include <algorithm>
+#include <chrono>
+#include "samplesource.h"
+#ifdef CHANNEL_STATS_X86
+#include <immintrin.h>
+#endif
+
+// This is how many times each kernel is timed when the fastest is chosen.
+#define CHANNEL_STATS_CALIBRATION_RUNS 5
+
+/*
+ * Every kernel sums each sample's distance from the channel's first sample
+ * and the squares of those distances. Shifting by a sample keeps the sums
+ * small, so the variance does not lose its digits to cancellation against a
+ * large mean, and it still takes a single pass.
+ */
+
+/**
+ * Turns one channel's sums into its stats and power
+ *
+ * @param shift the channel's first sample
+ * @param sum the sum of every sample minus shift
+ * @param squares the sum of the squares of every sample minus shift
+ */
+static inline void finishChannel(size_t channel, size_t samples, double shift,
+                                 double sum, double squares, double low,
+                                 double high, const double *voltages,
+                                 double resistance, channelStats *stats,
+                                 double *power) {
+  double mean = sum / samples;
+  channelStats &result = stats[channel];
+  result.mean = shift + mean;
+  result.min = low;
+  result.max = high;
+  result.variance = std::max(0.0, squares / samples - mean * mean);
+  if (voltages) {
+    power[channel] =
+        (result.mean / resistance) * (voltages[channel] - result.mean);
+  }
+}
+
+// This gives an empty block zero stats and power.
+static void emptyBlock(size_t numChannels, const double *voltages,
+                       channelStats *stats, double *power) {
+  for (size_t i = 0; i < numChannels; i++) {
+    stats[i] = {0.0, 0.0, 0.0, 0.0};
+    if (voltages) {
+      power[i] = 0.0;
+    }
+  }
+}
+
+void channelStatsScalar(const double *data, size_t numChannels,
+                        size_t samples, const double *voltages,
+                        double resistance, channelStats *stats,
+                        double *power) {
+  if (samples == 0) {
+    emptyBlock(numChannels, voltages, stats, power);
+    return;
+  }
+  for (size_t i = 0; i < numChannels; i++) {
+    const double *channel = data + i * samples;
+    double shift = channel[0];
+    double sum = 0.0, squares = 0.0;
+    double low = shift, high = shift;
+    for (size_t j = 0; j < samples; j++) {
+      double value = channel[j];
+      double distance = value - shift;
+      sum += distance;
+      squares += distance * distance;
+      low = std::min(low, value);
+      high = std::max(high, value);
+    }
+    finishChannel(i, samples, shift, sum, squares, low, high, voltages,
+                  resistance, stats, power);
+  }
+}
+
+#ifdef CHANNEL_STATS_X86
+// The vector kernels keep two sets of accumulators so consecutive additions
+// do not wait on each other, and finish the last few samples of a channel
+// with scalar code. FMA is not used, since AVX2 does not imply it.
+
+__attribute__((target("avx2"))) void channelStatsAVX2(
+    const double *data, size_t numChannels, size_t samples,
+    const double *voltages, double resistance, channelStats *stats,
+    double *power) {
+  if (samples == 0) {
+    emptyBlock(numChannels, voltages, stats, power);
+    return;
+  }
+  for (size_t i = 0; i < numChannels; i++) {
+    const double *channel = data + i * samples;
+    double shift = channel[0];
+    __m256d shifts = _mm256_set1_pd(shift);
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    __m256d squares0 = _mm256_setzero_pd(), squares1 = _mm256_setzero_pd();
+    __m256d low0 = shifts, low1 = shifts;
+    __m256d high0 = shifts, high1 = shifts;
+
+    size_t j = 0;
+    for (; j + 8 <= samples; j += 8) {
+      __m256d value0 = _mm256_loadu_pd(channel + j);
+      __m256d value1 = _mm256_loadu_pd(channel + j + 4);
+      __m256d distance0 = _mm256_sub_pd(value0, shifts);
+      __m256d distance1 = _mm256_sub_pd(value1, shifts);
+      sum0 = _mm256_add_pd(sum0, distance0);
+      sum1 = _mm256_add_pd(sum1, distance1);
+      squares0 = _mm256_add_pd(squares0, _mm256_mul_pd(distance0, distance0));
+      squares1 = _mm256_add_pd(squares1, _mm256_mul_pd(distance1, distance1));
+      low0 = _mm256_min_pd(low0, value0);
+      low1 = _mm256_min_pd(low1, value1);
+      high0 = _mm256_max_pd(high0, value0);
+      high1 = _mm256_max_pd(high1, value1);
+    }
+
+    double sums[4], squareSums[4], lows[4], highs[4];
+    _mm256_storeu_pd(sums, _mm256_add_pd(sum0, sum1));
+    _mm256_storeu_pd(squareSums, _mm256_add_pd(squares0, squares1));
+    _mm256_storeu_pd(lows, _mm256_min_pd(low0, low1));
+    _mm256_storeu_pd(highs, _mm256_max_pd(high0, high1));
+    double sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    double squares = (squareSums[0] + squareSums[1]) +
+                     (squareSums[2] + squareSums[3]);
+    double low = std::min(std::min(lows[0], lows[1]),
+                          std::min(lows[2], lows[3]));
+    double high = std::max(std::max(highs[0], highs[1]),
+                           std::max(highs[2], highs[3]));
+
+    for (; j < samples; j++) {
+      double value = channel[j];
+      double distance = value - shift;
+      sum += distance;
+      squares += distance * distance;
+      low = std::min(low, value);
+      high = std::max(high, value);
+    }
+    finishChannel(i, samples, shift, sum, squares, low, high, voltages,
+                  resistance, stats, power);
+  }
+}
+
+__attribute__((target("avx512f"))) void channelStatsAVX512(
+    const double *data, size_t numChannels, size_t samples,
+    const double *voltages, double resistance, channelStats *stats,
+    double *power) {
+  if (samples == 0) {
+    emptyBlock(numChannels, voltages, stats, power);
+    return;
+  }
+  for (size_t i = 0; i < numChannels; i++) {
+    const double *channel = data + i * samples;
+    double shift = channel[0];
+    __m512d shifts = _mm512_set1_pd(shift);
+    __m512d sum0 = _mm512_setzero_pd(), sum1 = _mm512_setzero_pd();
+    __m512d squares0 = _mm512_setzero_pd(), squares1 = _mm512_setzero_pd();
+    __m512d low0 = shifts, low1 = shifts;
+    __m512d high0 = shifts, high1 = shifts;
+
+    size_t j = 0;
+    for (; j + 16 <= samples; j += 16) {
+      __m512d value0 = _mm512_loadu_pd(channel + j);
+      __m512d value1 = _mm512_loadu_pd(channel + j + 8);
+      __m512d distance0 = _mm512_sub_pd(value0, shifts);
+      __m512d distance1 = _mm512_sub_pd(value1, shifts);
+      sum0 = _mm512_add_pd(sum0, distance0);
+      sum1 = _mm512_add_pd(sum1, distance1);
+      squares0 = _mm512_add_pd(squares0, _mm512_mul_pd(distance0, distance0));
+      squares1 = _mm512_add_pd(squares1, _mm512_mul_pd(distance1, distance1));
+      low0 = _mm512_min_pd(low0, value0);
+      low1 = _mm512_min_pd(low1, value1);
+      high0 = _mm512_max_pd(high0, value0);
+      high1 = _mm512_max_pd(high1, value1);
+    }
+
+    double sum = _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+    double squares = _mm512_reduce_add_pd(_mm512_add_pd(squares0, squares1));
+    double low = _mm512_reduce_min_pd(_mm512_min_pd(low0, low1));
+    double high = _mm512_reduce_max_pd(_mm512_max_pd(high0, high1));
+
+    for (; j < samples; j++) {
+      double value = channel[j];
+      double distance = value - shift;
+      sum += distance;
+      squares += distance * distance;
+      low = std::min(low, value);
+      high = std::max(high, value);
+    }
+    finishChannel(i, samples, shift, sum, squares, low, high, voltages,
+                  resistance, stats, power);
+  }
+}
+#endif
+
+void totalSamplePower(const double *data, size_t numChannels, size_t samples,
+                      const double *voltages, double resistance,
+                      double *totals) {
+  std::fill(totals, totals + samples, 0.0);
+  // The inner loop runs along a channel with no dependence between samples,
+  // so the compiler vectorizes it.
+  for (size_t i = 0; i < numChannels; i++) {
+    const double *channel = data + i * samples;
+    double voltage = voltages[i];
+    for (size_t j = 0; j < samples; j++) {
+      totals[j] += (channel[j] / resistance) * (voltage - channel[j]);
+    }
+  }
+}
+
+void scaleSampleCodesScalar(const int16_t *codes, size_t numChannels,
+                            size_t samples, const double *coefficients,
+                            double *volts) {
+  for (size_t i = 0; i < numChannels; i++) {
+    const int16_t *channel = codes + i * samples;
+    double *out = volts + i * samples;
+    const double *c = coefficients + i * SAMPLE_SCALING_COEFFS;
+    for (size_t j = 0; j < samples; j++) {
+      double x = channel[j];
+      out[j] = c[0] + x * (c[1] + x * (c[2] + x * c[3]));
+    }
+  }
+}
+
+#ifdef CHANNEL_STATS_X86
+// This widens eight codes at a time to doubles and evaluates the polynomial
+// on them in two vectors.
+__attribute__((target("avx2"))) void scaleSampleCodesAVX2(
+    const int16_t *codes, size_t numChannels, size_t samples,
+    const double *coefficients, double *volts) {
+  for (size_t i = 0; i < numChannels; i++) {
+    const int16_t *channel = codes + i * samples;
+    double *out = volts + i * samples;
+    const double *c = coefficients + i * SAMPLE_SCALING_COEFFS;
+    __m256d c0 = _mm256_set1_pd(c[0]), c1 = _mm256_set1_pd(c[1]);
+    __m256d c2 = _mm256_set1_pd(c[2]), c3 = _mm256_set1_pd(c[3]);
+
+    size_t j = 0;
+    for (; j + 8 <= samples; j += 8) {
+      __m128i packed = _mm_loadu_si128((const __m128i *)(channel + j));
+      __m256i wide = _mm256_cvtepi16_epi32(packed);
+      __m256d x0 = _mm256_cvtepi32_pd(_mm256_castsi256_si128(wide));
+      __m256d x1 = _mm256_cvtepi32_pd(_mm256_extracti128_si256(wide, 1));
+      __m256d y0 = _mm256_add_pd(c2, _mm256_mul_pd(x0, c3));
+      __m256d y1 = _mm256_add_pd(c2, _mm256_mul_pd(x1, c3));
+      y0 = _mm256_add_pd(c1, _mm256_mul_pd(x0, y0));
+      y1 = _mm256_add_pd(c1, _mm256_mul_pd(x1, y1));
+      y0 = _mm256_add_pd(c0, _mm256_mul_pd(x0, y0));
+      y1 = _mm256_add_pd(c0, _mm256_mul_pd(x1, y1));
+      _mm256_storeu_pd(out + j, y0);
+      _mm256_storeu_pd(out + j + 4, y1);
+    }
+    for (; j < samples; j++) {
+      double x = channel[j];
+      out[j] = c[0] + x * (c[1] + x * (c[2] + x * c[3]));
+    }
+  }
+}
+#endif
+
+// This picks the scaling kernel once. Widening and scaling is a fixed amount
+// of work per code, so the vector kernel is used whenever it can run.
+static codeScalingKernel chooseScaleSampleCodes() {
+#ifdef CHANNEL_STATS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return scaleSampleCodesAVX2;
+  }
+#endif
+  return scaleSampleCodesScalar;
+}
+
+void scaleSampleCodes(const int16_t *codes, size_t numChannels,
+                      size_t samples, const double *coefficients,
+                      double *volts) {
+  static const codeScalingKernel kernel = chooseScaleSampleCodes();
+  kernel(codes, numChannels, samples, coefficients, volts);
+}
+
+std::vector<channelStatsImplementation> channelStatsImplementations() {
+  std::vector<channelStatsImplementation> implementations;
+  implementations.push_back({"scalar", channelStatsScalar});
+#ifdef CHANNEL_STATS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    implementations.push_back({"avx2", channelStatsAVX2});
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    implementations.push_back({"avx512", channelStatsAVX512});
+  }
+#endif
+  return implementations;
+}
+
+/**
+ * Times every kernel the CPU can run on a block of made-up samples. A wider
+ * vector unit is not faster on every CPU, since some split 512-bit operations
+ * in two or lower their clock to run them.
+ *
+ * @returns the fastest kernel
+ */
+static channelStatsImplementation fastestChannelStats() {
+  std::vector<channelStatsImplementation> implementations =
+      channelStatsImplementations();
+  const size_t channels = 16, samples = 1024;
+  std::vector<double> data(channels * samples);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = 0.01 + (double)(i % 7) * 0.001;
+  }
+  std::vector<channelStats> stats(channels);
+
+  channelStatsImplementation fastest = implementations.front();
+  std::chrono::steady_clock::duration fastestTime =
+      std::chrono::steady_clock::duration::max();
+  for (const channelStatsImplementation &implementation : implementations) {
+    // The best of a few runs leaves out the first run's cache misses and any
+    // run that was interrupted.
+    for (int run = 0; run < CHANNEL_STATS_CALIBRATION_RUNS; run++) {
+      auto start = std::chrono::steady_clock::now();
+      implementation.kernel(data.data(), channels, samples, nullptr, 1.0,
+                            stats.data(), nullptr);
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      if (elapsed < fastestTime) {
+        fastest = implementation;
+        fastestTime = elapsed;
+      }
+    }
+  }
+  return fastest;
+}
+
+const channelStatsImplementation &bestChannelStats() {
+  static const channelStatsImplementation best = fastestChannelStats();
+  return best;
+}
@@ -0,0 +1,96 @@
+#ifndef CHANNEL_STATS_H
+#define CHANNEL_STATS_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Statistics of one channel over a block of samples
+ */
+struct channelStats {
+  double mean;
+  double min;
+  double max;
+  // population variance, about the mean
+  double variance;
+};
+
+// This computes the stats of every channel of a block grouped by channel, so
+// channel i's samples are data[i * samples] to data[i * samples + samples -
+// 1]. If voltages is not null it also converts each channel's mean
+// differential reading to power across a shunt of the given resistance, as
+// nidaqDiffVoltToPower does, into power. Every channel is read once.
+typedef void (*channelStatsKernel)(const double* data, size_t numChannels,
+                                   size_t samples, const double* voltages,
+                                   double resistance, channelStats* stats,
+                                   double* power);
+
+/**
+ * A channelStatsKernel and the instruction set it needs
+ */
+struct channelStatsImplementation {
+  const char* name;
+  channelStatsKernel kernel;
+};
+
+// These are the kernels. The vector ones must only be called on CPUs that
+// support their instruction set.
+void channelStatsScalar(const double* data, size_t numChannels,
+                        size_t samples, const double* voltages,
+                        double resistance, channelStats* stats, double* power);
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CHANNEL_STATS_X86
+void channelStatsAVX2(const double* data, size_t numChannels, size_t samples,
+                      const double* voltages, double resistance,
+                      channelStats* stats, double* power);
+void channelStatsAVX512(const double* data, size_t numChannels,
+                        size_t samples, const double* voltages,
+                        double resistance, channelStats* stats, double* power);
+#endif
+
+// This converts every sample of a block grouped by channel to power the way
+// nidaqDiffVoltToPower does, and sums the channels, so totals[j] is the total
+// power at sample j.
+void totalSamplePower(const double* data, size_t numChannels, size_t samples,
+                      const double* voltages, double resistance,
+                      double* totals);
+
+// This turns a block of ADC codes grouped by channel into volts. Channel i is
+// scaled by the polynomial whose coefficients, lowest order first, are
+// coefficients[i * SAMPLE_SCALING_COEFFS] onwards. It uses AVX2 when the CPU
+// has it.
+void scaleSampleCodes(const int16_t* codes, size_t numChannels,
+                      size_t samples, const double* coefficients,
+                      double* volts);
+
+// These are the scaling kernels scaleSampleCodes() chooses between.
+typedef void (*codeScalingKernel)(const int16_t* codes, size_t numChannels,
+                                  size_t samples, const double* coefficients,
+                                  double* volts);
+void scaleSampleCodesScalar(const int16_t* codes, size_t numChannels,
+                            size_t samples, const double* coefficients,
+                            double* volts);
+#ifdef CHANNEL_STATS_X86
+void scaleSampleCodesAVX2(const int16_t* codes, size_t numChannels,
+                          size_t samples, const double* coefficients,
+                          double* volts);
+#endif
+
+// This returns the kernels the CPU can run, scalar first and fastest last.
+std::vector<channelStatsImplementation> channelStatsImplementations();
+
+// This returns the fastest kernel the CPU can run. The first call times each
+// of them on a small block, which takes well under a millisecond.
+const channelStatsImplementation& bestChannelStats();
+
+// This runs the fastest kernel.
+inline void computeChannelStats(const double* data, size_t numChannels,
+                                size_t samples, const double* voltages,
+                                double resistance, channelStats* stats,
+                                double* power) {
+  bestChannelStats().kernel(data, numChannels, samples, voltages, resistance,
+                            stats, power);
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include <thread>
 #include "functionapi.h"
+#include "region.h"
 /**
  * Read client config info from configFile and initialize a client. Used as basic test of powerpack functionality
  * 
@@ -15,15 +16,40 @@ int clientThread(std::string configFile) {
 
   std::cout << configuration.toString();
 
+  // The TSC is much cheaper to read than the system clock when it is invariant.
+  if (configuration.get("clocksource", "chrono") == "tsc" &&
+      !setClockSource(CLOCK_SOURCE_TSC)) {
+    std::cerr << "TSC is not invariant, using the system clock" << std::endl;
+  }
+
   socketClient client = initializeFunctionClient(port, serverAddress);
 
+  // A nonzero tag buffer size moves tag sends off this thread.
+  size_t asyncTagBuffer =
+      stoul(configuration.get("asynctagbuffer", "0"), nullptr, 10);
+  if (asyncTagBuffer) {
+    client.enableAsyncTags(asyncTagBuffer);
+  }
+
+  // Extra clock probes during the session let the server follow drift.
+  client.setClockSyncInterval(
+      stoull(configuration.get("clocksyncinterval", "0"), nullptr, 10));
+
+  // With the server on the same host, tags can skip the socket entirely.
+  if (configuration.get("transport", "tcp") == "shm") {
+    client.enableSharedMemory(
+        stoul(configuration.get("shmringsize", "65536"), nullptr, 10));
+  }
+
   client.sendSessionStart();
 
+  powerpack::setDefaultClient(&client);
+
   std::size_t params[5] = {100, 250, 500, 750, 1000};
   std::size_t size;
 
   for (std::size_t& n : params) {
-    client.sendTag("Starting for n := " + std::to_string(n));
+    client.sendTagf("Starting for n := %zu", n);
     size = n * n;
 
     double* a = new double[size];
@@ -36,30 +62,31 @@ int clientThread(std::string configFile) {
       b[i] = rand() % 20 + 1;
     }
 
-    client.sendTag("Starting matrix mult");
+    {
+      POWERPACK_REGION("matrix mult");
 
-    for (std::size_t row = 0; row < n; row++) {
-      std::size_t curr_line = row * n;
+      for (std::size_t row = 0; row < n; row++) {
+        std::size_t curr_line = row * n;
 
-      for (std::size_t k = 0; k < n; k++) {
-        std::size_t row_idx = curr_line + k;
-        std::size_t curr_col = n * k;
+        for (std::size_t k = 0; k < n; k++) {
+          std::size_t row_idx = curr_line + k;
+          std::size_t curr_col = n * k;
 
-        for (std::size_t col = 0; col < n; col++) {
-          std::size_t col_idx = curr_col + col;
-          c[curr_line + col] += a[row_idx] * b[col_idx];
+          for (std::size_t col = 0; col < n; col++) {
+            std::size_t col_idx = curr_col + col;
+            c[curr_line + col] += a[row_idx] * b[col_idx];
+          }
         }
       }
     }
 
-    client.sendTag("End matrix mult");
-
     delete a;
     delete b;
     delete c;
   }
 
   client.sendSessionEnd();
+  powerpack::setDefaultClient(nullptr);
   return 0;
 }
 
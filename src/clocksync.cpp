@@ -0,0 +1,113 @@
+#include "clocksync.h"
+#include <algorithm>
+#include <cmath>
+
+clockSync::clockSync() { reset(); }
+
+void clockSync::reset() {
+  measurements.clear();
+  reference = 0;
+  intercept = 0.0;
+  slope = 0.0;
+  errorBound = 0.0;
+}
+
+void clockSync::restart() {
+  if (measurements.size() > 1) {
+    measurements.erase(measurements.begin(), measurements.end() - 1);
+    fit();
+  }
+}
+
+/**
+ * Adds the best probe of a burst and refits the clock model
+ *
+ * @param probes groups of four timestamps t1, t2, t3, t4 for each exchange
+ */
+void clockSync::addBurst(const std::vector<uint64_t> &probes) {
+  bool found = false;
+  measurement best = {0, 0, 0};
+
+  for (size_t i = 0; i + 3 < probes.size(); i += 4) {
+    uint64_t t1 = probes[i], t2 = probes[i + 1];
+    uint64_t t3 = probes[i + 2], t4 = probes[i + 3];
+    int64_t roundTrip = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+    if (t4 < t1 || roundTrip < 0) {
+      continue;
+    }
+
+    // The exchange with the shortest round trip has the least room for
+    // asymmetric delays, so its offset is the most trustworthy.
+    if (!found || roundTrip / 2 < best.halfRoundTrip) {
+      best.clientTime = t1 + (t4 - t1) / 2;
+      best.offset = ((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2;
+      best.halfRoundTrip = roundTrip / 2;
+      found = true;
+    }
+  }
+
+  if (found) {
+    measurements.push_back(best);
+    if (measurements.size() > CLOCK_SYNC_WINDOW) {
+      measurements.erase(measurements.begin());
+    }
+    fit();
+  }
+}
+
+/**
+ * Fits offset against client time by least squares. Measurements over less
+ * than CLOCK_SYNC_MIN_BASELINE_NANOS give a constant offset, their mean.
+ */
+void clockSync::fit() {
+  size_t count = measurements.size();
+  reference = measurements.front().clientTime;
+
+  double meanTime = 0.0, meanOffset = 0.0;
+  for (const measurement &entry : measurements) {
+    meanTime += (double)(int64_t)(entry.clientTime - reference);
+    meanOffset += (double)entry.offset;
+  }
+  meanTime /= count;
+  meanOffset /= count;
+
+  double covariance = 0.0, variance = 0.0;
+  for (const measurement &entry : measurements) {
+    double time = (double)(int64_t)(entry.clientTime - reference) - meanTime;
+    covariance += time * ((double)entry.offset - meanOffset);
+    variance += time * time;
+  }
+
+  uint64_t baseline = measurements.back().clientTime - reference;
+  slope = variance > 0.0 && baseline >= CLOCK_SYNC_MIN_BASELINE_NANOS
+              ? covariance / variance
+              : 0.0;
+  intercept = meanOffset - slope * meanTime;
+
+  // Each measurement is off by at most half its round trip, and the line can
+  // miss a measurement by its residual.
+  errorBound = 0.0;
+  for (const measurement &entry : measurements) {
+    double time = (double)(int64_t)(entry.clientTime - reference);
+    double residual =
+        std::fabs((double)entry.offset - (intercept + slope * time));
+    errorBound = std::max(errorBound, residual + entry.halfRoundTrip);
+  }
+}
+
+uint64_t clockSync::toServerTime(uint64_t clientTime) {
+  if (measurements.empty()) {
+    return clientTime;
+  }
+  double time = (double)(int64_t)(clientTime - reference);
+  return clientTime + (int64_t)llround(intercept + slope * time);
+}
+
+clockEstimate clockSync::estimate() {
+  clockEstimate result;
+  result.offset = (int64_t)llround(intercept);
+  result.driftPPM = slope * 1e6;
+  result.errorBound = errorBound;
+  result.measurements = measurements.size();
+  return result;
+}
@@ -0,0 +1,71 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdint.h>
+#include <vector>
+#include "eventhandler.h"
+
+// This is the shortest span of client time the bursts have to cover before a
+// drift is fitted. Over less, the measurements' own error swamps the drift,
+// and a slope fitted from it would grow into a large error over a session.
+#define CLOCK_SYNC_MIN_BASELINE_NANOS 5000000000ULL
+
+// This is the most bursts the fit is made from. Older ones are dropped, so a
+// long session follows a drift that changes.
+#define CLOCK_SYNC_WINDOW 256
+
+/**
+ * The clockSync class estimates how a client's clock relates to the server's
+ * from NTP-style probe exchanges. Each exchange has the client send time t1,
+ * the server receive time t2, the server send time t3 and the client receive
+ * time t4. The probe with the smallest round trip in each burst gives one
+ * offset measurement, and a line fitted through the measurements of the last
+ * CLOCK_SYNC_WINDOW bursts gives the offset and the drift between the clocks.
+ * Until the bursts span CLOCK_SYNC_MIN_BASELINE_NANOS the offset is taken as
+ * constant.
+ */
+class clockSync {
+ public:
+  clockSync();
+
+  // This adds a burst of probe exchanges. Each probe holds t1, t2, t3 and t4
+  // in that order.
+  void addBurst(const std::vector<uint64_t>& probes);
+
+  // This maps a client timestamp onto the server's clock using the current
+  // fit. Timestamps are passed through unchanged until a burst has been added.
+  uint64_t toServerTime(uint64_t clientTime);
+
+  // This returns the current fit and its error bound.
+  clockEstimate estimate();
+
+  // This forgets every measurement.
+  void reset();
+
+  // This forgets every measurement but the last, for a new session. A client
+  // sends a burst just before it starts a session, so the session keeps it.
+  void restart();
+
+ private:
+  // This is the best probe of one burst.
+  struct measurement {
+    // midpoint of the exchange on the client's clock
+    uint64_t clientTime;
+    // server clock minus client clock at clientTime
+    int64_t offset;
+    // half the round trip, which bounds the error of offset
+    int64_t halfRoundTrip;
+  };
+
+  std::vector<measurement> measurements;
+
+  // The fit is offset = intercept + slope * (clientTime - reference).
+  uint64_t reference;
+  double intercept;
+  double slope;
+  double errorBound;
+
+  void fit();
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "eventhandler.h"
+#include <algorithm>
 
 eventHandler::eventHandler(){
 
@@ -6,4 +7,159 @@ eventHandler::eventHandler(){
 
 eventHandler::~eventHandler(){
     
-}
\ No newline at end of file
+}
+
+/**
+ * Finds or creates the ID for a tag string
+ *
+ * @param tag the tag string
+ * @returns the ID that refers to tag in this handler
+ */
+uint32_t eventHandler::internTag(const std::string& tag) {
+  auto entry = tagIndex.find(tag);
+  if (entry != tagIndex.end()) {
+    return entry->second;
+  }
+
+  uint32_t tagID = (uint32_t)tagNames.size();
+  tagNames.push_back(tag);
+  tagIndex.emplace(tag, tagID);
+  return tagID;
+}
+
+/**
+ * Finds or creates the ID for a tag string of one session. The IDs come from
+ * their own range, so they never clash with those of internTag().
+ *
+ * @param sessionID the session the string belongs to
+ * @param tag the tag string
+ * @returns the ID that refers to tag until the session's strings are released
+ */
+uint32_t eventHandler::internSessionTag(uint32_t sessionID,
+                                        const std::string& tag) {
+  std::unordered_map<std::string, uint32_t>& ids = sessionTagIDs[sessionID];
+  auto entry = ids.find(tag);
+  if (entry != ids.end()) {
+    return entry->second;
+  }
+
+  auto advance = [this]() {
+    nextSessionTagID = nextSessionTagID < TAG_SESSION_LAST_ID
+                           ? nextSessionTagID + 1
+                           : TAG_SESSION_FIRST_ID;
+  };
+  while (sessionTagNames.count(nextSessionTagID)) {
+    advance();
+  }
+  uint32_t tagID = nextSessionTagID;
+  advance();
+  sessionTagNames.emplace(tagID, tag);
+  ids.emplace(tag, tagID);
+  return tagID;
+}
+
+/**
+ * Forgets the strings interned for a session
+ *
+ * @param sessionID the session that ended
+ */
+void eventHandler::releaseSessionTags(uint32_t sessionID) {
+  auto session = sessionTagIDs.find(sessionID);
+  if (session == sessionTagIDs.end()) {
+    return;
+  }
+  for (auto& entry : session->second) {
+    sessionTagNames.erase(entry.second);
+  }
+  sessionTagIDs.erase(session);
+}
+
+/**
+ * Looks up the string for a tag ID
+ *
+ * @param tagID an ID returned by internTag() or internSessionTag()
+ * @returns the tag string
+ */
+const std::string& eventHandler::tagName(uint32_t tagID) {
+  if (tagID >= TAG_SESSION_FIRST_ID) {
+    auto entry = sessionTagNames.find(tagID);
+    if (entry != sessionTagNames.end()) {
+      return entry->second;
+    }
+  }
+  return tagNames.at(tagID);
+}
+
+/**
+ * Records the beginning or end of a region alongside the tags
+ *
+ * @param sessionID the session the region belongs to
+ * @param timestamp epoch time of the event occuring
+ * @param tagID the interned region name
+ * @param threadID the client thread the region is in
+ * @param cpu the CPU the client thread was running on
+ * @param begin true if the region is being entered, false if it is being left
+ */
+void eventHandler::regionHandler(uint32_t sessionID, uint64_t timestamp,
+                                 uint32_t tagID, uint32_t threadID,
+                                 uint32_t cpu, bool begin) {
+  auto session = sessions.find(sessionID);
+  if (session == sessions.end()) {
+    return;
+  }
+  session->second.timestamps.push_back(
+      {timestamp, tagID,
+       (uint8_t)(begin ? TAG_EVENT_REGION_BEGIN : TAG_EVENT_REGION_END),
+       threadID, cpu});
+}
+
+/**
+ * Splits the recorded events by the client thread that sent them. Events from
+ * different threads can arrive interleaved and out of order, so each timeline
+ * is sorted by timestamp.
+ *
+ * @param sessionID the session whose events are split
+ * @returns a timeline of events for each client thread, keyed by thread ID
+ */
+std::map<uint32_t, std::vector<tagEvent>> eventHandler::threadTimelines(
+    uint32_t sessionID) {
+  std::map<uint32_t, std::vector<tagEvent>> timelines;
+  auto session = sessions.find(sessionID);
+  if (session == sessions.end()) {
+    return timelines;
+  }
+  for (const tagEvent& event : session->second.timestamps) {
+    timelines[event.threadID].push_back(event);
+  }
+  for (auto& timeline : timelines) {
+    std::stable_sort(timeline.second.begin(), timeline.second.end(),
+                     [](const tagEvent& a, const tagEvent& b) {
+                       return a.timestamp < b.timestamp;
+                     });
+  }
+  return timelines;
+}
+
+/**
+ * Stores the estimate of the client's clock for the session log
+ *
+ * @param sessionID the session the client is measuring
+ * @param estimate the offset, drift and error bound of the client's clock
+ */
+void eventHandler::clockSyncHandler(uint32_t sessionID,
+                                    const clockEstimate& estimate) {
+  auto session = sessions.find(sessionID);
+  if (session != sessions.end()) {
+    session->second.clockSyncEstimate = estimate;
+  }
+}
+
+/**
+ * Names the log file of a session after the handler's log file
+ *
+ * @param sessionID the session
+ * @returns the path of the session's log file
+ */
+std::string eventHandler::sessionLogFile(uint32_t sessionID) {
+  return logFile + "." + std::to_string(sessionID);
+}
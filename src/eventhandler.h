@@ -1,39 +1,204 @@
 #ifndef EVENT_HANDLER_H
 #define EVENT_HANDLER_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+// These identify what a tagEvent marks.
+#define TAG_EVENT_TAG 0
+#define TAG_EVENT_REGION_BEGIN 1
+#define TAG_EVENT_REGION_END 2
+
+// This marks a tag whose string is a format to fill in with the record's
+// arguments. It only appears on the wire; handlers receive the formatted
+// string as a TAG_EVENT_TAG.
+#define TAG_EVENT_FORMATTED 3
+
+// This is the CPU of an event when the client platform cannot report it.
+#define TAG_CPU_UNKNOWN UINT32_MAX
+
+// This is the thread ID of events the server adds itself, such as the start
+// and end of a session.
+#define TAG_THREAD_SESSION UINT32_MAX
+
+// These bound the IDs of strings interned for a single session. The IDs
+// above them are left for trees and tools to mark their own nodes with.
+#define TAG_SESSION_FIRST_ID 0x80000000u
+#define TAG_SESSION_LAST_ID (UINT32_MAX - 16)
+
+/**
+ * A tag as it is stored by the handler. The tag string is kept once in the
+ * handler's string table and referred to by its ID.
+ */
+struct tagEvent {
+  uint64_t timestamp;
+  uint32_t tagID;
+  // one of the TAG_EVENT_ values
+  uint8_t kind;
+  // the client thread that sent the event, numbered from 0
+  uint32_t threadID;
+  // the CPU the client thread was running on, or TAG_CPU_UNKNOWN
+  uint32_t cpu;
+};
+
+/**
+ * A total power reading. It covers the time since the previous sample.
+ */
+struct powerSample {
+  uint64_t timestamp;
+  double watts;
+};
+
+/**
+ * How a client's clock relates to the server's. Client timestamps have already
+ * been mapped onto the server's clock when they reach the handler.
+ */
+struct clockEstimate {
+  // server clock minus client clock in nanoseconds at the first measurement
+  int64_t offset;
+  // how fast the client clock drifts from the server's, in parts per million
+  double driftPPM;
+  // the most the mapped timestamps can be off by, in nanoseconds
+  double errorBound;
+  // number of probe bursts the estimate is based on
+  size_t measurements;
+};
+
+/**
+ * How well the acquisition kept up over some stretch of time. Sample counts
+ * are per channel.
+ */
+struct acquisitionHealth {
+  // reads that followed lost samples, each a gap in the readings
+  uint64_t gaps = 0;
+  // samples overwritten in the driver's buffer or dropped with a full queue
+  uint64_t lostSamples = 0;
+  // reads that left more than a callback's worth of samples waiting
+  uint64_t lateReads = 0;
+  // most samples left waiting after a read
+  uint64_t maxBacklog = 0;
+  // longest the acquisition callback ran
+  uint64_t maxCallbackNanos = 0;
+  // most samples taken by one read
+  uint64_t largestRead = 0;
+};
+
+/**
+ * What a handler keeps for one session. Sessions are windows over a single
+ * running measurement, so several can be open at once.
+ */
+struct sessionState {
+  // This stores the session's timestamps and their identifying tags.
+  std::vector<tagEvent> timestamps;
+
+  // This is the meter's total power over the session.
+  std::vector<powerSample> powerSamples;
+
+  // These are the times of region events that come after the last reading,
+  // when the handler captures every sample. A reading is split at each one,
+  // so regions are measured to the sample without a reading per sample.
+  std::set<uint64_t> regionTimes;
+
+  // This is the number of meter samples taken during the session.
+  uint64_t samplesRead = 0;
+
+  // This is how well the acquisition kept up during the session.
+  acquisitionHealth health;
+
+  // This is the last estimate passed to clockSyncHandler.
+  clockEstimate clockSyncEstimate = {0, 0.0, 0.0, 0};
+
+  // This is the session's own log file.
+  std::fstream writer;
+
+  // This is the session's raw sample file, if the handler captures every
+  // sample.
+  std::fstream rawWriter;
+};
+
 /**
- * Base class that specifies responses to measurement events
+ * Base class that specifies responses to measurement events. Every event names
+ * the session it belongs to, and sessions from different clients can overlap.
+ * The server calls these from a single thread.
  */
 class eventHandler {
  public:
-  std::fstream writer;
-  // TODO: IS IT NECESSARY TO KEEP TRACK OF THE LOG FILE?
+  // This is where session logs are written. Each session writes to its own
+  // file, named by sessionLogFile().
   std::string logFile;
 
   // constructor
   eventHandler();
 
-  // executed when a "start session" communication is received
-  virtual void startHandler(uint64_t timestamp) = 0;
+  // executed when a "start session" communication is received, with an ID
+  // that no other session of this handler has used
+  virtual void startHandler(uint32_t sessionID, uint64_t timestamp) = 0;
 
-  // executed when a "tag" communication is recieved
-  virtual void tagHandler(uint64_t timestamp, std::string tag) = 0;
+  // executed when a "tag" communication is recieved, with the ID returned by
+  // internTag() for the tag string and the client thread and CPU it came from
+  virtual void tagHandler(uint32_t sessionID, uint64_t timestamp,
+                          uint32_t tagID, uint32_t threadID, uint32_t cpu) = 0;
 
   // executed when a "end session" communication is received
-  virtual void endHandler(uint64_t timestamp) = 0;
+  virtual void endHandler(uint32_t sessionID, uint64_t timestamp) = 0;
+
+  // executed when a region begins or ends, with the ID returned by internTag()
+  // for the region name
+  virtual void regionHandler(uint32_t sessionID, uint64_t timestamp,
+                             uint32_t tagID, uint32_t threadID, uint32_t cpu,
+                             bool begin);
+
+  // executed before endHandler with the final estimate of the client's clock
+  virtual void clockSyncHandler(uint32_t sessionID,
+                                const clockEstimate& estimate);
+
+  // returns the ID of the given tag string, adding it to the string table the
+  // first time it is seen. IDs are shared by every session.
+  uint32_t internTag(const std::string& tag);
+
+  // returns the ID of a tag string that is only kept until the session's
+  // strings are released, such as a formatted tag, whose every value would
+  // otherwise stay in the string table for good
+  uint32_t internSessionTag(uint32_t sessionID, const std::string& tag);
+
+  // forgets the strings interned for a session once it has ended
+  void releaseSessionTags(uint32_t sessionID);
+
+  // returns the tag string for an ID returned by internTag() or
+  // internSessionTag()
+  const std::string& tagName(uint32_t tagID);
+
+  // returns the recorded tags and regions of each client thread of a session
+  // in time order
+  std::map<uint32_t, std::vector<tagEvent>> threadTimelines(uint32_t sessionID);
+
+  // returns the log file of a session
+  std::string sessionLogFile(uint32_t sessionID);
 
   // destructor
   virtual ~eventHandler();
 
  protected:
-  // This stores a list of timestamps and their identifying strings.
-  std::vector<std::pair<std::string, uint64_t>> timestamps;
+  // This is the state of every open session, keyed by session ID. Entries are
+  // added by startHandler and removed by endHandler.
+  std::map<uint32_t, sessionState> sessions;
+
+ private:
+  // This is the string table. tagNames is indexed by tag ID.
+  std::vector<std::string> tagNames;
+  std::unordered_map<std::string, uint32_t> tagIndex;
+
+  // These are the strings interned for open sessions, by ID and by session.
+  std::unordered_map<uint32_t, std::string> sessionTagNames;
+  std::map<uint32_t, std::unordered_map<std::string, uint32_t>> sessionTagIDs;
+  uint32_t nextSessionTagID = TAG_SESSION_FIRST_ID;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -25,6 +25,14 @@ std::string Configuration::get(std::string key) {
   return map.at(key);
 }
 
+std::string Configuration::get(std::string key, std::string defaultValue) {
+  if (map.find(key) == map.end()) {
+    return defaultValue;
+  }
+
+  return map.at(key);
+}
+
 std::string Configuration::toString() {
   std::stringstream ret;  // return value
 
@@ -45,6 +45,10 @@ class Configuration {
   // Get a value corresponding to a given key
   std::string get(std::string key);
 
+  // Get a value corresponding to a given key, or defaultValue if the key is
+  // not in the configuration
+  std::string get(std::string key, std::string defaultValue);
+
   // Print all key-value pairs
   std::string toString();
 };
@@ -1,29 +1,40 @@
 #include "nidaqmxeventhandler.h"
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
-
-NIDAQmxEventHandler::NIDAQmxEventHandler(void) {}
+#include "samplecodec.h"
 
 NIDAQmxEventHandler::~NIDAQmxEventHandler(void) {
+  stopAcquisition();
+  if (prepared) {
+    source->clear();
+  }
   // free the list of voltages if present
-  delete config.channelVoltages;
-  // close file stream
-  writer.close();
+  delete[] config.channelVoltages;
 }
 
 /**
  * Constructor with provided logfile
  *
- * @param logFilePath the file path to the logfile where power readings and time
- * stamps will be written
+ * @param logFilePath the file path that session logs of power readings and
+ * time stamps are named after
+ * @param sampleSource the meter hardware, which must outlive the handler
  */
-NIDAQmxEventHandler::NIDAQmxEventHandler(std::string logFilePath) {
+NIDAQmxEventHandler::NIDAQmxEventHandler(std::string logFilePath,
+                                         sampleSource *meter)
+    : droppedBlocks(0),
+      source(meter),
+      writing(false),
+      writerIdle(false),
+      queuedBlocks(0) {
   logFile = logFilePath;
-  writer.open(logFile, std::fstream::out);
 }
 
 // TODO: DETERMINE ACCURACY OF THESE CONSTANTS
 // coresponds to ATX 24-pin (maybe..?)
-float64 nidaq_chan_volts[] = {
+double nidaq_chan_volts[] = {
     3.3,    3.3,   5.00, 5.00,            /* NIDAQ1 MOD1 channel 0-3 */
     12.00,  12.00, 3.3,  3.3,             /* NIDAQ1 MOD1 channel 4-7 */
     -12.00, 5.00,  5.00, 5.00,            /* NIDAQ1 MOD1 channel 16-19 */
@@ -31,51 +42,199 @@ float64 nidaq_chan_volts[] = {
 };
 
 /**
- * Performs meter setup. Called after recieving the "start session"
- * communication
+ * Configures and commits the source's task so that starting it later is
+ * quick. Any task prepared before is cleared first.
  *
- * @param timestamp epoch time at which the session is started
+ * @returns true if the task is ready to start
  */
-void NIDAQmxEventHandler::startHandler(uint64_t timestamp) {
-  timestamps.emplace_back("Starting Session...", timestamp);
-
-  writer << "CHANNEL DESCRIPTION: " << config.channelDescription << std::endl;
-  writer << "START TIME: " << timestamps[0].second << std::endl;
-  writer << "NUMBER OF CHANNELS: " << config.numChannels << std::endl;
-  writer << "SAMPLE RATE: " << config.sampleRate << std::endl;
-  writer << std::endl;
-
-  int32 error = 0;
-  taskHandle = 0;
-  char errBuff[2048] = {'\0'};
+bool NIDAQmxEventHandler::prepareSource() {
+  if (prepared) {
+    source->clear();
+    prepared = false;
+  }
 
-  /*********************************************/
-  // DAQmx Configure Code
-  /*********************************************/
-  DAQmxErrChk(DAQmxCreateTask("", &taskHandle));
+  sampleSourceConfig sourceConfig;
+  sourceConfig.channelDescription = config.channelDescription;
+  sourceConfig.numChannels = config.numChannels;
+  sourceConfig.sampleClockRate = config.sampleClockRate;
+  sourceConfig.samplesPerCallback = config.samplesPerCallback;
+  sourceConfig.bufferSamples = config.bufferSamples;
+  sourceConfig.inputRange = config.inputRange;
+  sourceConfig.sampleFormat = config.sampleFormat;
+
+  if (!source->configure(sourceConfig, [this]() { readSamples(); }) ||
+      !source->commit() ||
+      (config.sampleFormat == SAMPLE_FORMAT_I16 &&
+       !source->scaling(scaling))) {
+    source->clear();
+    return false;
+  }
+  prepared = true;
+  return true;
+}
 
-  DAQmxErrChk(DAQmxCreateAIVoltageChan(
-      taskHandle, config.channelDescription.c_str(), "", DAQmx_Val_Cfg_Default,
-      -10.0, 10.0, DAQmx_Val_Volts, NULL));
+/**
+ * Starts the continuous acquisition. Sessions started while it runs share
+ * it. In fast-start mode the task was committed by configure(), so this only
+ * starts it.
+ *
+ * @returns true if the acquisition is running
+ */
+bool NIDAQmxEventHandler::startAcquisition() {
+  if (acquiring) {
+    return true;
+  }
+  if (!prepared && !prepareSource()) {
+    return false;
+  }
 
-  DAQmxErrChk(DAQmxCfgSampClkTiming(taskHandle, NULL, 1000.0, DAQmx_Val_Rising,
-                                    DAQmx_Val_ContSamps, 16000));
+  readTarget = config.samplesPerCallback;
+  calmReads = 0;
+  reportedLost = 0;
+  droppedSamples = 0;
+  callbackNanos = 0;
+  startWriter();
+  if (!source->start()) {
+    stopWriter();
+    return false;
+  }
+  acquiring = true;
+  return true;
+}
 
-  DAQmxErrChk(DAQmxRegisterEveryNSamplesEvent(
-      taskHandle, DAQmx_Val_Acquired_Into_Buffer, config.sampleRate, 0,
-      EveryNCallback, (void *)this));
+/**
+ * Stops the continuous acquisition. No callback runs once it returns, and
+ * every block it queued has been recorded. In fast-start mode the task stays
+ * committed for the next start, and otherwise it is cleared.
+ */
+void NIDAQmxEventHandler::stopAcquisition() {
+  if (!acquiring) {
+    return;
+  }
+  source->stop();
+  stopWriter();
+  acquiring = false;
+  startedBySession = false;
+
+  if (!config.fastStart) {
+    source->clear();
+    prepared = false;
+  }
+}
 
-  DAQmxErrChk(DAQmxRegisterDoneEvent(taskHandle, 0, DoneCallback, NULL));
+/**
+ * Writes the power of each channel as one line of a session log. The line is
+ * left in the stream's buffer rather than flushed.
+ *
+ * @param writer the session log
+ * @param powerReadings the power of each channel
+ * @param numChannels the number of channels
+ */
+static void writeReadings(std::fstream &writer, const double *powerReadings,
+                          int numChannels) {
+  char reading[32];
+  for (int index = 0; index < numChannels; index++) {
+    int length = snprintf(reading, sizeof(reading), "%f ",
+                          powerReadings[index]);
+    writer.write(reading, std::min(length, (int)sizeof(reading) - 1));
+  }
+  writer.put('\n');
+}
 
-  /*********************************************/
-  // DAQmx Start Code
-  /*********************************************/
-  DAQmxErrChk(DAQmxStartTask(taskHandle));
+/**
+ * Opens a session over the running acquisition and writes its log header.
+ * The session starts with the readings from the pre-roll before timestamp
+ * that are still in the history. Called after recieving the "start session"
+ * communication
+ *
+ * @param sessionID the ID of the new session
+ * @param timestamp epoch time at which the session is started
+ */
+void NIDAQmxEventHandler::startHandler(uint32_t sessionID,
+                                       uint64_t timestamp) {
+  // The acquisition is normally started up front by the server. If it was
+  // not, the session starts it and the last session to end stops it again.
+  if (!acquiring && startAcquisition()) {
+    startedBySession = true;
+  }
 
-Error:
-  if (DAQmxFailed(error)) {
-    DAQmxGetExtendedErrorInfo(errBuff, 2048);
-    printf("DAQmx Error: %s\n", errBuff);
+  std::lock_guard<std::mutex> lock(sessionsLock);
+  sessionState &session = sessions[sessionID];
+  session.timestamps.push_back({timestamp, internTag("Starting Session..."),
+                                TAG_EVENT_TAG, TAG_THREAD_SESSION,
+                                TAG_CPU_UNKNOWN});
+
+  session.writer.open(sessionLogFile(sessionID), std::fstream::out);
+  session.writer << "CHANNEL DESCRIPTION: " << config.channelDescription
+                 << std::endl;
+  session.writer << "SESSION: " << sessionID << std::endl;
+  session.writer << "START TIME: " << timestamp << std::endl;
+  session.writer << "NUMBER OF CHANNELS: " << config.numChannels << std::endl;
+  // SAMPLE RATE has always been the samples per channel of each reading.
+  session.writer << "SAMPLE RATE: " << config.samplesPerCallback << std::endl;
+  session.writer << "SAMPLE CLOCK RATE: " << config.sampleClockRate
+                 << std::endl;
+  session.writer << "BUFFER SAMPLES: " << config.bufferSamples << std::endl;
+
+  uint64_t preRoll = config.preRollMs * 1000000;
+  uint64_t preRollStart = timestamp > preRoll ? timestamp - preRoll : 0;
+  session.writer << "PRE-ROLL START TIME: " << preRollStart << std::endl;
+  if (config.rawCapture) {
+    std::string rawFile = sessionLogFile(sessionID) + ".raw";
+    session.writer << "RAW SAMPLES: " << rawFile << std::endl;
+    session.rawWriter.open(rawFile, std::fstream::out | std::fstream::binary);
+    rawSampleHeader header = {RAW_SAMPLE_MAGIC,
+                              RAW_SAMPLE_VERSION,
+                              (uint32_t)config.numChannels,
+                              (uint32_t)config.sampleFormat,
+                              config.sampleClockRate,
+                              NIDAQ_CHAN_RESISTOR};
+    writeRawSampleHeader(session.rawWriter, header, config.channelVoltages,
+                         scaling.data());
+  }
+  sessionLogWriter *binaryLog = nullptr;
+  if (config.binaryLog) {
+    std::string binaryFile = sessionLogFile(sessionID) + ".ppl";
+    session.writer << "BINARY LOG: " << binaryFile << std::endl;
+    sessionLogHeader header = {};
+    header.numChannels = (uint32_t)config.numChannels;
+    header.sessionID = sessionID;
+    header.sampleFormat = (uint32_t)config.sampleFormat;
+    header.startTime = timestamp;
+    header.preRollStart = preRollStart;
+    header.sampleClockRate = config.sampleClockRate;
+    header.shuntResistance = NIDAQ_CHAN_RESISTOR;
+    header.samplesPerCallback = (uint32_t)config.samplesPerCallback;
+    binaryLog = &binaryLogs[sessionID];
+    binaryLog->open(binaryFile, header, config.channelVoltages,
+                    scaling.data(), config.channelDescription,
+                    config.compression);
+  }
+  session.writer << std::endl;
+
+  // The first reading of the session covers the time from the start of the
+  // pre-roll if there is history for it, and from the start message if not.
+  // The binary log's energy table starts from the same time.
+  session.powerSamples.push_back({timestamp, 0.0});
+  if (binaryLog) {
+    binaryLog->coverFrom(preRollStart);
+  }
+  size_t spliced = history.forEachSince(
+      preRollStart, [this, &session, binaryLog](const historyEntry &entry) {
+        session.powerSamples.push_back({entry.timestamp, entry.watts});
+        session.samplesRead += entry.samplesRead;
+        if (config.averagedLog) {
+          writeReadings(session.writer, entry.channels, config.numChannels);
+        }
+        if (binaryLog && binaryLog->is_open()) {
+          binaryLog->append(entry.timestamp, (uint32_t)entry.samplesRead,
+                            entry.channels);
+        }
+      });
+  if (spliced > 0) {
+    session.powerSamples.front().timestamp = preRollStart;
+  } else if (binaryLog) {
+    binaryLog->coverFrom(timestamp);
   }
 }
 
@@ -83,141 +242,618 @@ Error:
  * Adds the given timestamp, tag pair to the collection of timestamps.  Called
  * when an "tag" communication is recieved
  *
+ * @param sessionID the session the tag belongs to
+ * @param timestamp epoch time of the event occuring
+ * @param tagID the interned string describing the event that was timestamped
+ * @param threadID the client thread that sent the tag
+ * @param cpu the CPU the client thread was running on
+ */
+void NIDAQmxEventHandler::tagHandler(uint32_t sessionID, uint64_t timestamp,
+                                     uint32_t tagID, uint32_t threadID,
+                                     uint32_t cpu) {
+  auto session = sessions.find(sessionID);
+  if (session != sessions.end()) {
+    session->second.timestamps.push_back(
+        {timestamp, tagID, TAG_EVENT_TAG, threadID, cpu});
+  }
+}
+
+/**
+ * Records the beginning or end of a region. In raw capture its time is kept
+ * so that the session's readings are split there, unless the readings have
+ * already passed it, in which case the region is measured to the reading.
+ *
+ * @param sessionID the session the region belongs to
  * @param timestamp epoch time of the event occuring
- * @param tag a string describing the event that was timestamped
+ * @param tagID the interned region name
+ * @param threadID the client thread the region is in
+ * @param cpu the CPU the client thread was running on
+ * @param begin true if the region is being entered, false if it is being left
  */
-void NIDAQmxEventHandler::tagHandler(uint64_t timestamp, std::string tag) {
-  timestamps.emplace_back(tag, timestamp);
+void NIDAQmxEventHandler::regionHandler(uint32_t sessionID,
+                                        uint64_t timestamp, uint32_t tagID,
+                                        uint32_t threadID, uint32_t cpu,
+                                        bool begin) {
+  eventHandler::regionHandler(sessionID, timestamp, tagID, threadID, cpu,
+                              begin);
+  if (!config.rawCapture) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(sessionsLock);
+  auto session = sessions.find(sessionID);
+  if (session != sessions.end() &&
+      timestamp > session->second.powerSamples.back().timestamp) {
+    session->second.regionTimes.insert(timestamp);
+  }
 }
 
 /**
- * Perfroms meter shutdown, cleanup, and final io.  Called when an "end session"
- * communication is recieved
+ * Writes a session's tags and energy to its log and closes it. The
+ * acquisition keeps running for the other sessions.  Called when an "end
+ * session" communication is recieved
  *
+ * @param sessionID the session that ended
  * @param timestamp epoch time of the end of the session
  */
-void NIDAQmxEventHandler::endHandler(uint64_t timestamp) {
-  timestamps.emplace_back("Ending Session...", timestamp);
-  DAQmxStopTask(taskHandle);
-  DAQmxClearTask(taskHandle);
+void NIDAQmxEventHandler::endHandler(uint32_t sessionID, uint64_t timestamp) {
+  {
+    // The session gets every block read before its end, including those
+    // still queued for the writer.
+    uint64_t queued = queuedBlocks.load();
+    wakeWriter.notify_one();
+    std::unique_lock<std::mutex> lock(sessionsLock);
+    drained.wait(lock, [this, queued]() {
+      return writtenBlocks >= queued || !writing.load();
+    });
+    writeSession(sessionID, timestamp);
+  }
 
-  // print timestamps
-  writer << std::endl;
-  for (auto &entry : timestamps) {
-    writer << entry.second << "\t" << entry.first << std::endl;
+  // The source is stopped without the lock, since stopping waits for a
+  // callback that may be waiting for it.
+  if (startedBySession && sessions.empty()) {
+    stopAcquisition();
+  }
+}
+
+/**
+ * Writes a session's tags and energy to its log and closes it. The caller
+ * holds sessionsLock.
+ *
+ * @param sessionID the session that ended
+ * @param timestamp epoch time of the end of the session
+ */
+void NIDAQmxEventHandler::writeSession(uint32_t sessionID,
+                                       uint64_t timestamp) {
+  // The writer thread waits while the log is written, and the queue absorbs
+  // the blocks read meanwhile.
+  auto open = sessions.find(sessionID);
+  if (open == sessions.end()) {
+    return;
+  }
+  sessionState &session = open->second;
+  session.timestamps.push_back({timestamp, internTag("Ending Session..."),
+                                TAG_EVENT_TAG, TAG_THREAD_SESSION,
+                                TAG_CPU_UNKNOWN});
+  std::fstream &writer = session.writer;
+
+  auto binaryLog = binaryLogs.find(sessionID);
+  if (binaryLog != binaryLogs.end()) {
+    binaryLog->second.close(session.timestamps, *this, session.health);
+    binaryLogs.erase(binaryLog);
+  }
+
+  // print timestamps, grouped by the client thread that sent them
+  std::map<uint32_t, std::vector<tagEvent>> timelines =
+      threadTimelines(sessionID);
+  for (auto &timeline : timelines) {
+    writer << std::endl;
+    if (timeline.first == TAG_THREAD_SESSION) {
+      writer << "SESSION:" << std::endl;
+    } else {
+      writer << "THREAD " << timeline.first << ":" << std::endl;
+    }
+    for (auto &entry : timeline.second) {
+      writer << entry.timestamp << "\t" << tagName(entry.tagID);
+      if (entry.cpu != TAG_CPU_UNKNOWN) {
+        writer << "\tCPU " << entry.cpu;
+      }
+      writer << std::endl;
+    }
   }
 
   writer << std::endl;
-  writer << "NUMBER OF TIMESTAMPS: " << timestamps.size() << std::endl;
-  writer << "TOTAL SAMPLES TAKEN: " << totalSamplesRead << std::endl;
+  writer << "NUMBER OF TIMESTAMPS: " << session.timestamps.size() << std::endl;
+  writer << "NUMBER OF CLIENT THREADS: "
+         << timelines.size() - timelines.count(TAG_THREAD_SESSION)
+         << std::endl;
+  writer << "TOTAL SAMPLES TAKEN: " << session.samplesRead << std::endl;
+  writer << "SAMPLE GAPS: " << session.health.gaps << std::endl;
+  writer << "SAMPLES LOST: " << session.health.lostSamples << std::endl;
+  writer << "LATE READS: " << session.health.lateReads << std::endl;
+  writer << "MAX BACKLOG SAMPLES: " << session.health.maxBacklog << std::endl;
+  writer << "MAX CALLBACK TIME (NS): " << session.health.maxCallbackNanos
+         << std::endl;
+  writer << "LARGEST READ SAMPLES: " << session.health.largestRead
+         << std::endl;
+  writer << "CLIENT CLOCK OFFSET (NS): " << session.clockSyncEstimate.offset
+         << std::endl;
+  writer << "CLIENT CLOCK DRIFT (PPM): " << session.clockSyncEstimate.driftPPM
+         << std::endl;
+  writer << "CLIENT CLOCK ERROR BOUND (NS): "
+         << session.clockSyncEstimate.errorBound << std::endl;
+
+  // print the energy of every region path, and the same tree as folded stacks
+  // for flame graph tools
+  regionTree regions;
+  regions.build(session.timestamps, session.powerSamples, timestamp);
+  if (regions.getNodes().size() > 1) {
+    writer << std::endl;
+    regions.writeSummary(writer, *this);
+
+    std::fstream folded(sessionLogFile(sessionID) + ".folded",
+                        std::fstream::out);
+    regions.writeFoldedStacks(folded, *this);
+  }
+
+  sessions.erase(open);
+}
+
+/**
+ * Hands the power readings of one block to the history and every open
+ * session. A block read before a session's first reading is left out of it,
+ * since the session already starts from that time. In raw capture the block
+ * is written to each session's raw sample file, as codes if it was read as
+ * codes, and the session's readings are worked out from its samples. Codes
+ * are compressed once for every file.
+ *
+ * @param powerReadings the average power of each channel over the block
+ * @param block the samples the readings come from
+ */
+void NIDAQmxEventHandler::recordPower(const double *powerReadings,
+                                      const sampleBlock &block) {
+  int numChannels = config.numChannels;
+  long samplesRead = block.samples;
+  double totalPower = 0.0;
+  for (int index = 0; index < numChannels; index++) {
+    totalPower += powerReadings[index];
+  }
+
+  bool encode = config.rawCapture && config.compression && block.codes;
+  if (encode) {
+    encodedCodes.clear();
+    encodeCodes(block.codes, samplesRead * numChannels, encodedCodes);
+  }
+
+  std::lock_guard<std::mutex> lock(sessionsLock);
+  history.push(block.timestamp, powerReadings, numChannels, samplesRead);
+  addHealth(health, block, config.samplesPerCallback);
+  for (auto &entry : sessions) {
+    sessionState &session = entry.second;
+    uint64_t start = session.powerSamples.front().timestamp;
+    if (block.timestamp < start) {
+      continue;
+    }
+    session.samplesRead += samplesRead;
+    addHealth(session.health, block, config.samplesPerCallback);
+
+    if (config.rawCapture) {
+      if (encode) {
+        writeEncodedRawSampleBlock(session.rawWriter, block.timestamp,
+                                   samplesRead, encodedCodes);
+      } else if (block.codes) {
+        writeRawSampleBlock(session.rawWriter, block.timestamp, block.codes,
+                            samplesRead, numChannels);
+      } else {
+        writeRawSampleBlock(session.rawWriter, block.timestamp, block.data,
+                            samplesRead, numChannels);
+      }
+      addSampleReadings(session, block);
+    } else {
+      session.powerSamples.push_back({block.timestamp, totalPower});
+    }
+
+    if (config.averagedLog) {
+      writeReadings(session.writer, powerReadings, numChannels);
+    }
+    auto binaryLog = binaryLogs.find(entry.first);
+    if (binaryLog != binaryLogs.end() && binaryLog->second.is_open()) {
+      binaryLog->second.append(block.timestamp, (uint32_t)samplesRead,
+                               powerReadings);
+    }
+  }
+}
+
+/**
+ * Adds a block to a session's readings from the power of each of its
+ * samples. The block is one reading, split at every region event inside it,
+ * so a region's energy adds up its samples exactly while the session keeps a
+ * reading per block and per region event rather than one per sample. The
+ * caller holds sessionsLock.
+ *
+ * @param session the session the block is added to
+ * @param block the samples, whose power is in samplePower
+ */
+void NIDAQmxEventHandler::addSampleReadings(sessionState &session,
+                                            const sampleBlock &block) {
+  // The block's timestamp is taken when it is read, so its samples are
+  // placed one sample clock period apart ending there. A sample placed
+  // before the previous reading, because it came before the session or the
+  // read was late, covers no time.
+  double period = 1e9 / config.sampleClockRate;
+  long samplesRead = block.samples;
+  uint64_t previous = session.powerSamples.back().timestamp;
+  uint64_t readingStart = previous;
+  double joules = 0.0;
+  std::set<uint64_t> &regionTimes = session.regionTimes;
+  regionTimes.erase(regionTimes.begin(), regionTimes.upper_bound(previous));
+
+  // This ends the reading so far at time.
+  auto endReading = [&session, &readingStart, &joules](uint64_t time) {
+    session.powerSamples.push_back(
+        {time, joules / ((double)(time - readingStart) * 1e-9)});
+    readingStart = time;
+    joules = 0.0;
+  };
+
+  for (long j = 0; j < samplesRead; j++) {
+    uint64_t offset = (uint64_t)((samplesRead - 1 - j) * period);
+    uint64_t timestamp =
+        block.timestamp > offset ? block.timestamp - offset : 0;
+    timestamp = std::max(timestamp, previous);
+    while (!regionTimes.empty() && *regionTimes.begin() <= timestamp) {
+      uint64_t time = *regionTimes.begin();
+      regionTimes.erase(regionTimes.begin());
+      joules += samplePower[j] * (double)(time - previous) * 1e-9;
+      endReading(time);
+      previous = time;
+    }
+    joules += samplePower[j] * (double)(timestamp - previous) * 1e-9;
+    previous = timestamp;
+  }
+  if (previous > readingStart) {
+    endReading(previous);
+  }
+}
+
+void NIDAQmxEventHandler::addHealth(acquisitionHealth &health,
+                                    const sampleBlock &block,
+                                    long samplesPerCallback) {
+  if (block.lost > 0) {
+    health.gaps++;
+    health.lostSamples += block.lost;
+  }
+  if (block.backlog > (uint64_t)samplesPerCallback) {
+    health.lateReads++;
+  }
+  health.maxBacklog = std::max(health.maxBacklog, block.backlog);
+  health.maxCallbackNanos =
+      std::max(health.maxCallbackNanos, block.callbackNanos);
+  health.largestRead = std::max(health.largestRead, (uint64_t)block.samples);
 }
 
 void NIDAQmxEventHandler::configure(Configuration configuration) {
-  config.numChannels =
+  NIDAQmxConfig parsed;
+  parsed.numChannels =
       stoi(configuration.get("NIDAQmxNumChannels"), nullptr, 10);
-  config.sampleRate = stoi(configuration.get("NIDAQmxSampleRate"), nullptr, 10);
-  config.bufferSize = config.numChannels * config.sampleRate;
-  config.channelDescription = configuration.get("NIDAQmxChannelDescription");
-  config.channelVoltages =
+  // NIDAQmxSampleRate is the old name of NIDAQmxSamplesPerCallback.
+  parsed.samplesPerCallback =
+      stoi(configuration.get("NIDAQmxSamplesPerCallback",
+                             configuration.get("NIDAQmxSampleRate", "0")));
+  parsed.sampleClockRate =
+      stod(configuration.get("NIDAQmxSampleClockRate",
+                             std::to_string(NIDAQ_SAMPLE_CLOCK_RATE)));
+  parsed.bufferSamples =
+      (uint32_t)stoul(configuration.get("NIDAQmxBufferSamples", "0"));
+  parsed.inputRange =
+      stod(configuration.get("NIDAQmxInputRange",
+                             std::to_string(SAMPLE_INPUT_RANGE)));
+  std::string sampleFormat = configuration.get("NIDAQmxSampleFormat", "f64");
+  if (sampleFormat == "i16") {
+    parsed.sampleFormat = SAMPLE_FORMAT_I16;
+  } else if (sampleFormat != "f64") {
+    std::cerr << "Unknown sample format " << sampleFormat
+              << ", reading volts as f64" << std::endl;
+  }
+  parsed.channelDescription = configuration.get("NIDAQmxChannelDescription");
+  parsed.channelVoltages =
       stringToDoubleArray(configuration.get("NIDAQmxChannelVoltages"));
+  parsed.historySeconds =
+      stod(configuration.get("NIDAQmxHistorySeconds",
+                             std::to_string(NIDAQ_DEFAULT_HISTORY_SECONDS)));
+  parsed.preRollMs =
+      stoull(configuration.get("NIDAQmxPreRollMs",
+                               std::to_string(NIDAQ_DEFAULT_PRE_ROLL_MS)));
+  parsed.fastStart = configuration.get("NIDAQmxFastStart", "1") != "0";
+  parsed.rawCapture = configuration.get("NIDAQmxRawCapture", "0") != "0";
+  parsed.averagedLog = configuration.get("NIDAQmxAveragedLog", "1") != "0";
+  parsed.binaryLog = configuration.get("NIDAQmxBinaryLog", "0") != "0";
+  parsed.compression = configuration.get("NIDAQmxCompression", "1") != "0";
+  parsed.queueSeconds =
+      stod(configuration.get("NIDAQmxQueueSeconds",
+                             std::to_string(NIDAQ_DEFAULT_QUEUE_SECONDS)));
+  configure(parsed);
 }
 
 /**
- * Averages n samples, converts them to power, and stores them in an
- * intermediate buffer.  Called after n samples are read by the meter
+ * Applies a configuration. In fast-start mode the task is built and committed
+ * here, so sessions only start and stop it.
  *
- * @param taskHandle the task handle of the current measuring task
- * @param everyNsamplesEventType code indicating the type of functionality this
- * function contains.
- * @param nSamples the number of samples read each time before this function is
- * called
- * @param callbackData a way to access the event handler that triggered this
- * callback function
- */
-int32 CVICALLBACK EveryNCallback(TaskHandle taskHandle,
-                                 int32 everyNsamplesEventType, uInt32 nSamples,
-                                 void *callbackData) {
-  NIDAQmxEventHandler *handler = (NIDAQmxEventHandler *)callbackData;
-  int numChannels = handler->config.numChannels;
-  uInt32 bufferSize = handler->config.bufferSize;
-
-  int32 error = 0;
-  char errBuff[2048] = {'\0'};
-  int32 samplesRead = 0;
-  float64 data[bufferSize];
-  std::string dataString;
-  float64 channels[numChannels];
-  float64 powerReadings[numChannels];
-
-  /*********************************************/
-  // DAQmx Read Code
-  /*********************************************/
-  DAQmxErrChk(DAQmxReadAnalogF64(taskHandle, -1, 0, DAQmx_Val_GroupByChannel,
-                                 data, bufferSize, &samplesRead, NULL));
-  if (samplesRead > 0) {
-    // Get the average reading for each channel
-    for (int i = 0; i < numChannels; i++) {
-      channels[i] = 0.0;
-      for (int j = 0; j < samplesRead; j++) {
-        channels[i] += data[j + i * samplesRead];
-      }
-      channels[i] /= samplesRead;
-    }
+ * @param newConfig the configuration, whose channelVoltages the handler takes
+ * ownership of
+ */
+void NIDAQmxEventHandler::configure(const NIDAQmxConfig &newConfig) {
+  stopAcquisition();
+  if (config.channelVoltages != newConfig.channelVoltages) {
+    delete[] config.channelVoltages;
   }
-
-  if (samplesRead > 0) {
-    printf("Acquired %d samples. Total %d\r", samplesRead,
-           handler->totalSamplesRead += samplesRead);
-    fflush(stdout);
+  config = newConfig;
+  sizeTiming();
+
+  // The history holds one reading per callback, and the queue one block.
+  // Neither is in use while the acquisition is stopped. Queued blocks have
+  // room for the largest read, so the queue holds queueSeconds of samples
+  // once reads grow to that size.
+  double callbacksPerSecond =
+      config.sampleClockRate / config.samplesPerCallback;
+  double largestReadsPerSecond = config.sampleClockRate / maxReadSamples;
+  {
+    std::lock_guard<std::mutex> lock(sessionsLock);
+    history.resize((size_t)ceil(config.historySeconds * callbacksPerSecond),
+                   config.numChannels);
+    health = acquisitionHealth();
   }
+  // Only the buffers of the configured sample format are allocated.
+  bool codes = config.sampleFormat == SAMPLE_FORMAT_I16;
+  queue.resize(
+      std::max((size_t)NIDAQ_QUEUE_MIN_BLOCKS,
+               (size_t)ceil(config.queueSeconds * largestReadsPerSecond)),
+      config.bufferSize, config.sampleFormat);
+  discard.assign(codes ? 0 : config.bufferSize, 0.0);
+  discardCodes.assign(codes ? config.bufferSize : 0, 0);
+  scaled.assign(codes ? config.bufferSize : 0, 0.0);
+  scaling.assign(codes ? config.numChannels * SAMPLE_SCALING_COEFFS : 0,
+                 0.0);
+  stats.assign(config.numChannels, {0.0, 0.0, 0.0, 0.0});
+  power.assign(config.numChannels, 0.0);
+  samplePower.assign(config.rawCapture ? maxReadSamples : 0, 0.0);
+  // A compressed change between codes takes at most 3 bytes.
+  encodedCodes.reserve(config.rawCapture && config.compression
+                           ? maxReadSamples * config.numChannels * 3
+                           : 0);
+
+  if (config.fastStart) {
+    prepareSource();
+  } else if (prepared) {
+    source->clear();
+    prepared = false;
+  }
+}
 
-  nidaqDiffVoltToPower(powerReadings, channels, handler->config.channelVoltages,
-                       numChannels);
+/**
+ * Fills in the timing left to be chosen and fixes timing that cannot work,
+ * saying so on stderr. The block size is chosen for
+ * NIDAQ_DEFAULT_CALLBACKS_PER_SECOND callbacks a second, and the buffer for
+ * NIDAQ_DEFAULT_BUFFER_SECONDS of samples. The buffer always holds
+ * NIDAQ_MIN_BUFFER_BLOCKS blocks and a whole number of them, since DAQmx
+ * needs its buffer to be a multiple of the every-N-samples interval on some
+ * devices.
+ */
+void NIDAQmxEventHandler::sizeTiming() {
+  if (!(config.sampleClockRate > 0.0)) {
+    std::cerr << "The sample clock rate must be positive, using "
+              << NIDAQ_SAMPLE_CLOCK_RATE << std::endl;
+    config.sampleClockRate = NIDAQ_SAMPLE_CLOCK_RATE;
+  }
+  if (config.samplesPerCallback < 0) {
+    std::cerr << "The samples per callback cannot be negative, choosing them"
+              << std::endl;
+    config.samplesPerCallback = 0;
+  }
+  if (config.samplesPerCallback == 0) {
+    double samples =
+        round(config.sampleClockRate / NIDAQ_DEFAULT_CALLBACKS_PER_SECOND);
+    config.samplesPerCallback = (int32_t)std::max(1.0, samples);
+  }
 
-  for (int index = 0; index < numChannels; index++) {
-    dataString += std::to_string(powerReadings[index]) + " ";
+  uint64_t blocks = NIDAQ_MIN_BUFFER_BLOCKS;
+  uint64_t block = (uint64_t)config.samplesPerCallback;
+  uint64_t requested = config.bufferSamples;
+  if (requested == 0) {
+    requested = std::max(
+        (uint64_t)NIDAQ_BUFFER_SAMPLES,
+        (uint64_t)ceil(config.sampleClockRate * NIDAQ_DEFAULT_BUFFER_SECONDS));
+  } else if (requested < blocks * block) {
+    std::cerr << "A buffer of " << requested << " samples per channel holds "
+              << "fewer than " << blocks << " callbacks, using "
+              << blocks * block << std::endl;
   }
+  uint64_t buffer = std::max(requested, blocks * block);
+  buffer = (buffer + block - 1) / block * block;
+  config.bufferSamples = (uint32_t)std::min<uint64_t>(buffer, UINT32_MAX);
+
+  maxReadSamples = (long)std::min<uint64_t>(
+      block * NIDAQ_MAX_BLOCK_FACTOR, std::max(block, buffer / 2));
+  config.bufferSize = config.numChannels * maxReadSamples;
+  callbackBudget =
+      (uint64_t)(NIDAQ_CALLBACK_BUDGET * block * 1e9 / config.sampleClockRate);
+}
 
-  handler->writer << dataString << std::endl;
+/**
+ * Reads the samples the source has ready into the next free block of the
+ * queue and hands it to the writer thread. Called by the source, so it does
+ * nothing that can block: no allocation, formatting or I/O. While the read
+ * block is grown, samples are left in the source until readTarget of them
+ * are waiting, and a read takes all that fit in a block, so a backlog never
+ * piles up unseen.
+ */
+void NIDAQmxEventHandler::readSamples() {
+  uint64_t entered = nanos();
+  long waiting = source->available();
+  if (waiting < 0) {
+    source->stop();
+    return;
+  }
+  // Samples are only held back while the read block is grown. Otherwise a
+  // callback that comes slightly early still reads what is there.
+  if (waiting == 0 ||
+      (readTarget > config.samplesPerCallback && waiting < readTarget)) {
+    callbackNanos = nanos() - entered;
+    return;
+  }
 
-Error:
-  if (DAQmxFailed(error)) {
-    // Get and print error information
-    DAQmxGetExtendedErrorInfo(errBuff, 2048);
+  sampleBlock *block = queue.claim();
+  long samplesRead;
+  if (config.sampleFormat == SAMPLE_FORMAT_I16) {
+    samplesRead = source->readCodes(block ? block->codes : discardCodes.data(),
+                                    queue.blockSize());
+  } else {
+    samplesRead = source->read(block ? block->data : discard.data(),
+                               queue.blockSize());
+  }
+  if (samplesRead < 0) {
+    source->stop();
+    return;
+  }
+  if (samplesRead == 0) {
+    return;
+  }
+  if (!block) {
+    droppedBlocks++;
+    droppedSamples += samplesRead;
+    adaptReadTarget(true);
+    callbackNanos = nanos() - entered;
+    return;
+  }
 
-    /*********************************************/
-    // DAQmx Stop Code
-    /*********************************************/
-    DAQmxStopTask(taskHandle);
-    DAQmxClearTask(taskHandle);
-    printf("DAQmx Error: %s\n", errBuff);
+  // The newest sample read was taken before the ones still waiting.
+  uint64_t now = nanos();
+  uint64_t backlog = waiting > samplesRead ? waiting - samplesRead : 0;
+  uint64_t behindNanos = (uint64_t)(backlog * 1e9 / config.sampleClockRate);
+  uint64_t lost = source->lostSamples();
+  block->timestamp = now > behindNanos ? now - behindNanos : 0;
+  block->samples = samplesRead;
+  block->lost = lost - reportedLost + droppedSamples;
+  block->backlog = backlog;
+  block->callbackNanos = callbackNanos;
+  reportedLost = lost;
+  droppedSamples = 0;
+  queue.publish();
+  queuedBlocks++;
+  if (writerIdle.load()) {
+    wakeWriter.notify_one();
   }
-  return 0;
+
+  adaptReadTarget(backlog > (uint64_t)config.samplesPerCallback ||
+                  callbackNanos > callbackBudget || block->lost > 0);
+  callbackNanos = nanos() - entered;
 }
 
 /**
- * Checks the err status.  Performed after completion of measuring task
+ * Doubles the read block when the acquisition is behind: samples were left
+ * waiting or lost, or the last callback ran over its budget. Larger reads
+ * cost the callback, the queue and the writer less per sample. The block
+ * halves again after NIDAQ_CALM_READS reads without trouble, so readings
+ * come as often as configured whenever the server keeps up.
  *
- * @param taskHandle the task handle of the current measuring task
- * @param status status code
- * @param callbackData a way to access the event handler that triggered this
- * callback function
+ * @param behind whether the read just made found the acquisition behind
  */
-int32 CVICALLBACK DoneCallback(TaskHandle taskHandle, int32 status,
-                               void *callbackData) {
-  int32 error = 0;
-  char errBuff[2048] = {'\0'};
+void NIDAQmxEventHandler::adaptReadTarget(bool behind) {
+  if (behind) {
+    readTarget = std::min(readTarget * 2, maxReadSamples);
+    calmReads = 0;
+  } else if (++calmReads >= NIDAQ_CALM_READS &&
+             readTarget > config.samplesPerCallback) {
+    readTarget = std::max(readTarget / 2, (long)config.samplesPerCallback);
+    calmReads = 0;
+  }
+}
 
-  // Check to see if an error stopped the task.
-  DAQmxErrChk(status);
+void NIDAQmxEventHandler::startWriter() {
+  if (writer.joinable()) {
+    return;
+  }
+  writing = true;
+  writer = std::thread([this]() { writeBlocks(); });
+}
 
-Error:
-  if (DAQmxFailed(error)) {
-    DAQmxGetExtendedErrorInfo(errBuff, 2048);
-    DAQmxClearTask(taskHandle);
-    printf("DAQmx Error: %s\n", errBuff);
+void NIDAQmxEventHandler::stopWriter() {
+  if (!writer.joinable()) {
+    return;
   }
-  return 0;
+  writing = false;
+  wakeWriter.notify_one();
+  writer.join();
+  // A session end waiting on blocks that were never queued gives up here.
+  drained.notify_all();
+}
+
+/**
+ * Records queued blocks until stopWriter() is called, then records whatever
+ * is left in the queue. The callback does not take wakeLock when it signals,
+ * so a wakeup can be missed; the wait is bounded so that only costs
+ * NIDAQ_WRITER_WAIT_MS.
+ */
+void NIDAQmxEventHandler::writeBlocks() {
+  while (true) {
+    sampleBlock *block = queue.front();
+    if (!block) {
+      if (!writing) {
+        break;
+      }
+      std::unique_lock<std::mutex> lock(wakeLock);
+      writerIdle = true;
+      if (!queue.front()) {
+        wakeWriter.wait_for(lock,
+                            std::chrono::milliseconds(NIDAQ_WRITER_WAIT_MS));
+      }
+      writerIdle = false;
+      continue;
+    }
+
+    writeBlock(*block);
+    queue.release();
+    {
+      std::lock_guard<std::mutex> lock(sessionsLock);
+      writtenBlocks++;
+    }
+    drained.notify_all();
+
+    uint64_t dropped = droppedBlocks.load();
+    if (dropped != reportedDrops) {
+      std::cerr << "The writer fell behind and " << dropped - reportedDrops
+                << " blocks of samples were dropped" << std::endl;
+      reportedDrops = dropped;
+    }
+  }
+}
+
+/**
+ * Reduces a block to the power of each channel, and hands it to the open
+ * sessions and the history. The reduction runs on the fastest kernel the CPU
+ * has, after codes are scaled to volts.
+ *
+ * @param block samples read by the callback
+ */
+void NIDAQmxEventHandler::writeBlock(const sampleBlock &block) {
+  long samplesRead = block.samples;
+  const double *data = block.data;
+  if (block.codes) {
+    scaleSampleCodes(block.codes, config.numChannels, samplesRead,
+                     scaling.data(), scaled.data());
+    data = scaled.data();
+  }
+  computeChannelStats(data, config.numChannels, samplesRead,
+                      config.channelVoltages, NIDAQ_CHAN_RESISTOR,
+                      stats.data(), power.data());
+  if (config.rawCapture) {
+    totalSamplePower(data, config.numChannels, samplesRead,
+                     config.channelVoltages, NIDAQ_CHAN_RESISTOR,
+                     samplePower.data());
+  }
+
+  totalSamplesRead += samplesRead;
+
+  recordPower(power.data(), block);
 }
 
 /**
@@ -228,7 +864,7 @@ Error:
  * @param voltages the voltage for each cable that the ni meter is reading
  * @param numChannels the number of channels the ni meter is reading from
  */
-void nidaqDiffVoltToPower(float64 *result, float64 *readings, float64 *voltages,
+void nidaqDiffVoltToPower(double *result, double *readings, double *voltages,
                           size_t numChannels) {
   for (size_t i = 0; i < numChannels; i++) {
     result[i] =
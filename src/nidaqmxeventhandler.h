@@ -1,111 +1,284 @@
 #ifndef NI_DAQ_MX_EVENT_HANDLER_H
 #define NI_DAQ_MX_EVENT_HANDLER_H
 
-#include <NIDAQmx.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "channelstats.h"
 #include "eventhandler.h"
 #include "functionapi.h"
-
-/*********************************************************************
- *
- * ANSI C Example program:
- *    ContAcq-IntClk.c
- *
- * Example Category:
- *    AI
- *
- * Description:
- *    This example demonstrates how to acquire a continuous amount of
- *    data using the DAQ device's internal clock.
- *
- * Instructions for Running:
- *    1. Select the physical channel to correspond to where your
- *       signal is input on the DAQ device.
- *    2. Enter the minimum and maximum voltage range.
- *    Note: For better accuracy try to match the input range to the
- *          expected voltage level of the measured signal.
- *    3. Set the rate of the acquisition. Also set the Samples per
- *       Channel control. This will determine how many samples are
- *       read at a time. This also determines how many points are
- *       plotted on the graph each time.
- *    Note: The rate should be at least twice as fast as the maximum
- *          frequency component of the signal being acquired.
- *
- * Steps:
- *    1. Create a task.
- *    2. Create an analog input voltage channel.
- *    3. Set the rate for the sample clock. Additionally, define the
- *       sample mode to be continuous.
- *    4. Call the Start function to start the acquistion.
- *    5. Read the data in the EveryNCallback function until the stop
- *       button is pressed or an error occurs.
- *    6. Call the Clear Task function to clear the task.
- *    7. Display an error if any.
- *
- * I/O Connections Overview:
- *    Make sure your signal input terminal matches the Physical
- *    Channel I/O control. For further connection information, refer
- *    to your hardware reference manual.
- *
- *********************************************************************/
+#include "powerhistory.h"
+#include "rawsamples.h"
+#include "regiontree.h"
+#include "samplequeue.h"
+#include "samplesource.h"
+#include "sessionlog.h"
 
 // TODO: DETERMINE ACCURACY OF THIS CONSTANTS
 #define NIDAQ_CHAN_RESISTOR 0.003  // currently don't know what this is for..
 
-// Allows DAQmx functions to respond to errors with their own error block
-#define DAQmxErrChk(functionCall)          \
-  if (DAQmxFailed(error = (functionCall))) \
-  { goto Error; }                            
+// This is the default rate of the sample clock in samples per second per
+// channel.
+#define NIDAQ_SAMPLE_CLOCK_RATE 1000.0
 
-// int NIMeasure(void); I don't think this is used
+// This is how many callbacks a second the block size is chosen for when it
+// is not configured.
+#define NIDAQ_DEFAULT_CALLBACKS_PER_SECOND 25.0
+
+// When the driver's buffer is not configured it holds this many seconds of
+// samples per channel, and never fewer than NIDAQ_BUFFER_SAMPLES.
+#define NIDAQ_DEFAULT_BUFFER_SECONDS 1.0
+#define NIDAQ_BUFFER_SAMPLES 16000
+
+// This is the fewest blocks the driver's buffer holds, so a callback that is
+// late by a block or two does not overrun it.
+#define NIDAQ_MIN_BUFFER_BLOCKS 4
+
+// When the acquisition falls behind, the callback reads blocks of up to this
+// many times samplesPerCallback, and up to half the driver's buffer.
+#define NIDAQ_MAX_BLOCK_FACTOR 4
 
-// called after measurements have concluded
-int32 CVICALLBACK DoneCallback(TaskHandle taskHandle, int32 status,
-                               void *callbackData);
+// The read block grows when a callback runs longer than this fraction of the
+// time between callbacks, and shrinks back after this many reads in a row
+// find the acquisition keeping up.
+#define NIDAQ_CALLBACK_BUDGET 0.5
+#define NIDAQ_CALM_READS 50
 
-// called after every n samples are measured by the ni meter
-int32 CVICALLBACK EveryNCallback(TaskHandle taskHandle,
-                                 int32 everyNsamplesEventType, uInt32 nSamples,
-                                 void *callbackData);
-void nidaqDiffVoltToPower(float64 *result, float64 *readings, float64 *voltages,
+// These are the defaults for how many seconds of readings are kept between
+// sessions, and how many milliseconds of them a session starts with. No
+// pre-roll by default keeps a session's log covering only the time from its
+// start message.
+#define NIDAQ_DEFAULT_HISTORY_SECONDS 10.0
+#define NIDAQ_DEFAULT_PRE_ROLL_MS 0
+
+// This is the default number of seconds of blocks the callback can queue
+// ahead of the writer thread, and the fewest blocks the queue holds.
+#define NIDAQ_DEFAULT_QUEUE_SECONDS 1.0
+#define NIDAQ_QUEUE_MIN_BLOCKS 4
+
+// This is the longest the writer thread sleeps before looking at the queue
+// again, which bounds how late it notices a block if a wakeup is missed.
+#define NIDAQ_WRITER_WAIT_MS 10
+
+// int NIMeasure(void); I don't think this is used
+
+void nidaqDiffVoltToPower(double *result, double *readings, double *voltages,
                           size_t numChannels);
 
 // Wrapper struct to bundle NIDAQmx related configuration options
 struct NIDAQmxConfig {
   // Number of channels being used
-  int numChannels;
-  // Number of samples per callback
-  int32 sampleRate;
-  // Minimum buffer size needed to hold channel data in a callback
-  uInt32 bufferSize;
+  int numChannels = 0;
+  // Samples per channel read by each callback, or 0 to choose it from the
+  // sample clock rate
+  int32_t samplesPerCallback = 0;
+  // Samples per second on each channel
+  double sampleClockRate = NIDAQ_SAMPLE_CLOCK_RATE;
+  // Samples per channel the driver buffers, or 0 to choose it from the sample
+  // clock rate
+  uint32_t bufferSamples = 0;
+  // Largest voltage either side of zero the channels read
+  double inputRange = SAMPLE_INPUT_RANGE;
+  // Read volts (SAMPLE_FORMAT_F64) or unscaled ADC codes (SAMPLE_FORMAT_I16),
+  // which are scaled by the writer thread and kept as codes in raw captures
+  int sampleFormat = SAMPLE_FORMAT_F64;
+  // Values a callback reads at most, numChannels times the largest read
+  // block, which configure() sets
+  uint32_t bufferSize = 0;
   // Description of channels being used
   std::string channelDescription;
   // Voltages for each channel, used when converting readings from voltage to
   // power
-  double *channelVoltages;
+  double *channelVoltages = nullptr;
+  // Seconds of readings kept in the history ring
+  double historySeconds = NIDAQ_DEFAULT_HISTORY_SECONDS;
+  // Milliseconds of history spliced in before each session start
+  uint64_t preRollMs = NIDAQ_DEFAULT_PRE_ROLL_MS;
+  // Seconds of blocks queued between the callback and the writer thread
+  double queueSeconds = NIDAQ_DEFAULT_QUEUE_SECONDS;
+  // Write every sample to a raw sample file next to each session log, and
+  // measure regions to the sample rather than to the callback
+  bool rawCapture = false;
+  // Write the average of each callback to the session log
+  bool averagedLog = true;
+  // Also write each session's readings and tags to a binary session log next
+  // to its text log
+  bool binaryLog = false;
+  // Compress the chunks of binary session logs, and the codes of raw sample
+  // files read as SAMPLE_FORMAT_I16
+  bool compression = true;
+  // Build and commit the task in configure(), so starting and ending a session
+  // only start and stop it
+  bool fastStart = true;
 };
 
+/**
+ * Runs one continuous acquisition and fans its readings out to every open
+ * session. The task is created and committed once, and sessions are only
+ * windows over the running stream, so they are cheap to start and can
+ * overlap. Each session writes its own log file. The source's callback only
+ * reads each block into a sampleQueue; a writer thread averages the blocks
+ * and does all of the formatting and I/O, so a slow disk cannot hold up the
+ * driver. The meter itself is reached through a sampleSource: a nidaqmxSource
+ * in production, or a synthetic or replayed one where there is no DAQmx
+ * hardware.
+ */
 class NIDAQmxEventHandler : public eventHandler {
  public:
-  int32 totalSamplesRead = 0;
+  uint64_t totalSamplesRead = 0;
   // configuration options
   NIDAQmxConfig config;
-  NIDAQmxEventHandler(void);
-  // constructor with given logfile
-  NIDAQmxEventHandler(std::string logFilePath);
+  // constructor with given logfile and meter
+  NIDAQmxEventHandler(std::string logFilePath, sampleSource *meter);
   // default destructor
   virtual ~NIDAQmxEventHandler();
   void configure(Configuration configuration);
+  void configure(const NIDAQmxConfig &newConfig);
+
+  // starts the acquisition task if it is not running, building it first
+  // unless configure() already has. Returns false if the source reported an
+  // error.
+  bool startAcquisition();
 
-  void startHandler(uint64_t timestamp);
+  // stops the acquisition task, and clears it unless in fast-start mode
+  void stopAcquisition();
+
+  // handles start event, starting the acquisition if it is not running
+  void startHandler(uint32_t sessionID, uint64_t timestamp);
 
   // handles tag event
-  void tagHandler(uint64_t timestamp, std::string tag);
+  void tagHandler(uint32_t sessionID, uint64_t timestamp, uint32_t tagID,
+                  uint32_t threadID, uint32_t cpu);
   // handles end event
-  void endHandler(uint64_t timestamp);
+  void endHandler(uint32_t sessionID, uint64_t timestamp);
+
+  // handles region event, keeping its time to split readings at in raw
+  // capture
+  void regionHandler(uint32_t sessionID, uint64_t timestamp, uint32_t tagID,
+                     uint32_t threadID, uint32_t cpu, bool begin);
+
+  // reads a block from the source into the queue. Called by the source.
+  void readSamples();
+
+  // adds the power readings of one block to the history and every open
+  // session
+  void recordPower(const double *powerReadings, const sampleBlock &block);
+
+  // number of blocks the callback read while the queue was full, whose
+  // samples were lost
+  std::atomic<uint64_t> droppedBlocks;
+
+  // how well the acquisition has kept up since it was configured, updated by
+  // the writer thread under the sessions lock
+  acquisitionHealth health;
 
  private:
-  // internal handle for nidaq measurement task
-  TaskHandle taskHandle;
+  // the meter, owned by the caller
+  sampleSource *source;
+  // true once the source's task is configured and committed
+  bool prepared = false;
+  // true while the task is running
+  bool acquiring = false;
+  // true if a session started the task, so the last session stops it
+  bool startedBySession = false;
+
+  // This is the most recent readings, kept whether or not a session is open.
+  powerHistory history;
+
+  // This is held while sessions are added or removed and while the writer
+  // thread hands readings to them and to the history. Tags only touch the
+  // timestamps of an open session, which the writer never reads, so they do
+  // not take it.
+  std::mutex sessionsLock;
+
+  // These carry blocks from the callback to the writer thread. When the
+  // queue is full, blocks are read into discard so the driver's buffer
+  // still drains.
+  sampleQueue queue;
+  std::vector<double> discard;
+  std::vector<int16_t> discardCodes;
+
+  // When reading codes, this is the source's scaling polynomial for each
+  // channel, and scaled holds a block's codes as volts while the writer
+  // reduces it.
+  std::vector<double> scaling;
+  std::vector<double> scaled;
+
+  // The writer thread runs while the acquisition does. queuedBlocks counts
+  // blocks published by the callback and writtenBlocks, under sessionsLock,
+  // those the writer has recorded, so a session end can wait for the blocks
+  // read before it.
+  std::thread writer;
+  std::atomic<bool> writing;
+  // This is set while the writer sleeps, so the callback only signals it
+  // when there is someone to wake.
+  std::atomic<bool> writerIdle;
+  std::mutex wakeLock;
+  std::condition_variable wakeWriter;
+  std::condition_variable drained;
+  std::atomic<uint64_t> queuedBlocks;
+  uint64_t writtenBlocks = 0;
+
+  // These are only used by the callback. It reads once readTarget samples
+  // per channel are waiting, which grows up to maxReadSamples while the
+  // acquisition falls behind and shrinks back to samplesPerCallback once it
+  // keeps up, so a backlog is taken in fewer, larger blocks rather than
+  // piling up in the driver. calmReads counts reads since it last changed,
+  // reportedLost is the source's lost samples already handed to the writer
+  // and droppedSamples those of dropped blocks not yet handed to it, and
+  // callbackNanos is the length of the last callback.
+  long readTarget = 0;
+  long maxReadSamples = 0;
+  uint64_t callbackBudget = 0;
+  uint64_t calmReads = 0;
+  uint64_t reportedLost = 0;
+  uint64_t droppedSamples = 0;
+  uint64_t callbackNanos = 0;
+  // This is the number of dropped blocks the writer has reported.
+  uint64_t reportedDrops = 0;
+
+  // These hold the stats and the power of each channel while the writer
+  // records a block, and in raw capture the total power of each sample.
+  std::vector<channelStats> stats;
+  std::vector<double> power;
+  std::vector<double> samplePower;
+  // This holds a block's codes compressed for the raw sample files.
+  std::vector<uint8_t> encodedCodes;
+
+  // These are the binary logs of the open sessions, when they are written.
+  std::map<uint32_t, sessionLogWriter> binaryLogs;
+
+  // This checks the sample clock rate, block size and buffer depth of config,
+  // fills in the ones left to be chosen and fixes any that cannot work.
+  void sizeTiming();
+
+  // This configures and commits the source's task.
+  bool prepareSource();
+
+  // These start the writer thread, and stop it once the queue is empty.
+  void startWriter();
+  void stopWriter();
+
+  // This is the writer thread.
+  void writeBlocks();
+
+  // This reduces a block to the power of each channel and records it.
+  void writeBlock(const sampleBlock &block);
+
+  // This adds a block's samples to a session's readings in raw capture.
+  void addSampleReadings(sessionState &session, const sampleBlock &block);
+
+  // This adds what a block says about the acquisition's health to health.
+  static void addHealth(acquisitionHealth &health, const sampleBlock &block,
+                        long samplesPerCallback);
+
+  // This sets the read block for the next callback from how the last one
+  // went.
+  void adaptReadTarget(bool behind);
+
+  // This writes a session's log and forgets the session.
+  void writeSession(uint32_t sessionID, uint64_t timestamp);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,327 @@
+#include "nidaqmxsource.h"
+#include <NIDAQmx.h>
+#include <stdio.h>
+#include <algorithm>
+#include <iostream>
+
+// called after measurements have concluded
+static int32 CVICALLBACK DoneCallback(TaskHandle taskHandle, int32 status,
+                                      void *callbackData);
+
+// called after every n samples are measured by the ni meter
+static int32 CVICALLBACK EveryNCallback(TaskHandle taskHandle,
+                                        int32 everyNsamplesEventType,
+                                        uInt32 nSamples, void *callbackData);
+
+nidaqmxSource::nidaqmxSource() : taskHandle(0) {}
+
+nidaqmxSource::~nidaqmxSource() { clear(); }
+
+/**
+ * Creates the task, its channels and its timing, and registers the callbacks
+ *
+ * @param config the channels and timing to acquire with
+ * @param callback called on the DAQmx thread whenever a block is ready
+ * @returns false if DAQmx reported an error
+ */
+bool nidaqmxSource::configure(const sampleSourceConfig &newConfig,
+                              const samplesReadyCallback &callback) {
+  clear();
+  config = newConfig;
+  onSamples = callback;
+
+  /*********************************************/
+  // DAQmx Configure Code
+  /*********************************************/
+  TaskHandle task = 0;
+  if (!check(DAQmxCreateTask("", &task))) {
+    return false;
+  }
+  taskHandle = task;
+
+  if (!check(DAQmxCreateAIVoltageChan(
+          task, config.channelDescription.c_str(), "", DAQmx_Val_Cfg_Default,
+          -config.inputRange, config.inputRange, DAQmx_Val_Volts, NULL)) ||
+      !check(DAQmxCfgSampClkTiming(task, NULL, config.sampleClockRate,
+                                   DAQmx_Val_Rising, DAQmx_Val_ContSamps,
+                                   config.bufferSamples)) ||
+      !check(DAQmxRegisterEveryNSamplesEvent(
+          task, DAQmx_Val_Acquired_Into_Buffer,
+          (uInt32)config.samplesPerCallback, 0, EveryNCallback,
+          (void *)this)) ||
+      !check(DAQmxRegisterDoneEvent(task, 0, DoneCallback, (void *)this)) ||
+      // A reader that falls behind loses the oldest samples rather than
+      // stopping the task, and read() skips past them.
+      !check(DAQmxSetReadOverWrite(task, DAQmx_Val_OverwriteUnreadSamps)) ||
+      !checkRate(config.sampleClockRate) ||
+      (config.sampleFormat == SAMPLE_FORMAT_I16 && !checkCodeSize())) {
+    clear();
+    return false;
+  }
+  return true;
+}
+
+bool nidaqmxSource::commit() {
+  // Committing verifies the task and reserves and programs the hardware, so
+  // DAQmxStartTask and DAQmxStopTask only arm and disarm it from then on.
+  return check(DAQmxTaskControl((TaskHandle)taskHandle,
+                                DAQmx_Val_Task_Commit));
+}
+
+bool nidaqmxSource::start() {
+  consumed = 0;
+  lost = 0;
+  /*********************************************/
+  // DAQmx Start Code
+  /*********************************************/
+  return check(DAQmxStartTask((TaskHandle)taskHandle));
+}
+
+bool nidaqmxSource::stop() {
+  // A committed task returns to the committed state when it stops.
+  return check(DAQmxStopTask((TaskHandle)taskHandle));
+}
+
+void nidaqmxSource::clear() {
+  if (taskHandle != 0) {
+    DAQmxStopTask((TaskHandle)taskHandle);
+    DAQmxClearTask((TaskHandle)taskHandle);
+    taskHandle = 0;
+  }
+}
+
+/**
+ * Reads the samples DAQmx has buffered that fit in data
+ *
+ * @param data where the samples go, grouped by channel
+ * @param size the number of values data can hold
+ * @returns the number of samples per channel, or -1 on error
+ */
+long nidaqmxSource::read(double *data, size_t size) {
+  return readAvailable(data, size, false);
+}
+
+/**
+ * Reads the samples DAQmx has buffered that fit in data as unscaled ADC
+ * codes, which is a quarter of the data DAQmxReadAnalogF64 produces and
+ * skips the driver's scaling
+ *
+ * @param data where the codes go, grouped by channel
+ * @param size the number of values data can hold
+ * @returns the number of samples per channel, or -1 on error
+ */
+long nidaqmxSource::readCodes(int16_t *data, size_t size) {
+  return readAvailable(data, size, true);
+}
+
+long nidaqmxSource::available() {
+  uInt32 samples = 0;
+  if (!check(DAQmxGetReadAvailSampPerChan((TaskHandle)taskHandle,
+                                          &samples))) {
+    return -1;
+  }
+  return (long)samples;
+}
+
+uint64_t nidaqmxSource::lostSamples() { return lost; }
+
+/**
+ * Reads a fixed number of samples rather than all available ones, so a
+ * backlog larger than data is left in the buffer instead of failing the
+ * read. If the buffer wrapped over the read position, the read restarts half
+ * a buffer behind the newest sample and the samples skipped are counted as
+ * lost.
+ */
+long nidaqmxSource::readAvailable(void *data, size_t size, bool codes) {
+  long waiting = available();
+  if (waiting <= 0 || config.numChannels == 0) {
+    return waiting;
+  }
+  long samples = std::min(waiting, (long)(size / config.numChannels));
+
+  int32 samplesRead = 0;
+  /*********************************************/
+  // DAQmx Read Code
+  /*********************************************/
+  int32 status = readOnce(data, size, codes, samples, &samplesRead);
+  if (status == DAQmxErrorSamplesNoLongerAvailable) {
+    TaskHandle task = (TaskHandle)taskHandle;
+    uInt64 acquired = 0;
+    int32 behind = (int32)std::max<size_t>(1, config.bufferSamples / 2);
+    if (!check(DAQmxGetReadTotalSampPerChanAcquired(task, &acquired)) ||
+        !check(DAQmxSetReadRelativeTo(task, DAQmx_Val_MostRecentSamp)) ||
+        !check(DAQmxSetReadOffset(task, -behind))) {
+      return -1;
+    }
+    uint64_t resume = acquired > (uint64_t)behind ? acquired - behind : 0;
+    lost += resume > consumed ? resume - consumed : 0;
+    consumed = resume;
+    samples = std::min((long)behind, (long)(size / config.numChannels));
+    status = readOnce(data, size, codes, samples, &samplesRead);
+    // Later reads continue from where this one ended.
+    DAQmxSetReadRelativeTo(task, DAQmx_Val_CurrReadPos);
+    DAQmxSetReadOffset(task, 0);
+  }
+  if (!check(status)) {
+    return -1;
+  }
+  consumed += samplesRead;
+  return samplesRead;
+}
+
+int32_t nidaqmxSource::readOnce(void *data, size_t size, bool codes,
+                                long samples, int32_t *samplesRead) {
+  if (codes) {
+    return DAQmxReadBinaryI16((TaskHandle)taskHandle, (int32)samples, 0,
+                              DAQmx_Val_GroupByChannel, (int16 *)data,
+                              (uInt32)size, (int32 *)samplesRead, NULL);
+  }
+  return DAQmxReadAnalogF64((TaskHandle)taskHandle, (int32)samples, 0,
+                            DAQmx_Val_GroupByChannel, (float64 *)data,
+                            (uInt32)size, (int32 *)samplesRead, NULL);
+}
+
+/**
+ * Reads the polynomial the device uses to turn each channel's codes into
+ * volts. Devices give up to SAMPLE_SCALING_COEFFS coefficients, and any the
+ * device leaves out are zero.
+ *
+ * @param coefficients set to SAMPLE_SCALING_COEFFS coefficients per channel,
+ * lowest order first
+ * @returns false if DAQmx reported an error or a channel has more
+ * coefficients
+ */
+bool nidaqmxSource::scaling(std::vector<double> &coefficients) {
+  uInt32 numChannels = 0;
+  if (!check(DAQmxGetTaskNumChans((TaskHandle)taskHandle, &numChannels))) {
+    return false;
+  }
+  coefficients.assign(numChannels * SAMPLE_SCALING_COEFFS, 0.0);
+  for (uInt32 i = 0; i < numChannels; i++) {
+    std::string name;
+    if (!channelName(i, name)) {
+      return false;
+    }
+    // Asking with no array returns the number of coefficients.
+    int32 count = DAQmxGetAIDevScalingCoeff((TaskHandle)taskHandle,
+                                            name.c_str(), NULL, 0);
+    if (!check(count)) {
+      return false;
+    }
+    if (count > SAMPLE_SCALING_COEFFS) {
+      std::cerr << name << " scales its codes with " << count
+                << " coefficients, but only " << SAMPLE_SCALING_COEFFS
+                << " are supported" << std::endl;
+      return false;
+    }
+    if (!check(DAQmxGetAIDevScalingCoeff(
+            (TaskHandle)taskHandle, name.c_str(),
+            coefficients.data() + i * SAMPLE_SCALING_COEFFS,
+            SAMPLE_SCALING_COEFFS))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool nidaqmxSource::channelName(size_t index, std::string &name) {
+  char buffer[256] = {'\0'};
+  if (!check(DAQmxGetNthTaskChannel((TaskHandle)taskHandle,
+                                    (uInt32)index + 1, buffer,
+                                    sizeof(buffer)))) {
+    return false;
+  }
+  name = buffer;
+  return true;
+}
+
+bool nidaqmxSource::checkRate(double sampleClockRate) {
+  // Multiplexed modules such as the NI 9205 share one ADC between their
+  // channels, so the fastest rate depends on how many channels the task has.
+  float64 maxRate = 0.0;
+  if (!check(DAQmxGetSampClkMaxRate((TaskHandle)taskHandle, &maxRate))) {
+    return false;
+  }
+  if (sampleClockRate > maxRate) {
+    std::cerr << "The channels can be sampled at most " << maxRate
+              << " times per second, not " << sampleClockRate << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool nidaqmxSource::checkCodeSize() {
+  uInt32 numChannels = 0;
+  if (!check(DAQmxGetTaskNumChans((TaskHandle)taskHandle, &numChannels))) {
+    return false;
+  }
+  for (uInt32 i = 0; i < numChannels; i++) {
+    std::string name;
+    uInt32 bits = 0;
+    if (!channelName(i, name) ||
+        !check(DAQmxGetAIRawSampSize((TaskHandle)taskHandle, name.c_str(),
+                                     &bits))) {
+      return false;
+    }
+    if (bits > 16) {
+      std::cerr << name << " has " << bits
+                << "-bit codes, which cannot be read as 16-bit samples"
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+void nidaqmxSource::samplesReady() {
+  if (onSamples) {
+    onSamples();
+  }
+}
+
+bool nidaqmxSource::check(int32_t status) {
+  if (DAQmxFailed(status)) {
+    // Get and print error information
+    char errBuff[2048] = {'\0'};
+    DAQmxGetExtendedErrorInfo(errBuff, 2048);
+    printf("DAQmx Error: %s\n", errBuff);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Hands a block of samples to the source's callback. Called after n samples
+ * are read by the meter
+ *
+ * @param taskHandle the task handle of the current measuring task
+ * @param everyNsamplesEventType code indicating the type of functionality this
+ * function contains.
+ * @param nSamples the number of samples read each time before this function is
+ * called
+ * @param callbackData the nidaqmxSource that owns the task
+ */
+static int32 CVICALLBACK EveryNCallback(TaskHandle taskHandle,
+                                        int32 everyNsamplesEventType,
+                                        uInt32 nSamples, void *callbackData) {
+  ((nidaqmxSource *)callbackData)->samplesReady();
+  return 0;
+}
+
+/**
+ * Checks the err status.  Performed after completion of measuring task
+ *
+ * @param taskHandle the task handle of the current measuring task
+ * @param status status code
+ * @param callbackData the nidaqmxSource that owns the task
+ */
+static int32 CVICALLBACK DoneCallback(TaskHandle taskHandle, int32 status,
+                                      void *callbackData) {
+  // Check to see if an error stopped the task.
+  if (DAQmxFailed(status)) {
+    char errBuff[2048] = {'\0'};
+    DAQmxGetExtendedErrorInfo(errBuff, 2048);
+    printf("DAQmx Error: %s\n", errBuff);
+  }
+  return 0;
+}
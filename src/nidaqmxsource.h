@@ -0,0 +1,112 @@
+#ifndef NIDAQMX_SOURCE_H
+#define NIDAQMX_SOURCE_H
+
+#include <string>
+#include <vector>
+#include "samplesource.h"
+
+/*********************************************************************
+ *
+ * ANSI C Example program:
+ *    ContAcq-IntClk.c
+ *
+ * Example Category:
+ *    AI
+ *
+ * Description:
+ *    This example demonstrates how to acquire a continuous amount of
+ *    data using the DAQ device's internal clock.
+ *
+ * Instructions for Running:
+ *    1. Select the physical channel to correspond to where your
+ *       signal is input on the DAQ device.
+ *    2. Enter the minimum and maximum voltage range.
+ *    Note: For better accuracy try to match the input range to the
+ *          expected voltage level of the measured signal.
+ *    3. Set the rate of the acquisition. Also set the Samples per
+ *       Channel control. This will determine how many samples are
+ *       read at a time. This also determines how many points are
+ *       plotted on the graph each time.
+ *    Note: The rate should be at least twice as fast as the maximum
+ *          frequency component of the signal being acquired.
+ *
+ * Steps:
+ *    1. Create a task.
+ *    2. Create an analog input voltage channel.
+ *    3. Set the rate for the sample clock. Additionally, define the
+ *       sample mode to be continuous.
+ *    4. Call the Start function to start the acquistion.
+ *    5. Read the data in the EveryNCallback function until the stop
+ *       button is pressed or an error occurs.
+ *    6. Call the Clear Task function to clear the task.
+ *    7. Display an error if any.
+ *
+ * I/O Connections Overview:
+ *    Make sure your signal input terminal matches the Physical
+ *    Channel I/O control. For further connection information, refer
+ *    to your hardware reference manual.
+ *
+ *********************************************************************/
+
+/**
+ * A sampleSource backed by a DAQmx analog input voltage task on the device's
+ * internal clock. The header does not need the DAQmx headers, so only
+ * nidaqmxsource.cpp has to be built against them.
+ */
+class nidaqmxSource : public sampleSource {
+ public:
+  nidaqmxSource();
+  ~nidaqmxSource();
+
+  bool configure(const sampleSourceConfig& config,
+                 const samplesReadyCallback& onSamples);
+  bool commit();
+  bool start();
+  bool stop();
+  void clear();
+  long read(double* data, size_t size);
+  long readCodes(int16_t* data, size_t size);
+  bool scaling(std::vector<double>& coefficients);
+  long available();
+  uint64_t lostSamples();
+
+  // This is called by DAQmx after every samplesPerCallback samples.
+  void samplesReady();
+
+ private:
+  // internal handle for nidaq measurement task, a DAQmx TaskHandle
+  void* taskHandle;
+  samplesReadyCallback onSamples;
+  sampleSourceConfig config;
+
+  // These count the samples per channel read and lost since the task was
+  // started.
+  uint64_t consumed = 0;
+  uint64_t lost = 0;
+
+  // This reads what is available and fits in size values, as volts or as
+  // codes, skipping ahead if the samples at the read position were
+  // overwritten.
+  long readAvailable(void* data, size_t size, bool codes);
+
+  // This does one DAQmx read of samples per channel.
+  int32_t readOnce(void* data, size_t size, bool codes, long samples,
+                   int32_t* samplesRead);
+
+  // This prints the DAQmx error behind status, if any, and returns false if
+  // there was one.
+  bool check(int32_t status);
+
+  // This sets name to the name of the task's channel at index, counting from
+  // zero.
+  bool channelName(size_t index, std::string& name);
+
+  // This checks the device can run the task's channels at sampleClockRate.
+  bool checkRate(double sampleClockRate);
+
+  // This checks that every channel's ADC codes fit in 16 bits, which
+  // DAQmxReadBinaryI16 needs.
+  bool checkCodeSize();
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "powerhistory.h"
+#include <algorithm>
+
+powerHistory::powerHistory()
+    : capacity(0), numChannels(0), next(0), count(0) {}
+
+void powerHistory::resize(size_t newCapacity, size_t newNumChannels) {
+  capacity = newCapacity;
+  numChannels = newNumChannels;
+  next = 0;
+  count = 0;
+  timestamps.assign(capacity, 0);
+  watts.assign(capacity, 0.0);
+  samplesRead.assign(capacity, 0);
+  channels.assign(capacity * numChannels, 0.0);
+}
+
+/**
+ * Stores a reading in the oldest slot
+ *
+ * @param timestamp when the reading was taken
+ * @param readings the power of each channel
+ * @param readingCount the number of entries in readings; channels past the
+ * ring's channel count are ignored and missing ones read as zero
+ * @param samples the number of meter samples the reading averages
+ */
+void powerHistory::push(uint64_t timestamp, const double *readings,
+                        size_t readingCount, uint64_t samples) {
+  if (capacity == 0) {
+    return;
+  }
+
+  double total = 0.0;
+  double *slot = channels.data() + next * numChannels;
+  for (size_t i = 0; i < numChannels; i++) {
+    slot[i] = i < readingCount ? readings[i] : 0.0;
+    total += slot[i];
+  }
+  timestamps[next] = timestamp;
+  watts[next] = total;
+  samplesRead[next] = samples;
+
+  next = (next + 1) % capacity;
+  count = std::min(count + 1, capacity);
+}
+
+size_t powerHistory::forEachSince(uint64_t since,
+                                  const historyCallback &onEntry) {
+  if (count == 0) {
+    return 0;
+  }
+  size_t oldest = (next + capacity - count) % capacity;
+  size_t passed = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t index = (oldest + i) % capacity;
+    if (timestamps[index] <= since) {
+      continue;
+    }
+    historyEntry entry = {timestamps[index], watts[index], samplesRead[index],
+                          channels.data() + index * numChannels};
+    onEntry(entry);
+    passed++;
+  }
+  return passed;
+}
+
+size_t powerHistory::size() { return count; }
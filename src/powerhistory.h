@@ -0,0 +1,64 @@
+#ifndef POWER_HISTORY_H
+#define POWER_HISTORY_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+/**
+ * One reading of the meter as it is kept in a powerHistory
+ */
+struct historyEntry {
+  uint64_t timestamp;
+  // total power over every channel
+  double watts;
+  // number of meter samples the reading averages
+  uint64_t samplesRead;
+  // power of each channel
+  const double* channels;
+};
+
+typedef std::function<void(const historyEntry& entry)> historyCallback;
+
+/**
+ * A bounded ring of the most recent meter readings. The acquisition runs
+ * between sessions, and the ring keeps what it measured so a session can
+ * start with the power from before its start message. Storage is allocated
+ * once by resize(); pushing never allocates and overwrites the oldest reading
+ * once the ring is full.
+ */
+class powerHistory {
+ public:
+  powerHistory();
+
+  // This makes room for capacity readings of numChannels channels each and
+  // forgets every reading. A capacity of 0 keeps no history.
+  void resize(size_t capacity, size_t numChannels);
+
+  // This adds a reading, dropping the oldest one if the ring is full.
+  void push(uint64_t timestamp, const double* channels, size_t numChannels,
+            uint64_t samplesRead);
+
+  // This calls onEntry for every reading taken after since, oldest first. It
+  // returns the number of readings passed to it.
+  size_t forEachSince(uint64_t since, const historyCallback& onEntry);
+
+  // This returns the number of readings held.
+  size_t size();
+
+ private:
+  size_t capacity;
+  size_t numChannels;
+  // index of the slot the next reading goes in
+  size_t next;
+  size_t count;
+
+  std::vector<uint64_t> timestamps;
+  std::vector<double> watts;
+  std::vector<uint64_t> samplesRead;
+  // numChannels readings for each slot
+  std::vector<double> channels;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include "sessionreport.h"
+
+static void usage(const char* program) {
+  std::cerr << "Usage: " << program
+            << " [-j threads] [-f csv|json] [-o output file]"
+            << " <session log>..." << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Writes the duration, average and peak power and energy of every region and
+ * tag interval in binary session logs, the "<session log>.ppl" files the
+ * server writes with NIDAQmxBinaryLog=1. The text logs have no time for each
+ * reading, so they cannot be lined up with the tags.
+ *
+ * The report goes to standard output unless an output file is given. The
+ * logs are read with a thread per core unless a number of threads is given.
+ */
+int main(int argc, char** argv) {
+  unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+  std::string format = "csv";
+  std::string outputFile;
+  int option;
+  while ((option = getopt(argc, argv, "j:f:o:")) != -1) {
+    switch (option) {
+      case 'j':
+        threads = (unsigned)std::max(atoi(optarg), 1);
+        break;
+      case 'f':
+        format = optarg;
+        break;
+      case 'o':
+        outputFile = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind >= argc || (format != "csv" && format != "json")) {
+    usage(argv[0]);
+  }
+
+  sessionReport report;
+  if (!report.open(std::vector<std::string>(argv + optind, argv + argc))) {
+    exit(EXIT_FAILURE);
+  }
+  report.run(threads);
+
+  std::ofstream file;
+  if (!outputFile.empty()) {
+    file.open(outputFile);
+    if (!file.is_open()) {
+      std::cerr << "Cannot write " << outputFile << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  std::ostream& out = outputFile.empty() ? std::cout : file;
+  if (format == "json") {
+    report.writeJSON(out);
+  } else {
+    report.writeCSV(out);
+  }
+  return 0;
+}
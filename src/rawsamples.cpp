@@ -0,0 +1,168 @@
+#include "rawsamples.h"
+#include <iostream>
+#include "channelstats.h"
+#include "samplecodec.h"
+
+// This rounds the size of a block's codes up to a multiple of 8 bytes.
+static size_t paddedBytes(size_t bytes) { return (bytes + 7) & ~(size_t)7; }
+
+void writeRawSampleHeader(std::ostream &out, const rawSampleHeader &header,
+                          const double *voltages, const double *scaling) {
+  out.write((const char *)&header, sizeof(header));
+  out.write((const char *)voltages,
+            (std::streamsize)(header.numChannels * sizeof(double)));
+  if (header.format == SAMPLE_FORMAT_I16) {
+    out.write((const char *)scaling,
+              (std::streamsize)(header.numChannels * SAMPLE_SCALING_COEFFS *
+                                sizeof(double)));
+  }
+}
+
+void writeRawSampleBlock(std::ostream &out, uint64_t timestamp,
+                         const double *data, size_t samples,
+                         size_t numChannels) {
+  rawBlockHeader block = {timestamp, (uint32_t)samples, 0};
+  out.write((const char *)&block, sizeof(block));
+  out.write((const char *)data,
+            (std::streamsize)(samples * numChannels * sizeof(double)));
+}
+
+void writeRawSampleBlock(std::ostream &out, uint64_t timestamp,
+                         const int16_t *codes, size_t samples,
+                         size_t numChannels) {
+  static const char padding[8] = {0};
+  rawBlockHeader block = {timestamp, (uint32_t)samples, 0};
+  size_t bytes = samples * numChannels * sizeof(int16_t);
+  out.write((const char *)&block, sizeof(block));
+  out.write((const char *)codes, (std::streamsize)bytes);
+  out.write(padding, (std::streamsize)(paddedBytes(bytes) - bytes));
+}
+
+void writeEncodedRawSampleBlock(std::ostream &out, uint64_t timestamp,
+                                size_t samples,
+                                const std::vector<uint8_t> &encoded) {
+  static const char padding[8] = {0};
+  rawBlockHeader block = {timestamp, (uint32_t)samples,
+                          (uint32_t)encoded.size()};
+  out.write((const char *)&block, sizeof(block));
+  out.write((const char *)encoded.data(), (std::streamsize)encoded.size());
+  out.write(padding,
+            (std::streamsize)(paddedBytes(encoded.size()) - encoded.size()));
+}
+
+/**
+ * Opens a raw sample file
+ *
+ * @param path the file
+ * @returns true if the header was read and is one this reader understands
+ */
+bool rawSampleReader::open(const std::string &path) {
+  close();
+  file.open(path, std::ios::in | std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Could not open raw sample file " << path << std::endl;
+    return false;
+  }
+  if (!file.read((char *)&header, sizeof(header)) ||
+      header.magic != RAW_SAMPLE_MAGIC) {
+    std::cerr << path << " is not a raw sample file" << std::endl;
+    close();
+    return false;
+  }
+  if (header.version < RAW_SAMPLE_MIN_VERSION ||
+      header.version > RAW_SAMPLE_VERSION) {
+    std::cerr << path << " is raw sample format version " << header.version
+              << ", but only versions " << RAW_SAMPLE_MIN_VERSION << " to "
+              << RAW_SAMPLE_VERSION << " can be read" << std::endl;
+    close();
+    return false;
+  }
+  if (header.format != SAMPLE_FORMAT_F64 &&
+      header.format != SAMPLE_FORMAT_I16) {
+    std::cerr << path << " holds samples in unknown format " << header.format
+              << std::endl;
+    close();
+    return false;
+  }
+  voltages.resize(header.numChannels);
+  scaling.resize(header.format == SAMPLE_FORMAT_I16
+                     ? header.numChannels * SAMPLE_SCALING_COEFFS
+                     : 0);
+  if (!file.read((char *)voltages.data(),
+                 (std::streamsize)(voltages.size() * sizeof(double))) ||
+      !file.read((char *)scaling.data(),
+                 (std::streamsize)(scaling.size() * sizeof(double)))) {
+    std::cerr << path << " is cut off in its header" << std::endl;
+    close();
+    return false;
+  }
+  firstBlock = file.tellg();
+  return true;
+}
+
+bool rawSampleReader::next(rawBlockHeader &block, std::vector<double> &data) {
+  if (!file.read((char *)&block, sizeof(block))) {
+    return false;
+  }
+  size_t values = (size_t)block.samples * header.numChannels;
+  data.resize(values);
+  if (header.format == SAMPLE_FORMAT_F64) {
+    return block.bytes == 0 &&
+           file.read((char *)data.data(),
+                     (std::streamsize)(values * sizeof(double)));
+  }
+
+  if (!readCodes(block, codes)) {
+    return false;
+  }
+  scaleSampleCodes(codes.data(), header.numChannels, block.samples,
+                   scaling.data(), data.data());
+  return true;
+}
+
+bool rawSampleReader::next(rawBlockHeader &block,
+                           std::vector<int16_t> &data) {
+  if (header.format != SAMPLE_FORMAT_I16 ||
+      !file.read((char *)&block, sizeof(block))) {
+    return false;
+  }
+  if (!readCodes(block, data)) {
+    return false;
+  }
+  data.resize((size_t)block.samples * header.numChannels);
+  return true;
+}
+
+/**
+ * Reads the codes of a block whose header has been read, decoding them if
+ * they are compressed. data can be left with padding after the codes.
+ *
+ * @param block the block's header
+ * @param data the codes
+ * @returns false if the block is cut off or damaged
+ */
+bool rawSampleReader::readCodes(const rawBlockHeader &block,
+                                std::vector<int16_t> &data) {
+  size_t values = (size_t)block.samples * header.numChannels;
+  if (block.bytes == 0) {
+    data.resize(paddedBytes(values * sizeof(int16_t)) / sizeof(int16_t));
+    return (bool)file.read((char *)data.data(),
+                           (std::streamsize)(data.size() * sizeof(int16_t)));
+  }
+  encoded.resize(paddedBytes(block.bytes));
+  data.resize(values);
+  return file.read((char *)encoded.data(), (std::streamsize)encoded.size()) &&
+         decodeCodes(encoded.data(), block.bytes, data.data(), values);
+}
+
+void rawSampleReader::rewind() {
+  file.clear();
+  file.seekg(firstBlock);
+}
+
+void rawSampleReader::close() {
+  if (file.is_open()) {
+    file.close();
+  }
+  file.clear();
+}
@@ -0,0 +1,116 @@
+#ifndef RAW_SAMPLES_H
+#define RAW_SAMPLES_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "samplesource.h"
+
+/*
+ * Raw sample files hold every sample the meter read, as the blocks the
+ * driver returned them in. A file starts with a rawSampleHeader and the
+ * voltage of each channel as doubles, and is followed by blocks. Each block
+ * is a rawBlockHeader and then the block's readings grouped by channel:
+ * every sample of the first channel, then every sample of the second, and so
+ * on. Everything is in the byte order of the machine that wrote it.
+ *
+ * Readings are volts as doubles, or in SAMPLE_FORMAT_I16 files the ADC codes
+ * as 16-bit integers. Those files store each channel's scaling polynomial
+ * after the voltages, SAMPLE_SCALING_COEFFS doubles per channel, and pad each
+ * block's codes to a multiple of 8 bytes so the next header stays aligned.
+ * A block of codes can instead be compressed with encodeCodes from
+ * samplecodec.h, which its header's bytes gives the size of, and is padded
+ * the same way.
+ */
+
+#define RAW_SAMPLE_MAGIC 0x57415250  // "PRAW"
+#define RAW_SAMPLE_VERSION 4
+#define RAW_SAMPLE_MIN_VERSION 4
+
+struct rawSampleHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t numChannels;
+  // SAMPLE_FORMAT_F64 or SAMPLE_FORMAT_I16
+  uint32_t format;
+  // samples per second on each channel
+  double sampleClockRate;
+  // ohms of the shunt each channel's differential reading is taken across
+  double shuntResistance;
+};
+
+struct rawBlockHeader {
+  // server time the block was read, which is about when its last sample was
+  // taken
+  uint64_t timestamp;
+  // samples per channel in the block
+  uint32_t samples;
+  // bytes of the block's compressed codes without padding, or 0 if the
+  // block is not compressed
+  uint32_t bytes;
+};
+
+// This writes the start of a raw sample file. scaling is only written, and
+// only needed, for SAMPLE_FORMAT_I16.
+void writeRawSampleHeader(std::ostream& out, const rawSampleHeader& header,
+                          const double* voltages,
+                          const double* scaling = nullptr);
+
+// These write one block of samples grouped by channel, in the file's format.
+void writeRawSampleBlock(std::ostream& out, uint64_t timestamp,
+                         const double* data, size_t samples,
+                         size_t numChannels);
+void writeRawSampleBlock(std::ostream& out, uint64_t timestamp,
+                         const int16_t* codes, size_t samples,
+                         size_t numChannels);
+
+// This writes one block of codes that encodeCodes has compressed, so a block
+// going to several files is only compressed once.
+void writeEncodedRawSampleBlock(std::ostream& out, uint64_t timestamp,
+                                size_t samples,
+                                const std::vector<uint8_t>& encoded);
+
+/**
+ * Reads a raw sample file one block at a time
+ */
+class rawSampleReader {
+ public:
+  rawSampleHeader header;
+  // voltage of each channel
+  std::vector<double> voltages;
+  // each channel's scaling polynomial, in SAMPLE_FORMAT_I16 files
+  std::vector<double> scaling;
+
+  // This opens a file and reads its header. It returns false and prints why
+  // if the file cannot be read.
+  bool open(const std::string& path);
+
+  // This reads the next block into data as volts, grouped by channel, scaling
+  // codes if the file holds them. It returns false at the end of the file or
+  // on a cut-off block.
+  bool next(rawBlockHeader& block, std::vector<double>& data);
+
+  // This reads the next block of a SAMPLE_FORMAT_I16 file as codes, grouped
+  // by channel, without scaling them. It returns false at the end of the
+  // file, on a cut-off or damaged block, or if the file holds volts.
+  bool next(rawBlockHeader& block, std::vector<int16_t>& data);
+
+  // This goes back to the first block.
+  void rewind();
+
+  void close();
+
+ private:
+  std::ifstream file;
+  std::streamoff firstBlock = 0;
+  // These hold a block's codes while they are decoded and scaled.
+  std::vector<uint8_t> encoded;
+  std::vector<int16_t> codes;
+
+  bool readCodes(const rawBlockHeader& block, std::vector<int16_t>& data);
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "region.h"
+
+namespace powerpack {
+
+// This is the client POWERPACK_REGION reports to.
+static std::atomic<socketClient *> regionClient(nullptr);
+
+// This is the number of regions the current thread is inside.
+static thread_local int depth = 0;
+
+void setDefaultClient(socketClient *client) { regionClient.store(client); }
+
+socketClient *defaultClient() { return regionClient.load(); }
+
+int regionDepth() { return depth; }
+
+regionSite::regionSite(uint32_t hash, const char *name)
+    : hash(hash), name(name), registeredWith(0) {}
+
+/**
+ * Registers the site's region name with a client. Only the first call for a
+ * client sends anything.
+ *
+ * @param client the client the region is about to be entered on
+ */
+void regionSite::registerWith(socketClient *client) {
+  // Clients are compared by ID, since a new client can be allocated where an
+  // old one was and the server keeps registrations per connection.
+  uint64_t clientID = client->clientID();
+  if (registeredWith.load(std::memory_order_acquire) != clientID) {
+    client->registerRegion(hash, name);
+    registeredWith.store(clientID, std::memory_order_release);
+  }
+}
+
+Region::Region(socketClient &client, const std::string &name)
+    : client(&client), hash(regionHash(name.c_str())) {
+  client.registerRegion(hash, name);
+  begin();
+}
+
+Region::Region(socketClient &client, regionSite &site)
+    : client(&client), hash(site.hash) {
+  site.registerWith(&client);
+  begin();
+}
+
+Region::Region(regionSite &site) : client(defaultClient()), hash(site.hash) {
+  if (client) {
+    site.registerWith(client);
+    begin();
+  }
+}
+
+Region::~Region() {
+  if (client) {
+    client->sendRegionEnd(hash);
+    depth--;
+  }
+}
+
+void Region::begin() {
+  depth++;
+  client->sendRegionBegin(hash);
+}
+
+}  // namespace powerpack
@@ -0,0 +1,103 @@
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <type_traits>
+#include "socketutils.h"
+
+/*
+ * Scoped regions for socketClient. A region sends a begin event when it is
+ * constructed and the matching end event when it goes out of scope, so the
+ * server can rebuild the nesting of regions and attribute energy to each one.
+ *
+ *   void multiply() {
+ *     POWERPACK_REGION("matrix mult");
+ *     ...
+ *   }
+ */
+namespace powerpack {
+
+// This is the 32-bit FNV-1a hash of a region name. It is written as a single
+// expression so that it is constexpr in C++11 and string literals are hashed
+// at compile time.
+constexpr uint32_t regionHash(const char* name, uint32_t hash = 2166136261u) {
+  return *name ? regionHash(name + 1, (hash ^ (uint8_t)*name) * 16777619u)
+               : hash;
+}
+
+// This sets the client that POWERPACK_REGION reports to. Regions do nothing
+// while it is null.
+void setDefaultClient(socketClient* client);
+
+// This returns the client that POWERPACK_REGION reports to.
+socketClient* defaultClient();
+
+// This returns the number of regions the calling thread is currently inside.
+int regionDepth();
+
+/**
+ * A regionSite is created once per POWERPACK_REGION call site. It holds the
+ * precomputed hash and remembers which client the name was registered with,
+ * so entering the region again does not touch the client's registration table.
+ */
+class regionSite {
+ public:
+  regionSite(uint32_t hash, const char* name);
+
+  // This registers the region name with client unless it already has been.
+  void registerWith(socketClient* client);
+
+  const uint32_t hash;
+  const char* const name;
+
+ private:
+  // This is the clientID() of the client the name was last registered with.
+  std::atomic<uint64_t> registeredWith;
+};
+
+/**
+ * RAII guard that marks the lifetime of a region.
+ */
+class Region {
+ public:
+  // This enters a region with a name known only at run time. The name is
+  // hashed and looked up on every call.
+  Region(socketClient& client, const std::string& name);
+
+  // This enters the region of a call site on the given client.
+  Region(socketClient& client, regionSite& site);
+
+  // This enters the region of a call site on the default client.
+  explicit Region(regionSite& site);
+
+  // This leaves the region.
+  ~Region();
+
+  Region(const Region&) = delete;
+  Region& operator=(const Region&) = delete;
+
+ private:
+  socketClient* client;
+  uint32_t hash;
+
+  void begin();
+};
+
+}  // namespace powerpack
+
+#define POWERPACK_CONCAT_INNER(a, b) a##b
+#define POWERPACK_CONCAT(a, b) POWERPACK_CONCAT_INNER(a, b)
+
+// This enters a region named by a string literal until the end of the
+// enclosing scope. The hash is forced to be a compile-time constant.
+#define POWERPACK_REGION(name)                                               \
+  static powerpack::regionSite POWERPACK_CONCAT(powerpackRegionSite,         \
+                                                __LINE__)(                   \
+      std::integral_constant<uint32_t, powerpack::regionHash(name)>::value,  \
+      name);                                                                 \
+  powerpack::Region POWERPACK_CONCAT(powerpackRegion, __LINE__)(             \
+      POWERPACK_CONCAT(powerpackRegionSite, __LINE__))
+
+#endif
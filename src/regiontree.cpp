@@ -0,0 +1,246 @@
+#include "regiontree.h"
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+regionTree::regionTree() : unmatched(0) {}
+
+/**
+ * Builds the calling context tree of a session
+ *
+ * @param events the tags and region events of the session
+ * @param samples the power readings of the session in time order
+ * @param endTime epoch time at which the session ended
+ */
+void regionTree::build(const std::vector<tagEvent> &events,
+                       const std::vector<powerSample> &samples,
+                       uint64_t endTime) {
+  // This is a region that has begun but not ended.
+  struct openRegion {
+    size_t node;
+    uint64_t begin;
+  };
+
+  std::vector<tagEvent> regions;
+  std::unordered_map<uint32_t, std::vector<openRegion>> stacks;
+
+  for (const tagEvent &event : events) {
+    if (event.kind != TAG_EVENT_TAG) {
+      regions.push_back(event);
+    }
+  }
+  // Events from a batched client can arrive out of order, but the begin and
+  // end of one region always keep their relative order.
+  std::stable_sort(regions.begin(), regions.end(),
+                   [](const tagEvent &a, const tagEvent &b) {
+                     return a.timestamp < b.timestamp;
+                   });
+
+  uint64_t startTime = samples.empty() ? endTime : samples.front().timestamp;
+  if (!regions.empty()) {
+    startTime = std::min(startTime, regions.front().timestamp);
+  }
+
+  nodes.clear();
+  unmatched = 0;
+  energyIndex energy(samples);
+  nodes.push_back({REGION_TREE_ROOT, TAG_THREAD_SESSION, 0, 1,
+                   endTime - startTime, energy.between(startTime, endTime),
+                   0.0, {}});
+
+  auto close = [&](const openRegion &region, uint64_t timestamp) {
+    regionNode &node = nodes[region.node];
+    node.inclusiveTime += timestamp - region.begin;
+    node.inclusiveEnergy += energy.between(region.begin, timestamp);
+  };
+
+  for (const tagEvent &event : regions) {
+    std::vector<openRegion> &stack = stacks[event.threadID];
+    if (event.kind == TAG_EVENT_REGION_BEGIN) {
+      size_t parent = stack.empty()
+                          ? child(0, REGION_TREE_THREAD, event.threadID)
+                          : stack.back().node;
+      size_t node = child(parent, event.tagID, event.threadID);
+      nodes[node].calls++;
+      stack.push_back({node, event.timestamp});
+      continue;
+    }
+
+    // An end closes the innermost open region with the same name. Regions
+    // opened inside it that were never ended are closed with it.
+    size_t match = stack.size();
+    while (match > 0 && nodes[stack[match - 1].node].tagID != event.tagID) {
+      match--;
+    }
+    if (match == 0) {
+      unmatched++;
+      continue;
+    }
+    while (stack.size() >= match) {
+      close(stack.back(), event.timestamp);
+      stack.pop_back();
+    }
+  }
+
+  for (auto &entry : stacks) {
+    std::vector<openRegion> &stack = entry.second;
+    while (!stack.empty()) {
+      close(stack.back(), std::max(endTime, stack.back().begin));
+      stack.pop_back();
+    }
+  }
+
+  // A thread covers the time and energy of its top-level regions.
+  for (size_t index : nodes[0].children) {
+    regionNode &thread = nodes[index];
+    thread.calls = 1;
+    for (size_t region : thread.children) {
+      thread.inclusiveTime += nodes[region].inclusiveTime;
+      thread.inclusiveEnergy += nodes[region].inclusiveEnergy;
+    }
+  }
+
+  for (regionNode &node : nodes) {
+    node.exclusiveEnergy = node.inclusiveEnergy;
+    for (size_t index : node.children) {
+      node.exclusiveEnergy -= nodes[index].inclusiveEnergy;
+    }
+    node.exclusiveEnergy = std::max(node.exclusiveEnergy, 0.0);
+  }
+}
+
+const std::vector<regionNode> &regionTree::getNodes() { return nodes; }
+
+size_t regionTree::unmatchedEnds() { return unmatched; }
+
+size_t regionTree::child(size_t parent, uint32_t tagID, uint32_t threadID) {
+  for (size_t index : nodes[parent].children) {
+    if (nodes[index].tagID == tagID && nodes[index].threadID == threadID) {
+      return index;
+    }
+  }
+  nodes.push_back({tagID, threadID, parent, 0, 0, 0.0, 0.0, {}});
+  nodes[parent].children.push_back(nodes.size() - 1);
+  return nodes.size() - 1;
+}
+
+std::string regionTree::nodeName(size_t node, eventHandler &handler) {
+  if (node == 0) {
+    return "session";
+  }
+  if (nodes[node].tagID == REGION_TREE_THREAD) {
+    return "thread " + std::to_string(nodes[node].threadID);
+  }
+  return handler.tagName(nodes[node].tagID);
+}
+
+std::string regionTree::pathName(size_t node, eventHandler &handler,
+                                 char separator) {
+  std::vector<size_t> path;
+  for (size_t index = node; index != 0; index = nodes[index].parent) {
+    path.push_back(index);
+  }
+
+  std::string name = "session";
+  for (auto index = path.rbegin(); index != path.rend(); ++index) {
+    std::string frame = nodeName(*index, handler);
+    // The separator cannot appear inside a frame name.
+    std::replace(frame.begin(), frame.end(), separator, ':');
+    name += separator + frame;
+  }
+  return name;
+}
+
+/**
+ * Writes the tree in folded stack format, with exclusive energy in microjoules
+ * as the sample count
+ *
+ * @param out the stream to write to
+ * @param handler the handler whose string table holds the region names
+ */
+void regionTree::writeFoldedStacks(std::ostream &out, eventHandler &handler) {
+  for (size_t index = 0; index < nodes.size(); index++) {
+    long long microjoules = llround(nodes[index].exclusiveEnergy * 1e6);
+    if (microjoules > 0) {
+      out << pathName(index, handler, ';') << " " << microjoules << "\n";
+    }
+  }
+}
+
+/**
+ * Writes the tree as an indented table
+ *
+ * @param out the stream to write to
+ * @param handler the handler whose string table holds the region names
+ */
+void regionTree::writeSummary(std::ostream &out, eventHandler &handler) {
+  out << "REGION\tCALLS\tSECONDS\tINCLUSIVE JOULES\tEXCLUSIVE JOULES"
+      << std::endl;
+  writeSummaryNode(out, handler, 0, 0);
+  if (unmatched) {
+    out << "UNMATCHED REGION ENDS: " << unmatched << std::endl;
+  }
+}
+
+void regionTree::writeSummaryNode(std::ostream &out, eventHandler &handler,
+                                  size_t node, int depth) {
+  const regionNode &entry = nodes[node];
+  out << std::string(2 * depth, ' ')
+      << nodeName(node, handler)
+      << "\t" << entry.calls << "\t" << entry.inclusiveTime * 1e-9 << "\t"
+      << entry.inclusiveEnergy << "\t" << entry.exclusiveEnergy << std::endl;
+  for (size_t index : entry.children) {
+    writeSummaryNode(out, handler, index, depth + 1);
+  }
+}
+
+/**
+ * Adds up the joules used up to each sample
+ *
+ * @param samples power readings in time order. Each covers the time since the
+ * previous reading
+ */
+energyIndex::energyIndex(const std::vector<powerSample> &samples)
+    : samples(samples) {
+  used.reserve(samples.size());
+  double joules = 0.0;
+  for (size_t i = 0; i < samples.size(); i++) {
+    if (i > 0 && samples[i].timestamp > samples[i - 1].timestamp) {
+      joules += samples[i].watts *
+                (double)(samples[i].timestamp - samples[i - 1].timestamp) *
+                1e-9;
+    }
+    used.push_back(joules);
+  }
+}
+
+/**
+ * Looks up the energy used in an interval
+ *
+ * @param start epoch time in nanoseconds of the start of the interval
+ * @param end epoch time in nanoseconds of the end of the interval
+ * @returns the energy used in joules
+ */
+double energyIndex::between(uint64_t start, uint64_t end) const {
+  if (end <= start) {
+    return 0.0;
+  }
+  return at(end) - at(start);
+}
+
+double energyIndex::at(uint64_t timestamp) const {
+  if (samples.size() < 2 || timestamp <= samples.front().timestamp) {
+    return 0.0;
+  }
+
+  // This finds the first sample whose interval ends at or after timestamp.
+  auto sample = std::lower_bound(
+      samples.begin() + 1, samples.end(), timestamp,
+      [](const powerSample &s, uint64_t time) { return s.timestamp < time; });
+  if (sample == samples.end()) {
+    return used.back();
+  }
+  size_t i = (size_t)(sample - samples.begin());
+  return used[i - 1] +
+         sample->watts * (double)(timestamp - samples[i - 1].timestamp) * 1e-9;
+}
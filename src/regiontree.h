@@ -0,0 +1,112 @@
+#ifndef REGION_TREE_H
+#define REGION_TREE_H
+
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "eventhandler.h"
+
+// This is the tagID of the root node, which stands for the whole session.
+#define REGION_TREE_ROOT UINT32_MAX
+
+// This is the tagID of the nodes under the root that stand for each client
+// thread.
+#define REGION_TREE_THREAD (UINT32_MAX - 1)
+
+/**
+ * One distinct call path in a regionTree
+ */
+struct regionNode {
+  // interned region name, REGION_TREE_ROOT or REGION_TREE_THREAD
+  uint32_t tagID;
+  // client thread the path runs on
+  uint32_t threadID;
+  // index of the parent node; the root is its own parent
+  size_t parent;
+  // number of times the path was entered
+  uint64_t calls;
+  // total nanoseconds spent in the path, including child regions
+  uint64_t inclusiveTime;
+  // joules used in the path, including and excluding child regions
+  double inclusiveEnergy;
+  double exclusiveEnergy;
+  std::vector<size_t> children;
+};
+
+/**
+ * The regionTree is a calling context tree of the regions in a session, with
+ * the energy of each path integrated from the session's power samples. Each
+ * client thread has its own subtree under the root, since regions only nest
+ * within a thread. Threads run at the same time, so the energy of regions on
+ * different threads overlaps and a thread's energy is that of its top-level
+ * regions.
+ */
+class regionTree {
+ public:
+  regionTree();
+
+  // This rebuilds the tree from the region events in events. samples must be
+  // in time order; each one covers the time since the previous one, and the
+  // first only marks where the covered time starts. Regions still open at
+  // endTime are closed there.
+  void build(const std::vector<tagEvent>& events,
+             const std::vector<powerSample>& samples, uint64_t endTime);
+
+  // This returns the nodes of the tree. The root is node 0.
+  const std::vector<regionNode>& getNodes();
+
+  // This returns the number of region ends that did not match an open region.
+  size_t unmatchedEnds();
+
+  // This writes one "session;outer;inner <microjoules>" line per path with
+  // nonzero exclusive energy, the folded stack format read by flame graph
+  // tools.
+  void writeFoldedStacks(std::ostream& out, eventHandler& handler);
+
+  // This writes an indented table of calls, time and energy per path.
+  void writeSummary(std::ostream& out, eventHandler& handler);
+
+ private:
+  std::vector<regionNode> nodes;
+  size_t unmatched;
+
+  // This returns the child of parent for tagID, creating it if needed.
+  size_t child(size_t parent, uint32_t tagID, uint32_t threadID);
+
+  // This returns the display name of a node.
+  std::string nodeName(size_t node, eventHandler& handler);
+
+  // This returns the name of a path from the root, joined with separator.
+  std::string pathName(size_t node, eventHandler& handler, char separator);
+
+  void writeSummaryNode(std::ostream& out, eventHandler& handler, size_t node,
+                        int depth);
+};
+
+/**
+ * The energyIndex holds the joules used up to each of a session's power
+ * samples, so the energy between any two times is the difference of two
+ * binary searches rather than a pass over the samples between them. Each
+ * sample is constant power since the previous one, so a time inside a
+ * sample's interval takes its share of that sample's energy, and the result
+ * is the same as adding up the samples.
+ */
+class energyIndex {
+ public:
+  // This indexes samples, which must be in time order and outlive the index.
+  explicit energyIndex(const std::vector<powerSample>& samples);
+
+  // This returns the joules used between start and end.
+  double between(uint64_t start, uint64_t end) const;
+
+ private:
+  const std::vector<powerSample>& samples;
+  // joules used from the first sample up to each sample
+  std::vector<double> used;
+
+  // This returns the joules used from the first sample up to timestamp.
+  double at(uint64_t timestamp) const;
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include "replaysource.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+replaySource::replaySource(const std::string &path, bool loop)
+    : path(path), loop(loop) {}
+
+replaySource::~replaySource() { stop(); }
+
+/**
+ * Opens the file and checks it holds readings of the configured channels
+ *
+ * @returns false if the file cannot be replayed with config
+ */
+bool replaySource::configure(const sampleSourceConfig &newConfig,
+                             const samplesReadyCallback &callback) {
+  if (!reader.open(path)) {
+    return false;
+  }
+  if (reader.header.numChannels != newConfig.numChannels) {
+    std::cerr << path << " holds " << reader.header.numChannels
+              << " channels, but " << newConfig.numChannels
+              << " are configured" << std::endl;
+    reader.close();
+    return false;
+  }
+
+  // Looping over a file without a sample in it would never finish.
+  rawBlockHeader header;
+  bool found = false;
+  while (!found && reader.next(header, block)) {
+    found = header.samples > 0;
+  }
+  if (!found) {
+    std::cerr << path << " holds no readings" << std::endl;
+    reader.close();
+    return false;
+  }
+  reader.rewind();
+  blockSamples = 0;
+  offset = 0;
+
+  if (reader.header.sampleClockRate != newConfig.sampleClockRate) {
+    std::cout << "Replaying " << path << ", recorded at "
+              << reader.header.sampleClockRate << " samples per second, at "
+              << newConfig.sampleClockRate << std::endl;
+  }
+  return pacedSource::configure(newConfig, callback);
+}
+
+void replaySource::clear() {
+  pacedSource::clear();
+  reader.close();
+}
+
+bool replaySource::nextBlock() {
+  rawBlockHeader header;
+  bool rewound = false;
+  while (true) {
+    if (reader.next(header, block)) {
+      if (header.samples > 0) {
+        blockSamples = header.samples;
+        offset = 0;
+        return true;
+      }
+      continue;
+    }
+    if (!loop || rewound) {
+      return false;
+    }
+    reader.rewind();
+    rewound = true;
+  }
+}
+
+/**
+ * Copies the next samples from the file's blocks
+ *
+ * @param data where the samples go, grouped by channel
+ * @param samples the number of samples per channel wanted
+ * @param position the sample number of the first sample, which is unused
+ * since the file is read in order
+ * @returns the number of samples per channel copied, which is less than
+ * samples only at the end of a file that does not loop
+ */
+size_t replaySource::generate(double *data, size_t samples,
+                              uint64_t position) {
+  size_t numChannels = config.numChannels;
+  size_t written = 0;
+  while (written < samples) {
+    if (offset == blockSamples && !nextBlock()) {
+      break;
+    }
+    size_t count = std::min(samples - written, blockSamples - offset);
+    for (size_t i = 0; i < numChannels; i++) {
+      memcpy(data + i * samples + written,
+             block.data() + i * blockSamples + offset, count * sizeof(double));
+    }
+    written += count;
+    offset += count;
+  }
+
+  // Each channel was placed samples values apart, but the caller expects
+  // them written values apart.
+  if (written < samples) {
+    for (size_t i = 1; i < numChannels; i++) {
+      memmove(data + i * written, data + i * samples,
+              written * sizeof(double));
+    }
+  }
+  return written;
+}
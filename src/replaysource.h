@@ -0,0 +1,44 @@
+#ifndef REPLAY_SOURCE_H
+#define REPLAY_SOURCE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "rawsamples.h"
+#include "samplesource.h"
+
+/**
+ * A pacedSource that plays back a raw sample file, such as a session's raw
+ * capture, at the configured rate, which need not be the rate it was
+ * recorded at. The blocks are played back to back regardless of their
+ * timestamps. It starts over at the end of the file if loop is set, and
+ * stops producing samples if not.
+ */
+class replaySource : public pacedSource {
+ public:
+  replaySource(const std::string& path, bool loop = true);
+  ~replaySource();
+
+  bool configure(const sampleSourceConfig& config,
+                 const samplesReadyCallback& onSamples);
+  void clear();
+
+ protected:
+  size_t generate(double* data, size_t samples, uint64_t position);
+
+ private:
+  std::string path;
+  bool loop;
+  rawSampleReader reader;
+  // This is the block being played and how many of its samples per channel
+  // have been handed out.
+  std::vector<double> block;
+  size_t blockSamples = 0;
+  size_t offset = 0;
+
+  // This reads the next block that has samples, starting over at the end of
+  // the file if looping. It returns false when there is none.
+  bool nextBlock();
+};
+
+#endif
@@ -0,0 +1,323 @@
+#include "samplecodec.h"
+#include <cstring>
+
+// This is the most bytes a varint of a 64-bit value takes.
+#define VARINT_MAX_BYTES 10
+
+static inline uint64_t zigzag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static inline uint8_t *putVarint(uint8_t *out, uint64_t value) {
+  while (value >= 0x80) {
+    *out++ = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (uint8_t)value;
+  return out;
+}
+
+// This returns the byte after the varint, or nullptr if it runs past end.
+static inline const uint8_t *getVarint(const uint8_t *in, const uint8_t *end,
+                                       uint64_t &value) {
+  value = 0;
+  for (unsigned shift = 0; in < end && shift < 64; shift += 7) {
+    uint8_t byte = *in++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return in;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Writes a stream of bits, most significant first
+ */
+class bitWriter {
+ public:
+  bitWriter(std::vector<uint8_t> &out) : out(out) {}
+
+  void put(uint64_t bits, unsigned count) {
+    if (count > 32) {
+      put(bits >> 32, count - 32);
+      count = 32;
+    }
+    buffer = (buffer << count) | (bits & ((1ULL << count) - 1));
+    used += count;
+    while (used >= 8) {
+      used -= 8;
+      out.push_back((uint8_t)(buffer >> used));
+    }
+  }
+
+  // This writes the last bits, padded with zeros to a whole byte.
+  void flush() {
+    if (used > 0) {
+      out.push_back((uint8_t)(buffer << (8 - used)));
+      used = 0;
+    }
+  }
+
+ private:
+  std::vector<uint8_t> &out;
+  uint64_t buffer = 0;
+  unsigned used = 0;
+};
+
+/**
+ * Reads a stream of bits written by a bitWriter
+ */
+class bitReader {
+ public:
+  bitReader(const uint8_t *in, size_t bytes) : in(in), end(in + bytes) {}
+
+  // This reads count bits. It returns false if the stream is too short.
+  bool get(unsigned count, uint64_t &bits) {
+    if (count > 32) {
+      uint64_t high;
+      if (!get(count - 32, high) || !get(32, bits)) {
+        return false;
+      }
+      bits |= high << 32;
+      return true;
+    }
+    while (available < count && in < end) {
+      buffer = (buffer << 8) | *in++;
+      available += 8;
+    }
+    if (available < count) {
+      return false;
+    }
+    available -= count;
+    bits = (buffer >> available) & ((1ULL << count) - 1);
+    return true;
+  }
+
+ private:
+  const uint8_t *in;
+  const uint8_t *end;
+  uint64_t buffer = 0;
+  unsigned available = 0;
+};
+
+void encodeTimestamps(const uint64_t *values, size_t count,
+                      std::vector<uint8_t> &out) {
+  size_t start = out.size();
+  out.resize(start + count * VARINT_MAX_BYTES);
+  uint8_t *cursor = out.data() + start;
+  uint64_t previous = 0, previousDelta = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t delta = values[i] - previous;
+    cursor = putVarint(cursor, zigzag((int64_t)(delta - previousDelta)));
+    previous = values[i];
+    previousDelta = delta;
+  }
+  out.resize((size_t)(cursor - out.data()));
+}
+
+bool decodeTimestamps(const uint8_t *in, size_t bytes, uint64_t *values,
+                      size_t count) {
+  const uint8_t *end = in + bytes;
+  uint64_t previous = 0, previousDelta = 0, change;
+  for (size_t i = 0; i < count; i++) {
+    if (!(in = getVarint(in, end, change))) {
+      return false;
+    }
+    previousDelta += (uint64_t)unzigzag(change);
+    previous += previousDelta;
+    values[i] = previous;
+  }
+  return true;
+}
+
+void encodeCounts(const uint32_t *values, size_t count,
+                  std::vector<uint8_t> &out) {
+  size_t start = out.size();
+  out.resize(start + count * VARINT_MAX_BYTES);
+  uint8_t *cursor = out.data() + start;
+  int64_t previous = 0;
+  for (size_t i = 0; i < count; i++) {
+    cursor = putVarint(cursor, zigzag((int64_t)values[i] - previous));
+    previous = values[i];
+  }
+  out.resize((size_t)(cursor - out.data()));
+}
+
+bool decodeCounts(const uint8_t *in, size_t bytes, uint32_t *values,
+                  size_t count) {
+  const uint8_t *end = in + bytes;
+  int64_t previous = 0;
+  uint64_t change;
+  for (size_t i = 0; i < count; i++) {
+    if (!(in = getVarint(in, end, change))) {
+      return false;
+    }
+    previous += unzigzag(change);
+    values[i] = (uint32_t)previous;
+  }
+  return true;
+}
+
+// A change between two codes is 17 bits at most, so its varint is one to
+// three bytes. These write and read those varints without branching on
+// their length, which is close to random for noisy readings. Each touches
+// 4 bytes, so the caller leaves a byte of room past the end.
+static inline uint8_t *putCodeVarint(uint8_t *out, uint32_t value) {
+  uint32_t twoBytes = value >= 0x80, threeBytes = value >= 0x4000;
+  uint32_t word = (value & 0x7f) | ((value << 1) & 0x7f00) |
+                  ((value << 2) & 0x7f0000) | (twoBytes << 7) |
+                  (threeBytes << 15);
+  memcpy(out, &word, sizeof(word));
+  return out + 1 + twoBytes + threeBytes;
+}
+
+static inline const uint8_t *getCodeVarint(const uint8_t *in,
+                                           uint32_t &value) {
+  uint32_t word;
+  memcpy(&word, in, sizeof(word));
+  uint32_t twoBytes = (word >> 7) & 1;
+  uint32_t threeBytes = twoBytes & (word >> 15);
+  uint32_t length = 1 + twoBytes + threeBytes;
+  value = ((word & 0x7f) | ((word >> 1) & 0x3f80) | ((word >> 2) & 0x1fc000)) &
+          ((1u << (7 * length)) - 1);
+  return in + length;
+}
+
+void encodeCodes(const int16_t *values, size_t count,
+                 std::vector<uint8_t> &out) {
+  size_t start = out.size();
+  out.resize(start + count * 3 + 1);
+  uint8_t *cursor = out.data() + start;
+  int32_t previous = 0;
+  for (size_t i = 0; i < count; i++) {
+    int32_t change = values[i] - previous;
+    cursor = putCodeVarint(
+        cursor, ((uint32_t)change << 1) ^ (uint32_t)(change >> 31));
+    previous = values[i];
+  }
+  out.resize((size_t)(cursor - out.data()));
+}
+
+bool decodeCodes(const uint8_t *in, size_t bytes, int16_t *values,
+                 size_t count) {
+  const uint8_t *end = in + bytes;
+  int32_t previous = 0;
+  size_t i = 0;
+  // Only the last few varints can be too near the end to read 4 bytes.
+  for (; i < count && end - in >= 4; i++) {
+    uint32_t change;
+    in = getCodeVarint(in, change);
+    previous += (int32_t)(change >> 1) ^ -(int32_t)(change & 1);
+    values[i] = (int16_t)previous;
+  }
+  for (; i < count; i++) {
+    uint64_t change;
+    if (!(in = getVarint(in, end, change)) || change > 0x1ffff) {
+      return false;
+    }
+    previous += (int32_t)unzigzag(change);
+    values[i] = (int16_t)previous;
+  }
+  return in <= end;
+}
+
+/**
+ * Encodes readings as in Facebook's Gorilla. Each reading is XORed with the
+ * one before. A zero result is the bit 0. Otherwise 1 is followed by 0 and
+ * the bits inside the window of significant bits last described if they fit
+ * in it, or by 1, the number of leading zeros in 5 bits, the number of
+ * significant bits in 6 bits (0 meaning 64) and the significant bits.
+ *
+ * @param values the readings
+ * @param count the number of readings
+ * @param out the stream to append to
+ */
+void encodeReadings(const double *values, size_t count,
+                    std::vector<uint8_t> &out) {
+  if (count == 0) {
+    return;
+  }
+  bitWriter writer(out);
+  uint64_t previous;
+  memcpy(&previous, values, sizeof(previous));
+  writer.put(previous, 64);
+  unsigned leading = 64, trailing = 0;
+  for (size_t i = 1; i < count; i++) {
+    uint64_t current;
+    memcpy(&current, values + i, sizeof(current));
+    uint64_t difference = current ^ previous;
+    previous = current;
+    if (difference == 0) {
+      writer.put(0, 1);
+      continue;
+    }
+    unsigned zeros = (unsigned)__builtin_clzll(difference);
+    unsigned newLeading = zeros < 31 ? zeros : 31;
+    unsigned newTrailing = (unsigned)__builtin_ctzll(difference);
+    if (newLeading >= leading && newTrailing >= trailing) {
+      writer.put(2, 2);
+      writer.put(difference >> trailing, 64 - leading - trailing);
+    } else {
+      unsigned significant = 64 - newLeading - newTrailing;
+      writer.put(3, 2);
+      writer.put(newLeading, 5);
+      writer.put(significant & 63, 6);
+      writer.put(difference >> newTrailing, significant);
+      leading = newLeading;
+      trailing = newTrailing;
+    }
+  }
+  writer.flush();
+}
+
+bool decodeReadings(const uint8_t *in, size_t bytes, double *values,
+                    size_t count) {
+  if (count == 0) {
+    return true;
+  }
+  bitReader reader(in, bytes);
+  uint64_t previous, bit, bits;
+  if (!reader.get(64, previous)) {
+    return false;
+  }
+  memcpy(values, &previous, sizeof(previous));
+  unsigned leading = 64, trailing = 0;
+  for (size_t i = 1; i < count; i++) {
+    if (!reader.get(1, bit)) {
+      return false;
+    }
+    if (bit) {
+      if (!reader.get(1, bit)) {
+        return false;
+      }
+      if (bit) {
+        uint64_t newLeading, significant;
+        if (!reader.get(5, newLeading) || !reader.get(6, significant)) {
+          return false;
+        }
+        if (significant == 0) {
+          significant = 64;
+        }
+        if (newLeading + significant > 64) {
+          return false;
+        }
+        leading = (unsigned)newLeading;
+        trailing = (unsigned)(64 - newLeading - significant);
+      } else if (leading == 64) {
+        // The encoder has not described a window yet.
+        return false;
+      }
+      if (!reader.get(64 - leading - trailing, bits)) {
+        return false;
+      }
+      previous ^= bits << trailing;
+    }
+    memcpy(values + i, &previous, sizeof(previous));
+  }
+  return true;
+}
@@ -0,0 +1,46 @@
+#ifndef SAMPLE_CODEC_H
+#define SAMPLE_CODEC_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+/*
+ * Lossless codecs for the columns the server stores. Each encodes a whole
+ * column into a self-contained byte stream, so any chunk of a file can be
+ * decoded without the ones before it.
+ *
+ *   timestamps are stored as the change in the time between readings,
+ *   which is zero when readings are evenly spaced
+ *   counts, such as samples per reading, and ADC codes are stored as the
+ *   change from the previous value
+ *   readings are stored Gorilla-style, as the bits that differ from the
+ *   previous reading, which is a single bit for a rail that holds steady
+ *
+ * Changes are zigzag encoded, so small negative changes stay small, and
+ * written as LEB128 varints of 7 bits per byte.
+ */
+
+// These append a column's stream to out.
+void encodeTimestamps(const uint64_t* values, size_t count,
+                      std::vector<uint8_t>& out);
+void encodeCounts(const uint32_t* values, size_t count,
+                  std::vector<uint8_t>& out);
+void encodeCodes(const int16_t* values, size_t count,
+                 std::vector<uint8_t>& out);
+void encodeReadings(const double* values, size_t count,
+                    std::vector<uint8_t>& out);
+
+// These decode count values from a stream of the given bytes. They return
+// false if the stream ends early or holds something the encoder cannot have
+// written.
+bool decodeTimestamps(const uint8_t* in, size_t bytes, uint64_t* values,
+                      size_t count);
+bool decodeCounts(const uint8_t* in, size_t bytes, uint32_t* values,
+                  size_t count);
+bool decodeCodes(const uint8_t* in, size_t bytes, int16_t* values,
+                 size_t count);
+bool decodeReadings(const uint8_t* in, size_t bytes, double* values,
+                    size_t count);
+
+#endif
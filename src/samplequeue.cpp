@@ -0,0 +1,81 @@
+#include "samplequeue.h"
+#include "samplesource.h"
+
+sampleQueue::sampleQueue()
+    : size(0), mask(0), tail(0), cachedHead(0), head(0) {}
+
+/**
+ * Allocates the blocks
+ *
+ * @param capacity the minimum number of blocks the ring can hold
+ * @param blockSize the number of values each block can hold
+ * @param sampleFormat SAMPLE_FORMAT_F64 or SAMPLE_FORMAT_I16
+ */
+void sampleQueue::resize(size_t capacity, size_t blockSize,
+                         int sampleFormat) {
+  size_t count = 1;
+  while (count < capacity) {
+    count <<= 1;
+  }
+  size = blockSize;
+  mask = count - 1;
+  bool codes = sampleFormat == SAMPLE_FORMAT_I16;
+  storage.assign(codes ? 0 : count * blockSize, 0.0);
+  codeStorage.assign(codes ? count * blockSize : 0, 0);
+  blocks.resize(count);
+  for (size_t i = 0; i < count; i++) {
+    blocks[i] = {0, 0, 0, 0, 0, nullptr, nullptr};
+    if (codes) {
+      blocks[i].codes = codeStorage.data() + i * blockSize;
+    } else {
+      blocks[i].data = storage.data() + i * blockSize;
+    }
+  }
+  tail.store(0);
+  cachedHead = 0;
+  head.store(0);
+}
+
+size_t sampleQueue::blockSize() const { return size; }
+
+/**
+ * Finds the block the producer fills next. Only the producer may call this.
+ *
+ * @returns the block, or nullptr if the ring is full
+ */
+sampleBlock *sampleQueue::claim() {
+  if (blocks.empty()) {
+    return nullptr;
+  }
+  size_t currentTail = tail.load(std::memory_order_relaxed);
+  if (currentTail - cachedHead > mask) {
+    cachedHead = head.load(std::memory_order_acquire);
+    if (currentTail - cachedHead > mask) {
+      return nullptr;
+    }
+  }
+  return &blocks[currentTail & mask];
+}
+
+void sampleQueue::publish() {
+  tail.store(tail.load(std::memory_order_relaxed) + 1,
+             std::memory_order_release);
+}
+
+/**
+ * Finds the oldest queued block. Only the consumer may call this.
+ *
+ * @returns the block, or nullptr if the ring is empty
+ */
+sampleBlock *sampleQueue::front() {
+  size_t currentHead = head.load(std::memory_order_relaxed);
+  if (tail.load(std::memory_order_acquire) == currentHead) {
+    return nullptr;
+  }
+  return &blocks[currentHead & mask];
+}
+
+void sampleQueue::release() {
+  head.store(head.load(std::memory_order_relaxed) + 1,
+             std::memory_order_release);
+}
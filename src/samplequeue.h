@@ -0,0 +1,82 @@
+#ifndef SAMPLE_QUEUE_H
+#define SAMPLE_QUEUE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * One callback's worth of samples as it is passed from the acquisition
+ * callback to the writer thread
+ */
+struct sampleBlock {
+  // time the samples were read
+  uint64_t timestamp;
+  // samples per channel in data
+  long samples;
+  // samples per channel lost between the previous block and this one
+  uint64_t lost;
+  // samples per channel still waiting to be read after this block
+  uint64_t backlog;
+  // how long the callback before the one that read this block ran
+  uint64_t callbackNanos;
+  // the samples, grouped by channel, as volts in a SAMPLE_FORMAT_F64 queue
+  // and as codes in a SAMPLE_FORMAT_I16 one. The other is null.
+  double* data;
+  int16_t* codes;
+};
+
+/**
+ * A single-producer single-consumer lock-free ring of sampleBlocks whose
+ * storage is allocated once by resize(), so the ring is also the pool the
+ * blocks come from. The producer claims the next free block, fills it in
+ * place and publishes it; the consumer reads the oldest published block in
+ * place and releases it. Neither side copies a block or allocates.
+ */
+class sampleQueue {
+ public:
+  sampleQueue();
+
+  // This makes room for capacity blocks of blockSize values each in the given
+  // sample format, rounding capacity up to the next power of two, and forgets
+  // every queued block. It must not be called while either side is using the
+  // queue.
+  void resize(size_t capacity, size_t blockSize, int sampleFormat);
+
+  // This returns the number of values each block can hold.
+  size_t blockSize() const;
+
+  // This returns the next free block for the producer to fill, or nullptr if
+  // every block is queued.
+  sampleBlock* claim();
+
+  // This queues the block returned by the last claim().
+  void publish();
+
+  // This returns the oldest queued block, or nullptr if there is none.
+  sampleBlock* front();
+
+  // This returns the block returned by front() to the pool.
+  void release();
+
+ private:
+  std::vector<sampleBlock> blocks;
+  std::vector<double> storage;
+  std::vector<int16_t> codeStorage;
+  size_t size;
+  size_t mask;
+
+  // The producer and consumer indices are kept on separate cache lines so the
+  // two threads do not bounce a shared line on every block.
+  char padding0[64];
+  std::atomic<size_t> tail;
+  // This is the producer's last view of head, refreshed only when the ring
+  // looks full.
+  size_t cachedHead;
+  char padding1[64];
+  std::atomic<size_t> head;
+  char padding2[64];
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include "samplesource.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+// This is the code of a full-scale reading in a pacedSource, the largest a
+// 16-bit ADC gives.
+#define PACED_FULL_SCALE_CODE 32768.0
+
+// This sleeps for a mocked operation.
+static void simulate(uint64_t microseconds) {
+  if (microseconds > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+  }
+}
+
+pacedSource::pacedSource() : position(0), lost(0), running(false) {}
+
+pacedSource::~pacedSource() { stop(); }
+
+bool pacedSource::configure(const sampleSourceConfig &newConfig,
+                            const samplesReadyCallback &callback) {
+  if (newConfig.sampleClockRate <= 0.0 || newConfig.samplesPerCallback == 0) {
+    std::cerr << "Sample source needs a positive rate and callback size"
+              << std::endl;
+    return false;
+  }
+  if (newConfig.inputRange <= 0.0) {
+    std::cerr << "Sample source needs a positive input range" << std::endl;
+    return false;
+  }
+  config = newConfig;
+  onSamples = callback;
+  scratch.clear();
+  if (config.sampleFormat == SAMPLE_FORMAT_I16) {
+    scratch.resize(std::max(config.bufferSamples, config.samplesPerCallback) *
+                   config.numChannels);
+  }
+  return true;
+}
+
+bool pacedSource::commit() { return true; }
+
+bool pacedSource::start() {
+  if (thread.joinable()) {
+    return true;
+  }
+
+  started = std::chrono::steady_clock::now();
+  position = 0;
+  lost = 0;
+  running = true;
+  thread = std::thread([this]() {
+    // The interval is rounded up so the clock has always produced a full
+    // callback's worth of samples when the callback reads them.
+    auto interval = std::chrono::nanoseconds((uint64_t)ceil(
+        config.samplesPerCallback * 1e9 / config.sampleClockRate));
+    auto next = started + interval;
+    std::unique_lock<std::mutex> lock(runningLock);
+    while (running) {
+      if (wake.wait_until(lock, next) == std::cv_status::no_timeout) {
+        continue;
+      }
+      next += interval;
+      // The callback may stop the source, so it runs without the lock.
+      lock.unlock();
+      if (onSamples) {
+        onSamples();
+      }
+      lock.lock();
+    }
+  });
+  return true;
+}
+
+bool pacedSource::stop() {
+  if (!thread.joinable()) {
+    return true;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(runningLock);
+    running = false;
+  }
+  wake.notify_all();
+  // The callback can stop the source it is running on, and must not wait for
+  // itself.
+  if (std::this_thread::get_id() == thread.get_id()) {
+    thread.detach();
+  } else {
+    thread.join();
+  }
+  return true;
+}
+
+void pacedSource::clear() {
+  stop();
+  onSamples = nullptr;
+}
+
+/**
+ * Hands out the samples produced since the last read
+ *
+ * @param data where the samples go, grouped by channel
+ * @param size the number of values data can hold
+ * @returns the number of samples per channel
+ */
+long pacedSource::read(double *data, size_t size) {
+  if (config.numChannels == 0) {
+    return 0;
+  }
+  uint64_t now = produced();
+  if (now <= position) {
+    return 0;
+  }
+
+  // A reader that falls behind loses the oldest samples, as it would once a
+  // driver's buffer wrapped.
+  if (config.bufferSamples > 0 && now - position > config.bufferSamples) {
+    lost += now - config.bufferSamples - position;
+    position = now - config.bufferSamples;
+  }
+  size_t samples = (size_t)std::min<uint64_t>(now - position,
+                                              size / config.numChannels);
+  if (samples == 0) {
+    return 0;
+  }
+  size_t written = generate(data, samples, position);
+  position += written;
+  return (long)written;
+}
+
+uint64_t pacedSource::produced() {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - started;
+  return (uint64_t)(elapsed.count() * config.sampleClockRate);
+}
+
+long pacedSource::available() {
+  uint64_t now = produced();
+  uint64_t waiting = now > position ? now - position : 0;
+  if (config.bufferSamples > 0) {
+    waiting = std::min<uint64_t>(waiting, config.bufferSamples);
+  }
+  return (long)waiting;
+}
+
+uint64_t pacedSource::lostSamples() { return lost; }
+
+/**
+ * Hands out the samples produced since the last read as codes
+ *
+ * @param data where the codes go, grouped by channel
+ * @param size the number of values data can hold
+ * @returns the number of samples per channel
+ */
+long pacedSource::readCodes(int16_t *data, size_t size) {
+  long samples = read(scratch.data(), std::min(size, scratch.size()));
+  double perVolt = PACED_FULL_SCALE_CODE / config.inputRange;
+  size_t count = samples > 0 ? (size_t)samples * config.numChannels : 0;
+  for (size_t i = 0; i < count; i++) {
+    // Readings past the range clip, and the rest round to the nearest code.
+    double code = std::min(std::max(scratch[i] * perVolt,
+                                    -PACED_FULL_SCALE_CODE),
+                           PACED_FULL_SCALE_CODE - 1.0);
+    data[i] = (int16_t)(code >= 0.0 ? code + 0.5 : code - 0.5);
+  }
+  return samples;
+}
+
+bool pacedSource::scaling(std::vector<double> &coefficients) {
+  coefficients.assign(config.numChannels * SAMPLE_SCALING_COEFFS, 0.0);
+  for (size_t i = 0; i < config.numChannels; i++) {
+    coefficients[i * SAMPLE_SCALING_COEFFS + 1] =
+        config.inputRange / PACED_FULL_SCALE_CODE;
+  }
+  return true;
+}
+
+mockSource::mockSource(double reading) : reading(reading) {}
+
+mockSource::~mockSource() { stop(); }
+
+bool mockSource::configure(const sampleSourceConfig &newConfig,
+                           const samplesReadyCallback &callback) {
+  configures++;
+  simulate(latency.configure);
+  return pacedSource::configure(newConfig, callback);
+}
+
+bool mockSource::commit() {
+  commits++;
+  simulate(latency.commit);
+  return pacedSource::commit();
+}
+
+bool mockSource::start() {
+  if (active) {
+    return true;
+  }
+  starts++;
+  simulate(latency.start);
+  active = true;
+  return pacedSource::start();
+}
+
+bool mockSource::stop() {
+  if (!active) {
+    return true;
+  }
+  stops++;
+  simulate(latency.stop);
+  active = false;
+  return pacedSource::stop();
+}
+
+void mockSource::clear() {
+  stop();
+  clears++;
+  simulate(latency.clear);
+  pacedSource::clear();
+}
+
+size_t mockSource::generate(double *data, size_t samples, uint64_t position) {
+  std::fill(data, data + samples * config.numChannels, reading);
+  return samples;
+}
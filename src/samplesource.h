@@ -0,0 +1,218 @@
+#ifndef SAMPLE_SOURCE_H
+#define SAMPLE_SOURCE_H
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// These are the forms a source can read samples in: volts as doubles, or the
+// device's unscaled 16-bit ADC codes, which take a quarter of the memory and
+// are turned into volts later with the source's scaling().
+#define SAMPLE_FORMAT_F64 0
+#define SAMPLE_FORMAT_I16 1
+
+// This is the number of coefficients of the polynomial that turns a code into
+// volts, lowest order first.
+#define SAMPLE_SCALING_COEFFS 4
+
+// This is the default input range in volts, which channels read from
+// -range to +range.
+#define SAMPLE_INPUT_RANGE 10.0
+
+/**
+ * How a sampleSource should acquire
+ */
+struct sampleSourceConfig {
+  // Description of the channels being used, such as "cDAQ1Mod1/ai0:7"
+  std::string channelDescription;
+  // Number of channels being used
+  size_t numChannels;
+  // Samples per second on each channel
+  double sampleClockRate;
+  // Samples per channel between callbacks
+  size_t samplesPerCallback;
+  // Samples per channel the driver buffers
+  size_t bufferSamples;
+  // Largest voltage either side of zero the channels read
+  double inputRange = SAMPLE_INPUT_RANGE;
+  // Whether read() or readCodes() is used, SAMPLE_FORMAT_F64 or
+  // SAMPLE_FORMAT_I16
+  int sampleFormat = SAMPLE_FORMAT_F64;
+};
+
+// This is called by a running source each time samplesPerCallback samples
+// per channel are ready to read. It runs on a thread owned by the source.
+typedef std::function<void()> samplesReadyCallback;
+
+/**
+ * The hardware-facing part of a meter. Setting a task up is split the same
+ * way DAQmx splits it: configure() describes the channels and timing, commit()
+ * does the slow verification and reservation, and start() and stop() only arm
+ * and disarm the acquisition, so a committed task can be started and stopped
+ * any number of times. clear() releases everything configure() set up.
+ *
+ * Every method except read() is called from one thread. read() is called
+ * from the callback.
+ */
+class sampleSource {
+ public:
+  virtual ~sampleSource() {}
+
+  // This sets up the channels, timing and callback. It returns false on error.
+  virtual bool configure(const sampleSourceConfig& config,
+                         const samplesReadyCallback& onSamples) = 0;
+
+  // This verifies and reserves the configured task so start() is quick.
+  virtual bool commit() = 0;
+
+  // This starts acquiring.
+  virtual bool start() = 0;
+
+  // This stops acquiring. The task stays committed.
+  virtual bool stop() = 0;
+
+  // This releases the task. configure() must be called before it is used
+  // again.
+  virtual void clear() = 0;
+
+  // This reads the available samples into data, grouped by channel, and
+  // returns the number of samples per channel, or -1 on error. size is the
+  // number of values data can hold, and samples that do not fit are left for
+  // the next read.
+  virtual long read(double* data, size_t size) = 0;
+
+  // This reads the available samples as ADC codes in the same way, when the
+  // source is configured for SAMPLE_FORMAT_I16.
+  virtual long readCodes(int16_t* data, size_t size) = 0;
+
+  // This sets coefficients to SAMPLE_SCALING_COEFFS coefficients per channel
+  // that turn the channel's codes into volts. It returns false if the
+  // configured task has no scaling to give.
+  virtual bool scaling(std::vector<double>& coefficients) = 0;
+
+  // This returns the number of samples per channel waiting to be read, or -1
+  // on error.
+  virtual long available() = 0;
+
+  // This returns the number of samples per channel lost since the source was
+  // started because they were overwritten before they were read.
+  virtual uint64_t lostSamples() = 0;
+};
+
+/**
+ * A sampleSource without hardware that makes up its samples. A thread calls
+ * back every samplesPerCallback samples at the configured rate, and read()
+ * hands out the samples the clock has produced since the last read, capped at
+ * the buffer size the way a driver's ring buffer would be. Subclasses only
+ * fill in the samples. Codes are the samples quantized linearly over the
+ * input range, the way a 16-bit ADC would.
+ */
+class pacedSource : public sampleSource {
+ public:
+  pacedSource();
+  // Subclasses stop the source in their destructors, since the thread calls
+  // generate().
+  virtual ~pacedSource();
+
+  bool configure(const sampleSourceConfig& config,
+                 const samplesReadyCallback& onSamples);
+  bool commit();
+  bool start();
+  bool stop();
+  void clear();
+  long read(double* data, size_t size);
+  long readCodes(int16_t* data, size_t size);
+  bool scaling(std::vector<double>& coefficients);
+  long available();
+  uint64_t lostSamples();
+
+ protected:
+  sampleSourceConfig config;
+
+  // This writes samples per channel into data, grouped by channel, starting
+  // at sample number position of the acquisition. It returns how many it
+  // wrote, which can be fewer than asked for, and the groups are that many
+  // samples apart.
+  virtual size_t generate(double* data, size_t samples, uint64_t position) = 0;
+
+ private:
+  samplesReadyCallback onSamples;
+
+  // This is the time start() was called and the number of samples per
+  // channel handed out since.
+  std::chrono::steady_clock::time_point started;
+  uint64_t position;
+  // This is the number of samples per channel skipped because the reader fell
+  // more than a buffer behind.
+  uint64_t lost;
+
+  // This returns the number of samples per channel the clock has produced.
+  uint64_t produced();
+
+  // This holds the samples readCodes() quantizes.
+  std::vector<double> scratch;
+
+  // This calls onSamples while running is set. stop() signals wake so it does
+  // not wait out the interval between callbacks.
+  std::thread thread;
+  bool running;
+  std::mutex runningLock;
+  std::condition_variable wake;
+};
+
+/**
+ * How long each operation of a mockSource takes, in microseconds
+ */
+struct mockLatency {
+  uint64_t configure;
+  uint64_t commit;
+  uint64_t start;
+  uint64_t stop;
+  uint64_t clear;
+};
+
+/**
+ * A pacedSource with every channel reading a constant value, which can be made
+ * to take as long as a driver would for each operation. It counts the
+ * operations so tests and benchmarks can check which ones a session paid for.
+ */
+class mockSource : public pacedSource {
+ public:
+  // how long each operation sleeps for
+  mockLatency latency = {0, 0, 0, 0, 0};
+
+  // how many times each operation was called
+  uint64_t configures = 0;
+  uint64_t commits = 0;
+  uint64_t starts = 0;
+  uint64_t stops = 0;
+  uint64_t clears = 0;
+
+  // This creates a source whose channels all read reading.
+  mockSource(double reading);
+  ~mockSource();
+
+  bool configure(const sampleSourceConfig& config,
+                 const samplesReadyCallback& onSamples);
+  bool commit();
+  bool start();
+  bool stop();
+  void clear();
+
+ protected:
+  size_t generate(double* data, size_t samples, uint64_t position);
+
+ private:
+  double reading;
+  // This is set between start() and stop(), so repeated calls are not
+  // counted.
+  bool active = false;
+};
+
+#endif
@@ -1,10 +1,69 @@
+#include <signal.h>
+#include <memory>
 #include <thread>
+#include "channelstats.h"
 #include "functionapi.h"
 #include "nidaqmxeventhandler.h"
+#include "replaysource.h"
+#include "syntheticsource.h"
+#ifndef POWERPACK_NO_NIDAQMX
+#include "nidaqmxsource.h"
+#endif
 
+// This is the server that SIGINT and SIGTERM stop.
+static socketServer* runningServer = nullptr;
+
+// This makes serve() return, which ends any open sessions so their logs are
+// written.
+static void stopServer(int signalNumber) {
+  if (runningServer) {
+    runningServer->stop();
+  }
+}
+
+/**
+ * Creates the source named by the "source" key: nidaqmx (the default),
+ * synthetic or replay.
+ *
+ * @returns the source, or nullptr if it is unknown or not built in
+ */
+static sampleSource* createSource(Configuration& configuration) {
+  std::string name = configuration.get("source", "nidaqmx");
+  if (name == "synthetic") {
+    syntheticWaveform waveform;
+    waveform.level = stod(configuration.get(
+        "syntheticLevel", std::to_string(waveform.level)));
+    waveform.stepLevel = stod(configuration.get(
+        "syntheticStepLevel", std::to_string(waveform.stepLevel)));
+    waveform.stepPeriodMs = stod(configuration.get(
+        "syntheticStepPeriodMs", std::to_string(waveform.stepPeriodMs)));
+    waveform.noise = stod(configuration.get(
+        "syntheticNoise", std::to_string(waveform.noise)));
+    waveform.seed = (uint32_t)stoul(configuration.get(
+        "syntheticSeed", std::to_string(waveform.seed)));
+    return new syntheticSource(waveform);
+  }
+  if (name == "replay") {
+    return new replaySource(configuration.get("replayFile"),
+                            configuration.get("replayLoop", "1") != "0");
+  }
+  if (name == "nidaqmx") {
+#ifdef POWERPACK_NO_NIDAQMX
+    std::cerr << "This server was built without NIDAQmx" << std::endl;
+    return nullptr;
+#else
+    return new nidaqmxSource();
+#endif
+  }
+  std::cerr << "Unknown sample source " << name << std::endl;
+  return nullptr;
+}
 
 /**
  * Read server config info from configFile and initialize a server. Used as basic test of powerpack functionality
+ *
+ * The acquisition runs until the server is interrupted, and every client
+ * session is logged to "<output file>.<session ID>".
  */ 
 int main(int argc, char** argv) {
   if (argc != 3) {
@@ -13,19 +72,42 @@ int main(int argc, char** argv) {
     exit(EXIT_FAILURE);
   }
   std::string configFile(argv[1]);
-  NIDAQmxEventHandler niHandler(argv[2]);
+  Configuration configuration = Configuration(configFile);
+  std::unique_ptr<sampleSource> meter(createSource(configuration));
+  if (!meter) {
+    exit(EXIT_FAILURE);
+  }
+  NIDAQmxEventHandler niHandler(argv[2], meter.get());
   eventHandler* handler;
   handler = &niHandler;
-  Configuration configuration = Configuration(configFile);
 
   niHandler.configure(configuration);
 
   uint16_t port = stoi(configuration.get("port"), nullptr, 10);
 
   std::cout << configuration.toString();
+  std::cout << "Sampling " << niHandler.config.numChannels << " channels at "
+            << niHandler.config.sampleClockRate << " samples per second, "
+            << niHandler.config.samplesPerCallback << " per callback, with "
+            << niHandler.config.bufferSamples << " buffered" << std::endl;
+  std::cout << "Reducing sample blocks with the " << bestChannelStats().name
+            << " kernel" << std::endl;
 
   socketServer server = initializeMeterServer(port, handler);
-  server.listenForClient();
+
+  // The acquisition is started once, so sessions do not wait for the task to
+  // be created.
+  if (!niHandler.startAcquisition()) {
+    exit(EXIT_FAILURE);
+  }
+
+  runningServer = &server;
+  signal(SIGINT, stopServer);
+  signal(SIGTERM, stopServer);
+  server.serve();
+  runningServer = nullptr;
+
+  niHandler.stopAcquisition();
 
   return 0;
 }
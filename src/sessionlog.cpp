@@ -0,0 +1,799 @@
+#include "sessionlog.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include "samplecodec.h"
+
+// This rounds a size up to a multiple of 8 bytes.
+static uint64_t paddedBytes(uint64_t bytes) {
+  return (bytes + 7) & ~(uint64_t)7;
+}
+
+// This is the size of the columns of a plain chunk of rows.
+static uint64_t columnBytes(uint64_t rows, uint64_t numChannels) {
+  return rows * sizeof(uint64_t) + paddedBytes(rows * sizeof(uint32_t)) +
+         numChannels * rows * sizeof(double);
+}
+
+// These frame a compressed column with its byte count. beginColumn leaves
+// room for the count and endColumn fills it in.
+static size_t beginColumn(std::vector<uint8_t> &stream) {
+  stream.resize(stream.size() + sizeof(uint32_t));
+  return stream.size();
+}
+
+static void endColumn(std::vector<uint8_t> &stream, size_t start) {
+  uint32_t bytes = (uint32_t)(stream.size() - start);
+  memcpy(stream.data() + start - sizeof(bytes), &bytes, sizeof(bytes));
+}
+
+/**
+ * Works out the running sum of each channel's energy over the rows of a chunk
+ *
+ * @param span the chunk's rows
+ * @param from the start of the first row's interval
+ * @param numChannels the number of channels
+ * @param sums set to the joules of each channel up to the end of each row,
+ * grouped by channel
+ */
+static void runningSums(const sessionLogSpan &span, uint64_t from,
+                        size_t numChannels, double *sums) {
+  for (size_t channel = 0; channel < numChannels; channel++) {
+    const double *power = span.channel(channel);
+    double *sum = sums + channel * span.rows;
+    double joules = 0.0;
+    uint64_t previous = from;
+    for (size_t row = 0; row < span.rows; row++) {
+      uint64_t timestamp = span.timestamps[row];
+      if (timestamp > previous) {
+        joules += power[row] * (double)(timestamp - previous) * 1e-9;
+        previous = timestamp;
+      }
+      sum[row] = joules;
+    }
+  }
+}
+
+void sessionLogWriter::put(const void *data, size_t bytes) {
+  file.write((const char *)data, (std::streamsize)bytes);
+  position += bytes;
+}
+
+void sessionLogWriter::align() {
+  static const char padding[8] = {0};
+  put(padding, paddedBytes(position) - position);
+}
+
+/**
+ * Creates a binary session log
+ *
+ * @param path the file
+ * @param header the session's settings
+ * @param voltages the voltage of each channel
+ * @param scaling each channel's scaling polynomial, for SAMPLE_FORMAT_I16
+ * @param description the channel description
+ * @param compressChunks whether to compress chunks
+ * @returns true if the file was created
+ */
+bool sessionLogWriter::open(const std::string &path, sessionLogHeader header,
+                            const double *voltages, const double *scaling,
+                            const std::string &description,
+                            bool compressChunks) {
+  file.open(path, std::fstream::out | std::fstream::binary |
+                      std::fstream::trunc);
+  if (!file.is_open()) {
+    std::cerr << "Could not create session log " << path << std::endl;
+    return false;
+  }
+  header.magic = SESSION_LOG_MAGIC;
+  header.version = SESSION_LOG_VERSION;
+  header.chunkRows = SESSION_LOG_CHUNK_ROWS;
+  header.descriptionBytes = (uint32_t)description.size();
+  numChannels = header.numChannels;
+  compress = compressChunks;
+  position = 0;
+  lastTimestamp = 0;
+  rows = 0;
+  index.clear();
+  energyStart = UINT64_MAX;
+  coveredTo = 0;
+  joules.assign(numChannels, 0.0);
+  energyTable.clear();
+
+  put(&header, sizeof(header));
+  put(voltages, numChannels * sizeof(double));
+  if (header.sampleFormat == SAMPLE_FORMAT_I16) {
+    put(scaling, numChannels * SAMPLE_SCALING_COEFFS * sizeof(double));
+  }
+  put(description.data(), description.size());
+  align();
+
+  timestamps.clear();
+  timestamps.reserve(SESSION_LOG_CHUNK_ROWS);
+  samples.clear();
+  samples.reserve(SESSION_LOG_CHUNK_ROWS);
+  power.assign(numChannels * SESSION_LOG_CHUNK_ROWS, 0.0);
+  return true;
+}
+
+void sessionLogWriter::append(uint64_t timestamp, uint32_t samplesRead,
+                              const double *channels) {
+  timestamp = std::max(timestamp, lastTimestamp);
+  lastTimestamp = timestamp;
+  size_t row = timestamps.size();
+  timestamps.push_back(timestamp);
+  samples.push_back(samplesRead);
+  for (uint32_t channel = 0; channel < numChannels; channel++) {
+    power[channel * SESSION_LOG_CHUNK_ROWS + row] = channels[channel];
+  }
+  if (timestamps.size() == SESSION_LOG_CHUNK_ROWS) {
+    writeChunk();
+  }
+}
+
+void sessionLogWriter::coverFrom(uint64_t timestamp) {
+  energyStart = timestamp;
+}
+
+/**
+ * Writes the rows gathered so far as a chunk and notes it in the index and
+ * the energy table. The chunk is written plain if compressing it would not
+ * make it smaller.
+ */
+void sessionLogWriter::writeChunk() {
+  uint32_t count = (uint32_t)timestamps.size();
+  if (count == 0) {
+    return;
+  }
+  sessionLogChunkHeader chunk = {SESSION_LOG_CHUNK_MAGIC,
+                                 count,
+                                 timestamps.front(),
+                                 timestamps.back(),
+                                 SESSION_LOG_PLAIN,
+                                 (uint32_t)columnBytes(count, numChannels)};
+  index.push_back(
+      {position, chunk.firstTimestamp, chunk.lastTimestamp, count, 0});
+
+  if (index.size() == 1) {
+    energyStart = std::min(energyStart, chunk.firstTimestamp);
+    coveredTo = energyStart;
+  }
+  energyTable.insert(energyTable.end(), joules.begin(), joules.end());
+  for (uint32_t channel = 0; channel < numChannels; channel++) {
+    const double *column = power.data() + channel * SESSION_LOG_CHUNK_ROWS;
+    uint64_t previous = coveredTo;
+    for (uint32_t row = 0; row < count; row++) {
+      if (timestamps[row] > previous) {
+        joules[channel] +=
+            column[row] * (double)(timestamps[row] - previous) * 1e-9;
+        previous = timestamps[row];
+      }
+    }
+  }
+  coveredTo = chunk.lastTimestamp;
+
+  if (compress) {
+    encoded.clear();
+    size_t start = beginColumn(encoded);
+    encodeTimestamps(timestamps.data(), count, encoded);
+    endColumn(encoded, start);
+    start = beginColumn(encoded);
+    encodeCounts(samples.data(), count, encoded);
+    endColumn(encoded, start);
+    for (uint32_t channel = 0; channel < numChannels; channel++) {
+      start = beginColumn(encoded);
+      encodeReadings(power.data() + channel * SESSION_LOG_CHUNK_ROWS, count,
+                     encoded);
+      endColumn(encoded, start);
+    }
+    if (encoded.size() < chunk.bytes) {
+      chunk.encoding = SESSION_LOG_COMPRESSED;
+      chunk.bytes = (uint32_t)encoded.size();
+    }
+  }
+
+  put(&chunk, sizeof(chunk));
+  if (chunk.encoding == SESSION_LOG_COMPRESSED) {
+    put(encoded.data(), encoded.size());
+    align();
+  } else {
+    put(timestamps.data(), count * sizeof(uint64_t));
+    put(samples.data(), count * sizeof(uint32_t));
+    align();
+    for (uint32_t channel = 0; channel < numChannels; channel++) {
+      put(power.data() + channel * SESSION_LOG_CHUNK_ROWS,
+          count * sizeof(double));
+    }
+  }
+  rows += count;
+  timestamps.clear();
+  samples.clear();
+}
+
+/**
+ * Finishes a binary session log
+ *
+ * @param tags the session's tags and regions
+ * @param names the handler whose string table the tag IDs refer to
+ * @param health how well the acquisition kept up over the session
+ */
+void sessionLogWriter::close(const std::vector<tagEvent> &tags,
+                             eventHandler &names,
+                             const acquisitionHealth &health) {
+  if (!file.is_open()) {
+    return;
+  }
+  writeChunk();
+  sessionLogFooter footer;
+  footer.rows = rows;
+  footer.gaps = health.gaps;
+  footer.lostSamples = health.lostSamples;
+  footer.lateReads = health.lateReads;
+  footer.maxBacklog = health.maxBacklog;
+  footer.maxCallbackNanos = health.maxCallbackNanos;
+  footer.largestRead = health.largestRead;
+  footer.reserved = 0;
+  footer.magic = SESSION_LOG_MAGIC;
+
+  // Tags from different client threads arrive interleaved, so they are put in
+  // time order for the reader to search.
+  std::vector<sessionLogTag> table;
+  table.reserve(tags.size());
+  std::map<uint32_t, const std::string *> strings;
+  for (const tagEvent &tag : tags) {
+    table.push_back({tag.timestamp, tag.tagID, tag.kind, tag.threadID,
+                     tag.cpu});
+    strings[tag.tagID] = nullptr;
+  }
+  std::stable_sort(table.begin(), table.end(),
+                   [](const sessionLogTag &a, const sessionLogTag &b) {
+                     return a.timestamp < b.timestamp;
+                   });
+  footer.tagOffset = position;
+  footer.tags = table.size();
+  put(table.data(), table.size() * sizeof(sessionLogTag));
+
+  footer.nameOffset = position;
+  footer.names = strings.size();
+  uint64_t offset = position + strings.size() * sizeof(sessionLogName);
+  for (auto &entry : strings) {
+    entry.second = &names.tagName(entry.first);
+    sessionLogName name = {entry.first, (uint32_t)entry.second->size(),
+                           offset};
+    put(&name, sizeof(name));
+    offset += name.length;
+  }
+  for (auto &entry : strings) {
+    put(entry.second->data(), entry.second->size());
+  }
+  align();
+
+  footer.indexOffset = position;
+  footer.chunks = index.size();
+  put(index.data(), index.size() * sizeof(sessionLogChunk));
+  uint64_t start = energyStart == UINT64_MAX ? 0 : energyStart;
+  put(&start, sizeof(start));
+  put(energyTable.data(), energyTable.size() * sizeof(double));
+  put(joules.data(), joules.size() * sizeof(double));
+  put(&footer, sizeof(footer));
+  file.close();
+}
+
+/**
+ * Maps a binary session log
+ *
+ * @param path the file
+ * @returns true if the file is a session log this reader understands
+ */
+bool sessionLogReader::open(const std::string &path) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    std::cerr << "Could not open session log " << path << std::endl;
+    return false;
+  }
+  struct stat status;
+  if (fstat(fd, &status) == -1 ||
+      (size_t)status.st_size < sizeof(sessionLogHeader)) {
+    std::cerr << path << " is not a session log" << std::endl;
+    ::close(fd);
+    return false;
+  }
+  mappingSize = (size_t)status.st_size;
+  void *mapped = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    std::cerr << "Could not map session log " << path << std::endl;
+    mappingSize = 0;
+    return false;
+  }
+  mapping = (const char *)mapped;
+
+  memcpy(&header, mapping, sizeof(header));
+  if (header.magic != SESSION_LOG_MAGIC) {
+    std::cerr << path << " is not a session log" << std::endl;
+    close();
+    return false;
+  }
+  if (header.version < SESSION_LOG_MIN_VERSION ||
+      header.version > SESSION_LOG_VERSION) {
+    std::cerr << path << " is session log version " << header.version
+              << ", but only versions " << SESSION_LOG_MIN_VERSION << " to "
+              << SESSION_LOG_VERSION << " can be read" << std::endl;
+    close();
+    return false;
+  }
+
+  uint64_t offset = sizeof(header);
+  uint64_t voltageBytes = (uint64_t)header.numChannels * sizeof(double);
+  uint64_t scalingBytes = header.sampleFormat == SAMPLE_FORMAT_I16
+                              ? voltageBytes * SAMPLE_SCALING_COEFFS
+                              : 0;
+  uint64_t firstChunk = paddedBytes(offset + voltageBytes + scalingBytes +
+                                    header.descriptionBytes);
+  if (header.chunkRows == 0 || firstChunk > mappingSize) {
+    std::cerr << path << " is cut off in its header" << std::endl;
+    close();
+    return false;
+  }
+  channelVoltages = (const double *)(mapping + offset);
+  offset += voltageBytes;
+  if (scalingBytes > 0) {
+    scalingCoeffs = (const double *)(mapping + offset);
+    offset += scalingBytes;
+  }
+  description.assign(mapping + offset, header.descriptionBytes);
+
+  if (!readIndex(path, firstChunk)) {
+    scanChunks(firstChunk);
+    sumEnergy();
+    std::cerr << path << " has no chunk index, so it was cut off. Reading its "
+              << index.size() << " whole chunks" << std::endl;
+  }
+  decoded.resize(index.size());
+  runningEnergy.resize(index.size());
+  return true;
+}
+
+/**
+ * Reads the header of a chunk
+ *
+ * @param offset where the chunk starts
+ * @param chunk the header
+ * @returns false if there is no chunk header at offset
+ */
+bool sessionLogReader::chunkHeader(uint64_t offset,
+                                   sessionLogChunkHeader &chunk) const {
+  if (offset % 8 != 0 || offset > mappingSize ||
+      sizeof(chunk) > mappingSize - offset) {
+    return false;
+  }
+  memcpy(&chunk, mapping + offset, sizeof(chunk));
+  return chunk.magic == SESSION_LOG_CHUNK_MAGIC;
+}
+
+// This is the size of a chunk in the file, including its header.
+uint64_t sessionLogReader::storedBytes(
+    const sessionLogChunkHeader &chunk) const {
+  return sizeof(sessionLogChunkHeader) + paddedBytes(chunk.bytes);
+}
+
+/**
+ * Checks that a chunk lies within the file and starts with a chunk header
+ *
+ * @param offset where the chunk starts
+ * @param rows the rows the chunk should hold
+ * @returns true if the chunk can be used
+ */
+bool sessionLogReader::validChunk(uint64_t offset, uint32_t rows) const {
+  sessionLogChunkHeader chunk;
+  if (!chunkHeader(offset, chunk) || chunk.rows != rows || rows == 0 ||
+      rows > header.chunkRows ||
+      storedBytes(chunk) > mappingSize - offset) {
+    return false;
+  }
+  if (chunk.encoding == SESSION_LOG_PLAIN) {
+    return chunk.bytes == columnBytes(rows, header.numChannels);
+  }
+  return chunk.encoding == SESSION_LOG_COMPRESSED;
+}
+
+/**
+ * Reads the footer, chunk index, tag table and energy table
+ *
+ * @param path the file, for messages
+ * @param firstChunk where the first chunk starts
+ * @returns false if the file does not end with a footer, or what it locates
+ * is damaged
+ */
+bool sessionLogReader::readIndex(const std::string &path,
+                                 uint64_t firstChunk) {
+  if (mappingSize < firstChunk + sizeof(sessionLogFooter)) {
+    return false;
+  }
+  sessionLogFooter footer;
+  memcpy(&footer, mapping + mappingSize - sizeof(footer), sizeof(footer));
+  uint64_t end = mappingSize - sizeof(footer);
+  if (footer.magic != SESSION_LOG_MAGIC || footer.indexOffset > end ||
+      footer.chunks > (end - footer.indexOffset) / sizeof(sessionLogChunk) ||
+      footer.tagOffset > end ||
+      footer.tags > (end - footer.tagOffset) / sizeof(sessionLogTag) ||
+      footer.nameOffset > end ||
+      footer.names > (end - footer.nameOffset) / sizeof(sessionLogName)) {
+    return false;
+  }
+
+  const sessionLogChunk *chunks =
+      (const sessionLogChunk *)(mapping + footer.indexOffset);
+  index.assign(chunks, chunks + footer.chunks);
+  totalRows = 0;
+  for (const sessionLogChunk &chunk : index) {
+    if (!validChunk(chunk.offset, chunk.rows)) {
+      std::cerr << path << " has a chunk index entry for a damaged chunk"
+                << std::endl;
+      index.clear();
+      return false;
+    }
+    totalRows += chunk.rows;
+  }
+
+  uint64_t energyOffset =
+      footer.indexOffset + footer.chunks * sizeof(sessionLogChunk);
+  if (!readEnergyTable(energyOffset, end - energyOffset)) {
+    std::cerr << path << " has an energy table of the wrong size" << std::endl;
+    index.clear();
+    return false;
+  }
+
+  tagTable = (const sessionLogTag *)(mapping + footer.tagOffset);
+  tagTableSize = footer.tags;
+  names = (const sessionLogName *)(mapping + footer.nameOffset);
+  nameCount = footer.names;
+  sessionHealth.gaps = footer.gaps;
+  sessionHealth.lostSamples = footer.lostSamples;
+  sessionHealth.lateReads = footer.lateReads;
+  sessionHealth.maxBacklog = footer.maxBacklog;
+  sessionHealth.maxCallbackNanos = footer.maxCallbackNanos;
+  sessionHealth.largestRead = footer.largestRead;
+  return true;
+}
+
+/**
+ * Reads the energy table
+ *
+ * @param offset where the table starts
+ * @param bytes the bytes from there to the footer
+ * @returns false if the table is not the size the index calls for
+ */
+bool sessionLogReader::readEnergyTable(uint64_t offset, uint64_t bytes) {
+  size_t values = (index.size() + 1) * header.numChannels;
+  if (bytes != sizeof(uint64_t) + values * sizeof(double)) {
+    return false;
+  }
+  memcpy(&energyStart, mapping + offset, sizeof(energyStart));
+  const double *table = (const double *)(mapping + offset + sizeof(uint64_t));
+  chunkEnergy.assign(table, table + values);
+  return true;
+}
+
+/**
+ * Works out the energy table of a log that was cut off before it was written,
+ * going through every chunk without keeping them decoded. The first reading
+ * covers no time.
+ */
+void sessionLogReader::sumEnergy() {
+  size_t numChannels = header.numChannels;
+  energyStart = index.empty() ? 0 : index.front().firstTimestamp;
+  chunkEnergy.assign((index.size() + 1) * numChannels, 0.0);
+  std::vector<double> sums;
+  std::vector<uint64_t> columns;
+  for (size_t chunk = 0; chunk < index.size(); chunk++) {
+    const double *before = &chunkEnergy[chunk * numChannels];
+    double *after = &chunkEnergy[(chunk + 1) * numChannels];
+    sessionLogSpan span = this->chunk(chunk, columns);
+    uint64_t from = chunk == 0 ? energyStart : index[chunk - 1].lastTimestamp;
+    sums.resize(span.rows * numChannels);
+    runningSums(span, from, numChannels, sums.data());
+    for (size_t channel = 0; channel < numChannels; channel++) {
+      after[channel] = before[channel] +
+                       (span.rows > 0 ? sums[(channel + 1) * span.rows - 1]
+                                      : 0.0);
+    }
+  }
+}
+
+/**
+ * Rebuilds the chunk index of a log that was cut off by following the chunks
+ * from the first until one is missing or incomplete
+ *
+ * @param firstChunk where the first chunk starts
+ */
+void sessionLogReader::scanChunks(uint64_t firstChunk) {
+  index.clear();
+  totalRows = 0;
+  uint64_t offset = firstChunk;
+  sessionLogChunkHeader chunk;
+  while (chunkHeader(offset, chunk) && validChunk(offset, chunk.rows)) {
+    index.push_back({offset, chunk.firstTimestamp, chunk.lastTimestamp,
+                     chunk.rows, 0});
+    totalRows += chunk.rows;
+    offset += storedBytes(chunk);
+  }
+}
+
+/**
+ * Decodes a compressed chunk into the layout of a plain one
+ *
+ * @param chunk the chunk
+ * @param columns the decoded columns
+ * @returns false if the chunk is damaged
+ */
+bool sessionLogReader::decode(size_t chunk,
+                              std::vector<uint64_t> &columns) const {
+  sessionLogChunkHeader info;
+  chunkHeader(index[chunk].offset, info);
+  const uint8_t *stream = (const uint8_t *)mapping + index[chunk].offset +
+                          sizeof(sessionLogChunkHeader);
+  const uint8_t *end = stream + info.bytes;
+  uint32_t bytes = 0;
+  // This moves stream to the next column and sets bytes to its length.
+  auto nextColumn = [&stream, &end, &bytes]() {
+    stream += bytes;
+    if (end - stream < (ptrdiff_t)sizeof(bytes)) {
+      return false;
+    }
+    memcpy(&bytes, stream, sizeof(bytes));
+    stream += sizeof(bytes);
+    return bytes <= end - stream;
+  };
+
+  size_t rows = info.rows;
+  columns.assign(columnBytes(rows, header.numChannels) / sizeof(uint64_t), 0);
+  char *out = (char *)columns.data();
+  double *power = (double *)(out + rows * sizeof(uint64_t) +
+                             paddedBytes(rows * sizeof(uint32_t)));
+  if (!nextColumn() ||
+      !decodeTimestamps(stream, bytes, (uint64_t *)out, rows) ||
+      !nextColumn() ||
+      !decodeCounts(stream, bytes, (uint32_t *)(out + rows * sizeof(uint64_t)),
+                    rows)) {
+    return false;
+  }
+  for (uint32_t channel = 0; channel < header.numChannels; channel++) {
+    if (!nextColumn() ||
+        !decodeReadings(stream, bytes, power + channel * rows, rows)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+sessionLogSpan sessionLogReader::chunk(size_t chunk) const {
+  if (!compressed(chunk)) {
+    return columnSpan(chunk, plainColumns(chunk));
+  }
+  std::lock_guard<std::mutex> lock(cacheLock);
+  std::vector<uint64_t> &copy = decoded[chunk];
+  if (copy.empty() && !decode(chunk, copy)) {
+    copy.clear();
+    std::cerr << "Chunk " << chunk << " of the session log is damaged"
+              << std::endl;
+    return {nullptr, nullptr, nullptr, 0, 0};
+  }
+  return columnSpan(chunk, (const char *)copy.data());
+}
+
+sessionLogSpan sessionLogReader::chunk(size_t chunk,
+                                       std::vector<uint64_t> &columns) const {
+  if (!compressed(chunk)) {
+    return columnSpan(chunk, plainColumns(chunk));
+  }
+  if (!decode(chunk, columns)) {
+    std::cerr << "Chunk " << chunk << " of the session log is damaged"
+              << std::endl;
+    return {nullptr, nullptr, nullptr, 0, 0};
+  }
+  return columnSpan(chunk, (const char *)columns.data());
+}
+
+bool sessionLogReader::compressed(size_t chunk) const {
+  sessionLogChunkHeader info;
+  chunkHeader(index[chunk].offset, info);
+  return info.encoding == SESSION_LOG_COMPRESSED;
+}
+
+const char *sessionLogReader::plainColumns(size_t chunk) const {
+  return mapping + index[chunk].offset + sizeof(sessionLogChunkHeader);
+}
+
+/**
+ * Points a span at the columns of a chunk laid out as in a plain chunk
+ *
+ * @param chunk the chunk
+ * @param columns the start of the columns
+ * @returns every row of the chunk
+ */
+sessionLogSpan sessionLogReader::columnSpan(size_t chunk,
+                                            const char *columns) const {
+  uint32_t rows = index[chunk].rows;
+  sessionLogSpan span;
+  span.timestamps = (const uint64_t *)columns;
+  span.samples = (const uint32_t *)(columns + rows * sizeof(uint64_t));
+  span.power = (const double *)(columns + rows * sizeof(uint64_t) +
+                                paddedBytes(rows * sizeof(uint32_t)));
+  span.stride = rows;
+  span.rows = rows;
+  return span;
+}
+
+/**
+ * Finds the rows in a stretch of time. The chunk index narrows the search to
+ * the chunks that overlap it, and only those chunks' timestamps are read.
+ *
+ * @param begin the earliest timestamp to include
+ * @param end the timestamp to stop before
+ * @returns a span of the rows in each chunk, in time order
+ */
+std::vector<sessionLogSpan> sessionLogReader::range(uint64_t begin,
+                                                    uint64_t end) const {
+  std::vector<sessionLogSpan> spans;
+  auto first = std::lower_bound(
+      index.begin(), index.end(), begin,
+      [](const sessionLogChunk &chunk, uint64_t timestamp) {
+        return chunk.lastTimestamp < timestamp;
+      });
+  for (auto entry = first;
+       entry != index.end() && entry->firstTimestamp < end && begin < end;
+       ++entry) {
+    sessionLogSpan span = chunk((size_t)(entry - index.begin()));
+    const uint64_t *last = span.timestamps + span.rows;
+    size_t from = std::lower_bound(span.timestamps, last, begin) -
+                  span.timestamps;
+    size_t to = std::lower_bound(span.timestamps, last, end) -
+                span.timestamps;
+    if (to > from) {
+      span.timestamps += from;
+      span.samples += from;
+      span.power += from;
+      span.rows = to - from;
+      spans.push_back(span);
+    }
+  }
+  return spans;
+}
+
+std::pair<const sessionLogTag *, const sessionLogTag *> sessionLogReader::tags(
+    uint64_t begin, uint64_t end) const {
+  auto before = [](const sessionLogTag &tag, uint64_t timestamp) {
+    return tag.timestamp < timestamp;
+  };
+  const sessionLogTag *last = tagTable + tagTableSize;
+  const sessionLogTag *first =
+      std::lower_bound(tagTable, last, begin, before);
+  return {first,
+          std::max(first, std::lower_bound(tagTable, last, end, before))};
+}
+
+double sessionLogReader::energyBetween(uint64_t begin, uint64_t end,
+                                      double *channels) const {
+  if (channels) {
+    std::fill(channels, channels + header.numChannels, 0.0);
+  }
+  if (end <= begin) {
+    return 0.0;
+  }
+  return energyAt(end, channels, 1.0) - energyAt(begin, channels, -1.0);
+}
+
+/**
+ * Finds the joules used from the start of the first reading's interval up to
+ * a time
+ *
+ * @param timestamp the time
+ * @param channels if given, each channel's joules times sign are added to it
+ * @param sign 1 or -1
+ * @returns the joules used over every channel
+ */
+double sessionLogReader::energyAt(uint64_t timestamp, double *channels,
+                                  double sign) const {
+  size_t numChannels = header.numChannels;
+  if (index.empty() || timestamp <= energyStart) {
+    return 0.0;
+  }
+
+  // This is the chunk whose rows cover the time, since each chunk's first row
+  // covers the time since the chunk before ended.
+  auto entry = std::lower_bound(
+      index.begin(), index.end(), timestamp,
+      [](const sessionLogChunk &chunk, uint64_t time) {
+        return chunk.lastTimestamp < time;
+      });
+  size_t chunk = (size_t)(entry - index.begin());
+  const double *before = &chunkEnergy[chunk * numChannels];
+  double total = 0.0;
+  if (entry == index.end()) {
+    for (size_t channel = 0; channel < numChannels; channel++) {
+      total += before[channel];
+      if (channels) {
+        channels[channel] += sign * before[channel];
+      }
+    }
+    return total;
+  }
+
+  sessionLogSpan span = this->chunk(chunk);
+  uint64_t from = chunk == 0 ? energyStart : index[chunk - 1].lastTimestamp;
+  const double *sums = nullptr;
+  if (span.rows > 0) {
+    std::lock_guard<std::mutex> lock(cacheLock);
+    std::vector<double> &running = runningEnergy[chunk];
+    if (running.empty()) {
+      running.resize(span.rows * numChannels);
+      runningSums(span, from, numChannels, running.data());
+    }
+    sums = running.data();
+  }
+
+  // The row is the first that ends at or after the time, and the time splits
+  // its interval.
+  size_t row = std::lower_bound(span.timestamps,
+                                span.timestamps + span.rows, timestamp) -
+               span.timestamps;
+  uint64_t rowStart = row > 0 ? span.timestamps[row - 1] : from;
+  double seconds =
+      timestamp > rowStart ? (double)(timestamp - rowStart) * 1e-9 : 0.0;
+  for (size_t channel = 0; channel < numChannels; channel++) {
+    double joules = before[channel];
+    if (row < span.rows) {
+      joules += span.channel(channel)[row] * seconds;
+      if (row > 0) {
+        joules += sums[channel * span.rows + row - 1];
+      }
+    }
+    total += joules;
+    if (channels) {
+      channels[channel] += sign * joules;
+    }
+  }
+  return total;
+}
+
+std::string sessionLogReader::tagName(uint32_t tagID) const {
+  const sessionLogName *last = names + nameCount;
+  const sessionLogName *name = std::lower_bound(
+      names, last, tagID, [](const sessionLogName &entry, uint32_t id) {
+        return entry.tagID < id;
+      });
+  if (name == last || name->tagID != tagID || name->offset > mappingSize ||
+      name->length > mappingSize - name->offset) {
+    return "";
+  }
+  return std::string(mapping + name->offset, name->length);
+}
+
+void sessionLogReader::close() {
+  if (mapping) {
+    munmap((void *)mapping, mappingSize);
+  }
+  mapping = nullptr;
+  mappingSize = 0;
+  channelVoltages = nullptr;
+  scalingCoeffs = nullptr;
+  description.clear();
+  index.clear();
+  totalRows = 0;
+  tagTable = nullptr;
+  tagTableSize = 0;
+  names = nullptr;
+  nameCount = 0;
+  decoded.clear();
+  runningEnergy.clear();
+  energyStart = 0;
+  chunkEnergy.clear();
+  sessionHealth = acquisitionHealth();
+}
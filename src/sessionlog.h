@@ -0,0 +1,335 @@
+#ifndef SESSION_LOG_H
+#define SESSION_LOG_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "eventhandler.h"
+#include "samplesource.h"
+
+/*
+ * Binary session logs hold a session's readings in columns, so a tool can map
+ * the file and work on any stretch of it without parsing text. A file is
+ *
+ *   a sessionLogHeader, the voltage of each channel as doubles, in
+ *   SAMPLE_FORMAT_I16 sessions each channel's scaling polynomial
+ *   (SAMPLE_SCALING_COEFFS doubles per channel), and the channel description
+ *   padded to a multiple of 8 bytes
+ *
+ *   chunks of readings. Each is a sessionLogChunkHeader followed by columns of
+ *   its rows: the timestamps as uint64_t, the samples per channel each reading
+ *   covers as uint32_t padded to a multiple of 8 bytes, and then the power of
+ *   every channel as doubles, one column per channel. Every chunk holds
+ *   chunkRows rows except the last, which holds the rest. A compressed chunk
+ *   holds the same columns encoded with the codecs of samplecodec.h, each
+ *   as a uint32_t byte count and the stream, padded to a multiple of 8 bytes
+ *   at the end.
+ *
+ *   the tag table, the session's tags as sessionLogTag in time order, then a
+ *   sessionLogName for each tag string they use and the strings' bytes padded
+ *   to a multiple of 8 bytes
+ *
+ *   the chunk index, a sessionLogChunk for each chunk
+ *
+ *   the energy table: the time the first reading's interval starts as a
+ *   uint64_t, then for each chunk the joules each channel used before it, and
+ *   the joules each channel used in the whole log, as doubles. Each reading
+ *   is the power since the reading before it.
+ *
+ *   a sessionLogFooter that locates the index and the tag table, and says
+ *   how well the acquisition kept up over the session
+ *
+ * Every structure starts on a multiple of 8 bytes, so the columns of plain
+ * chunks can be used in place once the file is mapped. Timestamps never go
+ * backwards. Everything is in the byte order of the machine that wrote it.
+ */
+
+#define SESSION_LOG_MAGIC 0x474c5050  // "PPLG"
+#define SESSION_LOG_CHUNK_MAGIC 0x4b484350  // "PCHK"
+#define SESSION_LOG_VERSION 4
+#define SESSION_LOG_MIN_VERSION 4
+
+// These are the encodings of a chunk.
+#define SESSION_LOG_PLAIN 0
+#define SESSION_LOG_COMPRESSED 1
+
+// This is the number of readings in each chunk. At 25 readings a second a
+// chunk covers a little under three minutes.
+#define SESSION_LOG_CHUNK_ROWS 4096
+
+struct sessionLogHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t numChannels;
+  // rows in every chunk but the last
+  uint32_t chunkRows;
+  uint32_t sessionID;
+  // SAMPLE_FORMAT_F64 or SAMPLE_FORMAT_I16, the format samples were read in
+  uint32_t sampleFormat;
+  // server time of the start message, and of the start of the pre-roll
+  uint64_t startTime;
+  uint64_t preRollStart;
+  // samples per second on each channel
+  double sampleClockRate;
+  // ohms of the shunt each channel's differential reading is taken across
+  double shuntResistance;
+  // samples per channel of a callback's read
+  uint32_t samplesPerCallback;
+  // bytes of the channel description, without padding
+  uint32_t descriptionBytes;
+};
+
+struct sessionLogChunkHeader {
+  uint32_t magic;
+  uint32_t rows;
+  // timestamps of the first and last row
+  uint64_t firstTimestamp;
+  uint64_t lastTimestamp;
+  // SESSION_LOG_PLAIN or SESSION_LOG_COMPRESSED
+  uint32_t encoding;
+  // bytes after the header, without padding
+  uint32_t bytes;
+};
+
+struct sessionLogChunk {
+  // where the chunk's header starts in the file
+  uint64_t offset;
+  uint64_t firstTimestamp;
+  uint64_t lastTimestamp;
+  uint32_t rows;
+  uint32_t reserved;
+};
+
+struct sessionLogTag {
+  uint64_t timestamp;
+  uint32_t tagID;
+  // one of the TAG_EVENT_ values
+  uint32_t kind;
+  uint32_t threadID;
+  uint32_t cpu;
+};
+
+struct sessionLogName {
+  uint32_t tagID;
+  uint32_t length;
+  // where the string's bytes start in the file
+  uint64_t offset;
+};
+
+struct sessionLogFooter {
+  uint64_t indexOffset;
+  uint64_t chunks;
+  uint64_t tagOffset;
+  uint64_t tags;
+  uint64_t nameOffset;
+  uint64_t names;
+  // readings in every chunk
+  uint64_t rows;
+  // These are the session's acquisitionHealth.
+  uint64_t gaps;
+  uint64_t lostSamples;
+  uint64_t lateReads;
+  uint64_t maxBacklog;
+  uint64_t maxCallbackNanos;
+  uint64_t largestRead;
+  uint32_t reserved;
+  uint32_t magic;
+};
+
+/**
+ * Writes a binary session log. Readings are gathered into a chunk in memory,
+ * which is written once it is full, and the tag table and chunk index are
+ * written when the log is closed.
+ */
+class sessionLogWriter {
+ public:
+  // This creates the file and writes its header. header.magic, version and
+  // chunkRows are filled in here. scaling is only written, and only needed,
+  // for SAMPLE_FORMAT_I16. Chunks are compressed if compress is set and that
+  // makes them smaller. It returns false if the file cannot be created.
+  bool open(const std::string& path, sessionLogHeader header,
+            const double* voltages, const double* scaling,
+            const std::string& description, bool compress = true);
+
+  bool is_open() const { return file.is_open(); }
+
+  // This adds a reading of every channel. A timestamp earlier than the last
+  // one is moved up to it.
+  void append(uint64_t timestamp, uint32_t samples, const double* power);
+
+  // This sets when the first reading's interval starts, such as the start of
+  // the pre-roll. It has to be called before the first chunk is written,
+  // chunkRows readings in. Without it the first reading covers no time.
+  void coverFrom(uint64_t timestamp);
+
+  // This writes the last chunk, the tags with the strings of names, the
+  // chunk index, and the session's health, and closes the file.
+  void close(const std::vector<tagEvent>& tags, eventHandler& names,
+             const acquisitionHealth& health = acquisitionHealth());
+
+ private:
+  std::fstream file;
+  // This is the number of bytes written so far.
+  uint64_t position = 0;
+  uint32_t numChannels = 0;
+  bool compress = true;
+  uint64_t lastTimestamp = 0;
+  uint64_t rows = 0;
+  // These are the columns of the chunk being gathered. power holds a column
+  // of SESSION_LOG_CHUNK_ROWS for each channel.
+  std::vector<uint64_t> timestamps;
+  std::vector<uint32_t> samples;
+  std::vector<double> power;
+  std::vector<sessionLogChunk> index;
+  // This holds a chunk while it is compressed.
+  std::vector<uint8_t> encoded;
+  // These are the start of the first reading's interval, or UINT64_MAX if it
+  // is not set, the end of the last interval written, the joules of each
+  // channel so far, and the energy table without its start.
+  uint64_t energyStart = UINT64_MAX;
+  uint64_t coveredTo = 0;
+  std::vector<double> joules;
+  std::vector<double> energyTable;
+
+  void writeChunk();
+  void put(const void* data, size_t bytes);
+  // This pads the file to a multiple of 8 bytes.
+  void align();
+};
+
+/**
+ * Some consecutive rows of one chunk of a mapped session log. The columns
+ * point into the mapping, or for a compressed chunk into the reader's copy
+ * of it decoded, so they are only valid while the log is open.
+ */
+struct sessionLogSpan {
+  const uint64_t* timestamps;
+  const uint32_t* samples;
+  // These are the first channel's readings and the distance in doubles from
+  // one channel's column to the next.
+  const double* power;
+  size_t stride;
+  size_t rows;
+
+  // This returns the power readings of a channel, rows of them.
+  const double* channel(size_t index) const { return power + index * stride; }
+};
+
+/**
+ * Maps a binary session log and hands out its columns without copying them.
+ * A compressed chunk is decoded the first time it is asked for and kept until
+ * the log is closed, so only the chunks a tool uses are decoded. Chunks can be
+ * asked for from several threads at once.
+ */
+class sessionLogReader {
+ public:
+  sessionLogHeader header;
+  std::string description;
+
+  sessionLogReader() {}
+  ~sessionLogReader() { close(); }
+  sessionLogReader(const sessionLogReader&) = delete;
+  sessionLogReader& operator=(const sessionLogReader&) = delete;
+
+  // This maps a file and checks its structure. A log that was cut off before
+  // its index was written is read up to its last whole chunk. It returns
+  // false and prints why if the file cannot be read.
+  bool open(const std::string& path);
+
+  void close();
+
+  // These return the voltage of each channel, and in SAMPLE_FORMAT_I16 logs
+  // each channel's scaling polynomial, or nullptr.
+  const double* voltages() const { return channelVoltages; }
+  const double* scaling() const { return scalingCoeffs; }
+
+  // These describe the chunks, in time order.
+  size_t chunkCount() const { return index.size(); }
+  const sessionLogChunk& chunkInfo(size_t chunk) const { return index[chunk]; }
+
+  // This returns every row of a chunk, or no rows if the chunk cannot be
+  // decoded.
+  sessionLogSpan chunk(size_t chunk) const;
+
+  // This is chunk(), but a compressed chunk is decoded into columns rather
+  // than kept by the reader, so a tool going through a log once only holds
+  // the chunks it is using.
+  sessionLogSpan chunk(size_t chunk, std::vector<uint64_t>& columns) const;
+
+  // This returns the rows with timestamps from begin up to but not including
+  // end, as a span for each chunk they fall in.
+  std::vector<sessionLogSpan> range(uint64_t begin, uint64_t end) const;
+
+  // This returns the number of readings in the log.
+  uint64_t rows() const { return totalRows; }
+
+  // These return the tags, in time order, and those from begin up to but not
+  // including end.
+  const sessionLogTag* tags() const { return tagTable; }
+  size_t tagCount() const { return tagTableSize; }
+  std::pair<const sessionLogTag*, const sessionLogTag*> tags(
+      uint64_t begin, uint64_t end) const;
+
+  // This returns the string of a tag ID, or an empty string if the log does
+  // not have it.
+  std::string tagName(uint32_t tagID) const;
+
+  // This returns the joules used from begin to end over every channel, and
+  // sets channels, if given, to those of each channel. It looks up the
+  // energy used up to each end in the energy table, and adds the part of the
+  // chunk up to it from the chunk's running sums, which are worked out the
+  // first time the chunk is used. A reading's power is spread evenly over
+  // the time since the reading before it.
+  double energyBetween(uint64_t begin, uint64_t end,
+                       double* channels = nullptr) const;
+
+  // This returns when the first reading's interval starts.
+  uint64_t coveredFrom() const { return energyStart; }
+
+  // This returns how well the acquisition kept up over the session. A log
+  // that was cut off before its footer has no record of it, so it is zero.
+  const acquisitionHealth& health() const { return sessionHealth; }
+
+ private:
+  const char* mapping = nullptr;
+  size_t mappingSize = 0;
+  const double* channelVoltages = nullptr;
+  const double* scalingCoeffs = nullptr;
+  // This is the index from the file, or rebuilt by scanning the chunks when
+  // the file was cut off.
+  std::vector<sessionLogChunk> index;
+  uint64_t totalRows = 0;
+  const sessionLogTag* tagTable = nullptr;
+  size_t tagTableSize = 0;
+  const sessionLogName* names = nullptr;
+  size_t nameCount = 0;
+  // These are the compressed chunks decoded so far, and the running sums of
+  // each channel's energy over the rows of the chunks used for energy so
+  // far, indexed by chunk.
+  mutable std::mutex cacheLock;
+  mutable std::vector<std::vector<uint64_t>> decoded;
+  mutable std::vector<std::vector<double>> runningEnergy;
+  // This is the energy table, from the file or worked out from the chunks.
+  uint64_t energyStart = 0;
+  std::vector<double> chunkEnergy;
+  acquisitionHealth sessionHealth;
+
+  bool readIndex(const std::string& path, uint64_t firstChunk);
+  void scanChunks(uint64_t firstChunk);
+  bool chunkHeader(uint64_t offset, sessionLogChunkHeader& chunk) const;
+  uint64_t storedBytes(const sessionLogChunkHeader& chunk) const;
+  bool validChunk(uint64_t offset, uint32_t rows) const;
+  bool decode(size_t chunk, std::vector<uint64_t>& columns) const;
+  bool compressed(size_t chunk) const;
+  const char* plainColumns(size_t chunk) const;
+  sessionLogSpan columnSpan(size_t chunk, const char* columns) const;
+  bool readEnergyTable(uint64_t offset, uint64_t bytes);
+  void sumEnergy();
+  double energyAt(uint64_t timestamp, double* channels, double sign) const;
+};
+
+#endif
@@ -0,0 +1,460 @@
+#include "sessionreport.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <thread>
+
+// This is the number of significant digits readings are written with.
+#define REPORT_PRECISION 10
+
+double reportInterval::averageWatts() const {
+  return end > begin ? joules / ((double)(end - begin) * 1e-9) : 0.0;
+}
+
+/**
+ * Finds the first chunk whose last reading is at or after a time
+ *
+ * @param log the session log
+ * @param timestamp the time
+ * @returns the chunk, or the number of chunks if every chunk ends before it
+ */
+static size_t chunkEndingBy(const sessionLogReader &log, uint64_t timestamp) {
+  size_t low = 0, high = log.chunkCount();
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (log.chunkInfo(middle).lastTimestamp < timestamp) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/**
+ * Adds up the power of the readings of a chunk that fall in an interval.
+ * Each reading is the power since the reading before it, so a reading that
+ * straddles an end of the interval adds the share inside it.
+ *
+ * @param span the chunk's rows
+ * @param from the start of the first row's interval
+ * @param begin the start of the interval
+ * @param end the end of the interval
+ * @param numChannels the number of channels
+ * @param joules has each channel's joules added to it
+ * @param peakWatts raised to the highest power over every channel of a
+ * reading in the interval
+ */
+static void addPower(const sessionLogSpan &span, uint64_t from,
+                     uint64_t begin, uint64_t end, size_t numChannels,
+                     double *joules, double &peakWatts) {
+  size_t row = std::upper_bound(span.timestamps, span.timestamps + span.rows,
+                                begin) -
+               span.timestamps;
+  for (; row < span.rows; row++) {
+    uint64_t timestamp = span.timestamps[row];
+    uint64_t previous = row > 0 ? span.timestamps[row - 1] : from;
+    uint64_t start = std::max(previous, begin);
+    uint64_t stop = std::min(timestamp, end);
+    if (stop > start) {
+      double seconds = (double)(stop - start) * 1e-9;
+      double watts = 0.0;
+      for (size_t channel = 0; channel < numChannels; channel++) {
+        double power = span.channel(channel)[row];
+        watts += power;
+        joules[channel] += power * seconds;
+      }
+      peakWatts = std::max(peakWatts, watts);
+    }
+    if (timestamp >= end) {
+      break;
+    }
+  }
+}
+
+// This quotes a CSV field if it has a comma, quote or line break in it.
+static std::string csvField(const std::string &field) {
+  if (field.find_first_of(",\"\r\n") == std::string::npos) {
+    return field;
+  }
+  std::string quoted = "\"";
+  for (char c : field) {
+    quoted += c;
+    if (c == '"') {
+      quoted += '"';
+    }
+  }
+  return quoted + "\"";
+}
+
+static std::string jsonString(const std::string &text) {
+  std::string escaped = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if ((unsigned char)c < 0x20) {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", (unsigned)c);
+      escaped += code;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped + "\"";
+}
+
+static std::string threadName(uint32_t threadID) {
+  return threadID == TAG_THREAD_SESSION ? "session"
+                                        : std::to_string(threadID);
+}
+
+static const char *kindName(uint32_t kind) {
+  return kind == REPORT_INTERVAL_REGION ? "region" : "tag";
+}
+
+/**
+ * Opens the session logs and finds their intervals
+ *
+ * @param paths the binary session logs
+ * @returns false if a log cannot be read
+ */
+bool sessionReport::open(const std::vector<std::string> &paths) {
+  files = paths;
+  logs.clear();
+  intervals.clear();
+  maxChannels = 0;
+  for (const std::string &file : files) {
+    std::unique_ptr<sessionLogReader> log(new sessionLogReader());
+    if (!log->open(file)) {
+      return false;
+    }
+    // The readings of a log with gaps are missing the energy of the samples
+    // lost in them, which the intervals cannot make up.
+    if (log->health().gaps > 0) {
+      std::cerr << file << " has " << log->health().gaps
+                << " gaps in its readings, from "
+                << log->health().lostSamples << " lost samples" << std::endl;
+    }
+    maxChannels = std::max(maxChannels, (size_t)log->header.numChannels);
+    logs.push_back(std::move(log));
+  }
+
+  for (size_t log = 0; log < logs.size(); log++) {
+    findIntervals(log);
+  }
+  std::stable_sort(intervals.begin(), intervals.end(),
+                   [](const reportInterval &a, const reportInterval &b) {
+                     return a.log < b.log ||
+                            (a.log == b.log && a.begin < b.begin);
+                   });
+  placeIntervals();
+  return true;
+}
+
+/**
+ * Finds the regions and tag intervals of a log from its tags. An end closes
+ * the innermost open region of its thread with the same name, and regions
+ * opened inside it that were never ended are closed with it.
+ *
+ * @param log the log
+ */
+void sessionReport::findIntervals(size_t log) {
+  // This is a region that has begun but not ended.
+  struct openRegion {
+    uint32_t tagID;
+    std::string path;
+    uint64_t begin;
+  };
+
+  const sessionLogReader &reader = *logs[log];
+  std::map<uint32_t, std::vector<openRegion>> stacks;
+  std::map<uint32_t, const sessionLogTag *> lastTags;
+  auto add = [&](uint32_t threadID, uint32_t kind, const std::string &name,
+                 uint64_t begin, uint64_t end) {
+    reportInterval interval;
+    interval.log = log;
+    interval.threadID = threadID;
+    interval.kind = kind;
+    interval.name = name;
+    interval.begin = begin;
+    interval.end = end;
+    interval.joules = 0.0;
+    interval.channelJoules.assign(reader.header.numChannels, 0.0);
+    interval.peakWatts = 0.0;
+    intervals.push_back(interval);
+  };
+
+  uint64_t endTime = reader.chunkCount() > 0
+                         ? reader.chunkInfo(reader.chunkCount() - 1)
+                               .lastTimestamp
+                         : 0;
+  for (size_t i = 0; i < reader.tagCount(); i++) {
+    const sessionLogTag &tag = reader.tags()[i];
+    endTime = std::max(endTime, tag.timestamp);
+    if (tag.kind == TAG_EVENT_TAG) {
+      auto last = lastTags.find(tag.threadID);
+      if (last != lastTags.end()) {
+        add(tag.threadID, REPORT_INTERVAL_TAG,
+            reader.tagName(last->second->tagID), last->second->timestamp,
+            tag.timestamp);
+      }
+      lastTags[tag.threadID] = &tag;
+      continue;
+    }
+
+    std::vector<openRegion> &stack = stacks[tag.threadID];
+    std::string name = reader.tagName(tag.tagID);
+    if (tag.kind == TAG_EVENT_REGION_BEGIN) {
+      stack.push_back({tag.tagID,
+                       stack.empty() ? name : stack.back().path + ";" + name,
+                       tag.timestamp});
+      continue;
+    }
+    size_t match = stack.size();
+    while (match > 0 && stack[match - 1].tagID != tag.tagID) {
+      match--;
+    }
+    while (match > 0 && stack.size() >= match) {
+      add(tag.threadID, REPORT_INTERVAL_REGION, stack.back().path,
+          stack.back().begin, tag.timestamp);
+      stack.pop_back();
+    }
+  }
+
+  for (auto &entry : stacks) {
+    std::vector<openRegion> &stack = entry.second;
+    while (!stack.empty()) {
+      add(entry.first, REPORT_INTERVAL_REGION, stack.back().path,
+          stack.back().begin, std::max(endTime, stack.back().begin));
+      stack.pop_back();
+    }
+  }
+}
+
+/**
+ * Finds the chunks each interval begins and ends in, so the pass over those
+ * chunks works out the interval's part in them
+ */
+void sessionReport::placeIntervals() {
+  chunks.assign(logs.size(), logChunks());
+  for (size_t log = 0; log < logs.size(); log++) {
+    size_t count = logs[log]->chunkCount();
+    chunks[log].joulesBefore.assign(
+        (count + 1) * logs[log]->header.numChannels, 0.0);
+    chunks[log].peakWatts.assign(count, 0.0);
+    chunks[log].parts.resize(count);
+  }
+
+  firstChunks.assign(intervals.size(), SIZE_MAX);
+  lastChunks.assign(intervals.size(), SIZE_MAX);
+  partJoules.assign(intervals.size() * 2 * maxChannels, 0.0);
+  partPeaks.assign(intervals.size() * 2, 0.0);
+  for (size_t i = 0; i < intervals.size(); i++) {
+    const reportInterval &interval = intervals[i];
+    const sessionLogReader &log = *logs[interval.log];
+    // The first reading in the interval is the first after its start, and
+    // the last is the first at or after its end.
+    size_t first = chunkEndingBy(log, interval.begin + 1);
+    if (interval.end <= interval.begin || first >= log.chunkCount()) {
+      continue;
+    }
+    size_t last =
+        std::min(chunkEndingBy(log, interval.end), log.chunkCount() - 1);
+    firstChunks[i] = first;
+    lastChunks[i] = last;
+    chunks[interval.log].parts[first].push_back({i, 0});
+    if (last != first) {
+      chunks[interval.log].parts[last].push_back({i, 1});
+    }
+  }
+}
+
+/**
+ * Works out the power of every interval. The chunks of every log are handed
+ * out to the threads in file order, so each thread reads on from where it
+ * was, and a compressed chunk is only held while it is used.
+ *
+ * @param threads the number of threads to use
+ */
+void sessionReport::run(unsigned threads) {
+  std::vector<std::pair<size_t, size_t>> tasks;
+  for (size_t log = 0; log < logs.size(); log++) {
+    for (size_t chunk = 0; chunk < logs[log]->chunkCount(); chunk++) {
+      tasks.push_back({log, chunk});
+    }
+  }
+
+  std::atomic<size_t> next(0);
+  auto work = [this, &tasks, &next]() {
+    std::vector<uint64_t> columns;
+    for (size_t task = next++; task < tasks.size(); task = next++) {
+      readChunk(tasks[task].first, tasks[task].second, columns);
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned i = 1; i < threads; i++) {
+    pool.emplace_back(work);
+  }
+  work();
+  for (std::thread &thread : pool) {
+    thread.join();
+  }
+
+  // Each chunk's joules were put after the chunk, so a running sum gives the
+  // joules before each chunk.
+  for (size_t log = 0; log < logs.size(); log++) {
+    std::vector<double> &joules = chunks[log].joulesBefore;
+    size_t numChannels = logs[log]->header.numChannels;
+    for (size_t i = numChannels; i < joules.size(); i++) {
+      joules[i] += joules[i - numChannels];
+    }
+  }
+  for (size_t i = 0; i < intervals.size(); i++) {
+    addParts(i);
+  }
+}
+
+/**
+ * Goes through the readings of a chunk for its joules and peak power, and
+ * the part of each interval that begins or ends in it
+ *
+ * @param log the log
+ * @param chunk the chunk
+ * @param columns space for the chunk if it is compressed
+ */
+void sessionReport::readChunk(size_t log, size_t chunk,
+                              std::vector<uint64_t> &columns) {
+  const sessionLogReader &reader = *logs[log];
+  size_t numChannels = reader.header.numChannels;
+  logChunks &work = chunks[log];
+  sessionLogSpan span = reader.chunk(chunk, columns);
+  uint64_t from = chunk == 0 ? reader.coveredFrom()
+                             : reader.chunkInfo(chunk - 1).lastTimestamp;
+  addPower(span, from, 0, UINT64_MAX, numChannels,
+           &work.joulesBefore[(chunk + 1) * numChannels],
+           work.peakWatts[chunk]);
+  for (const intervalPart &part : work.parts[chunk]) {
+    const reportInterval &interval = intervals[part.interval];
+    addPower(span, from, interval.begin, interval.end, numChannels,
+             partOf(part.interval, part.end),
+             partPeaks[part.interval * 2 + part.end]);
+  }
+}
+
+/**
+ * Adds up an interval's parts in the chunks it begins and ends in, and the
+ * whole chunks between them
+ *
+ * @param i the interval
+ */
+void sessionReport::addParts(size_t i) {
+  reportInterval &interval = intervals[i];
+  size_t first = firstChunks[i], last = lastChunks[i];
+  if (first == SIZE_MAX) {
+    return;
+  }
+  const logChunks &work = chunks[interval.log];
+  size_t numChannels = interval.channelJoules.size();
+  const double *head = partOf(i, 0);
+  interval.peakWatts = partPeaks[i * 2];
+  for (size_t channel = 0; channel < numChannels; channel++) {
+    interval.channelJoules[channel] = head[channel];
+  }
+  if (last != first) {
+    const double *tail = partOf(i, 1);
+    for (size_t channel = 0; channel < numChannels; channel++) {
+      interval.channelJoules[channel] +=
+          tail[channel] + work.joulesBefore[last * numChannels + channel] -
+          work.joulesBefore[(first + 1) * numChannels + channel];
+    }
+    interval.peakWatts = std::max(interval.peakWatts, partPeaks[i * 2 + 1]);
+    for (size_t chunk = first + 1; chunk < last; chunk++) {
+      interval.peakWatts = std::max(interval.peakWatts, work.peakWatts[chunk]);
+    }
+  }
+  interval.joules = 0.0;
+  for (double joules : interval.channelJoules) {
+    interval.joules += joules;
+  }
+}
+
+double *sessionReport::partOf(size_t interval, size_t end) {
+  return &partJoules[(interval * 2 + end) * maxChannels];
+}
+
+const std::vector<reportInterval> &sessionReport::getIntervals() {
+  return intervals;
+}
+
+/**
+ * Writes the intervals as comma separated values. Logs with fewer channels
+ * than others leave the extra channel columns empty.
+ *
+ * @param out the stream to write to
+ */
+void sessionReport::writeCSV(std::ostream &out) {
+  out << std::setprecision(REPORT_PRECISION);
+  out << "file,session,thread,kind,name,begin_ns,end_ns,seconds,"
+         "average_watts,peak_watts,joules";
+  for (size_t channel = 0; channel < maxChannels; channel++) {
+    out << ",channel_" << channel << "_joules";
+  }
+  out << "\n";
+  for (const reportInterval &interval : intervals) {
+    out << csvField(files[interval.log]) << ","
+        << logs[interval.log]->header.sessionID << ","
+        << threadName(interval.threadID) << "," << kindName(interval.kind)
+        << "," << csvField(interval.name) << "," << interval.begin << ","
+        << interval.end << "," << (double)(interval.end - interval.begin) * 1e-9
+        << "," << interval.averageWatts() << "," << interval.peakWatts << ","
+        << interval.joules;
+    for (size_t channel = 0; channel < maxChannels; channel++) {
+      out << ",";
+      if (channel < interval.channelJoules.size()) {
+        out << interval.channelJoules[channel];
+      }
+    }
+    out << "\n";
+  }
+  out.flush();
+}
+
+/**
+ * Writes the files and the intervals as a JSON object, an interval per line
+ *
+ * @param out the stream to write to
+ */
+void sessionReport::writeJSON(std::ostream &out) {
+  out << std::setprecision(REPORT_PRECISION);
+  out << "{\"files\": [";
+  for (size_t log = 0; log < files.size(); log++) {
+    out << (log > 0 ? ", " : "") << jsonString(files[log]);
+  }
+  out << "], \"intervals\": [";
+  for (size_t i = 0; i < intervals.size(); i++) {
+    const reportInterval &interval = intervals[i];
+    out << (i > 0 ? "," : "") << "\n  {\"file\": "
+        << jsonString(files[interval.log])
+        << ", \"session\": " << logs[interval.log]->header.sessionID
+        << ", \"thread\": " << jsonString(threadName(interval.threadID))
+        << ", \"kind\": \"" << kindName(interval.kind)
+        << "\", \"name\": " << jsonString(interval.name)
+        << ", \"begin_ns\": " << interval.begin
+        << ", \"end_ns\": " << interval.end << ", \"seconds\": "
+        << (double)(interval.end - interval.begin) * 1e-9
+        << ", \"average_watts\": " << interval.averageWatts()
+        << ", \"peak_watts\": " << interval.peakWatts
+        << ", \"joules\": " << interval.joules << ", \"channel_joules\": [";
+    for (size_t channel = 0; channel < interval.channelJoules.size();
+         channel++) {
+      out << (channel > 0 ? ", " : "") << interval.channelJoules[channel];
+    }
+    out << "]}";
+  }
+  out << "\n]}\n";
+  out.flush();
+}
@@ -0,0 +1,101 @@
+#ifndef SESSION_REPORT_H
+#define SESSION_REPORT_H
+
+#include <stdint.h>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "sessionlog.h"
+
+// These are the kinds of interval a report has a row for.
+#define REPORT_INTERVAL_REGION 0
+#define REPORT_INTERVAL_TAG 1
+
+/**
+ * A region of a session, or the time from a tag to the next tag of the same
+ * thread, and the power used in it
+ */
+struct reportInterval {
+  // index of the session log in the report's files
+  size_t log;
+  // client thread, or TAG_THREAD_SESSION
+  uint32_t threadID;
+  // REPORT_INTERVAL_REGION or REPORT_INTERVAL_TAG
+  uint32_t kind;
+  // region path from the outermost region, joined with ';', or the tag
+  std::string name;
+  uint64_t begin;
+  uint64_t end;
+  // joules used over every channel and in each channel
+  double joules;
+  std::vector<double> channelJoules;
+  // highest power over every channel of a reading in the interval
+  double peakWatts;
+
+  // This returns the average power over the interval, or 0 if it is empty.
+  double averageWatts() const;
+};
+
+/**
+ * The sessionReport works out the energy and power of every region and tag
+ * interval in a set of binary session logs. Each log's chunks are shared out
+ * over a pool of threads, which go through every reading once: a chunk gives
+ * its joules and peak power as a whole, and the part of each interval that
+ * begins or ends in it. An interval then adds up its two ends and the whole
+ * chunks between them. Regions nest within a thread as in a regionTree, and
+ * regions still open at the end of a log are closed at its last reading.
+ */
+class sessionReport {
+ public:
+  // This opens the logs and finds their intervals. It returns false and
+  // prints why if a log cannot be read.
+  bool open(const std::vector<std::string>& files);
+
+  // This works out the intervals' power with the given number of threads.
+  void run(unsigned threads);
+
+  // This returns the intervals, ordered by log and then by start.
+  const std::vector<reportInterval>& getIntervals();
+
+  // These write an interval per line as comma separated values with a
+  // header line, or as a JSON object.
+  void writeCSV(std::ostream& out);
+  void writeJSON(std::ostream& out);
+
+ private:
+  // This is where a chunk's pass puts the part of an interval in the chunk.
+  struct intervalPart {
+    size_t interval;
+    // 0 for the chunk the interval begins in, 1 for the one it ends in
+    size_t end;
+  };
+
+  // These are the work of one log's chunks, indexed by chunk.
+  struct logChunks {
+    // joules of each channel in the chunks before each chunk, and in all
+    std::vector<double> joulesBefore;
+    std::vector<double> peakWatts;
+    std::vector<std::vector<intervalPart>> parts;
+  };
+
+  std::vector<std::string> files;
+  std::vector<std::unique_ptr<sessionLogReader>> logs;
+  std::vector<logChunks> chunks;
+  std::vector<reportInterval> intervals;
+  // These are the chunks each interval begins and ends in, and the joules
+  // and peak power of the interval in each of those chunks.
+  std::vector<size_t> firstChunks;
+  std::vector<size_t> lastChunks;
+  std::vector<double> partJoules;
+  std::vector<double> partPeaks;
+  size_t maxChannels = 0;
+
+  void findIntervals(size_t log);
+  void placeIntervals();
+  void readChunk(size_t log, size_t chunk, std::vector<uint64_t>& columns);
+  void addParts(size_t interval);
+  double* partOf(size_t interval, size_t end);
+};
+
+#endif
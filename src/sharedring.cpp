@@ -0,0 +1,209 @@
+#include "sharedring.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <new>
+#include "socketutils.h"
+
+/**
+ * The start of the mapping. The producer and consumer positions are kept on
+ * separate cache lines.
+ */
+struct sharedTagRing::header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  char padding0[48];
+  std::atomic<uint64_t> enqueuePosition;
+  std::atomic<uint64_t> dropped;
+  char padding1[48];
+  std::atomic<uint64_t> dequeuePosition;
+  char padding2[56];
+};
+
+struct sharedTagRing::slot {
+  std::atomic<uint64_t> sequence;
+  tagRecord record;
+};
+
+sharedTagRing::sharedTagRing(const std::string &name, void *mapping,
+                             size_t mappingSize, uint64_t capacity)
+    : name(name),
+      mapping(mapping),
+      mappingSize(mappingSize),
+      ringHeader((header *)mapping),
+      slots((slot *)((char *)mapping + sizeof(header))),
+      capacity(capacity) {}
+
+sharedTagRing::~sharedTagRing() { munmap(mapping, mappingSize); }
+
+/**
+ * Creates and maps a new ring
+ *
+ * @param name the POSIX shared memory name, starting with '/'
+ * @param capacity the minimum number of records the ring can hold
+ * @returns the mapped ring
+ */
+sharedTagRing *sharedTagRing::create(const std::string &name,
+                                     size_t capacity) {
+  static_assert(ATOMIC_LONG_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+                "shared memory rings need address-free 64-bit atomics");
+
+  uint64_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  if (size > SHARED_RING_MAX_CAPACITY) {
+    printError("Shared memory ring capacity of " + std::to_string(capacity) +
+               " is too large");
+  }
+  size_t mappingSize = sizeof(header) + size * sizeof(slot);
+
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd == -1) {
+    printError("Failed to create shared memory ring " + name + ": ");
+  }
+  if (ftruncate(fd, (off_t)mappingSize) == -1) {
+    printError("Failed to size shared memory ring " + name + ": ");
+  }
+  void *mapping =
+      mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    printError("Failed to map shared memory ring " + name + ": ");
+  }
+
+  header *ringHeader = new (mapping) header;
+  ringHeader->capacity = size;
+  ringHeader->enqueuePosition.store(0);
+  ringHeader->dropped.store(0);
+  ringHeader->dequeuePosition.store(0);
+  slot *slots = (slot *)((char *)mapping + sizeof(header));
+  for (uint64_t i = 0; i < size; i++) {
+    new (&slots[i]) slot;
+    slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  ringHeader->version = SHARED_RING_VERSION;
+  std::atomic_thread_fence(std::memory_order_release);
+  ringHeader->magic = SHARED_RING_MAGIC;
+
+  return new sharedTagRing(name, mapping, mappingSize, size);
+}
+
+/**
+ * Maps a ring that another process created
+ *
+ * @param name the POSIX shared memory name of the ring
+ * @returns the mapped ring
+ */
+sharedTagRing *sharedTagRing::attach(const std::string &name) {
+  // A bad ring only fails the client that sent its name, so errors are
+  // reported rather than fatal.
+  int fd = shm_open(name.c_str(), O_RDWR, 0600);
+  if (fd == -1) {
+    std::cerr << "Failed to open shared memory ring " << name << ": "
+              << std::strerror(errno) << std::endl;
+    return nullptr;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == -1 || (size_t)info.st_size < sizeof(header)) {
+    std::cerr << "Shared memory ring " << name << " is truncated" << std::endl;
+    close(fd);
+    return nullptr;
+  }
+  size_t mappingSize = (size_t)info.st_size;
+  void *mapping =
+      mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    std::cerr << "Failed to map shared memory ring " << name << ": "
+              << std::strerror(errno) << std::endl;
+    return nullptr;
+  }
+
+  // The capacity is read once and kept, since the client can still write to
+  // the header after it has been checked.
+  header *ringHeader = (header *)mapping;
+  uint64_t capacity = ringHeader->capacity;
+  if (ringHeader->magic != SHARED_RING_MAGIC ||
+      ringHeader->version != SHARED_RING_VERSION || capacity == 0 ||
+      (capacity & (capacity - 1)) != 0 ||
+      capacity > SHARED_RING_MAX_CAPACITY ||
+      sizeof(header) + capacity * sizeof(slot) > mappingSize) {
+    std::cerr << "Shared memory ring " << name << " has an unknown layout"
+              << std::endl;
+    munmap(mapping, mappingSize);
+    return nullptr;
+  }
+
+  return new sharedTagRing(name, mapping, mappingSize, capacity);
+}
+
+/**
+ * Claims a slot and copies a record into it. Safe to call from any number of
+ * threads and processes.
+ *
+ * @param record the record to copy
+ * @returns true if the record was queued, false if the ring was full
+ */
+bool sharedTagRing::push(const tagRecord &record) {
+  uint64_t mask = capacity - 1;
+  uint64_t position =
+      ringHeader->enqueuePosition.load(std::memory_order_relaxed);
+  slot *target;
+
+  for (;;) {
+    target = &slots[position & mask];
+    uint64_t sequence = target->sequence.load(std::memory_order_acquire);
+    int64_t difference = (int64_t)(sequence - position);
+    if (difference == 0) {
+      if (ringHeader->enqueuePosition.compare_exchange_weak(
+              position, position + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      ringHeader->dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      position = ringHeader->enqueuePosition.load(std::memory_order_relaxed);
+    }
+  }
+
+  target->record = record;
+  target->sequence.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+/**
+ * Moves the records that have been fully written out of the ring
+ *
+ * @param out location for the records
+ * @param maxRecords the most records to move
+ * @returns the number of records moved
+ */
+size_t sharedTagRing::pop(tagRecord *out, size_t maxRecords) {
+  uint64_t position =
+      ringHeader->dequeuePosition.load(std::memory_order_relaxed);
+  size_t count = 0;
+
+  while (count < maxRecords) {
+    slot *source = &slots[position & (capacity - 1)];
+    if (source->sequence.load(std::memory_order_acquire) != position + 1) {
+      break;
+    }
+    out[count++] = source->record;
+    source->sequence.store(position + capacity, std::memory_order_release);
+    position++;
+  }
+
+  ringHeader->dequeuePosition.store(position, std::memory_order_relaxed);
+  return count;
+}
+
+void sharedTagRing::unlink() { shm_unlink(name.c_str()); }
+
+uint64_t sharedTagRing::droppedCount() { return ringHeader->dropped.load(); }
+
+const std::string &sharedTagRing::getName() { return name; }
@@ -0,0 +1,75 @@
+#ifndef SHARED_RING_H
+#define SHARED_RING_H
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include "tagbuffer.h"
+
+// This identifies a mapping as a sharedTagRing and its layout version.
+#define SHARED_RING_MAGIC 0x50505352
+#define SHARED_RING_VERSION 3
+
+// This is the most records a single sharedTagRing can hold.
+#define SHARED_RING_MAX_CAPACITY (1 << 24)
+
+// This is the longest name a sharedTagRing can have.
+#define SHARED_RING_MAX_NAME 255
+
+/**
+ * A bounded multi-producer single-consumer ring of tagRecords in POSIX shared
+ * memory. Any number of client threads push records and the meter server pops
+ * them, without either side making a system call. Each slot carries a sequence
+ * number that tells producers and the consumer whose turn it is, so pushes
+ * only contend on a single compare-and-swap.
+ *
+ * The client creates the ring and tells the server its name over the socket.
+ * The server attaches to it and unlinks the name, so the memory is released
+ * once both sides unmap it.
+ */
+class sharedTagRing {
+ public:
+  // This creates a ring with room for at least capacity records.
+  static sharedTagRing* create(const std::string& name, size_t capacity);
+
+  // This maps a ring created by another process. It returns null if the ring
+  // cannot be mapped.
+  static sharedTagRing* attach(const std::string& name);
+
+  // This unmaps the ring.
+  ~sharedTagRing();
+
+  // This copies the record into the ring. It returns false if the ring is full.
+  bool push(const tagRecord& record);
+
+  // This moves up to maxRecords records into out and returns how many were
+  // moved. Only one thread may pop.
+  size_t pop(tagRecord* out, size_t maxRecords);
+
+  // This removes the name of the ring so no other process can attach to it.
+  void unlink();
+
+  // Number of records dropped because the ring was full.
+  uint64_t droppedCount();
+
+  const std::string& getName();
+
+ private:
+  struct header;
+  struct slot;
+
+  std::string name;
+  void* mapping;
+  size_t mappingSize;
+  header* ringHeader;
+  slot* slots;
+  // This is the capacity checked when the ring was mapped. The one in the
+  // header is never used again, since a client could change it.
+  uint64_t capacity;
+
+  sharedTagRing(const std::string& name, void* mapping, size_t mappingSize,
+                uint64_t capacity);
+};
+
+#endif
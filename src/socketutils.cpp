@@ -1,11 +1,20 @@
 #include "socketutils.h"
 
+// This hands out a unique id to every socketClient that is created.
+static std::atomic<uint64_t> nextClientID(1);
+
 void printError(std::string errorMsg) {
   std::cerr << errorMsg << std::strerror(errno) << "\n";
   exit(EXIT_FAILURE);
 }
 
-socketServer::socketServer(uint16_t portNumber, eventHandler *eventHandler) {
+socketServer::socketServer(uint16_t portNumber, eventHandler *eventHandler)
+    : epollFD(-1),
+      wakeFD(-1),
+      activeSessions(0),
+      nextSessionID(0),
+      sessionsEnded(false),
+      stopping(false) {
   handler = eventHandler;
 
   // This causes the connection to be IPv4.
@@ -16,8 +25,10 @@ socketServer::socketServer(uint16_t portNumber, eventHandler *eventHandler) {
   address.sin_port = htons(portNumber);
   int opt = 1;
 
-  // This sets the socket to use TCP.
-  if ((sock = socket(address.sin_family, SOCK_STREAM, 0)) == 0) {
+  // This sets the socket to use TCP. Accepting never blocks, since the event
+  // loop only accepts when epoll says a connection is waiting.
+  if ((sock = socket(address.sin_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) <
+      0) {
     printError("Server failed to initialize socket\n");
   }
 
@@ -32,118 +43,841 @@ socketServer::socketServer(uint16_t portNumber, eventHandler *eventHandler) {
   if (bind(sock, (sockaddr *)&address, sizeof(address)) < 0) {
     printError("Server failed to bind to socket\n");
   }
+
+  // Clients can connect as soon as the server exists, and wait in the backlog
+  // until the event loop runs.
+  if (listen(sock, SERVER_LISTEN_BACKLOG) == -1) {
+    printError("Server failed to listen on socket");
+  }
+
+  if ((epollFD = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+      (wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    printError("Server failed to create its event loop: ");
+  }
+
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = sock;
+  if (epoll_ctl(epollFD, EPOLL_CTL_ADD, sock, &event) == -1) {
+    printError("Server failed to watch its socket: ");
+  }
+  event.data.fd = wakeFD;
+  if (epoll_ctl(epollFD, EPOLL_CTL_ADD, wakeFD, &event) == -1) {
+    printError("Server failed to watch its wake event: ");
+  }
+}
+
+socketServer::socketServer(socketServer &&other)
+    : sock(other.sock),
+      epollFD(other.epollFD),
+      wakeFD(other.wakeFD),
+      handler(other.handler),
+      address(other.address),
+      connections(std::move(other.connections)),
+      activeSessions(other.activeSessions),
+      nextSessionID(other.nextSessionID),
+      sessionsEnded(other.sessionsEnded),
+      stopping(other.stopping.load()) {
+  other.sock = -1;
+  other.epollFD = -1;
+  other.wakeFD = -1;
+  other.connections.clear();
+}
+
+socketServer::~socketServer() {
+  for (auto &entry : connections) {
+    close(entry.first);
+  }
+  if (sock >= 0) {
+    close(sock);
+  }
+  if (epollFD >= 0) {
+    close(epollFD);
+  }
+  if (wakeFD >= 0) {
+    close(wakeFD);
+  }
+}
+
+void socketServer::listenForClient() { run(true); }
+
+void socketServer::serve() { run(false); }
+
+void socketServer::stop() {
+  stopping.store(true);
+  uint64_t wake = 1;
+  if (write(wakeFD, &wake, sizeof(wake)) < 0) {
+    std::cerr << "Failed to wake the server: " << std::strerror(errno)
+              << std::endl;
+  }
+}
+
+/**
+ * Runs the event loop. Sockets are only read when epoll reports data, and
+ * the shared memory rings of clients that use them are drained between waits.
+ *
+ * @param untilSessionsEnd return once every session that was started has ended
+ */
+void socketServer::run(bool untilSessionsEnd) {
+  epoll_event events[SERVER_MAX_EVENTS];
+  sessionsEnded = false;
+
+  while (!stopping.load()) {
+    // While a ring has records the sockets are only checked, and once every
+    // ring is empty they are waited on for a short time so the rings keep
+    // being polled.
+    bool sharedMemory = false;
+    size_t drained = 0;
+    std::vector<int> malformed;
+    for (auto &entry : connections) {
+      if (entry.second->sharedRing) {
+        sharedMemory = true;
+        bool failed = false;
+        drained += drainSharedMemory(*entry.second, failed);
+        if (failed) {
+          malformed.push_back(entry.first);
+        }
+      }
+    }
+    for (int socketFD : malformed) {
+      closeClient(socketFD);
+    }
+    int timeout = !sharedMemory ? -1 : drained ? 0 : SHM_POLL_INTERVAL_MS;
+
+    int count = epoll_wait(epollFD, events, SERVER_MAX_EVENTS, timeout);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printError("Server failed to wait for clients: ");
+    }
+
+    for (int i = 0; i < count; i++) {
+      int socketFD = events[i].data.fd;
+      if (socketFD == sock) {
+        acceptClients();
+        continue;
+      }
+      if (socketFD == wakeFD) {
+        uint64_t wake;
+        while (read(wakeFD, &wake, sizeof(wake)) > 0) {
+        }
+        continue;
+      }
+
+      auto entry = connections.find(socketFD);
+      if (entry == connections.end()) {
+        continue;
+      }
+      clientConnection &client = *entry->second;
+      bool open = true;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        open = readClient(client);
+      }
+      if (open && (events[i].events & EPOLLOUT)) {
+        open = flushOutput(client);
+      }
+      if (!open) {
+        closeClient(socketFD);
+      }
+    }
+
+    if (untilSessionsEnd && sessionsEnded) {
+      stopping.store(true);
+    }
+  }
+
+  // Clients still connected when the loop stops have their sessions ended.
+  std::vector<int> open;
+  for (auto &entry : connections) {
+    open.push_back(entry.first);
+  }
+  for (int socketFD : open) {
+    closeClient(socketFD);
+  }
+  stopping.store(false);
 }
 
-socketServer::~socketServer() { close(sock); }
+void socketServer::acceptClients() {
+  while (true) {
+    int socketFD = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (socketFD < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        std::cerr << "Server failed to accept a client: "
+                  << std::strerror(errno) << std::endl;
+      }
+      return;
+    }
+
+    // Clock probes are small messages that are answered right away, so they
+    // must not wait on Nagle's algorithm.
+    int noDelay = 1;
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = socketFD;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, socketFD, &event) == -1) {
+      std::cerr << "Server failed to watch a client: " << std::strerror(errno)
+                << std::endl;
+      close(socketFD);
+      continue;
+    }
 
-void socketServer::readData(int socketFD, void *buf, size_t size) {
-  int *tmp = (int *)buf;
-  size_t to_read = size;
-  ssize_t numRead = 0;
+    std::unique_ptr<clientConnection> client(new clientConnection());
+    client->socketFD = socketFD;
+    client->consumed = 0;
+    client->inSession = false;
+    client->sessionID = 0;
+    client->discardedRecords = 0;
+    connections[socketFD] = std::move(client);
+  }
+}
+
+/**
+ * Reads what a client has sent and handles every complete message. A message
+ * that is cut off is kept until the rest of it arrives.
+ *
+ * @param client the connection that has data waiting
+ * @returns false if the client disconnected or sent something malformed
+ */
+bool socketServer::readClient(clientConnection &client) {
+  // Only one read is done per wakeup so a busy client cannot starve the
+  // others. Epoll reports the socket again if there is more.
+  size_t used = client.input.size();
+  client.input.resize(used + SERVER_READ_SIZE);
+  ssize_t numRead;
   do {
-    if ((numRead = read(socketFD, tmp, to_read)) == -1) {
-      printError(
-          "Server failed to completely read from the socket with errorno: ");
+    numRead = read(client.socketFD, client.input.data() + used,
+                   SERVER_READ_SIZE);
+  } while (numRead < 0 && errno == EINTR);
+
+  if (numRead <= 0) {
+    client.input.resize(used);
+    return numRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+  client.input.resize(used + numRead);
+
+  while (client.consumed < client.input.size()) {
+    bool failed = false;
+    size_t length =
+        handleMessage(client, client.input.data() + client.consumed,
+                      client.input.size() - client.consumed, failed);
+    if (failed) {
+      return false;
     }
-    to_read -= numRead;
-    tmp += numRead;
-  } while (to_read);
+    if (length == 0) {
+      break;
+    }
+    client.consumed += length;
+  }
+
+  // Handled bytes are dropped once they are most of the buffer, so the buffer
+  // is not shifted for every message.
+  if (client.consumed == client.input.size()) {
+    client.input.clear();
+    client.consumed = 0;
+  } else if (client.consumed > client.input.size() / 2) {
+    client.input.erase(client.input.begin(),
+                       client.input.begin() + client.consumed);
+    client.consumed = 0;
+  }
+  return true;
 }
 
-void socketServer::writeData(int socketFD, void *buf, size_t size) {
-  ssize_t bytesSent;
-  if ((bytesSent = send(socketFD, buf, size, 0)) < size) {
-    printError("Server failed to completely send on socket. Server sent " +
-               std::to_string(bytesSent) + " bytes, but was expected to send " +
-               std::to_string(size) + " bytes.");
+void socketServer::closeClient(int socketFD) {
+  auto entry = connections.find(socketFD);
+  if (entry == connections.end()) {
+    return;
+  }
+
+  clientConnection &client = *entry->second;
+  if (client.inSession) {
+    std::cerr << "Client disconnected without ending its session" << std::endl;
+    handleSessionEnd(client, nanos());
   }
+
+  epoll_ctl(epollFD, EPOLL_CTL_DEL, socketFD, NULL);
+  close(socketFD);
+  connections.erase(entry);
 }
 
-void socketServer::listenForClient() {
-  socklen_t clientLength;
-  int readSocket;
+bool socketServer::writeData(clientConnection &client, const void *buf,
+                             size_t size) {
+  // Anything already waiting has to go first.
+  if (!client.output.empty()) {
+    const char *data = (const char *)buf;
+    client.output.insert(client.output.end(), data, data + size);
+    return true;
+  }
 
-  if (listen(sock, 2) == -1) {
-    printError("Server failed to listen on socket");
+  ssize_t bytesSent = send(client.socketFD, buf, size, MSG_NOSIGNAL);
+  if (bytesSent < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      return false;
+    }
+    bytesSent = 0;
+  }
+
+  if ((size_t)bytesSent < size) {
+    const char *rest = (const char *)buf + bytesSent;
+    client.output.insert(client.output.end(), rest, rest + (size - bytesSent));
+
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.fd = client.socketFD;
+    epoll_ctl(epollFD, EPOLL_CTL_MOD, client.socketFD, &event);
+  }
+  return true;
+}
+
+bool socketServer::flushOutput(clientConnection &client) {
+  if (!client.output.empty()) {
+    ssize_t bytesSent = send(client.socketFD, client.output.data(),
+                             client.output.size(), MSG_NOSIGNAL);
+    if (bytesSent < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    client.output.erase(client.output.begin(),
+                        client.output.begin() + bytesSent);
   }
 
-  clientLength = sizeof(address);
-  if ((readSocket = accept(sock, (sockaddr *)&address,
-                           &clientLength)) == -1) {
-    printError("Error, the accept failed with errno: ");
+  if (client.output.empty()) {
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = client.socketFD;
+    epoll_ctl(epollFD, EPOLL_CTL_MOD, client.socketFD, &event);
   }
-  // Once the connection has been accepted, keep reading until
-  // handleClientConnection() gives an error.
-  while (handleClientConnection(readSocket) == 0)
-    ;
+  return true;
 }
 
-int socketServer::handleClientConnection(int readSocket) {
-  char msgTypeBuffer;
-  readData(readSocket, &msgTypeBuffer, sizeof(char));
-  switch (msgTypeBuffer) {
+/**
+ * Handles one message from a client's input buffer
+ *
+ * @param client the connection the message came from
+ * @param data the start of the message, beginning with its type
+ * @param size the number of bytes received from data onwards
+ * @param failed set if the message is malformed
+ * @returns the size of the message, or 0 if it has not all arrived
+ */
+size_t socketServer::handleMessage(clientConnection &client, const char *data,
+                                   size_t size, bool &failed) {
+  const char *body = data + sizeof(char);
+  size_t available = size - sizeof(char);
+  uint64_t timestamp;
+  uint32_t header[2];
+
+  auto reject = [&failed](const std::string &reason) -> size_t {
+    std::cerr << "Closing client connection: " << reason << std::endl;
+    failed = true;
+    return 0;
+  };
+
+  switch (data[0]) {
     case SESSION_START:
-      handleSessionStart(readSocket);
-      break;
+      if (available < sizeof(uint64_t)) {
+        return 0;
+      }
+      if (!handleSessionStart(client, body)) {
+        failed = true;
+      }
+      return sizeof(char) + sizeof(uint64_t);
 
     case SESSION_END:
-      handleSessionEnd(readSocket);
-      return 1;
+      if (available < sizeof(uint64_t)) {
+        return 0;
+      }
+      memcpy(&timestamp, body, sizeof(uint64_t));
+      if (client.inSession &&
+          !handleSessionEnd(client, client.clock.toServerTime(timestamp))) {
+        failed = true;
+      }
+      return sizeof(char) + sizeof(uint64_t);
 
-    case SESSION_TAG:
-      handleTag(readSocket);
-      break;
+    case SESSION_TAG: {
+      size_t tagSize;
+      if (available < sizeof(size_t)) {
+        return 0;
+      }
+      memcpy(&tagSize, body, sizeof(size_t));
+      if (tagSize > TAG_BATCH_MAX_PAYLOAD) {
+        return reject("oversized tag of " + std::to_string(tagSize) +
+                      " bytes");
+      }
+      if (available < sizeof(size_t) + tagSize + sizeof(uint64_t)) {
+        return 0;
+      }
+      memcpy(&timestamp, body + sizeof(size_t) + tagSize, sizeof(uint64_t));
+      handleTag(client, body + sizeof(size_t), tagSize, timestamp);
+      return sizeof(char) + sizeof(size_t) + tagSize + sizeof(uint64_t);
+    }
+
+    case SESSION_TAG_BATCH: {
+      if (available < TAG_BATCH_HEADER_SIZE) {
+        return 0;
+      }
+      uint8_t version = (uint8_t)body[0];
+      uint32_t payloadSize;
+      memcpy(&payloadSize, body + sizeof(char), sizeof(uint32_t));
+      if (version != TAG_PROTOCOL_VERSION) {
+        return reject("unsupported tag protocol version " +
+                      std::to_string(version));
+      }
+      if (payloadSize > TAG_BATCH_MAX_PAYLOAD) {
+        return reject("oversized tag frame of " + std::to_string(payloadSize) +
+                      " bytes");
+      }
+      if (available < TAG_BATCH_HEADER_SIZE + payloadSize) {
+        return 0;
+      }
+      // The frame is decoded where it was received, without a copy.
+      if (!handleTagBatch(client, body + TAG_BATCH_HEADER_SIZE, payloadSize)) {
+        return reject("malformed tag frame");
+      }
+      return sizeof(char) + TAG_BATCH_HEADER_SIZE + payloadSize;
+    }
+
+    case TAG_REGISTER:
+    case REGION_REGISTER:
+      if (available < sizeof(header)) {
+        return 0;
+      }
+      memcpy(header, body, sizeof(header));
+      if (header[1] > TAG_BATCH_MAX_PAYLOAD ||
+          (data[0] == TAG_REGISTER && header[0] >= TAG_REGISTER_MAX_IDS)) {
+        return reject("invalid registration for ID " +
+                      std::to_string(header[0]));
+      }
+      if (available < sizeof(header) + header[1]) {
+        return 0;
+      }
+      if (data[0] == TAG_REGISTER) {
+        handleTagRegister(client, header[0], body + sizeof(header), header[1]);
+      } else {
+        handleRegionRegister(client, header[0], body + sizeof(header),
+                             header[1]);
+      }
+      return sizeof(char) + sizeof(header) + header[1];
+
+    case SESSION_TAG_ID:
+    case REGION_BEGIN:
+    case REGION_END: {
+      if (available < TAG_RECORD_MESSAGE_SIZE) {
+        return 0;
+      }
+      uint8_t kind = data[0] == SESSION_TAG_ID
+                         ? TAG_EVENT_TAG
+                         : data[0] == REGION_BEGIN ? TAG_EVENT_REGION_BEGIN
+                                                   : TAG_EVENT_REGION_END;
+      if (!dispatchTag(client, readRecord(body, kind))) {
+        return reject("event with an unregistered ID");
+      }
+      return sizeof(char) + TAG_RECORD_MESSAGE_SIZE;
+    }
+
+    case SESSION_TAG_FORMATTED: {
+      if (available < TAG_RECORD_MESSAGE_SIZE + sizeof(uint8_t)) {
+        return 0;
+      }
+      tagRecord record = readRecord(body, TAG_EVENT_FORMATTED);
+      record.argsSize = (uint8_t)body[TAG_RECORD_MESSAGE_SIZE];
+      if (record.argsSize > TAG_ARGS_SIZE) {
+        return reject("formatted tag with " +
+                      std::to_string(record.argsSize) +
+                      " bytes of arguments");
+      }
+      size_t length = TAG_RECORD_MESSAGE_SIZE + sizeof(uint8_t) +
+                      record.argsSize;
+      if (available < length) {
+        return 0;
+      }
+      memcpy(record.args, body + TAG_RECORD_MESSAGE_SIZE + sizeof(uint8_t),
+             record.argsSize);
+      if (!dispatchTag(client, record)) {
+        return reject("formatted tag with an unregistered ID");
+      }
+      return sizeof(char) + length;
+    }
+
+    case SHM_ATTACH: {
+      uint32_t nameSize;
+      if (available < sizeof(uint32_t)) {
+        return 0;
+      }
+      memcpy(&nameSize, body, sizeof(uint32_t));
+      if (nameSize > SHARED_RING_MAX_NAME) {
+        return reject("invalid shared memory ring name");
+      }
+      if (available < sizeof(uint32_t) + nameSize) {
+        return 0;
+      }
+      if (!handleSharedMemoryAttach(client, body + sizeof(uint32_t),
+                                    nameSize)) {
+        return reject("could not attach to its shared memory ring");
+      }
+      return sizeof(char) + sizeof(uint32_t) + nameSize;
+    }
+
+    case CLOCK_PROBE:
+      if (available < sizeof(uint64_t)) {
+        return 0;
+      }
+      if (!handleClockProbe(client, nanos())) {
+        failed = true;
+      }
+      return sizeof(char) + sizeof(uint64_t);
+
+    case CLOCK_SAMPLES: {
+      uint32_t probeCount;
+      if (available < sizeof(uint32_t)) {
+        return 0;
+      }
+      memcpy(&probeCount, body, sizeof(uint32_t));
+      if (probeCount > CLOCK_SYNC_MAX_PROBES) {
+        return reject("too many clock probes: " + std::to_string(probeCount));
+      }
+      size_t probeSize = 4 * probeCount * sizeof(uint64_t);
+      if (available < sizeof(uint32_t) + probeSize) {
+        return 0;
+      }
+      std::vector<uint64_t> probes(4 * probeCount);
+      memcpy(probes.data(), body + sizeof(uint32_t), probeSize);
+      client.clock.addBurst(probes);
+      return sizeof(char) + sizeof(uint32_t) + probeSize;
+    }
 
     default:
-      std::cerr << msgTypeBuffer << std::endl;
-      printError("received unknown msg code");
+      return reject("unknown message type " + std::to_string((int)data[0]));
   }
-
-  return 0;
 }
 
-void socketServer::handleSessionStart(int readSocket) {
+bool socketServer::handleSessionStart(clientConnection &client,
+                                      const char *body) {
   uint64_t timestamp;
-  read(readSocket, &timestamp, sizeof(uint64_t));
+  memcpy(&timestamp, body, sizeof(uint64_t));
 
-  socketServer::handler->startHandler(timestamp);
+  // Every session is its own window over the handler's measurement, so a
+  // client can start one while others are open.
+  if (!client.inSession) {
+    client.sessionID = nextSessionID++;
+    client.inSession = true;
+    client.threadIDs.clear();
+    client.clock.restart();
+    activeSessions++;
+    handler->startHandler(client.sessionID,
+                          client.clock.toServerTime(timestamp));
+  }
 
   char response = HANDSHAKE_OK;
-  writeData(readSocket, &response, sizeof(char));
+  return writeData(client, &response, sizeof(char));
 }
 
-void socketServer::handleSessionEnd(int readSocket) {
-  uint64_t timestamp;
-  read(readSocket, &timestamp, sizeof(uint64_t));
+bool socketServer::handleSessionEnd(clientConnection &client,
+                                    uint64_t timestamp) {
+  // The client pushes every record before it sends the end message.
+  bool failed = false;
+  if (client.sharedRing) {
+    drainSharedMemory(client, failed);
+    uint64_t discarded = client.pendingRecords.size() +
+                         client.discardedRecords;
+    if (discarded) {
+      std::cerr << "Discarded " << discarded
+                << " shared memory tags with unknown kinds or unregistered IDs"
+                << std::endl;
+      client.pendingRecords.clear();
+      client.discardedRecords = 0;
+    }
+    if (client.sharedRing->droppedCount()) {
+      std::cerr << "Client dropped " << client.sharedRing->droppedCount()
+                << " tags because its shared memory ring was full"
+                << std::endl;
+    }
+  }
+
+  clockEstimate estimate = client.clock.estimate();
+  std::cout << "Client clock offset " << estimate.offset << " ns, drift "
+            << estimate.driftPPM << " ppm, error bound "
+            << estimate.errorBound << " ns over " << estimate.measurements
+            << " probe bursts" << std::endl;
+
+  handler->clockSyncHandler(client.sessionID, estimate);
+  handler->endHandler(client.sessionID, timestamp);
+  handler->releaseSessionTags(client.sessionID);
+
+  client.inSession = false;
+  activeSessions--;
+  if (activeSessions == 0) {
+    sessionsEnded = true;
+  }
+  return !failed;
+}
+
+void socketServer::handleTag(clientConnection &client, const char *tag,
+                             size_t tagSize, uint64_t timestamp) {
+  // Legacy tags do not say which thread sent them, and may include the null
+  // terminator.
+  if (!client.inSession) {
+    return;
+  }
+  std::string message(tag, strnlen(tag, tagSize));
+  handler->tagHandler(client.sessionID, client.clock.toServerTime(timestamp),
+                      handler->internTag(message),
+                      handlerThreadID(client, 0), TAG_CPU_UNKNOWN);
+}
 
-  socketServer::handler->endHandler(timestamp);
+void socketServer::handleTagRegister(clientConnection &client,
+                                     uint32_t clientTagID, const char *tag,
+                                     size_t tagSize) {
+  if (client.tagIDs.size() <= clientTagID) {
+    client.tagIDs.resize(clientTagID + 1, UINT32_MAX);
+  }
+  client.tagIDs[clientTagID] = handler->internTag(std::string(tag, tagSize));
 }
 
-void socketServer::handleTag(int socketFD) {
-  // Timestamps is pushed with an empty string so that the nanoseconds timestamp
-  // can be recorded as accurately as possible.
+void socketServer::handleRegionRegister(clientConnection &client,
+                                        uint32_t regionHash, const char *name,
+                                        size_t nameSize) {
+  client.regionIDs[regionHash] =
+      handler->internTag(std::string(name, nameSize));
+}
 
-  // This receives the size of the string that will be transmitted.
-  size_t tagSize;
-  readData(socketFD, &tagSize, sizeof(size_t));
+tagRecord socketServer::readRecord(const char *body, uint8_t kind) {
+  tagRecord record;
+  size_t position = 0;
+  memcpy(&record.tagID, body + position, sizeof(uint32_t));
+  position += sizeof(uint32_t);
+  memcpy(&record.timestamp, body + position, sizeof(uint64_t));
+  position += sizeof(uint64_t);
+  memcpy(&record.threadID, body + position, sizeof(uint32_t));
+  position += sizeof(uint32_t);
+  memcpy(&record.cpu, body + position, sizeof(uint32_t));
+  record.kind = kind;
+  record.argsSize = 0;
+  return record;
+}
 
-  // This receives the tag string from the client.
-  char *message = (char *)calloc(tagSize, sizeof(char));
-  readData(socketFD, message, tagSize);
+uint32_t socketServer::handlerThreadID(clientConnection &client,
+                                       uint32_t threadID) {
+  auto entry = client.threadIDs.find(threadID);
+  if (entry != client.threadIDs.end()) {
+    return entry->second;
+  }
+  // Threads are numbered from 0 in the order they first tag in the session.
+  uint32_t handlerID = (uint32_t)client.threadIDs.size();
+  client.threadIDs.emplace(threadID, handlerID);
+  return handlerID;
+}
 
-  // Receive timestamp
-  uint64_t timestamp;
-  readData(socketFD, &timestamp, sizeof(uint64_t));
+bool socketServer::dispatchTag(clientConnection &client,
+                               const tagRecord &record) {
+  if (!isRegistered(client, record.tagID, record.kind) ||
+      (record.kind == TAG_EVENT_FORMATTED && record.argsSize > TAG_ARGS_SIZE)) {
+    return false;
+  }
+  // Events sent outside a session have no window to go in.
+  if (!client.inSession) {
+    return true;
+  }
+
+  uint64_t timestamp = client.clock.toServerTime(record.timestamp);
+  uint32_t threadID = handlerThreadID(client, record.threadID);
+  switch (record.kind) {
+    case TAG_EVENT_TAG:
+      handler->tagHandler(client.sessionID, timestamp,
+                          client.tagIDs[record.tagID], threadID, record.cpu);
+      break;
 
-  socketServer::handler->tagHandler(timestamp, message);
+    case TAG_EVENT_FORMATTED: {
+      // The formatted string is only kept for the session, so a tag that
+      // carries a counter does not grow the string table for good. Repeated
+      // values within the session share an ID.
+      std::string tag =
+          formatTag(handler->tagName(client.tagIDs[record.tagID]),
+                    record.args, record.argsSize);
+      handler->tagHandler(client.sessionID, timestamp,
+                          handler->internSessionTag(client.sessionID, tag),
+                          threadID, record.cpu);
+      break;
+    }
 
-  free(message);
+    case TAG_EVENT_REGION_BEGIN:
+    case TAG_EVENT_REGION_END:
+      handler->regionHandler(client.sessionID, timestamp,
+                             client.regionIDs[record.tagID], threadID,
+                             record.cpu,
+                             record.kind == TAG_EVENT_REGION_BEGIN);
+      break;
+  }
+  return true;
+}
+
+bool socketServer::handleTagBatch(clientConnection &client,
+                                  const char *payload, size_t payloadSize) {
+  bool registered = true;
+  bool decoded =
+      decodeTagBatch(payload, payloadSize,
+                     [this, &client, &registered](const tagRecord &record) {
+                       if (registered) {
+                         registered = dispatchTag(client, record);
+                       }
+                     });
+  return decoded && registered;
+}
+
+bool socketServer::handleClockProbe(clientConnection &client,
+                                    uint64_t receiveTime) {
+  uint64_t times[2];
+  times[0] = receiveTime;
+
+  // The client keeps its own send time, so only t2 and t3 are sent back.
+  times[1] = nanos();
+  return writeData(client, times, sizeof(times));
+}
+
+bool socketServer::handleSharedMemoryAttach(clientConnection &client,
+                                            const char *name,
+                                            size_t nameSize) {
+  client.sharedRing.reset(
+      sharedTagRing::attach(std::string(name, nameSize)));
+  if (!client.sharedRing) {
+    return false;
+  }
+  // Nothing else needs to find the ring, and unlinking now means it cannot be
+  // leaked if either side exits without cleaning up.
+  client.sharedRing->unlink();
+  return true;
+}
+
+size_t socketServer::drainSharedMemory(clientConnection &client,
+                                       bool &failed) {
+  tagRecord batch[TAG_FLUSH_BATCH_SIZE];
+  size_t count;
+  size_t total = 0;
+
+  // Records held back for a registration that has since been read go first.
+  if (!client.pendingRecords.empty()) {
+    std::vector<tagRecord> waiting;
+    waiting.swap(client.pendingRecords);
+    for (tagRecord &record : waiting) {
+      if (!dispatchTag(client, record)) {
+        client.pendingRecords.push_back(record);
+      }
+    }
+  }
+
+  while ((count = client.sharedRing->pop(batch, TAG_FLUSH_BATCH_SIZE)) > 0) {
+    total += count;
+    for (size_t i = 0; i < count; i++) {
+      // The ring is writable by the client, so a record is checked as the
+      // socket paths check theirs before anything reads its arguments.
+      if (batch[i].kind == TAG_EVENT_FORMATTED &&
+          batch[i].argsSize > TAG_ARGS_SIZE) {
+        std::cerr << "Closing client connection: shared memory tag with "
+                  << (int)batch[i].argsSize << " bytes of arguments"
+                  << std::endl;
+        failed = true;
+        return total;
+      }
+      // A kind the client cannot have meant will never be registered.
+      if (batch[i].kind > TAG_EVENT_FORMATTED) {
+        client.discardedRecords++;
+        continue;
+      }
+      // The client writes a registration to the socket before it pushes a
+      // record that uses it, but the ring can be read first.
+      if (!dispatchTag(client, batch[i])) {
+        if (client.pendingRecords.size() < SHM_MAX_PENDING_RECORDS) {
+          client.pendingRecords.push_back(batch[i]);
+        } else {
+          client.discardedRecords++;
+        }
+      }
+    }
+  }
+  return total;
+}
+
+bool socketServer::isRegistered(clientConnection &client, uint32_t tagID,
+                                uint8_t kind) {
+  switch (kind) {
+    case TAG_EVENT_TAG:
+    case TAG_EVENT_FORMATTED:
+      return tagID < client.tagIDs.size() &&
+             client.tagIDs[tagID] != UINT32_MAX;
+    case TAG_EVENT_REGION_BEGIN:
+    case TAG_EVENT_REGION_END:
+      return client.regionIDs.find(tagID) != client.regionIDs.end();
+    default:
+      return false;
+  }
+}
+
+/**
+ * Decodes the payload of a SESSION_TAG_BATCH frame
+ *
+ * @param payload the bytes following the frame header
+ * @param size the number of bytes in the payload
+ * @param onTag called with every record in the frame, holding the client's
+ * tag ID
+ * @returns true if the whole payload was decoded, false if it is malformed
+ */
+bool decodeTagBatch(const char *payload, size_t size,
+                    const tagCallback &onTag) {
+  const char *position = payload;
+  const char *end = payload + size;
+  uint32_t count;
+  tagRecord record;
+
+  if (!getFixed(position, end, count) ||
+      !getFixed(position, end, record.timestamp)) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t delta;
+    uint64_t taggedID;
+    uint64_t threadID;
+    uint64_t cpu;
+    if (!getVarint(position, end, delta) ||
+        !getVarint(position, end, taggedID) || (taggedID >> 2) > UINT32_MAX ||
+        !getVarint(position, end, threadID) || threadID > UINT32_MAX ||
+        !getVarint(position, end, cpu) || cpu > UINT32_MAX) {
+      return false;
+    }
+    record.timestamp += zigzagDecode(delta);
+    record.tagID = (uint32_t)(taggedID >> 2);
+    record.kind = (uint8_t)(taggedID & 3);
+    record.threadID = (uint32_t)threadID;
+    record.cpu = (uint32_t)cpu;
+    record.argsSize = 0;
+    if (record.kind == TAG_EVENT_FORMATTED) {
+      if (position >= end || (uint8_t)*position > TAG_ARGS_SIZE ||
+          (size_t)(end - position) < 1 + (size_t)(uint8_t)*position) {
+        return false;
+      }
+      record.argsSize = (uint8_t)*position++;
+      memcpy(record.args, position, record.argsSize);
+      position += record.argsSize;
+    }
+    onTag(record);
+  }
+
+  return position == end;
 }
 
 //####################################################################
-socketClient::socketClient(){}
+socketClient::socketClient()
+    : sock(-1),
+      asyncRingCapacity(0),
+      id(nextClientID++),
+      clockSyncInterval(0),
+      clockSyncRunning(false) {}
 
-socketClient::socketClient(uint16_t portNumber, std::string serverIP) {
+socketClient::socketClient(uint16_t portNumber, std::string serverIP)
+    : asyncRingCapacity(0),
+      id(nextClientID++),
+      clockSyncInterval(0),
+      clockSyncRunning(false) {
   // This sets the socket to IPv4 and to the port number given.
   serverAddress.sin_family = AF_INET;
   serverAddress.sin_port = htons(portNumber);
@@ -162,55 +896,165 @@ socketClient::socketClient(uint16_t portNumber, std::string serverIP) {
   if (connect(sock, (sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) {
     printError("Client connection failed: ");
   }
+
+  // Clock probes and tags are small messages that should go out immediately.
+  int noDelay = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
 }
 
-socketClient::~socketClient() { close(sock); }
+socketClient::socketClient(socketClient &&other)
+    : sock(-1),
+      asyncRingCapacity(0),
+      id(nextClientID++),
+      clockSyncInterval(other.clockSyncInterval),
+      clockSyncRunning(false) {
+  other.stopClockSync();
+  // The flusher sends through the client that created it, so it is drained on
+  // the old client and recreated on this one.
+  if (other.flusher) {
+    other.flusher.reset();
+    asyncRingCapacity = other.asyncRingCapacity;
+  }
+  sock = other.sock;
+  serverAddress = other.serverAddress;
+  tagIDs = std::move(other.tagIDs);
+  regionNames = std::move(other.regionNames);
+  sharedRing = std::move(other.sharedRing);
+  other.sock = -1;
+  if (asyncRingCapacity) {
+    enableAsyncTags(asyncRingCapacity);
+  }
+}
+
+socketClient::~socketClient() {
+  stopClockSync();
+  flusher.reset();
+  if (sharedRing) {
+    // The server unlinks the ring when it attaches, but it may never have.
+    sharedRing->unlink();
+  }
+  if (sock >= 0) {
+    close(sock);
+  }
+}
 
 void socketClient::readData(void *buf, size_t size) {
-  if (read(sock, buf, size) == -1) {
-    printError("Client failed to completely read from socket\n");
+  char *tmp = (char *)buf;
+  ssize_t numRead;
+
+  while (size) {
+    if ((numRead = read(sock, tmp, size)) <= 0) {
+      printError("Client failed to completely read from socket\n");
+    }
+    tmp += numRead;
+    size -= numRead;
   }
 }
 
 void socketClient::writeData(void *buf, size_t size) {
-  int bytesSent;
+  char *tmp = (char *)buf;
+  ssize_t bytesSent;
 
-  if ((bytesSent = send(sock, buf, size, 0)) <= 0) {
-    printError("Client failed to completely send on socket. Client sent " +
-               std::to_string(bytesSent) + " bytes, but expected to send " +
-               std::to_string(size) + " bytes: ");
+  // A large batch of tags may take more than one send to go out.
+  while (size) {
+    if ((bytesSent = send(sock, tmp, size, 0)) <= 0) {
+      printError("Client failed to completely send on socket. Client sent " +
+                 std::to_string(bytesSent) + " bytes, but expected to send " +
+                 std::to_string(size) + " bytes: ");
+    }
+    tmp += bytesSent;
+    size -= bytesSent;
   }
 }
 
+void socketClient::enableAsyncTags(size_t ringCapacity) {
+  asyncRingCapacity = ringCapacity;
+  flusher.reset(new tagFlusher(
+      ringCapacity, [this](const tagRecord *records, size_t count) {
+        sendRecords(records, count);
+      }));
+  flusher->start();
+}
+
+uint64_t socketClient::droppedTags() {
+  return (flusher ? flusher->droppedCount() : 0) +
+         (sharedRing ? sharedRing->droppedCount() : 0);
+}
+
+uint64_t socketClient::tagOverflows() {
+  return flusher ? flusher->overflowCount() : 0;
+}
+
+void socketClient::enableSharedMemory(size_t ringCapacity) {
+  static std::atomic<int> ringCount(0);
+  std::string name = "/powerpack-" + std::to_string(getpid()) + "-" +
+                     std::to_string(ringCount++);
+
+  sharedRing.reset(sharedTagRing::create(name, ringCapacity));
+
+  std::vector<char> buffer;
+  buffer.push_back(SHM_ATTACH);
+  putFixed<uint32_t>(buffer, (uint32_t)name.size());
+  buffer.insert(buffer.end(), name.begin(), name.end());
+  writeMessage(buffer);
+}
+
 void socketClient::sendSessionStart() {
   char buffer[512];
-  uint64_t currTime = nanos();
   char tagBuf = SESSION_START;
   size_t position = 0;
 
+  // The offset has to be known before the start timestamp is mapped.
+  syncClock();
+  uint64_t currTime = nanos();
+
   memcpy(buffer + position, &tagBuf, sizeof(char));
   position += sizeof(char);
 
   memcpy(buffer + position, &currTime, sizeof(uint64_t));
   position += sizeof(uint64_t);
 
-  writeData(buffer, position);
+  // The flusher is stopped at the end of every session.
+  if (flusher) {
+    flusher->start();
+  }
 
   char response;
-  readData(&response, sizeof(char));
+  {
+    std::lock_guard<std::mutex> lock(sendMutex);
+    writeData(buffer, position);
+    readData(&response, sizeof(char));
+  }
 
   if (response != HANDSHAKE_OK) {
     std::cerr << "Handshake with server failed!" << std::endl;
     exit(-1);
   }
   std::cout << "Handshake OK!" << std::endl;
+
+  startClockSync();
 }
 
 void socketClient::sendSessionEnd() {
   char buffer[512];
-  uint64_t currTime = nanos();
   char tagBuf = SESSION_END;
   size_t position = 0;
+  uint64_t currTime = nanos();
+
+  stopClockSync();
+
+  // Every queued tag has to reach the server before it closes the session.
+  if (flusher) {
+    flusher->stop();
+    if (flusher->droppedCount()) {
+      std::cerr << "Dropped " << flusher->droppedCount() << " tags in "
+                << flusher->overflowCount() << " tag buffer overflows"
+                << std::endl;
+    }
+  }
+
+  // A final burst lets the server fit the drift over the whole session.
+  syncClock();
 
   memcpy(buffer + position, &tagBuf, sizeof(char));
   position += sizeof(char);
@@ -218,27 +1062,284 @@ void socketClient::sendSessionEnd() {
   memcpy(buffer + position, &currTime, sizeof(uint64_t));
   position += sizeof(uint64_t);
 
-  writeData(buffer, position);
+  writeMessage(buffer, position);
+}
+
+/**
+ * Sends a burst of CLOCK_SYNC_PROBES probes and then their results. The send
+ * lock is held for one probe and its reply at a time, so tags sent from other
+ * threads only wait for a single round trip.
+ */
+void socketClient::syncClock() {
+  std::vector<char> buffer;
+  uint64_t probes[CLOCK_SYNC_PROBES][4];
+
+  for (int i = 0; i < CLOCK_SYNC_PROBES; i++) {
+    char probe[sizeof(char) + sizeof(uint64_t)];
+    uint64_t serverTimes[2];
+    probe[0] = CLOCK_PROBE;
+    {
+      std::lock_guard<std::mutex> lock(sendMutex);
+      probes[i][0] = nanos();
+      memcpy(probe + sizeof(char), &probes[i][0], sizeof(uint64_t));
+      writeData(probe, sizeof(probe));
+      readData(serverTimes, sizeof(serverTimes));
+      probes[i][3] = nanos();
+    }
+    probes[i][1] = serverTimes[0];
+    probes[i][2] = serverTimes[1];
+  }
+
+  buffer.push_back(CLOCK_SAMPLES);
+  putFixed<uint32_t>(buffer, CLOCK_SYNC_PROBES);
+  const char *results = (const char *)probes;
+  buffer.insert(buffer.end(), results, results + sizeof(probes));
+  std::lock_guard<std::mutex> lock(sendMutex);
+  writeData(buffer.data(), buffer.size());
+}
+
+void socketClient::setClockSyncInterval(uint64_t interval) {
+  clockSyncInterval = interval;
+}
+
+void socketClient::startClockSync() {
+  if (!clockSyncInterval || clockSyncRunning) {
+    return;
+  }
+
+  clockSyncRunning = true;
+  clockSyncThread = std::thread([this]() {
+    std::unique_lock<std::mutex> lock(clockSyncLock);
+    while (!clockSyncWake.wait_for(
+        lock, std::chrono::milliseconds(clockSyncInterval),
+        [this]() { return !clockSyncRunning; })) {
+      lock.unlock();
+      syncClock();
+      lock.lock();
+    }
+  });
+}
+
+void socketClient::stopClockSync() {
+  {
+    std::lock_guard<std::mutex> lock(clockSyncLock);
+    if (!clockSyncRunning) {
+      return;
+    }
+    clockSyncRunning = false;
+  }
+  clockSyncWake.notify_all();
+  clockSyncThread.join();
 }
 
 void socketClient::sendTag(std::string tagName) {
-  char buffer[512];
-  uint64_t currTime = nanos();
-  char tagBuf = SESSION_TAG;
+  sendTag(registerTag(tagName));
+}
+
+void socketClient::sendTag(uint32_t tagID) {
+  sendEvent(tagID, TAG_EVENT_TAG);
+}
+
+void socketClient::sendRegionBegin(uint32_t regionHash) {
+  sendEvent(regionHash, TAG_EVENT_REGION_BEGIN);
+}
+
+void socketClient::sendRegionEnd(uint32_t regionHash) {
+  sendEvent(regionHash, TAG_EVENT_REGION_END);
+}
+
+uint64_t socketClient::clientID() { return id; }
+
+void socketClient::sendEvent(uint32_t tagID, uint8_t kind) {
+  tagRecord record;
+  record.tagID = tagID;
+  record.kind = kind;
+  record.argsSize = 0;
+  sendRecord(record);
+}
+
+void socketClient::sendRecord(tagRecord &record) {
+  record.timestamp = nanos();
+  record.threadID = tagThreadID();
+  record.cpu = tagCPU();
+
+  if (sharedRing) {
+    sharedRing->push(record);
+    return;
+  }
+
+  if (flusher) {
+    flusher->push(record);
+    return;
+  }
+
+  char buffer[sizeof(char) + 3 * sizeof(uint32_t) + sizeof(uint64_t) +
+              sizeof(uint8_t) + TAG_ARGS_SIZE];
+  char tagBuf;
+  switch (record.kind) {
+    case TAG_EVENT_FORMATTED:
+      tagBuf = SESSION_TAG_FORMATTED;
+      break;
+    case TAG_EVENT_REGION_BEGIN:
+      tagBuf = REGION_BEGIN;
+      break;
+    case TAG_EVENT_REGION_END:
+      tagBuf = REGION_END;
+      break;
+    default:
+      tagBuf = SESSION_TAG_ID;
+  }
   size_t position = 0;
-  size_t tagSize = tagName.size() + 1;
 
   memcpy(buffer + position, &tagBuf, sizeof(char));
   position += sizeof(char);
 
-  memcpy(buffer + position, &tagSize, sizeof(size_t));
-  position += sizeof(size_t);
+  memcpy(buffer + position, &record.tagID, sizeof(uint32_t));
+  position += sizeof(uint32_t);
 
-  memcpy(buffer + position, tagName.c_str(), tagName.size() + 1);
-  position += tagName.size() + 1;
-
-  memcpy(buffer + position, &currTime, sizeof(uint64_t));
+  memcpy(buffer + position, &record.timestamp, sizeof(uint64_t));
   position += sizeof(uint64_t);
 
-  writeData(buffer, position);
+  memcpy(buffer + position, &record.threadID, sizeof(uint32_t));
+  position += sizeof(uint32_t);
+
+  memcpy(buffer + position, &record.cpu, sizeof(uint32_t));
+  position += sizeof(uint32_t);
+
+  if (record.kind == TAG_EVENT_FORMATTED) {
+    memcpy(buffer + position, &record.argsSize, sizeof(uint8_t));
+    position += sizeof(uint8_t);
+
+    memcpy(buffer + position, record.args, record.argsSize);
+    position += record.argsSize;
+  }
+
+  writeMessage(buffer, position);
+}
+
+uint32_t socketClient::registerTag(std::string tagName) {
+  // IDs never change once registered, so each thread can keep the ones it has
+  // seen and skip the shared table.
+  static thread_local uint64_t cachedClient = 0;
+  static thread_local std::unordered_map<std::string, uint32_t> cachedIDs;
+
+  if (cachedClient != id) {
+    cachedIDs.clear();
+    cachedClient = id;
+  }
+  auto cached = cachedIDs.find(tagName);
+  if (cached != cachedIDs.end()) {
+    return cached->second;
+  }
+
+  std::lock_guard<std::mutex> lock(tagIDsLock);
+
+  auto entry = tagIDs.find(tagName);
+  if (entry != tagIDs.end()) {
+    cachedIDs.emplace(tagName, entry->second);
+    return entry->second;
+  }
+
+  uint32_t tagID = (uint32_t)tagIDs.size();
+  uint32_t tagSize = (uint32_t)tagName.size();
+  std::vector<char> buffer;
+  buffer.push_back(TAG_REGISTER);
+  putFixed<uint32_t>(buffer, tagID);
+  putFixed<uint32_t>(buffer, tagSize);
+  buffer.insert(buffer.end(), tagName.begin(), tagName.end());
+  writeMessage(buffer);
+
+  tagIDs.emplace(tagName, tagID);
+  cachedIDs.emplace(tagName, tagID);
+  return tagID;
+}
+
+uint32_t socketClient::registerFormat(const char *format) {
+  // Formats are nearly always string literals, so the address is enough to
+  // find one again without building a std::string.
+  static thread_local uint64_t cachedClient = 0;
+  static thread_local std::unordered_map<const char *, uint32_t> cachedIDs;
+
+  if (cachedClient != id) {
+    cachedIDs.clear();
+    cachedClient = id;
+  }
+  auto cached = cachedIDs.find(format);
+  if (cached != cachedIDs.end()) {
+    return cached->second;
+  }
+
+  uint32_t tagID = registerTag(format);
+  cachedIDs.emplace(format, tagID);
+  return tagID;
+}
+
+void socketClient::registerRegion(uint32_t regionHash,
+                                  std::string regionName) {
+  std::lock_guard<std::mutex> lock(tagIDsLock);
+
+  auto entry = regionNames.find(regionHash);
+  if (entry != regionNames.end()) {
+    if (entry->second != regionName) {
+      std::cerr << "Region \"" << regionName << "\" has the same hash as \""
+                << entry->second << "\" and will be reported under that name"
+                << std::endl;
+    }
+    return;
+  }
+
+  uint32_t nameSize = (uint32_t)regionName.size();
+  std::vector<char> buffer;
+  buffer.push_back(REGION_REGISTER);
+  putFixed<uint32_t>(buffer, regionHash);
+  putFixed<uint32_t>(buffer, nameSize);
+  buffer.insert(buffer.end(), regionName.begin(), regionName.end());
+  writeMessage(buffer);
+
+  regionNames.emplace(regionHash, regionName);
+}
+
+void socketClient::writeMessage(const void *buf, size_t size) {
+  std::lock_guard<std::mutex> lock(sendMutex);
+  writeData((void *)buf, size);
+}
+
+void socketClient::writeMessage(const std::vector<char> &buffer) {
+  writeMessage(buffer.data(), buffer.size());
+}
+
+void socketClient::sendRecords(const tagRecord *records, size_t count) {
+  std::vector<char> buffer;
+  uint64_t previous = records[0].timestamp;
+
+  buffer.reserve(TAG_BATCH_HEADER_SIZE + sizeof(char) + sizeof(uint32_t) +
+                 sizeof(uint64_t) + count * 10);
+  buffer.push_back(SESSION_TAG_BATCH);
+  buffer.push_back(TAG_PROTOCOL_VERSION);
+  // The payload size is filled in once the records are encoded.
+  putFixed<uint32_t>(buffer, 0);
+
+  size_t payloadStart = buffer.size();
+  putFixed<uint32_t>(buffer, (uint32_t)count);
+  putFixed<uint64_t>(buffer, previous);
+  for (size_t i = 0; i < count; i++) {
+    // Timestamps can step backwards if the system clock is adjusted, so the
+    // delta is signed.
+    putVarint(buffer, zigzagEncode((int64_t)(records[i].timestamp - previous)));
+    putVarint(buffer, (uint64_t)records[i].tagID << 2 | records[i].kind);
+    putVarint(buffer, records[i].threadID);
+    putVarint(buffer, records[i].cpu);
+    if (records[i].kind == TAG_EVENT_FORMATTED) {
+      buffer.push_back((char)records[i].argsSize);
+      buffer.insert(buffer.end(), records[i].args,
+                    records[i].args + records[i].argsSize);
+    }
+    previous = records[i].timestamp;
+  }
+
+  uint32_t payloadSize = (uint32_t)(buffer.size() - payloadStart);
+  memcpy(buffer.data() + payloadStart - sizeof(uint32_t), &payloadSize,
+         sizeof(uint32_t));
+
+  writeMessage(buffer);
 }
@@ -4,19 +4,35 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <clocale>
+#include <condition_variable>
 #include <cstring>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
+#include "clocksync.h"
 #include "eventhandler.h"
+#include "sharedring.h"
+#include "tagbuffer.h"
 #include "timeutils.h"
+#include "wireformat.h"
 
 // CONTROL MESSAGE MACROS
 
@@ -24,6 +40,120 @@
 #define SESSION_END 1
 #define SESSION_TAG 2
 #define HANDSHAKE_OK 3
+#define SESSION_TAG_BATCH 4
+#define TAG_REGISTER 5
+#define SESSION_TAG_ID 6
+#define REGION_REGISTER 7
+#define REGION_BEGIN 8
+#define REGION_END 9
+#define SHM_ATTACH 10
+#define CLOCK_PROBE 11
+#define CLOCK_SAMPLES 12
+#define SESSION_TAG_FORMATTED 13
+
+// TAG REGISTRATION
+//
+// A TAG_REGISTER message maps a tag string to a client-chosen ID for the rest
+// of the connection. It is followed by the uint32_t ID, the uint32_t string
+// length and the string bytes without a null terminator. IDs are handed out
+// from 0 upwards. A SESSION_TAG_ID message is followed by the uint32_t ID of a
+// registered tag, its uint64_t timestamp, and the uint32_t thread ID and CPU
+// of the thread that sent it.
+//
+// A SESSION_TAG_FORMATTED message has the same fields as SESSION_TAG_ID
+// followed by the uint8_t size of its arguments and the argument bytes packed
+// by packTagArgs. The tag ID refers to a registered format string, which the
+// server fills in with the arguments.
+
+// This is the size of the body of SESSION_TAG_ID, REGION_BEGIN and REGION_END
+// messages.
+#define TAG_RECORD_MESSAGE_SIZE (3 * sizeof(uint32_t) + sizeof(uint64_t))
+
+// This is the most tag strings a single connection can register.
+#define TAG_REGISTER_MAX_IDS (1 << 24)
+
+// REGIONS
+//
+// Regions are named by a 32-bit hash of their name rather than a sequential
+// ID, so the hash can be computed at compile time. A REGION_REGISTER message
+// is followed by the uint32_t hash, the uint32_t name length and the name
+// bytes. REGION_BEGIN and REGION_END messages are followed by the uint32_t
+// hash of a registered region, a uint64_t timestamp, and the uint32_t thread
+// ID and CPU of the thread that sent it.
+
+// SHARED MEMORY TRANSPORT
+//
+// A client on the same host as the server can send tag and region events
+// through a sharedTagRing instead of the socket. The SHM_ATTACH message is
+// followed by the uint32_t length of the ring's name and the name bytes. All
+// other messages, including registrations, still go over the socket.
+
+// This is how long the server waits for socket traffic between polls of the
+// shared memory rings when they have gone empty.
+#define SHM_POLL_INTERVAL_MS 1
+
+// This is the most shared memory records of a client that can wait for their
+// registration. Records past it are discarded, so a client that never
+// registers an ID cannot grow the server without bound.
+#define SHM_MAX_PENDING_RECORDS 4096
+
+// CLOCK SYNCHRONIZATION
+//
+// The client and server clocks are compared with bursts of probe exchanges.
+// A CLOCK_PROBE message is followed by the uint64_t client send time t1, and
+// the server answers right away with its uint64_t receive time t2 and send
+// time t3. Once the client has the whole burst, it sends a CLOCK_SAMPLES
+// message followed by the uint32_t number of probes and t1, t2, t3 and the
+// client receive time t4 as uint64_t for each probe. The server uses them to
+// map every later client timestamp onto its own clock.
+
+// This is the number of probes in a burst.
+#define CLOCK_SYNC_PROBES 8
+
+// This is the most probes a CLOCK_SAMPLES message can hold.
+#define CLOCK_SYNC_MAX_PROBES 256
+
+// BATCHED FRAME FORMAT
+//
+// A SESSION_TAG_BATCH message is followed by a 1-byte protocol version and a
+// uint32_t payload size. The payload is a uint32_t record count and a uint64_t
+// base timestamp, then one record per tag: the zigzag varint difference
+// between its timestamp and the previous one (the base timestamp for the first
+// record), a varint holding the tag ID (or region hash) shifted left by two
+// bits with the TAG_EVENT_ kind in the low bits, and varints holding the
+// thread ID and CPU of the thread that made the record. TAG_EVENT_FORMATTED
+// records are followed by a byte holding the size of their arguments and the
+// argument bytes.
+
+#define TAG_PROTOCOL_VERSION 6
+#define TAG_BATCH_HEADER_SIZE (sizeof(char) + sizeof(uint32_t))
+#define TAG_BATCH_MAX_PAYLOAD (16 * 1024 * 1024)
+
+// This is called for every tag decoded from a batched frame with the ID the
+// client registered for it and its TAG_EVENT_ kind.
+typedef std::function<void(const tagRecord& record)> tagCallback;
+
+// This decodes the payload of a SESSION_TAG_BATCH frame and calls onTag for
+// every record in it. It returns false if the payload is malformed.
+bool decodeTagBatch(const char* payload, size_t size, const tagCallback& onTag);
+
+// SERVER EVENT LOOP
+//
+// The server accepts any number of clients and multiplexes them with epoll.
+// Sockets are non-blocking, and every connection keeps the bytes it has
+// received until a whole message is there, so a slow or stalled client never
+// holds up the others. The handler is only called from the event loop thread.
+// Each SESSION_START opens a session with a new ID, and sessions of different
+// clients overlap freely as windows over the handler's running measurement.
+
+// This is how many connection attempts can wait to be accepted.
+#define SERVER_LISTEN_BACKLOG 256
+
+// This is the most epoll events handled per wait.
+#define SERVER_MAX_EVENTS 64
+
+// This is how many bytes are read from a client at a time.
+#define SERVER_READ_SIZE (64 * 1024)
 
 /**
  * The socketServer class handles communication for the server side (meter side)
@@ -31,55 +161,214 @@
 class socketServer {
  public:
   socketServer(uint16_t portNumber, eventHandler* handler);
+  socketServer(socketServer&& other);
 
   ~socketServer();
 
-  // This blocks until it receives a connection from a client then continues to
-  // receive data from the client.
+  // This serves clients until every session that was started has ended, then
+  // closes the connections and returns. Any number of clients can connect and
+  // run sessions while it runs.
   void listenForClient();
 
+  // This serves clients and sessions until stop() is called.
+  void serve();
+
+  // This makes serve() or listenForClient() return. It can be called from any
+  // thread.
+  void stop();
+
  private:
-  // This is the file descriptor of the socket.
+  // This is the state of one client connection.
+  struct clientConnection {
+    int socketFD;
+    // bytes received that have not been handled yet, starting at consumed
+    std::vector<char> input;
+    size_t consumed;
+    // bytes that could not be sent yet because the socket was full
+    std::vector<char> output;
+    // true between the client's SESSION_START and SESSION_END
+    bool inSession;
+    // the ID the handler knows the current or last session by
+    uint32_t sessionID;
+
+    // This maps the client's tag IDs, which index this vector, to the IDs the
+    // handler interned the same strings under.
+    std::vector<uint32_t> tagIDs;
+
+    // This maps region hashes to the IDs the handler interned their names
+    // under.
+    std::unordered_map<uint32_t, uint32_t> regionIDs;
+
+    // This maps the client's thread IDs to ones numbered from 0 within the
+    // session.
+    std::unordered_map<uint32_t, uint32_t> threadIDs;
+
+    // This maps the client's clock onto the server's.
+    clockSync clock;
+
+    // This is the shared memory ring of the client, if it uses one, the
+    // records from it whose registration has not been read from the socket
+    // yet, and the number discarded this session for an unknown kind or for
+    // having no room to wait.
+    std::unique_ptr<sharedTagRing> sharedRing;
+    std::vector<tagRecord> pendingRecords;
+    uint64_t discardedRecords;
+  };
+
+  // This is the file descriptor of the listening socket.
   int sock;
+  // This is the epoll instance and an eventfd that wakes it for stop().
+  int epollFD;
+  int wakeFD;
   eventHandler* handler;
 
   // This stores information about the server that is being connected to.
   sockaddr_in address;
 
-  // This is a wrapper for socket read that stores the data in the given buffer.
-  void readData(int socketFD, void* buf, size_t size);
+  // These are the open connections, keyed by socket.
+  std::unordered_map<int, std::unique_ptr<clientConnection>> connections;
 
-  // This is a wrapper for socket write that sends data from the given buffer.
-  void writeData(int socketFD, void* buf, size_t size);
+  // This is the number of sessions that are open.
+  int activeSessions;
+
+  // This hands out session IDs.
+  uint32_t nextSessionID;
+
+  // This is set when the last session ends.
+  bool sessionsEnded;
+
+  // This is set by stop(), and once the sessions end while listenForClient()
+  // is waiting for them.
+  std::atomic<bool> stopping;
+
+  // This runs the event loop until stopping is set. If untilSessionsEnd is
+  // true it also stops once every session has ended.
+  void run(bool untilSessionsEnd);
+
+  // This accepts every waiting connection.
+  void acceptClients();
+
+  // This reads what a client has sent and handles every complete message. It
+  // returns false if the connection should be closed.
+  bool readClient(clientConnection& client);
+
+  // This closes a connection, ending its session if it was in one.
+  void closeClient(int socketFD);
+
+  // This sends data to a client, keeping what does not fit in the socket for
+  // when it drains. It returns false if the connection failed.
+  bool writeData(clientConnection& client, const void* buf, size_t size);
 
-  // This function interprets the data received in listenForClient() and calls
-  // the correct function to handle the communication.`
-  int handleClientConnection(int readSocket);
+  // This sends what is left in a client's output buffer.
+  bool flushOutput(clientConnection& client);
+
+  // This handles the message at the start of data. It returns the size of the
+  // message, or 0 if the message is not all there yet. failed is set if the
+  // message is malformed.
+  size_t handleMessage(clientConnection& client, const char* data,
+                       size_t size, bool& failed);
 
   // This does the things needed at a session start such as starting
   // the meter and taking the first timestamp.
-  void handleSessionStart(int readSocket);
+  bool handleSessionStart(clientConnection& client, const char* body);
 
   // This does the things needed at the end of a session such as
   // stopping the meter and dumping the timestamps and meter readings to a file.
-  void handleSessionEnd(int readSocket);
+  // It returns false if the client's shared memory ring held a malformed
+  // record.
+  bool handleSessionEnd(clientConnection& client, uint64_t timestamp);
 
   // This marks the timestamp and string of a tag that has been
   // received.
-  void handleTag(int socketFD);
+  void handleTag(clientConnection& client, const char* tag, size_t tagSize,
+                 uint64_t timestamp);
+
+  // This marks every tag in a batched frame.
+  bool handleTagBatch(clientConnection& client, const char* payload,
+                      size_t payloadSize);
+
+  // This records the string for a tag ID chosen by the client.
+  void handleTagRegister(clientConnection& client, uint32_t clientTagID,
+                         const char* tag, size_t tagSize);
+
+  // This records the name for a region hash.
+  void handleRegionRegister(clientConnection& client, uint32_t regionHash,
+                            const char* name, size_t nameSize);
+
+  // This reads the fixed-size body shared by SESSION_TAG_ID, REGION_BEGIN,
+  // REGION_END and SESSION_TAG_FORMATTED messages.
+  tagRecord readRecord(const char* body, uint8_t kind);
+
+  // This passes a decoded tag or region event on to the handler. It returns
+  // false if the event refers to an unregistered ID or has more arguments
+  // than a record holds.
+  bool dispatchTag(clientConnection& client, const tagRecord& record);
+
+  // This converts a client's thread ID to the one the handler sees.
+  uint32_t handlerThreadID(clientConnection& client, uint32_t threadID);
+
+  // This answers a clock probe with the server's receive and send times.
+  bool handleClockProbe(clientConnection& client, uint64_t receiveTime);
+
+  // This attaches to the shared memory ring the client created.
+  bool handleSharedMemoryAttach(clientConnection& client, const char* name,
+                                size_t nameSize);
+
+  // This passes every record in a client's shared memory ring to the handler.
+  // Records whose registration has not been read from the socket yet are held
+  // back until it has. It returns the number of records taken from the ring,
+  // and sets failed and stops at a record the client cannot have written.
+  size_t drainSharedMemory(clientConnection& client, bool& failed);
+
+  // This returns true if the ID of a tag or region event has been registered.
+  bool isRegistered(clientConnection& client, uint32_t tagID, uint8_t kind);
 };
 
 /**
  * The socketServer class handles communication for the client side (benchmark
  * side)
+ *
+ * Every method may be called from any number of threads at once. Each tag
+ * carries the ID and CPU of the thread that sent it. Without asynchronous tags
+ * or shared memory, every tag takes a lock to write to the socket, so
+ * programs that tag from many threads should enable one of them; those paths
+ * only touch the calling thread's own ring or a single compare-and-swap.
  */
 class socketClient {
  public:
   socketClient(uint16_t portNumber, std::string serverIP);
   socketClient();
+  socketClient(socketClient&& other);
 
   ~socketClient();
 
+  // This switches the client to asynchronous tagging. Tags are queued on a
+  // per-thread ring holding ringCapacity records and a background thread sends
+  // them to the server, so sendTag never makes a syscall. Tags are flushed
+  // before the session end message is sent.
+  void enableAsyncTags(size_t ringCapacity);
+
+  // This returns the number of asynchronous tags dropped because a ring was
+  // full.
+  uint64_t droppedTags();
+
+  // This returns the number of times a ring filled up and started dropping
+  // tags.
+  uint64_t tagOverflows();
+
+  // This measures the offset between the client and server clocks with a
+  // burst of probes. It is done at the start and end of every session.
+  void syncClock();
+
+  // This also measures the clock offset every interval milliseconds during a
+  // session, so the server can track drift. Zero turns it off.
+  void setClockSyncInterval(uint64_t interval);
+
+  // This sends tags and regions through a shared memory ring holding
+  // ringCapacity records instead of the socket. It only works when the server
+  // is on the same host, and takes precedence over asynchronous tagging.
+  void enableSharedMemory(size_t ringCapacity);
+
   // This lets the server know to start measuring.
   void sendSessionStart();
 
@@ -87,9 +376,50 @@ class socketClient {
   void sendSessionEnd();
 
   // This tells the server to tag a specific time in the measurements while
-  // something of note is happening.
+  // something of note is happening. The string is registered with the server
+  // the first time it is used and sent as its ID afterwards.
   void sendTag(std::string tagName);
 
+  // This tags a specific time with a string returned by registerTag().
+  void sendTag(uint32_t tagID);
+
+  // This tags a specific time with a printf-style format string and its
+  // arguments. The arguments are copied in binary and the server does the
+  // formatting, so the tag costs about as much as sendTag(uint32_t). The
+  // arguments must be numbers or strings, and only the first TAG_ARGS_SIZE
+  // bytes of them are kept. The format is registered once per thread by its
+  // address, so it should be a string literal.
+  template <typename... Args>
+  void sendTagf(const char* format, const Args&... args) {
+    tagRecord record;
+    record.tagID = registerFormat(format);
+    record.kind = TAG_EVENT_FORMATTED;
+    record.argsSize = 0;
+    packTagArgs(record.args, record.argsSize, args...);
+    sendRecord(record);
+  }
+
+  // This sends tagName to the server once and returns the ID it can be tagged
+  // with from then on. Registering the same string again returns the same ID.
+  uint32_t registerTag(std::string tagName);
+
+  // This registers a format string for sendTagf() and returns its ID. The
+  // ID is remembered by the address of the format.
+  uint32_t registerFormat(const char* format);
+
+  // This sends the name of a region to the server once. The hash should come
+  // from powerpack::regionHash().
+  void registerRegion(uint32_t regionHash, std::string regionName);
+
+  // These mark the beginning and end of a registered region. Most code should
+  // use powerpack::Region or POWERPACK_REGION instead.
+  void sendRegionBegin(uint32_t regionHash);
+  void sendRegionEnd(uint32_t regionHash);
+
+  // This returns a number that identifies the client. Unlike its address, it
+  // is never reused by a later client.
+  uint64_t clientID();
+
  private:
   // This is the file descriptor of the socket.
   int sock;
@@ -97,11 +427,59 @@ class socketClient {
   // This stores information about the server that is being connected to.
   sockaddr_in serverAddress;
 
+  // This queues and sends tags when asynchronous tagging is enabled.
+  std::unique_ptr<tagFlusher> flusher;
+  size_t asyncRingCapacity;
+
+  // This carries tags to a server on the same host when shared memory is
+  // enabled.
+  std::unique_ptr<sharedTagRing> sharedRing;
+
+  // This maps every registered tag string to its ID. Each thread also keeps
+  // the IDs it has used, so only new strings take tagIDsLock.
+  std::unordered_map<std::string, uint32_t> tagIDs;
+  std::mutex tagIDsLock;
+
+  // This identifies the client in the per-thread tag ID cache, since a new
+  // client can be allocated at the address of a destroyed one.
+  uint64_t id;
+
+  // This maps every registered region hash to its name.
+  std::unordered_map<uint32_t, std::string> regionNames;
+
+  // This sends a tag, region begin or region end event.
+  void sendEvent(uint32_t tagID, uint8_t kind);
+
+  // This timestamps a record and sends it by whichever transport is enabled.
+  void sendRecord(tagRecord& record);
+
+  // This is held while a whole message is written, so messages from the
+  // application, flusher and clock sync threads do not interleave.
+  std::mutex sendMutex;
+
+  // These write a whole message while holding sendMutex.
+  void writeMessage(const void* buf, size_t size);
+  void writeMessage(const std::vector<char>& buffer);
+
+  // This repeats syncClock() while a session is running.
+  uint64_t clockSyncInterval;
+  std::thread clockSyncThread;
+  std::mutex clockSyncLock;
+  std::condition_variable clockSyncWake;
+  bool clockSyncRunning;
+
+  void startClockSync();
+  void stopClockSync();
+
   // This is a wrapper for socket read that stores the data in the given buffer.
   void readData(void* buf, size_t size);
 
   // This is a wrapper for socket write that sends data from the given buffer.
   void writeData(void* buf, size_t size);
+
+  // This sends a batch of queued tags as a single SESSION_TAG_BATCH frame. It
+  // runs on the flusher thread.
+  void sendRecords(const tagRecord* records, size_t count);
 };
 
 // This function prints an error message, prints the last errorno, and exits the
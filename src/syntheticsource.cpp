@@ -0,0 +1,60 @@
+#include "syntheticsource.h"
+#include <random>
+
+// This is the number of noise values drawn up front. It is a power of two so
+// a random index is a mask away.
+#define SYNTHETIC_NOISE_TABLE_SIZE 65536
+
+syntheticSource::syntheticSource() : noiseState(1) {}
+
+syntheticSource::syntheticSource(const syntheticWaveform &waveform)
+    : waveform(waveform), noiseState(1) {}
+
+syntheticSource::~syntheticSource() { stop(); }
+
+bool syntheticSource::configure(const sampleSourceConfig &newConfig,
+                                const samplesReadyCallback &callback) {
+  std::mt19937 generator(waveform.seed);
+  std::normal_distribution<double> distribution(0.0, waveform.noise);
+  noiseTable.resize(SYNTHETIC_NOISE_TABLE_SIZE);
+  for (double &value : noiseTable) {
+    value = waveform.noise > 0.0 ? distribution(generator) : 0.0;
+  }
+  noiseState = waveform.seed | 1;
+  return pacedSource::configure(newConfig, callback);
+}
+
+/**
+ * Writes the waveform for samples per channel
+ *
+ * @param data where the samples go, grouped by channel
+ * @param samples the number of samples per channel to write
+ * @param position the sample number of the first sample
+ * @returns samples
+ */
+size_t syntheticSource::generate(double *data, size_t samples,
+                                 uint64_t position) {
+  size_t numChannels = config.numChannels;
+  uint64_t period =
+      (uint64_t)(waveform.stepPeriodMs * config.sampleClockRate / 1000.0);
+
+  for (size_t i = 0; i < numChannels; i++) {
+    double *channel = data + i * samples;
+    uint64_t offset = period * i / numChannels;
+    for (size_t j = 0; j < samples; j++) {
+      // xorshift picks the noise value, since a generator per sample would
+      // cost more than everything else here.
+      noiseState ^= noiseState << 13;
+      noiseState ^= noiseState >> 7;
+      noiseState ^= noiseState << 17;
+      double value =
+          waveform.level +
+          noiseTable[noiseState & (SYNTHETIC_NOISE_TABLE_SIZE - 1)];
+      if (period > 1 && (position + j + offset) % period < period / 2) {
+        value += waveform.stepLevel;
+      }
+      channel[j] = value;
+    }
+  }
+  return samples;
+}
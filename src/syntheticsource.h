@@ -0,0 +1,51 @@
+#ifndef SYNTHETIC_SOURCE_H
+#define SYNTHETIC_SOURCE_H
+
+#include <stdint.h>
+#include <vector>
+#include "samplesource.h"
+
+/**
+ * The shape of a syntheticSource's waveform. Every channel reads level, plus
+ * stepLevel for the first half of every stepPeriodMs, plus gaussian noise
+ * with a standard deviation of noise. Channel i's steps are delayed by
+ * i / numChannels of a period, so the channels do not all move together.
+ */
+struct syntheticWaveform {
+  // Reading in volts between steps
+  double level = 0.01;
+  // Volts added during a step
+  double stepLevel = 0.01;
+  // Length of one step and the gap after it, in milliseconds, or 0 for none
+  double stepPeriodMs = 1000.0;
+  // Standard deviation of the noise in volts
+  double noise = 0.0005;
+  // Seed of the noise, so runs can be repeated
+  uint32_t seed = 1;
+};
+
+/**
+ * A pacedSource that generates a waveform on any number of channels. The
+ * noise comes from a table of gaussian values drawn up front, so rates in
+ * the millions of samples per second cost little more than a copy.
+ */
+class syntheticSource : public pacedSource {
+ public:
+  syntheticWaveform waveform;
+
+  syntheticSource();
+  syntheticSource(const syntheticWaveform& waveform);
+  ~syntheticSource();
+
+  bool configure(const sampleSourceConfig& config,
+                 const samplesReadyCallback& onSamples);
+
+ protected:
+  size_t generate(double* data, size_t samples, uint64_t position);
+
+ private:
+  std::vector<double> noiseTable;
+  uint64_t noiseState;
+};
+
+#endif
@@ -0,0 +1,245 @@
+#include "tagbuffer.h"
+#include <sched.h>
+#include <algorithm>
+#include <unordered_map>
+
+// This hands out a unique id to every tagFlusher that is created.
+static std::atomic<uint64_t> nextFlusherID(1);
+
+// This hands out the numbers returned by tagThreadID().
+static std::atomic<uint32_t> nextThreadID(0);
+
+uint32_t tagThreadID() {
+  static thread_local uint32_t threadID = nextThreadID++;
+  return threadID;
+}
+
+namespace {
+/**
+ * The rings of one thread, one for each flusher it has tagged through, so a
+ * thread that tags through several clients keeps each one's tags in order in
+ * a single ring. When the thread exits its rings are marked abandoned.
+ */
+struct threadRings {
+  std::unordered_map<uint64_t, std::shared_ptr<tagRingBuffer>> rings;
+
+  ~threadRings() {
+    for (auto &entry : rings) {
+      entry.second->abandoned.store(true, std::memory_order_release);
+    }
+  }
+};
+}  // namespace
+
+uint32_t tagCPU() {
+#ifdef __linux__
+  // glibc answers this from the kernel's per-thread data without a system
+  // call, so it is cheap enough to do on every tag.
+  int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return (uint32_t)cpu;
+  }
+#endif
+  return TAG_CPU_UNKNOWN;
+}
+
+/**
+ * Creates an empty ring
+ *
+ * @param capacity the minimum number of records the ring can hold
+ */
+tagRingBuffer::tagRingBuffer(size_t capacity)
+    : overflowing(false), abandoned(false), tail(0), cachedHead(0), head(0) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  records.resize(size);
+  mask = size - 1;
+}
+
+/**
+ * Copies a record into the ring. Only the owning thread may call this.
+ *
+ * @param record the record to copy
+ * @returns true if the record was queued, false if the ring was full
+ */
+bool tagRingBuffer::push(const tagRecord &record) {
+  size_t currentTail = tail.load(std::memory_order_relaxed);
+  if (currentTail - cachedHead > mask) {
+    cachedHead = head.load(std::memory_order_acquire);
+    if (currentTail - cachedHead > mask) {
+      return false;
+    }
+  }
+  records[currentTail & mask] = record;
+  tail.store(currentTail + 1, std::memory_order_release);
+  return true;
+}
+
+/**
+ * Moves queued records out of the ring. Only the flusher thread may call this.
+ *
+ * @param out location for the records
+ * @param maxRecords the most records to move
+ * @returns the number of records moved
+ */
+size_t tagRingBuffer::pop(tagRecord *out, size_t maxRecords) {
+  size_t currentHead = head.load(std::memory_order_relaxed);
+  size_t available = tail.load(std::memory_order_acquire) - currentHead;
+  size_t count = available < maxRecords ? available : maxRecords;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = records[(currentHead + i) & mask];
+  }
+  head.store(currentHead + count, std::memory_order_release);
+  return count;
+}
+
+//####################################################################
+/**
+ * Creates a flusher. The background thread is not started until start() is
+ * called.
+ *
+ * @param ringCapacity the number of records each thread can queue
+ * @param send function that writes a batch of records to the server
+ */
+tagFlusher::tagFlusher(size_t ringCapacity, sendFunction send)
+    : ringCapacity(ringCapacity),
+      send(send),
+      id(nextFlusherID++),
+      running(false),
+      dropped(0),
+      overflows(0),
+      flushed(0) {}
+
+tagFlusher::~tagFlusher() { stop(); }
+
+/**
+ * Finds the ring that belongs to the calling thread. The last ring used is
+ * cached per thread, and the lock is only taken the first time a thread tags
+ * through this flusher.
+ *
+ * @returns the calling thread's ring
+ */
+tagRingBuffer *tagFlusher::threadRing() {
+  static thread_local threadRings ownRings;
+  static thread_local uint64_t cachedFlusher = 0;
+  static thread_local tagRingBuffer *cachedRing = nullptr;
+
+  if (cachedFlusher == id) {
+    return cachedRing;
+  }
+
+  auto found = ownRings.rings.find(id);
+  if (found == ownRings.rings.end()) {
+    // This lets go of the rings of flushers that have been destroyed, which
+    // the thread holds the only reference to.
+    for (auto entry = ownRings.rings.begin(); entry != ownRings.rings.end();) {
+      if (entry->second.use_count() == 1) {
+        entry = ownRings.rings.erase(entry);
+      } else {
+        ++entry;
+      }
+    }
+    std::shared_ptr<tagRingBuffer> ring(new tagRingBuffer(ringCapacity));
+    {
+      std::lock_guard<std::mutex> lock(ringsLock);
+      rings.push_back(ring);
+    }
+    found = ownRings.rings.emplace(id, ring).first;
+  }
+  cachedFlusher = id;
+  cachedRing = found->second.get();
+  return cachedRing;
+}
+
+bool tagFlusher::push(const tagRecord &record) {
+  tagRingBuffer *ring = threadRing();
+  if (ring->push(record)) {
+    ring->overflowing = false;
+    return true;
+  }
+
+  dropped.fetch_add(1, std::memory_order_relaxed);
+  if (!ring->overflowing) {
+    ring->overflowing = true;
+    overflows.fetch_add(1, std::memory_order_relaxed);
+  }
+  return false;
+}
+
+void tagFlusher::start() {
+  if (running.exchange(true)) {
+    return;
+  }
+  thread = std::thread(&tagFlusher::run, this);
+}
+
+void tagFlusher::stop() {
+  if (running.exchange(false)) {
+    thread.join();
+  }
+  drain();
+}
+
+uint64_t tagFlusher::droppedCount() const { return dropped.load(); }
+
+uint64_t tagFlusher::overflowCount() const { return overflows.load(); }
+
+uint64_t tagFlusher::flushedCount() const { return flushed.load(); }
+
+/**
+ * Sends everything queued in every ring. A ring whose thread had exited before
+ * it was emptied has nothing more to come, so it is freed.
+ *
+ * @returns the number of records sent
+ */
+size_t tagFlusher::drain() {
+  tagRecord batch[TAG_FLUSH_BATCH_SIZE];
+  std::vector<std::shared_ptr<tagRingBuffer>> snapshot;
+  std::vector<tagRingBuffer *> finished;
+  size_t total = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(ringsLock);
+    snapshot = rings;
+  }
+
+  for (auto &ring : snapshot) {
+    bool abandoned = ring->abandoned.load(std::memory_order_acquire);
+    size_t count;
+    while ((count = ring->pop(batch, TAG_FLUSH_BATCH_SIZE)) > 0) {
+      send(batch, count);
+      total += count;
+    }
+    if (abandoned) {
+      finished.push_back(ring.get());
+    }
+  }
+
+  if (!finished.empty()) {
+    std::lock_guard<std::mutex> lock(ringsLock);
+    for (tagRingBuffer *ring : finished) {
+      rings.erase(std::find_if(rings.begin(), rings.end(),
+                               [ring](const std::shared_ptr<tagRingBuffer> &r) {
+                                 return r.get() == ring;
+                               }));
+    }
+  }
+
+  flushed.fetch_add(total, std::memory_order_relaxed);
+  return total;
+}
+
+/**
+ * Body of the background thread. It drains the rings until they are empty
+ * then sleeps for TAG_FLUSH_INTERVAL_US.
+ */
+void tagFlusher::run() {
+  while (running.load(std::memory_order_acquire)) {
+    if (drain() == 0) {
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(TAG_FLUSH_INTERVAL_US));
+    }
+  }
+}
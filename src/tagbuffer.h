@@ -0,0 +1,151 @@
+#ifndef TAG_BUFFER_H
+#define TAG_BUFFER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "eventhandler.h"
+#include "tagformat.h"
+
+// This is how long the flusher thread sleeps when every ring is empty.
+#define TAG_FLUSH_INTERVAL_US 1000
+
+// This is the most records the flusher hands to the send function at once.
+#define TAG_FLUSH_BATCH_SIZE 256
+
+/**
+ * A fixed-size tag as it is stored between the application thread and the
+ * flusher thread. The tag string is registered with the server beforehand.
+ */
+struct tagRecord {
+  uint64_t timestamp;
+  // a registered tag ID, or a region hash for region records
+  uint32_t tagID;
+  // one of the TAG_EVENT_ values
+  uint8_t kind;
+  // number of bytes used in args
+  uint8_t argsSize;
+  // the tagThreadID() of the thread that made the record
+  uint32_t threadID;
+  // the CPU the thread was running on, or TAG_CPU_UNKNOWN
+  uint32_t cpu;
+  // arguments packed by packTagArgs for TAG_EVENT_FORMATTED records, which
+  // fill the record out to a cache line
+  char args[TAG_ARGS_SIZE];
+};
+
+// This returns a small number that identifies the calling thread. Threads are
+// numbered from 0 in the order they first ask.
+uint32_t tagThreadID();
+
+// This returns the CPU the calling thread is running on, or TAG_CPU_UNKNOWN.
+uint32_t tagCPU();
+
+/**
+ * A single-producer single-consumer lock-free ring of tagRecords. The producer
+ * is the thread that owns the ring and the consumer is the flusher thread.
+ */
+class tagRingBuffer {
+ public:
+  // The capacity is rounded up to the next power of two.
+  tagRingBuffer(size_t capacity);
+
+  // This copies the record into the ring. It returns false if the ring is full.
+  bool push(const tagRecord& record);
+
+  // This is true when the previous push found the ring full, so a run of
+  // drops counts as a single overflow.
+  bool overflowing;
+
+  // This is set when the owning thread exits, after its last push, so the
+  // flusher can free the ring once it is empty.
+  std::atomic<bool> abandoned;
+
+  // This moves up to maxRecords records into out and returns how many were
+  // moved.
+  size_t pop(tagRecord* out, size_t maxRecords);
+
+ private:
+  std::vector<tagRecord> records;
+  size_t mask;
+
+  // The producer and consumer indices are kept on separate cache lines so the
+  // two threads do not bounce a shared line on every push.
+  char padding0[64];
+  std::atomic<size_t> tail;
+  // This is the producer's last view of head, refreshed only when the ring
+  // looks full.
+  size_t cachedHead;
+  char padding1[64];
+  std::atomic<size_t> head;
+  char padding2[64];
+};
+
+/**
+ * The tagFlusher owns one tagRingBuffer per producing thread and a background
+ * thread that drains them through the given send function.
+ */
+class tagFlusher {
+ public:
+  typedef std::function<void(const tagRecord*, size_t)> sendFunction;
+
+  tagFlusher(size_t ringCapacity, sendFunction send);
+
+  // This stops the flusher thread after draining every ring.
+  ~tagFlusher();
+
+  // This queues a record on the calling thread's ring. It never blocks; if the
+  // ring is full the record is dropped and counted.
+  bool push(const tagRecord& record);
+
+  // This starts the background thread.
+  void start();
+
+  // This stops the background thread and sends everything still queued.
+  void stop();
+
+  // Number of records dropped because a ring was full.
+  uint64_t droppedCount() const;
+
+  // Number of times a ring went from accepting records to dropping them.
+  uint64_t overflowCount() const;
+
+  // Number of records handed to the send function.
+  uint64_t flushedCount() const;
+
+ private:
+  size_t ringCapacity;
+  sendFunction send;
+
+  // This identifies the flusher in the per-thread ring cache, since a new
+  // flusher can be allocated at the address of a destroyed one.
+  uint64_t id;
+
+  // The calling thread's ring is shared with the thread's own list of rings,
+  // which marks it abandoned when the thread exits.
+  std::mutex ringsLock;
+  std::vector<std::shared_ptr<tagRingBuffer>> rings;
+
+  std::thread thread;
+  std::atomic<bool> running;
+
+  std::atomic<uint64_t> dropped;
+  std::atomic<uint64_t> overflows;
+  std::atomic<uint64_t> flushed;
+
+  // This returns the ring owned by the calling thread, creating it if needed.
+  tagRingBuffer* threadRing();
+
+  // This empties every ring, frees those whose threads have exited, and
+  // returns the number of records sent.
+  size_t drain();
+
+  void run();
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include "tagformat.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <vector>
+
+// These are the conversions formatTag will pass to snprintf. Anything else,
+// such as %n or %p, is copied to the tag as written.
+static const char *integerConversions = "diouxXc";
+static const char *floatConversions = "fFeEgGaA";
+
+// This is the most digits a width or precision can have, so a conversion
+// cannot make a tag longer than about a thousand bytes. A conversion with a
+// longer one is copied to the tag as written.
+#define TAG_FORMAT_MAX_DIGITS 3
+
+/**
+ * Appends one snprintf conversion to out
+ *
+ * @param out the string being built
+ * @param spec a complete conversion specification such as "%08llx"
+ * @param value the value to convert, of the type spec expects
+ */
+template <typename T>
+static void appendFormatted(std::string &out, const std::string &spec,
+                            T value) {
+  char buffer[64];
+  int length = snprintf(buffer, sizeof(buffer), spec.c_str(), value);
+  if (length < 0) {
+    return;
+  }
+  if ((size_t)length < sizeof(buffer)) {
+    out.append(buffer, length);
+    return;
+  }
+  std::vector<char> large(length + 1);
+  snprintf(large.data(), large.size(), spec.c_str(), value);
+  out.append(large.data(), length);
+}
+
+/**
+ * Converts a signed integer argument with the given conversion
+ */
+static void appendInteger(std::string &out, const std::string &prefix,
+                          char conversion, long long value) {
+  if (conversion == 'c') {
+    appendFormatted(out, prefix + conversion, (int)value);
+  } else if (strchr(floatConversions, conversion)) {
+    appendFormatted(out, prefix + conversion, (double)value);
+  } else if (strchr(integerConversions, conversion)) {
+    appendFormatted(out, prefix + "ll" + conversion, value);
+  } else {
+    appendFormatted(out, "%lld", value);
+  }
+}
+
+/**
+ * Converts an unsigned integer argument with the given conversion
+ */
+static void appendUnsigned(std::string &out, const std::string &prefix,
+                           char conversion, unsigned long long value) {
+  if (conversion == 'c') {
+    appendFormatted(out, prefix + conversion, (int)value);
+  } else if (strchr(floatConversions, conversion)) {
+    appendFormatted(out, prefix + conversion, (double)value);
+  } else if (strchr(integerConversions, conversion)) {
+    appendFormatted(out, prefix + "ll" + conversion, value);
+  } else {
+    appendFormatted(out, "%llu", value);
+  }
+}
+
+/**
+ * Converts a floating point argument with the given conversion
+ */
+static void appendDouble(std::string &out, const std::string &prefix,
+                         char conversion, double value) {
+  if (strchr(floatConversions, conversion)) {
+    appendFormatted(out, prefix + conversion, value);
+  } else if (strchr(integerConversions, conversion) && conversion != 'c') {
+    appendFormatted(out, prefix + "ll" + conversion, (long long)value);
+  } else {
+    appendFormatted(out, "%g", value);
+  }
+}
+
+/**
+ * Fills in a format string with packed arguments
+ *
+ * @param format a printf-style format string
+ * @param args arguments packed by packTagArgs
+ * @param size the number of bytes in args
+ * @returns the formatted tag string
+ */
+std::string formatTag(const std::string &format, const char *args,
+                      size_t size) {
+  std::string out;
+  size_t position = 0;
+
+  for (size_t i = 0; i < format.size(); i++) {
+    if (format[i] != '%') {
+      out += format[i];
+      continue;
+    }
+    if (i + 1 < format.size() && format[i + 1] == '%') {
+      out += '%';
+      i++;
+      continue;
+    }
+
+    // The flags, width and precision are kept and the length modifiers are
+    // dropped, since the argument's own type decides the length.
+    size_t end = i + 1;
+    while (end < format.size() && strchr("-+ #0", format[end])) {
+      end++;
+    }
+    size_t digits = 0, longest = 0;
+    while (end < format.size() &&
+           (isdigit((unsigned char)format[end]) || format[end] == '.')) {
+      digits = format[end] == '.' ? 0 : digits + 1;
+      longest = std::max(longest, digits);
+      end++;
+    }
+    if (longest > TAG_FORMAT_MAX_DIGITS) {
+      out += format.substr(i, end - i);
+      i = end - 1;
+      continue;
+    }
+    std::string prefix = format.substr(i, end - i);
+    while (end < format.size() && strchr("hlLqjzt", format[end])) {
+      end++;
+    }
+    if (end >= format.size()) {
+      out += format.substr(i);
+      break;
+    }
+
+    char conversion = format[end];
+    if (conversion != 's' && !strchr(integerConversions, conversion) &&
+        !strchr(floatConversions, conversion)) {
+      out += format.substr(i, end + 1 - i);
+      i = end;
+      continue;
+    }
+    i = end;
+
+    if (position >= size) {
+      out += '?';
+      continue;
+    }
+
+    char type = args[position++];
+    size_t remaining = size - position;
+    switch (type) {
+      case TAG_ARG_INT32: {
+        int32_t value;
+        if (remaining < sizeof(value)) {
+          position = size;
+          out += '?';
+          break;
+        }
+        memcpy(&value, args + position, sizeof(value));
+        position += sizeof(value);
+        appendInteger(out, prefix, conversion, value);
+        break;
+      }
+
+      case TAG_ARG_INT64: {
+        int64_t value;
+        if (remaining < sizeof(value)) {
+          position = size;
+          out += '?';
+          break;
+        }
+        memcpy(&value, args + position, sizeof(value));
+        position += sizeof(value);
+        appendInteger(out, prefix, conversion, value);
+        break;
+      }
+
+      case TAG_ARG_UINT32: {
+        uint32_t value;
+        if (remaining < sizeof(value)) {
+          position = size;
+          out += '?';
+          break;
+        }
+        memcpy(&value, args + position, sizeof(value));
+        position += sizeof(value);
+        appendUnsigned(out, prefix, conversion, value);
+        break;
+      }
+
+      case TAG_ARG_UINT64: {
+        uint64_t value;
+        if (remaining < sizeof(value)) {
+          position = size;
+          out += '?';
+          break;
+        }
+        memcpy(&value, args + position, sizeof(value));
+        position += sizeof(value);
+        appendUnsigned(out, prefix, conversion, value);
+        break;
+      }
+
+      case TAG_ARG_DOUBLE: {
+        double value;
+        if (remaining < sizeof(value)) {
+          position = size;
+          out += '?';
+          break;
+        }
+        memcpy(&value, args + position, sizeof(value));
+        position += sizeof(value);
+        appendDouble(out, prefix, conversion, value);
+        break;
+      }
+
+      case TAG_ARG_STRING: {
+        size_t length = remaining ? (uint8_t)args[position++] : 0;
+        length = std::min(length, size - position);
+        std::string value(args + position, length);
+        position += length;
+        if (conversion == 's') {
+          appendFormatted(out, prefix + 's', value.c_str());
+        } else {
+          out += value;
+        }
+        break;
+      }
+
+      default:
+        // The rest of the buffer cannot be trusted after an unknown type.
+        position = size;
+        out += '?';
+    }
+  }
+
+  return out;
+}
@@ -0,0 +1,119 @@
+#ifndef TAG_FORMAT_H
+#define TAG_FORMAT_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+/*
+ * Binary arguments for formatted tags. socketClient::sendTagf copies each
+ * argument into a fixed buffer as a one byte type code followed by its raw
+ * bytes, and the server turns the format string and the buffer into the tag
+ * string. Nothing is formatted or allocated on the thread that tags.
+ */
+
+// This is the number of bytes of arguments a formatted tag can carry.
+// Arguments that do not fit are dropped and strings are cut short.
+#define TAG_ARGS_SIZE 40
+
+// These are the type codes of the arguments. Integers keep their width and
+// signedness, floating point values are widened to double, and strings are
+// a one byte length followed by the bytes without a null terminator.
+#define TAG_ARG_INT32 'i'
+#define TAG_ARG_UINT32 'I'
+#define TAG_ARG_INT64 'l'
+#define TAG_ARG_UINT64 'L'
+#define TAG_ARG_DOUBLE 'd'
+#define TAG_ARG_STRING 's'
+
+// This is true for the types sendTagf accepts.
+template <typename T>
+struct isTagArg
+    : std::integral_constant<bool, std::is_arithmetic<T>::value ||
+                                       std::is_same<T, const char*>::value ||
+                                       std::is_same<T, char*>::value ||
+                                       std::is_same<T, std::string>::value> {};
+
+// This copies a type code and a value into args if there is room.
+template <typename T>
+inline void putTagArgBytes(char* args, uint8_t& size, char type, T value) {
+  if (size + 1 + sizeof(T) > TAG_ARGS_SIZE) {
+    return;
+  }
+  args[size] = type;
+  memcpy(args + size + 1, &value, sizeof(T));
+  size += 1 + sizeof(T);
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_signed<T>::value>::type
+putTagArg(char* args, uint8_t& size, T value) {
+  if (sizeof(T) <= sizeof(int32_t)) {
+    putTagArgBytes(args, size, TAG_ARG_INT32, (int32_t)value);
+  } else {
+    putTagArgBytes(args, size, TAG_ARG_INT64, (int64_t)value);
+  }
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value &&
+                               !std::is_signed<T>::value>::type
+putTagArg(char* args, uint8_t& size, T value) {
+  if (sizeof(T) <= sizeof(uint32_t)) {
+    putTagArgBytes(args, size, TAG_ARG_UINT32, (uint32_t)value);
+  } else {
+    putTagArgBytes(args, size, TAG_ARG_UINT64, (uint64_t)value);
+  }
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value>::type
+putTagArg(char* args, uint8_t& size, T value) {
+  putTagArgBytes(args, size, TAG_ARG_DOUBLE, (double)value);
+}
+
+inline void putTagArg(char* args, uint8_t& size, const char* value,
+                      size_t length) {
+  if (size + 2 > TAG_ARGS_SIZE) {
+    return;
+  }
+  length = std::min(length, (size_t)(TAG_ARGS_SIZE - size - 2));
+  args[size] = TAG_ARG_STRING;
+  args[size + 1] = (char)length;
+  memcpy(args + size + 2, value, length);
+  size += 2 + length;
+}
+
+inline void putTagArg(char* args, uint8_t& size, const char* value) {
+  putTagArg(args, size, value, strlen(value));
+}
+
+inline void putTagArg(char* args, uint8_t& size, const std::string& value) {
+  putTagArg(args, size, value.data(), value.size());
+}
+
+inline void packTagArgs(char*, uint8_t&) {}
+
+// This copies every argument into args and sets size to the bytes used. The
+// types are checked at compile time.
+template <typename T, typename... Rest>
+inline void packTagArgs(char* args, uint8_t& size, const T& value,
+                        const Rest&... rest) {
+  static_assert(isTagArg<typename std::decay<T>::type>::value,
+                "sendTagf arguments must be numbers or strings");
+  putTagArg(args, size, value);
+  packTagArgs(args, size, rest...);
+}
+
+// This fills in a printf-style format string with arguments packed by
+// packTagArgs. Conversions whose argument is missing are written as "?", and
+// an argument of the wrong kind for its conversion is written in a default
+// form rather than reinterpreted. A conversion with a width or precision of
+// more than three digits is copied as written.
+std::string formatTag(const std::string& format, const char* args,
+                      size_t size);
+
+#endif
@@ -1,4 +1,12 @@
 #include "timeutils.h"
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 /**
  * Returns the number of milliseconds since jan 1, 1970
@@ -6,6 +14,9 @@
  * @returns the number of milliseconds since jan 1, 1970
 */
 uint64_t millis() {
+  if (getClockSource() == CLOCK_SOURCE_TSC) {
+    return nanos() / 1000000;
+  }
   uint64_t ms =
       std::chrono::duration_cast<std::chrono::duration<uint64_t, std::milli>>(
           std::chrono::high_resolution_clock::now().time_since_epoch())
@@ -19,6 +30,9 @@ uint64_t millis() {
  * @returns the number of microseconds since jan 1, 1970
 */
 uint64_t micros() {
+  if (getClockSource() == CLOCK_SOURCE_TSC) {
+    return nanos() / 1000;
+  }
   uint64_t us =
       std::chrono::duration_cast<std::chrono::duration<uint64_t, std::micro>>(
           std::chrono::high_resolution_clock::now().time_since_epoch())
@@ -26,15 +40,202 @@ uint64_t micros() {
   return us;
 }
 
+// This is the current clock source.
+static std::atomic<int> clockSource(CLOCK_SOURCE_CHRONO);
+
+#if defined(__x86_64__)
+// The TSC is converted with ns = nsBase + ((tsc - tscBase) * multiplier >>
+// TSC_SHIFT). The three values are published together under a sequence lock
+// so readers never see a half-updated conversion.
+#define TSC_SHIFT 32
+
+static std::atomic<uint32_t> tscSequence(0);
+static std::atomic<uint64_t> tscBase(0);
+static std::atomic<uint64_t> tscNsBase(0);
+static std::atomic<uint64_t> tscMultiplier(0);
+
+// This is the first calibration point. Later calibrations measure the rate
+// over the whole time since then, so the estimate keeps getting better.
+static uint64_t tscOrigin;
+static uint64_t rawOrigin;
+
+// This is held while the source is switched and while the calibration is
+// changed, so there is only ever one writer of it. recalibrating is set while
+// the recalibration thread runs.
+static std::mutex clockSourceLock;
+static bool recalibrating = false;
+
+static uint64_t clockNanos(clockid_t clock) {
+  timespec now;
+  clock_gettime(clock, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// This reads the TSC and CLOCK_MONOTONIC_RAW as close together as possible by
+// keeping the pair with the shortest TSC window around the clock read.
+static void readPair(uint64_t &tsc, uint64_t &raw) {
+  uint64_t bestWindow = UINT64_MAX;
+  for (int i = 0; i < 8; i++) {
+    uint64_t before = __rdtsc();
+    uint64_t time = clockNanos(CLOCK_MONOTONIC_RAW);
+    uint64_t after = __rdtsc();
+    if (after - before < bestWindow) {
+      bestWindow = after - before;
+      tsc = before + (after - before) / 2;
+      raw = time;
+    }
+  }
+}
+
+// This reads the published calibration, retrying while it is being changed.
+static void readCalibration(uint64_t& base, uint64_t& nsBase,
+                            uint64_t& multiplier) {
+  uint32_t sequence;
+  do {
+    sequence = tscSequence.load(std::memory_order_acquire);
+    base = tscBase.load(std::memory_order_relaxed);
+    nsBase = tscNsBase.load(std::memory_order_relaxed);
+    multiplier = tscMultiplier.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((sequence & 1) ||
+           sequence != tscSequence.load(std::memory_order_relaxed));
+}
+
+static uint64_t tscToNanos(uint64_t tsc, uint64_t base, uint64_t nsBase,
+                           uint64_t multiplier) {
+  return nsBase + (uint64_t)(((unsigned __int128)(tsc - base) * multiplier) >>
+                             TSC_SHIFT);
+}
+
+// This reads the TSC only after the calibration, so it is never before the
+// base a calibration was published with.
+static uint64_t tscNanos() {
+  uint64_t base, nsBase, multiplier;
+  readCalibration(base, nsBase, multiplier);
+  return tscToNanos(__rdtsc(), base, nsBase, multiplier);
+}
+
+static void publishCalibration(uint64_t base, uint64_t nsBase,
+                               uint64_t multiplier) {
+  tscSequence.fetch_add(1, std::memory_order_acq_rel);
+  tscBase.store(base, std::memory_order_relaxed);
+  tscNsBase.store(nsBase, std::memory_order_relaxed);
+  tscMultiplier.store(multiplier, std::memory_order_relaxed);
+  tscSequence.fetch_add(1, std::memory_order_release);
+}
+
+/**
+ * Measures the TSC rate against CLOCK_MONOTONIC_RAW and anchors it to the
+ * epoch. This blocks for about 10 milliseconds.
+ */
+static void calibrateTSC() {
+  readPair(tscOrigin, rawOrigin);
+  uint64_t epoch = clockNanos(CLOCK_REALTIME);
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  uint64_t tsc, raw;
+  readPair(tsc, raw);
+  uint64_t multiplier =
+      (uint64_t)(((unsigned __int128)(raw - rawOrigin) << TSC_SHIFT) /
+                 (tsc - tscOrigin));
+  publishCalibration(tscOrigin, epoch, multiplier);
+}
+
+/**
+ * Refines the TSC rate while the TSC is the clock source. The conversion is
+ * rebased at a TSC reading, to the time the old conversion gives for it, so
+ * the clock does not jump. Only one of these runs at a time, and it stops
+ * once the source is switched away from the TSC.
+ */
+static void recalibrateTSC() {
+  for (;;) {
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(TSC_CALIBRATION_INTERVAL_MS));
+    std::lock_guard<std::mutex> lock(clockSourceLock);
+    if (clockSource.load() != CLOCK_SOURCE_TSC) {
+      recalibrating = false;
+      return;
+    }
+
+    uint64_t tsc, raw;
+    readPair(tsc, raw);
+    uint64_t base, nsBase, multiplier;
+    readCalibration(base, nsBase, multiplier);
+    nsBase = tscToNanos(tsc, base, nsBase, multiplier);
+    multiplier =
+        (uint64_t)(((unsigned __int128)(raw - rawOrigin) << TSC_SHIFT) /
+                   (tsc - tscOrigin));
+    publishCalibration(tsc, nsBase, multiplier);
+  }
+}
+#endif
+
 /**
  * Returns the number of nanoseconds since jan 1, 1970
  * 
  * @returns the number of nanoseconds since jan 1, 1970
 */
 uint64_t nanos() {
+#if defined(__x86_64__)
+  if (clockSource.load(std::memory_order_relaxed) == CLOCK_SOURCE_TSC) {
+    return tscNanos();
+  }
+#endif
   uint64_t ns =
       std::chrono::duration_cast<std::chrono::duration<uint64_t, std::nano>>(
           std::chrono::high_resolution_clock::now().time_since_epoch())
           .count();
   return ns;
 }
+
+/**
+ * Selects the source of millis(), micros() and nanos(). Switching to the TSC
+ * calibrates it and starts a background thread that keeps it calibrated.
+ *
+ * @param source CLOCK_SOURCE_CHRONO or CLOCK_SOURCE_TSC
+ * @returns true if the source is now in use
+ */
+bool setClockSource(int source) {
+#if defined(__x86_64__)
+  std::lock_guard<std::mutex> lock(clockSourceLock);
+#endif
+  if (source == CLOCK_SOURCE_CHRONO) {
+    clockSource.store(CLOCK_SOURCE_CHRONO);
+    return true;
+  }
+
+#if defined(__x86_64__)
+  if (source == CLOCK_SOURCE_TSC && tscIsInvariant()) {
+    if (clockSource.load() != CLOCK_SOURCE_TSC) {
+      calibrateTSC();
+      clockSource.store(CLOCK_SOURCE_TSC);
+      // A thread that is still waiting to recalibrate carries on.
+      if (!recalibrating) {
+        recalibrating = true;
+        std::thread(recalibrateTSC).detach();
+      }
+    }
+    return true;
+  }
+#endif
+  return false;
+}
+
+int getClockSource() { return clockSource.load(std::memory_order_relaxed); }
+
+/**
+ * Checks the invariant TSC flag, CPUID leaf 0x80000007 EDX bit 8
+ *
+ * @returns true if the TSC rate does not change with power states
+ */
+bool tscIsInvariant() {
+#if defined(__x86_64__)
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return (edx & (1u << 8)) != 0;
+#else
+  return false;
+#endif
+}
@@ -3,6 +3,16 @@
 #include <stdint.h>
 #include <chrono>
 
+// These select where millis(), micros() and nanos() read the time from.
+// CLOCK_SOURCE_CHRONO uses std::chrono::high_resolution_clock.
+// CLOCK_SOURCE_TSC reads the processor's time stamp counter and converts it
+// with a calibrated multiply and shift, which avoids the clock_gettime call.
+#define CLOCK_SOURCE_CHRONO 0
+#define CLOCK_SOURCE_TSC 1
+
+// This is how often the TSC conversion is recalibrated, in milliseconds.
+#define TSC_CALIBRATION_INTERVAL_MS 1000
+
 // This returns the milliseconds since the epoch.
 uint64_t millis();
 
@@ -11,4 +21,15 @@ uint64_t micros();
 
 // This returns the nanoseconds since the epoch.
 uint64_t nanos();
-#endif
\ No newline at end of file
+
+// This switches the clock source. It returns false and leaves the source
+// unchanged if the TSC is requested but is not invariant.
+bool setClockSource(int source);
+
+// This returns the current clock source.
+int getClockSource();
+
+// This returns true if the processor has a TSC that ticks at a constant rate
+// in every power state.
+bool tscIsInvariant();
+#endif
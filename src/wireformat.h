@@ -0,0 +1,67 @@
+#ifndef WIRE_FORMAT_H
+#define WIRE_FORMAT_H
+
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+
+/*
+ * Helpers for the variable-length integer encoding used in batched frames.
+ * Integers are written 7 bits at a time, least significant group first, with
+ * the high bit set on every byte except the last.
+ */
+
+// This appends value to buffer as a varint.
+inline void putVarint(std::vector<char>& buffer, uint64_t value) {
+  while (value >= 0x80) {
+    buffer.push_back((char)(value | 0x80));
+    value >>= 7;
+  }
+  buffer.push_back((char)value);
+}
+
+// This reads a varint starting at position and advances position past it. It
+// returns false if the varint runs past end.
+inline bool getVarint(const char*& position, const char* end,
+                      uint64_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 64 && position < end; shift += 7) {
+    uint8_t byte = (uint8_t)*position++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// This maps signed values to unsigned ones so small negative numbers stay
+// small when written as varints.
+inline uint64_t zigzagEncode(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+inline int64_t zigzagDecode(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// This appends the raw bytes of value to buffer.
+template <typename T>
+inline void putFixed(std::vector<char>& buffer, T value) {
+  const char* bytes = (const char*)&value;
+  buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+// This reads a fixed-size value starting at position and advances position
+// past it. It returns false if the value runs past end.
+template <typename T>
+inline bool getFixed(const char*& position, const char* end, T& value) {
+  if ((size_t)(end - position) < sizeof(T)) {
+    return false;
+  }
+  memcpy(&value, position, sizeof(T));
+  position += sizeof(T);
+  return true;
+}
+
+#endif
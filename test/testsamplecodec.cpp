@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include "samplecodec.h"
+
+static int failures = 0;
+
+static void check(bool passed, const std::string& what) {
+  if (!passed) {
+    std::cerr << "testsamplecodec failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+static double fromBits(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static uint64_t toBits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// This returns the bit at index in a stream, counting from the most
+// significant bit of its first byte.
+static unsigned bitAt(const std::vector<uint8_t>& stream, size_t index) {
+  return (stream[index / 8] >> (7 - index % 8)) & 1;
+}
+
+/**
+ * Encodes values after a few bytes already in the stream, and checks that
+ * they decode bit for bit from a copy of exactly the stream's bytes, and that
+ * the stream without its last byte does not decode
+ *
+ * @param name what the values are, for the failure message
+ * @param values the column
+ * @param encode the column's encoder
+ * @param decode the column's decoder
+ * @returns the stream, without the bytes before it
+ */
+template <typename T>
+static std::vector<uint8_t> checkRoundTrip(
+    const std::string& name, const std::vector<T>& values,
+    void (*encode)(const T*, size_t, std::vector<uint8_t>&),
+    bool (*decode)(const uint8_t*, size_t, T*, size_t)) {
+  std::vector<uint8_t> out = {0xff, 0x00, 0xff};
+  encode(values.data(), values.size(), out);
+  std::vector<uint8_t> stream(out.begin() + 3, out.end());
+  check(values.empty() == stream.empty(), name + ": stream size");
+
+  // The copy is exactly as long as the stream, so a decoder reading past it
+  // shows up under a memory checker.
+  uint8_t* exact = new uint8_t[stream.size()];
+  std::copy(stream.begin(), stream.end(), exact);
+  std::vector<T> decoded(values.size());
+  check(decode(exact, stream.size(), decoded.data(), values.size()) &&
+            std::equal(values.begin(), values.end(), decoded.begin(),
+                       [](const T& a, const T& b) {
+                         return memcmp(&a, &b, sizeof(T)) == 0;
+                       }),
+        name + ": round trip of " + std::to_string(values.size()));
+  if (!stream.empty()) {
+    check(!decode(exact, stream.size() - 1, decoded.data(), values.size()),
+          name + ": stream cut short");
+  }
+  delete[] exact;
+  return stream;
+}
+
+static void checkReadings(const std::string& name,
+                          const std::vector<double>& values) {
+  checkRoundTrip<double>(name, values, encodeReadings, decodeReadings);
+}
+
+static void checkCodes(const std::string& name,
+                       const std::vector<int16_t>& values) {
+  checkRoundTrip<int16_t>(name, values, encodeCodes, decodeCodes);
+}
+
+int main() {
+  double nan = std::numeric_limits<double>::quiet_NaN();
+  double infinity = std::numeric_limits<double>::infinity();
+  double denormal = std::numeric_limits<double>::denorm_min();
+  double largestDenormal = fromBits(0x000fffffffffffffULL);
+
+  // These are readings the meter cannot give, but a log has to keep as they
+  // were: NaNs with and without payloads, signed zeros and infinities, and
+  // denormals, which XOR to differences with many leading zeros.
+  checkReadings("no readings", {});
+  checkReadings("one reading", {nan});
+  checkReadings("special readings",
+                {nan, -nan, fromBits(0x7ff0000000000001ULL),
+                 fromBits(0xfff8dead0000beefULL), 0.0, -0.0, 0.0, -0.0,
+                 infinity, -infinity, denormal, -denormal, largestDenormal,
+                 0.0, denormal, DBL_MIN, 1.0});
+  checkReadings("alternating extremes",
+                {DBL_MAX, -DBL_MAX, denormal, DBL_MAX, -denormal, -DBL_MAX,
+                 DBL_MIN, DBL_MAX, 0.0, -DBL_MAX, DBL_MAX, DBL_MAX});
+  checkReadings("steady readings", std::vector<double>(100, 1.25));
+
+  // A difference of every bit is written with 0 for 64 significant bits.
+  // After the first reading, that is 11, 5 bits of leading zeros and 6 of
+  // significant bits. A second difference inside it reuses the window, 10.
+  double first = 1.0;
+  std::vector<uint8_t> stream = checkRoundTrip<double>(
+      "64 significant bits",
+      {first, fromBits(toBits(first) ^ 0x8000000000000001ULL), first},
+      encodeReadings, decodeReadings);
+  check(stream.size() > 17 && stream[8] == 0xc0 && (stream[9] & 0xf8) == 0 &&
+            bitAt(stream, 77 + 64) == 1 && bitAt(stream, 78 + 64) == 0,
+        "64 significant bits: not the 64 bit window");
+
+  // This is a window of 8 bits, from bit 40 to bit 47, and then a difference
+  // of 2 bits inside it.
+  double second = fromBits(toBits(first) ^ 0x0000ff0000000000ULL);
+  stream = checkRoundTrip<double>(
+      "window reuse",
+      {first, second, fromBits(toBits(second) ^ 0x0000180000000000ULL)},
+      encodeReadings, decodeReadings);
+  check(stream.size() > 10 && bitAt(stream, 64 + 21) == 1 &&
+            bitAt(stream, 64 + 22) == 0,
+        "window reuse: the window was described again");
+
+  // Codes jump the whole range, a change of 17 bits and a 3 byte varint, and
+  // every count up to past the 4 bytes the decoder reads at once is checked
+  // so that the last values are read one byte at a time.
+  std::vector<int16_t> jumps;
+  for (size_t count = 0; count <= 6; count++) {
+    checkCodes("codes near the end " + std::to_string(count), jumps);
+    jumps.push_back(count % 2 ? INT16_MAX : INT16_MIN);
+  }
+  checkCodes("one small code", {1});
+  checkCodes("three codes", {0, -1, 0x3fff});
+  checkCodes("code extremes",
+             {INT16_MAX, INT16_MAX, INT16_MIN, 0, INT16_MIN, -1, INT16_MAX,
+              -64, 63, -8192, 8191, INT16_MIN, INT16_MIN});
+
+  checkRoundTrip<uint64_t>(
+      "timestamps", {}, encodeTimestamps, decodeTimestamps);
+  checkRoundTrip<uint64_t>(
+      "timestamp extremes",
+      {0, UINT64_MAX, 0, 1ULL << 63, 12345, 12345, 12345, 1, UINT64_MAX},
+      encodeTimestamps, decodeTimestamps);
+  checkRoundTrip<uint32_t>("counts", {}, encodeCounts, decodeCounts);
+  checkRoundTrip<uint32_t>("count extremes",
+                           {0, UINT32_MAX, 0, UINT32_MAX, 40, 40, 1},
+                           encodeCounts, decodeCounts);
+
+  // These are random columns, as noisy readings, as any bits at all, and as
+  // codes from a noisy ADC and from anywhere in its range.
+  std::mt19937_64 generator(5);
+  std::normal_distribution<double> noise(2.0, 0.01);
+  std::normal_distribution<double> codeNoise(0.0, 300.0);
+  for (size_t round = 0; round < 200; round++) {
+    size_t count = generator() % 300;
+    std::vector<double> readings(count), bits(count);
+    std::vector<int16_t> codes(count), anyCodes(count);
+    std::vector<uint64_t> timestamps(count);
+    uint64_t time = generator();
+    for (size_t i = 0; i < count; i++) {
+      readings[i] = noise(generator);
+      bits[i] = fromBits(generator());
+      codes[i] = (int16_t)std::max(
+          std::min(codeNoise(generator), (double)INT16_MAX),
+          (double)INT16_MIN);
+      anyCodes[i] = (int16_t)generator();
+      time += generator() % 3 ? 40000000 : generator() % 1000000000;
+      timestamps[i] = time;
+    }
+    std::string name = " in round " + std::to_string(round);
+    checkReadings("noisy readings" + name, readings);
+    checkReadings("random bits" + name, bits);
+    checkCodes("noisy codes" + name, codes);
+    checkCodes("random codes" + name, anyCodes);
+    checkRoundTrip<uint64_t>("random timestamps" + name, timestamps,
+                             encodeTimestamps, decodeTimestamps);
+  }
+
+  if (failures > 0) {
+    return 1;
+  }
+  std::cout << "testsamplecodec passed" << std::endl;
+  return 0;
+}
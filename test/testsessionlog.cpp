@@ -0,0 +1,386 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "sessionlog.h"
+
+// This is two whole chunks and part of a third.
+#define TEST_CHANNELS 3
+#define TEST_ROWS (2 * SESSION_LOG_CHUNK_ROWS + 1000)
+
+// This is a handler with no sessions, whose string table names the tags.
+class namesOnly : public eventHandler {
+ public:
+  void startHandler(uint32_t sessionID, uint64_t timestamp) {}
+  void tagHandler(uint32_t sessionID, uint64_t timestamp, uint32_t tagID,
+                  uint32_t threadID, uint32_t cpu) {}
+  void endHandler(uint32_t sessionID, uint64_t timestamp) {}
+};
+
+// These are the readings a log is written with, as the reader should return
+// them. power holds TEST_CHANNELS readings for each row.
+struct testReadings {
+  uint64_t coveredFrom;
+  std::vector<uint64_t> timestamps;
+  std::vector<uint32_t> samples;
+  std::vector<double> power;
+};
+
+static int failures = 0;
+
+static void check(bool passed, const std::string& what) {
+  if (!passed) {
+    std::cerr << "testsessionlog failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+static bool sameBits(double a, double b) {
+  return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// This returns the joules used from begin to end over every channel, or in
+// one channel, by going through the readings. Each reading covers the time
+// since the one before it, and the first covers the time from coveredFrom.
+static double scanEnergy(const testReadings& readings, size_t rows,
+                         uint64_t coveredFrom, uint64_t begin, uint64_t end,
+                         int channel = -1) {
+  double joules = 0.0;
+  uint64_t from = coveredFrom;
+  for (size_t row = 0; row < rows; row++) {
+    uint64_t to = readings.timestamps[row];
+    uint64_t low = std::max(from, begin), high = std::min(to, end);
+    if (high > low) {
+      double watts = 0.0;
+      for (int index = 0; index < TEST_CHANNELS; index++) {
+        if (channel < 0 || channel == index) {
+          watts += readings.power[row * TEST_CHANNELS + index];
+        }
+      }
+      joules += watts * (double)(high - low) * 1e-9;
+    }
+    from = to;
+  }
+  return joules;
+}
+
+// This makes readings with uneven timestamps, some of them repeated and one
+// that goes backwards, and channels that are noisy, steady, and full of
+// signed zeros and denormals.
+static testReadings makeReadings(std::vector<uint64_t>& appended) {
+  std::mt19937 generator(7);
+  std::normal_distribution<double> noise(4.0, 0.5);
+  testReadings readings;
+  readings.coveredFrom = 1500000000000000000ULL;
+  uint64_t timestamp = readings.coveredFrom;
+  for (size_t row = 0; row < TEST_ROWS; row++) {
+    if (row % 500 != 17 && row != 5000) {
+      timestamp += 40000000 + generator() % 2000000;
+    }
+    appended.push_back(row == 5000 ? timestamp - 1000 : timestamp);
+    readings.timestamps.push_back(timestamp);
+    readings.samples.push_back(row % 97 == 0 ? 80 : 40);
+    readings.power.push_back(noise(generator));
+    readings.power.push_back(row < 6000 ? 2.5 : 2.75);
+    static const double awkward[] = {0.0, -0.0, 4.9e-324, 2.2e-308, 1e-3};
+    readings.power.push_back(awkward[generator() % 5]);
+  }
+  return readings;
+}
+
+static bool writeLog(const std::string& path, const testReadings& readings,
+                     const std::vector<uint64_t>& appended,
+                     const std::vector<tagEvent>& tags, eventHandler& names,
+                     const acquisitionHealth& health, bool compress) {
+  double voltages[TEST_CHANNELS] = {12.0, 5.0, 3.3};
+  sessionLogHeader header = {};
+  header.numChannels = TEST_CHANNELS;
+  header.sessionID = 7;
+  header.sampleFormat = SAMPLE_FORMAT_F64;
+  header.startTime = readings.coveredFrom;
+  header.preRollStart = readings.coveredFrom;
+  header.sampleClockRate = 1000.0;
+  header.samplesPerCallback = 40;
+  sessionLogWriter writer;
+  if (!writer.open(path, header, voltages, nullptr, "test channels",
+                   compress)) {
+    return false;
+  }
+  writer.coverFrom(readings.coveredFrom);
+  for (size_t row = 0; row < appended.size(); row++) {
+    writer.append(appended[row], readings.samples[row],
+                  &readings.power[row * TEST_CHANNELS]);
+  }
+  writer.close(tags, names, health);
+  return true;
+}
+
+// This checks that a row of a span holds the given row of readings, bit for
+// bit.
+static bool sameRow(const sessionLogSpan& span, size_t spanRow,
+                    const testReadings& readings, size_t row) {
+  if (span.timestamps[spanRow] != readings.timestamps[row] ||
+      span.samples[spanRow] != readings.samples[row]) {
+    return false;
+  }
+  for (size_t channel = 0; channel < TEST_CHANNELS; channel++) {
+    if (!sameBits(span.channel(channel)[spanRow],
+                  readings.power[row * TEST_CHANNELS + channel])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// This checks that the log's chunks hold the first rows of the readings,
+// read both through the reader's cache and into the caller's columns.
+static void checkRows(const sessionLogReader& log,
+                      const testReadings& readings, size_t rows,
+                      const std::string& name) {
+  check(log.rows() == rows, name + ": row count");
+  std::vector<uint64_t> columns;
+  size_t row = 0;
+  for (size_t chunk = 0; chunk < log.chunkCount(); chunk++) {
+    sessionLogSpan cached = log.chunk(chunk);
+    sessionLogSpan copied = log.chunk(chunk, columns);
+    check(cached.rows == log.chunkInfo(chunk).rows &&
+              copied.rows == cached.rows,
+          name + ": rows of chunk " + std::to_string(chunk));
+    for (size_t spanRow = 0; spanRow < cached.rows && row < rows;
+         spanRow++, row++) {
+      if (!sameRow(cached, spanRow, readings, row) ||
+          !sameRow(copied, spanRow, readings, row)) {
+        check(false, name + ": row " + std::to_string(row));
+        return;
+      }
+    }
+  }
+  check(row == rows, name + ": rows in chunks");
+}
+
+static void checkEnergy(const sessionLogReader& log,
+                        const testReadings& readings, size_t rows,
+                        uint64_t coveredFrom, const std::string& name) {
+  check(log.coveredFrom() == coveredFrom, name + ": covered from");
+  std::vector<std::pair<uint64_t, uint64_t>> intervals = {
+      {0, UINT64_MAX},
+      {coveredFrom, readings.timestamps[rows - 1]},
+      {readings.timestamps[100], readings.timestamps[101]},
+      {readings.timestamps[100] + 1, readings.timestamps[100] + 2},
+      {readings.timestamps[rows - 1], UINT64_MAX},
+      {readings.timestamps[200], readings.timestamps[100]}};
+  std::mt19937_64 generator(11);
+  uint64_t span = readings.timestamps[rows - 1] - coveredFrom + 2000000000;
+  for (int i = 0; i < 200; i++) {
+    uint64_t begin = coveredFrom - 1000000000 + generator() % span;
+    intervals.push_back({begin, begin + generator() % (span / 4)});
+  }
+
+  for (const auto& interval : intervals) {
+    double channels[TEST_CHANNELS];
+    double joules = log.energyBetween(interval.first, interval.second,
+                                      channels);
+    double expected = scanEnergy(readings, rows, coveredFrom, interval.first,
+                                 interval.second);
+    bool close = std::abs(joules - expected) <=
+                 1e-9 * std::max(std::abs(expected), 1.0);
+    for (int channel = 0; channel < TEST_CHANNELS; channel++) {
+      double channelExpected =
+          scanEnergy(readings, rows, coveredFrom, interval.first,
+                     interval.second, channel);
+      close = close && std::abs(channels[channel] - channelExpected) <=
+                           1e-9 * std::max(std::abs(channelExpected), 1.0);
+    }
+    if (!close) {
+      check(false, name + ": energy from " + std::to_string(interval.first) +
+                       " to " + std::to_string(interval.second));
+      return;
+    }
+  }
+}
+
+static void checkRange(const sessionLogReader& log,
+                       const testReadings& readings, const std::string& name) {
+  // This crosses the end of the first chunk, and starts and ends on repeated
+  // timestamps.
+  size_t first = SESSION_LOG_CHUNK_ROWS - 579, last = first + 1000;
+  uint64_t begin = readings.timestamps[first];
+  uint64_t end = readings.timestamps[last];
+  while (first > 0 && readings.timestamps[first - 1] == begin) {
+    first--;
+  }
+  while (last > 0 && readings.timestamps[last - 1] == end) {
+    last--;
+  }
+  size_t row = first;
+  std::vector<sessionLogSpan> spans = log.range(begin, end);
+  check(spans.size() == 2, name + ": range spans");
+  for (const sessionLogSpan& span : spans) {
+    for (size_t spanRow = 0; spanRow < span.rows; spanRow++, row++) {
+      if (row >= last || !sameRow(span, spanRow, readings, row)) {
+        check(false, name + ": range row " + std::to_string(row));
+        return;
+      }
+    }
+  }
+  check(row == last, name + ": range rows");
+  check(log.range(end, begin).empty(), name + ": backwards range");
+  check(log.range(readings.timestamps.back() + 1, UINT64_MAX).empty(),
+        name + ": range after the log");
+  check(log.range(0, readings.coveredFrom).empty(),
+        name + ": range before the log");
+}
+
+static void checkTags(const sessionLogReader& log, std::vector<tagEvent> tags,
+                      eventHandler& names, const std::string& name) {
+  std::stable_sort(tags.begin(), tags.end(),
+                   [](const tagEvent& a, const tagEvent& b) {
+                     return a.timestamp < b.timestamp;
+                   });
+  check(log.tagCount() == tags.size(), name + ": tag count");
+  for (size_t i = 0; i < tags.size() && i < log.tagCount(); i++) {
+    const sessionLogTag& tag = log.tags()[i];
+    if (tag.timestamp != tags[i].timestamp || tag.tagID != tags[i].tagID ||
+        tag.kind != tags[i].kind || tag.threadID != tags[i].threadID ||
+        tag.cpu != tags[i].cpu ||
+        log.tagName(tag.tagID) != names.tagName(tags[i].tagID)) {
+      check(false, name + ": tag " + std::to_string(i));
+      return;
+    }
+  }
+  check(log.tagName(UINT32_MAX - 5).empty(), name + ": unknown tag name");
+
+  uint64_t begin = tags[3].timestamp, end = tags[5].timestamp;
+  auto inside = log.tags(begin, end);
+  size_t expected = 0;
+  for (const tagEvent& tag : tags) {
+    expected += tag.timestamp >= begin && tag.timestamp < end;
+  }
+  check(inside.first == log.tags() + 3 &&
+            (size_t)(inside.second - inside.first) == expected,
+        name + ": tags between two times");
+  inside = log.tags(end, begin);
+  check(inside.first == inside.second, name + ": tags backwards");
+}
+
+static size_t fileSize(const std::string& path) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  return (size_t)file.tellg();
+}
+
+// This copies the first bytes of a file, as if it was cut off while it was
+// written.
+static void cutCopy(const std::string& from, const std::string& to,
+                    size_t bytes) {
+  std::ifstream in(from, std::ios::binary);
+  std::ofstream out(to, std::ios::binary);
+  out << in.rdbuf();
+  out.close();
+  if (truncate(to.c_str(), (off_t)bytes) != 0) {
+    check(false, "cannot cut " + to);
+  }
+}
+
+int main() {
+  char directory[] = "/tmp/testsessionlogXXXXXX";
+  if (!mkdtemp(directory)) {
+    std::cerr << "testsessionlog failed: cannot make a directory"
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<uint64_t> appended;
+  testReadings readings = makeReadings(appended);
+  namesOnly names;
+  uint64_t start = readings.coveredFrom;
+  // These come from two threads and are out of order, as they can arrive.
+  std::vector<tagEvent> tags = {
+      {start + 9000000000, names.internTag("phase 2"), TAG_EVENT_TAG, 1, 3},
+      {start + 1000000000, names.internTag("work"), TAG_EVENT_REGION_BEGIN, 1,
+       TAG_CPU_UNKNOWN},
+      {start, names.internTag("Starting Session..."), TAG_EVENT_TAG,
+       TAG_THREAD_SESSION, TAG_CPU_UNKNOWN},
+      {start + 1000000000, names.internTag("phase 1"), TAG_EVENT_TAG, 2, 0},
+      {start + 300000000000, names.internTag("work"), TAG_EVENT_REGION_END, 1,
+       TAG_CPU_UNKNOWN},
+      {start + 2000000000, names.internTag("inner"), TAG_EVENT_REGION_BEGIN, 2,
+       1},
+      {start + 2500000000, names.internTag("inner"), TAG_EVENT_REGION_END, 2,
+       1}};
+
+  std::string plain = std::string(directory) + "/plain.ppl";
+  std::string compressed = std::string(directory) + "/compressed.ppl";
+  std::string cut = std::string(directory) + "/cut.ppl";
+  acquisitionHealth health;
+  health.gaps = 2;
+  health.lostSamples = 1500;
+  health.lateReads = 3;
+  health.maxBacklog = 120;
+  health.maxCallbackNanos = 2500000;
+  health.largestRead = 160;
+  check(writeLog(plain, readings, appended, tags, names, health, false),
+        "cannot write " + plain);
+  check(writeLog(compressed, readings, appended, tags, names, health, true),
+        "cannot write " + compressed);
+  check(fileSize(compressed) < fileSize(plain), "compressed log size");
+
+  for (const std::string& path : {plain, compressed}) {
+    sessionLogReader log;
+    if (!log.open(path)) {
+      check(false, "cannot read " + path);
+      continue;
+    }
+    check(log.header.numChannels == TEST_CHANNELS &&
+              log.header.sessionID == 7 &&
+              log.header.samplesPerCallback == 40 &&
+              log.description == "test channels" &&
+              log.voltages()[2] == 3.3 && !log.scaling(),
+          path + ": header");
+    check(log.chunkCount() == 3 && log.chunkInfo(2).rows == 1000,
+          path + ": chunks");
+    check(log.health().gaps == 2 && log.health().lostSamples == 1500 &&
+              log.health().lateReads == 3 && log.health().maxBacklog == 120 &&
+              log.health().maxCallbackNanos == 2500000 &&
+              log.health().largestRead == 160,
+          path + ": health");
+    checkRows(log, readings, TEST_ROWS, path);
+    checkRange(log, readings, path);
+    checkTags(log, tags, names, path);
+    checkEnergy(log, readings, TEST_ROWS, readings.coveredFrom, path);
+
+    // A log cut off in a chunk is read up to the chunk before. It has no
+    // energy table, so its first reading covers no time.
+    for (size_t chunks = 1; chunks <= 2; chunks++) {
+      cutCopy(path, cut, log.chunkInfo(chunks).offset + 8 * chunks);
+      sessionLogReader cutLog;
+      std::string name = path + " cut in chunk " + std::to_string(chunks);
+      if (!cutLog.open(cut)) {
+        check(false, name + ": cannot read");
+        continue;
+      }
+      size_t rows = chunks * SESSION_LOG_CHUNK_ROWS;
+      check(cutLog.chunkCount() == chunks, name + ": chunks");
+      check(cutLog.tagCount() == 0, name + ": tags");
+      check(cutLog.health().gaps == 0 && cutLog.health().largestRead == 0,
+            name + ": health");
+      checkRows(cutLog, readings, rows, name);
+      checkEnergy(cutLog, readings, rows, readings.timestamps[0], name);
+    }
+  }
+
+  unlink(plain.c_str());
+  unlink(compressed.c_str());
+  unlink(cut.c_str());
+  rmdir(directory);
+  if (failures > 0) {
+    return 1;
+  }
+  std::cout << "testsessionlog passed" << std::endl;
+  return 0;
+}
@@ -1,14 +1,35 @@
+#include <map>
 #include <thread>
+#include <vector>
 #include "socketutils.h"
 
-void setServerToListen(int serverPort) {
-  socketServer server(serverPort);
+// This handler keeps the tag strings of each session so they can be checked.
+class recordingHandler : public eventHandler {
+ public:
+  std::map<uint32_t, std::vector<std::string>> tags;
+  int started = 0;
+  int ended = 0;
+
+  void startHandler(uint32_t sessionID, uint64_t timestamp) {
+    started++;
+    tags[sessionID];
+  }
+  void tagHandler(uint32_t sessionID, uint64_t timestamp, uint32_t tagID,
+                  uint32_t threadID, uint32_t cpu) {
+    tags[sessionID].push_back(tagName(tagID));
+  }
+  void endHandler(uint32_t sessionID, uint64_t timestamp) { ended++; }
+};
+
+void setServerToListen(int serverPort, eventHandler* handler) {
+  socketServer server(serverPort, handler);
   server.listenForClient();
 }
 
 int main() {
   int port = 8080;
-  std::thread serverThread(setServerToListen, port);
+  recordingHandler handler;
+  std::thread serverThread(setServerToListen, port, &handler);
 
   // This sleeps to be sure the server has enough time to start listening.
   sleep(1);
@@ -20,10 +41,31 @@ int main() {
   client.sendSessionStart();
   client.sendTag("tag1");
   client.sendTag("tag2");
+
+  // This opens a second session that overlaps the first, which should get
+  // only its own tags.
+  socketClient other(port, "127.0.0.1");
+  other.sendSessionStart();
+  other.sendTag("other1");
+
   client.sendTag("tag3");
+  client.sendTagf("tag%d", 4);
   client.sendSessionEnd();
 
+  other.sendTag("other2");
+  other.sendSessionEnd();
+
   // This makes sure that the separate thread is correctly destroyed at the end
   // of the test.
   serverThread.join();
-}
\ No newline at end of file
+
+  std::map<uint32_t, std::vector<std::string>> expected = {
+      {0, {"tag1", "tag2", "tag3", "tag4"}}, {1, {"other1", "other2"}}};
+  if (handler.started != 2 || handler.ended != 2 || handler.tags != expected) {
+    std::cerr << "testsockets failed: received " << handler.tags.size()
+              << " of " << expected.size() << " sessions" << std::endl;
+    return 1;
+  }
+  std::cout << "testsockets passed" << std::endl;
+  return 0;
+}